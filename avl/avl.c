@@ -36,8 +36,209 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_AVL_STATS
+# ifdef _WIN32
+#  include <windows.h>
+# else
+#  include <time.h>
+# endif
+#endif
 
 #include "avl.h"
+#include "avl_btree.h"
+#include "avl_compact.h"
+#include "avl_frozen.h"
+
+#define AVL_MAX(X, Y)  ((X) > (Y) ? (X) : (Y))
+/* an avl tree of 2^32 nodes is less than 48 levels deep */
+#define AVL_PATH_MAX   (64)
+
+#ifdef HAVE_AVL_STATS
+/*
+ * Every thread counts into the shard it drew first, a cache line of
+ * its own as long as there are no more threads than shards.  Threads
+ * sharing one add to it atomically, so no count is lost; compilers
+ * without atomics take a lock for every count instead.
+ */
+#define AVL_STATS_SHARDS        (16)
+#define AVL_STATS_ALIGN         (64)
+
+typedef union {
+  avl_tree_stats        counts;
+  char                  pad[(sizeof (avl_tree_stats) + AVL_STATS_ALIGN - 1) / AVL_STATS_ALIGN * AVL_STATS_ALIGN];
+} avl_stats_shard;
+
+struct avl_stats_tag {
+  avl_stats_shard       shards[AVL_STATS_SHARDS];
+  /* what the tree was created with, its compare_fun counts and calls it */
+  avl_key_compare_fun_type      compare_fun;
+  void *                compare_arg;
+#if !defined(__GNUC__) && !defined(NO_THREAD)
+  mutex_t               lock;
+#endif
+};
+
+#ifdef __GNUC__
+static unsigned int avl_stats_next_slot = 0;
+static __thread unsigned int avl_stats_slot_hint = 0;
+
+#define AVL_STATS_LOAD(p)       __atomic_load_n ((p), __ATOMIC_RELAXED)
+#define AVL_STATS_STORE(p,v)    __atomic_store_n ((p), (v), __ATOMIC_RELAXED)
+#define AVL_STATS_ADD(stats,p,n)        ((void) __atomic_fetch_add ((p), (n), __ATOMIC_RELAXED))
+#else
+#define AVL_STATS_LOAD(p)       (*(p))
+#define AVL_STATS_STORE(p,v)    (*(p) = (v))
+#define AVL_STATS_ADD(stats,p,n) \
+  do { \
+    thread_mutex_lock (&(stats)->lock); \
+    *(p) += (n); \
+    thread_mutex_unlock (&(stats)->lock); \
+  } while (0)
+#endif
+
+static avl_tree_stats *
+avl_stats_local (avl_tree * tree)
+{
+#ifdef __GNUC__
+  if (!avl_stats_slot_hint) {
+    avl_stats_slot_hint = __atomic_add_fetch (&avl_stats_next_slot, 1, __ATOMIC_RELAXED);
+  }
+  return &(tree->stats->shards[avl_stats_slot_hint % AVL_STATS_SHARDS].counts);
+#else
+  return &(tree->stats->shards[0].counts);
+#endif
+}
+
+/* scratch trees have no counters */
+#define AVL_STATS_COUNT(tree,field,n) \
+  do { \
+    if ((tree)->stats) { \
+      avl_tree_stats * local_ = avl_stats_local (tree); \
+      AVL_STATS_ADD ((tree)->stats, &local_->field, (n)); \
+    } \
+  } while (0)
+#define AVL_STATS_DEPTH(tree,node)      avl_stats_depth ((tree), (node))
+
+static void
+avl_stats_depth (avl_tree * tree, avl_node * node)
+{
+  avl_tree_stats * local;
+  unsigned long depth = 0;
+#ifdef __GNUC__
+  unsigned long seen;
+#endif
+
+  if (!tree->stats) {
+    return;
+  }
+  for (; node != tree->root; node = node->parent) {
+    depth++;
+  }
+  local = avl_stats_local (tree);
+#ifdef __GNUC__
+  seen = AVL_STATS_LOAD (&local->max_depth);
+  while (depth > seen &&
+         !__atomic_compare_exchange_n (&local->max_depth, &seen, depth, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    /* <seen> is what another thread put there, try again */
+  }
+#else
+  thread_mutex_lock (&tree->stats->lock);
+  if (depth > local->max_depth) {
+    local->max_depth = depth;
+  }
+  thread_mutex_unlock (&tree->stats->lock);
+#endif
+}
+
+/* nanoseconds from some fixed point */
+static unsigned long long
+avl_stats_clock (void)
+{
+#ifdef _WIN32
+  LARGE_INTEGER now, frequency;
+
+  QueryPerformanceCounter (&now);
+  QueryPerformanceFrequency (&frequency);
+  return (unsigned long long) (now.QuadPart * (1000000000.0 / frequency.QuadPart));
+#else
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (unsigned long long) now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif
+}
+
+static int
+avl_stats_compare (void * compare_arg, void * a, void * b)
+{
+  avl_tree * tree = (avl_tree *) compare_arg;
+
+  AVL_STATS_COUNT (tree, compares, 1);
+  return tree->stats->compare_fun (tree->stats->compare_arg, a, b);
+}
+
+static int
+avl_stats_new (avl_tree * tree)
+{
+  void * ptr;
+
+#ifdef _WIN32
+  ptr = _aligned_malloc (sizeof (avl_stats), AVL_STATS_ALIGN);
+#else
+  if (posix_memalign (&ptr, AVL_STATS_ALIGN, sizeof (avl_stats)) != 0) {
+    ptr = NULL;
+  }
+#endif
+  if (!ptr) {
+    return -1;
+  }
+  tree->stats = (avl_stats *) ptr;
+  memset (tree->stats, 0, sizeof (avl_stats));
+#ifndef __GNUC__
+  thread_mutex_create (&tree->stats->lock);
+#endif
+  tree->stats->compare_fun = tree->compare_fun;
+  tree->stats->compare_arg = tree->compare_arg;
+  tree->compare_fun = avl_stats_compare;
+  tree->compare_arg = tree;
+  return 0;
+}
+
+static void
+avl_stats_free (avl_stats * stats)
+{
+  if (!stats) {
+    return;
+  }
+#ifndef __GNUC__
+  thread_mutex_destroy (&stats->lock);
+#endif
+#ifdef _WIN32
+  _aligned_free (stats);
+#else
+  free (stats);
+#endif
+}
+#else
+#define AVL_STATS_COUNT(tree,field,n)   do { } while (0)
+#define AVL_STATS_DEPTH(tree,node)      do { } while (0)
+#endif
+
+static void
+avl_node_init (avl_node * node, void * key, avl_node * parent)
+{
+  node->parent = parent;
+  node->key = key;
+  node->left = NULL;
+  node->right = NULL;
+  node->rank_and_balance = 0;
+  AVL_SET_BALANCE (node, 0);
+  AVL_SET_RANK (node, 1);
+#ifdef HAVE_AVL_NODE_LOCK
+  thread_rwlock_create(&node->rwlock);
+#endif
+}
 
 avl_node *
 avl_node_new (void *        key,
@@ -48,679 +249,3333 @@ avl_node_new (void *        key,
   if (!node) {
     return NULL;
   } else {
-    node->parent = parent;
-    node->key = key;
-    node->left = NULL;
-    node->right = NULL;
-    node->rank_and_balance = 0;
-    AVL_SET_BALANCE (node, 0);
-    AVL_SET_RANK (node, 1);
-#ifdef HAVE_AVL_NODE_LOCK
-    thread_rwlock_create(&node->rwlock);
-#endif
+    avl_node_init (node, key, parent);
     return node;
   }
 }         
 
-avl_tree *
-avl_tree_new (avl_key_compare_fun_type compare_fun,
-          void * compare_arg)
+/*
+ * Slab allocation: a tree created with AVL_TREE_FLAG_SLAB takes its
+ * nodes from pages it owns.  Pages start small and double in size up
+ * to AVL_SLAB_PAGE_MAX nodes, freed nodes go to a per-tree free list
+ * (linked through <right>) and pages are only returned to the system
+ * by avl_tree_free().
+ */
+
+struct avl_slab_page_tag {
+  struct avl_slab_page_tag *    next;
+  unsigned int                  count;
+  avl_node                      nodes[1];
+};
+
+static avl_node *
+avl_tree_node_new (avl_tree * tree, void * key, avl_node * parent)
 {
-  avl_tree * t = (avl_tree *) malloc (sizeof (avl_tree));
+  avl_node * node;
 
-  if (!t) {
-    return NULL;
-  } else {
-    avl_node * root = avl_node_new((void *)NULL, (avl_node *) NULL);
-    if (!root) {
-      free (t);
+  if (!(tree->flags & AVL_TREE_FLAG_SLAB)) {
+    return avl_node_new (key, parent);
+  }
+
+  if (!tree->slab_free) {
+    unsigned int count = tree->slab_page_nodes;
+    unsigned int i;
+    avl_slab_page * page = (avl_slab_page *) malloc (sizeof (avl_slab_page) + (count - 1) * sizeof (avl_node));
+
+    if (!page) {
       return NULL;
-    } else {
-      t->root = root;
-      t->height = 0;
-      t->length = 0;
-      t->compare_fun = compare_fun;
-      t->compare_arg = compare_arg;
-      thread_rwlock_create(&t->rwlock);
-      return t;
+    }
+    page->count = count;
+    page->next = tree->slab_pages;
+    tree->slab_pages = page;
+    /* thread the free list in address order so walks stay local */
+    for (i = count; i > 0; i--) {
+      page->nodes[i - 1].right = tree->slab_free;
+      tree->slab_free = &(page->nodes[i - 1]);
+    }
+    if (count < AVL_SLAB_PAGE_MAX) {
+      tree->slab_page_nodes = count * 2;
     }
   }
+
+  node = tree->slab_free;
+  tree->slab_free = node->right;
+  avl_node_init (node, key, parent);
+  return node;
 }
-  
+
 static void
-avl_tree_free_helper (avl_node * node, avl_free_key_fun_type free_key_fun)
+avl_tree_node_free (avl_tree * tree, avl_node * node)
 {
-  if (node->left) {
-    avl_tree_free_helper (node->left, free_key_fun);
-  }
-  if (free_key_fun)
-      free_key_fun (node->key);
-  if (node->right) {
-    avl_tree_free_helper (node->right, free_key_fun);
-  }
 #ifdef HAVE_AVL_NODE_LOCK
   thread_rwlock_destroy (&node->rwlock);
 #endif
-  free (node);
+  if (tree->flags & AVL_TREE_FLAG_SLAB) {
+    node->key = NULL;
+    node->right = tree->slab_free;
+    tree->slab_free = node;
+  } else if (!(tree->flags & AVL_TREE_FLAG_INTRUSIVE)) {
+    free (node);
+  }
 }
-  
-void
-avl_tree_free (avl_tree * tree, avl_free_key_fun_type free_key_fun)
+
+/*
+ * Hash index: with avl_tree_set_hash_index() a tree also keeps its
+ * keys in an open addressing table (linear probing, at most 3/4 full),
+ * which avl_get_by_key() answers from with usually a single compare.
+ * Entries store the hash with the lowest bit set, so that 0 marks an
+ * empty slot, and are removed by shifting the following run back
+ * instead of leaving tombstones.  Room is reserved before the tree is
+ * changed, so an update that runs out of memory fails cleanly.
+ */
+
+#define AVL_HASH_MIN_SIZE (16)
+
+typedef struct avl_hash_entry_tag {
+  unsigned long                 hash;
+  void *                        key;
+} avl_hash_entry;
+
+struct avl_hash_tag {
+  avl_key_hash_fun_type         hash_fun;
+  void *                        hash_arg;
+  avl_hash_entry *              entries;
+  /* number of entries - 1, a power of two - 1 */
+  unsigned long                 mask;
+  unsigned long                 count;
+};
+
+static unsigned long
+avl_hash_key (avl_hash * hash, void * key)
 {
-  if (tree->length) {
-    avl_tree_free_helper (tree->root->right, free_key_fun);
-  }
-  if (tree->root) {
-#ifdef HAVE_AVL_NODE_LOCK
-    thread_rwlock_destroy(&tree->root->rwlock);
-#endif
-    free (tree->root);
-  }
-  thread_rwlock_destroy(&tree->rwlock);
-  free (tree);
+  return hash->hash_fun (hash->hash_arg, key) | 1;
 }
 
-int
-avl_insert (avl_tree * ob,
-           void * key)
+static void
+avl_hash_put (avl_hash * hash, unsigned long h, void * key)
 {
-  if (!(ob->root->right)) {
-    avl_node * node = avl_node_new (key, ob->root);
-    if (!node) {
-      return -1;
-    } else {
-      ob->root->right = node;
-      ob->length = ob->length + 1;
-      return 0;
-    }
-  } else { /* not self.right == None */
-    avl_node *t, *p, *s, *q, *r;
-    int a;
+  unsigned long i = (h >> 1) & hash->mask;
 
-    t = ob->root;
-    s = p = t->right;
+  while (hash->entries[i].hash) {
+    i = (i + 1) & hash->mask;
+  }
+  hash->entries[i].hash = h;
+  hash->entries[i].key = key;
+  hash->count++;
+}
 
-    while (1) {
-      if (ob->compare_fun (ob->compare_arg, key, p->key) < 1) {
-    /* move left */
-    AVL_SET_RANK (p, (AVL_GET_RANK (p) + 1));
-    q = p->left;
-    if (!q) {
-      /* insert */
-      avl_node * q_node = avl_node_new (key, p);
-      if (!q_node) {
-        return (-1);
-      } else {
-        q = q_node;
-        p->left = q;
-        break;
-      }
-    } else if (AVL_GET_BALANCE(q)) {
-      t = p;
-      s = q;
-    }
-    p = q;
-      } else {
-    /* move right */
-    q = p->right;
-    if (!q) {
-      /* insert */
-      avl_node * q_node = avl_node_new (key, p);
-      if (!q_node) {
-        return -1;
-      } else {
-        q = q_node;
-        p->right = q;
-        break;
-      }
-    } else if (AVL_GET_BALANCE(q)) {
-      t = p;
-      s = q;
-    }
-    p = q;
+/* make sure <extra> more keys fit */
+static int
+avl_hash_reserve (avl_tree * tree, unsigned long extra)
+{
+  avl_hash * hash = tree->hash;
+  avl_hash_entry * old;
+  unsigned long size, need, i;
+
+  if (!hash) {
+    return 0;
+  }
+  need = hash->count + extra;
+  size = hash->mask + 1;
+  if (hash->entries && need * 4 <= size * 3) {
+    return 0;
+  }
+  while (size * 3 < need * 4) {
+    size = size * 2;
+  }
+  old = hash->entries;
+  hash->entries = (avl_hash_entry *) calloc (size, sizeof (avl_hash_entry));
+  if (!hash->entries) {
+    hash->entries = old;
+    return -1;
+  }
+  i = hash->mask + 1;
+  hash->mask = size - 1;
+  hash->count = 0;
+  if (old) {
+    while (i > 0) {
+      i--;
+      if (old[i].hash) {
+        avl_hash_put (hash, old[i].hash, old[i].key);
       }
     }
-    
-    ob->length = ob->length + 1;
-    
-    /* adjust balance factors */
-    if (ob->compare_fun (ob->compare_arg, key, s->key) < 1) {
-      r = p = s->left;
-    } else {
-      r = p = s->right;
+    free (old);
+  }
+  return 0;
+}
+
+static void
+avl_hash_insert (avl_tree * tree, void * key)
+{
+  if (tree->hash) {
+    avl_hash_put (tree->hash, avl_hash_key (tree->hash, key), key);
+  }
+}
+
+/* drop the entry of exactly <key> */
+static void
+avl_hash_remove (avl_tree * tree, void * key)
+{
+  avl_hash * hash = tree->hash;
+  unsigned long i, j, home;
+
+  if (!hash) {
+    return;
+  }
+  i = (avl_hash_key (hash, key) >> 1) & hash->mask;
+  while (hash->entries[i].key != key) {
+    if (!hash->entries[i].hash) {
+      return;
     }
-    while (p != q) {
-      if (ob->compare_fun (ob->compare_arg, key, p->key) < 1) {
-    AVL_SET_BALANCE (p, -1);
-    p = p->left;
-      } else {
-    AVL_SET_BALANCE (p, +1);
-    p = p->right;
-      }
+    i = (i + 1) & hash->mask;
+  }
+  /* move back entries that would not be found past the hole */
+  j = i;
+  while (1) {
+    j = (j + 1) & hash->mask;
+    if (!hash->entries[j].hash) {
+      break;
     }
-    
-    /* balancing act */
-    
-    if (ob->compare_fun (ob->compare_arg, key, s->key) < 1) {
-      a = -1;
-    } else {
-      a = +1;
+    home = (hash->entries[j].hash >> 1) & hash->mask;
+    if (((j - home) & hash->mask) >= ((j - i) & hash->mask)) {
+      hash->entries[i] = hash->entries[j];
+      i = j;
     }
-    
-    if (AVL_GET_BALANCE (s) == 0) {
-      AVL_SET_BALANCE (s, a);
-      ob->height = ob->height + 1;
-      return 0;
-    } else if (AVL_GET_BALANCE (s) == -a) {
-      AVL_SET_BALANCE (s, 0);
+  }
+  hash->entries[i].hash = 0;
+  hash->entries[i].key = NULL;
+  hash->count--;
+}
+
+static int
+avl_hash_get (avl_tree * tree, void * key, void ** value_address)
+{
+  avl_hash * hash = tree->hash;
+  unsigned long h = avl_hash_key (hash, key);
+  unsigned long i = (h >> 1) & hash->mask;
+
+  while (hash->entries[i].hash) {
+    if (hash->entries[i].hash == h &&
+        tree->compare_fun (tree->compare_arg, key, hash->entries[i].key) == 0) {
+      *value_address = hash->entries[i].key;
       return 0;
-    } else if (AVL_GET_BALANCE(s) == a) {
-      if (AVL_GET_BALANCE (r) == a) {
-    /* single rotation */
-    p = r;
-    if (a == -1) {
-      s->left = r->right;
-      if (r->right) {
-        r->right->parent = s;
-      }
-      r->right = s;
-      s->parent = r;
-      AVL_SET_RANK (s, (AVL_GET_RANK (s) - AVL_GET_RANK (r)));
-    } else {
-      s->right = r->left;
-      if (r->left) {
-        r->left->parent = s;
-      }
-      r->left = s;
-      s->parent = r;
-      AVL_SET_RANK (r, (AVL_GET_RANK (r) + AVL_GET_RANK (s)));
-    }
-    AVL_SET_BALANCE (s, 0);
-    AVL_SET_BALANCE (r, 0);
-      } else if (AVL_GET_BALANCE (r) == -a) {
-    /* double rotation */
-    if (a == -1) {
-      p = r->right;
-      r->right = p->left;
-      if (p->left) {
-        p->left->parent = r;
-      }
-      p->left = r;
-      r->parent = p;
-      s->left = p->right;
-      if (p->right) {
-        p->right->parent = s;
-      }
-      p->right = s;
-      s->parent = p;
-      AVL_SET_RANK (p, (AVL_GET_RANK (p) + AVL_GET_RANK (r)));
-      AVL_SET_RANK (s, (AVL_GET_RANK (s) - AVL_GET_RANK (p)));
-    } else {
-      p = r->left;
-      r->left = p->right;
-      if (p->right) {
-        p->right->parent = r;
-      }
-      p->right = r;
-      r->parent = p;
-      s->right = p->left;
-      if (p->left) {
-        p->left->parent = s;
-      }
-      p->left = s;
-      s->parent = p;
-      AVL_SET_RANK (r, (AVL_GET_RANK (r) - AVL_GET_RANK (p)));
-      AVL_SET_RANK (p, (AVL_GET_RANK (p) + AVL_GET_RANK (s)));
-    }
-    if (AVL_GET_BALANCE (p) == a) {
-      AVL_SET_BALANCE (s, -a);
-      AVL_SET_BALANCE (r, 0);
-    } else if (AVL_GET_BALANCE (p) == -a) {
-      AVL_SET_BALANCE (s, 0);
-      AVL_SET_BALANCE (r, a);
-    } else {
-      AVL_SET_BALANCE (s, 0);
-      AVL_SET_BALANCE (r, 0);
-    }
-    AVL_SET_BALANCE (p, 0);
-      }
-      /* finishing touch */
-      if (s == t->right) {
-    t->right = p;
-      } else {
-    t->left = p;
-      }
-      p->parent = t;
     }
+    i = (i + 1) & hash->mask;
   }
-  return 0;
+  return -1;
 }
 
-int
-avl_get_by_index (avl_tree * tree,
-           unsigned long index,
-           void ** value_address)
+static void
+avl_hash_free (avl_hash * hash)
 {
-  avl_node * p = tree->root->right;
-  unsigned long m = index + 1;
-  while (1) {
-    if (!p) {
-      return -1;
+  free (hash->entries);
+  free (hash);
+}
+
+static int
+avl_hash_fill (void * key, void * iter_arg)
+{
+  avl_hash_insert ((avl_tree *) iter_arg, key);
+  return 0;
+}
+
+/*
+ * RCU read mode.
+ *
+ * Besides the normal tree a tree created with AVL_TREE_FLAG_RCU keeps
+ * a second, immutable copy of its keys that readers walk without
+ * locking.  Writers (serialised by the tree's write lock) never modify
+ * a published node: they copy the path from the root down to the
+ * change, rebalance the copies and publish the new root with a single
+ * atomic store.  Replaced nodes and deleted keys go on a retired list
+ * and are freed after a grace period, i.e. after every reader that
+ * could have seen them has left its read section.
+ *
+ * Readers announce themselves in one of two counters (selected by the
+ * current epoch) of a per-thread slot, so that readers on different
+ * cores do not share a cache line.  A grace period flips the epoch
+ * twice, each time waiting for the counters of the previous epoch to
+ * drain.
+ */
+
+#if defined(__GNUC__)
+# define AVL_RCU_SUPPORTED
+#endif
+
+#define AVL_RCU_SLOTS          (16)
+#define AVL_RCU_RETIRED_MAX    (1024)
+
+typedef struct avl_rcu_node_tag {
+  void *                        key;
+  struct avl_rcu_node_tag *     left;
+  struct avl_rcu_node_tag *     right;
+  /* number of nodes in this subtree */
+  unsigned long                 count;
+  int                           height;
+  /* the following are never looked at by readers */
+  unsigned long                 gen;
+  struct avl_rcu_node_tag *     retired_next;
+  avl_free_key_fun_type         free_key;
+} avl_rcu_node;
+
+typedef struct {
+  unsigned long         readers[2];
+  /* keep each slot on a cache line of its own */
+  char                  pad[64 - 2 * sizeof (unsigned long)];
+} avl_rcu_slot;
+
+struct avl_rcu_tag {
+  avl_rcu_slot          slots[AVL_RCU_SLOTS];
+  avl_rcu_node *        root;
+  unsigned int          epoch;
+  /* generation of the write in progress, nodes of this generation
+   * are not published yet and may be modified in place
+   */
+  unsigned long         gen;
+  avl_rcu_node *        retired;
+  unsigned long         retired_count;
+  /* nodes reserved before a write so it cannot fail half way */
+  avl_rcu_node *        spare;
+  unsigned long         spare_count;
+};
+
+#ifdef AVL_RCU_SUPPORTED
+static unsigned int avl_rcu_next_slot = 0;
+static __thread unsigned int avl_rcu_slot_hint = 0;
+
+#define AVL_RCU_LOAD(p)         __atomic_load_n ((p), __ATOMIC_SEQ_CST)
+#define AVL_RCU_STORE(p,v)      __atomic_store_n ((p), (v), __ATOMIC_SEQ_CST)
+#define AVL_RCU_INC(p)          __atomic_add_fetch ((p), 1, __ATOMIC_SEQ_CST)
+#define AVL_RCU_DEC(p)          __atomic_sub_fetch ((p), 1, __ATOMIC_SEQ_CST)
+#endif
+
+#define AVL_RCU_HEIGHT(n)       ((n) ? (n)->height : 0)
+#define AVL_RCU_COUNT(n)        ((n) ? (n)->count : 0)
+
+static avl_rcu *
+avl_rcu_new (void)
+{
+  return (avl_rcu *) calloc (1, sizeof (avl_rcu));
+}
+
+static void
+avl_rcu_free_nodes (avl_rcu_node * node)
+{
+  if (node) {
+    avl_rcu_free_nodes (node->left);
+    avl_rcu_free_nodes (node->right);
+    free (node);
+  }
+}
+
+static void
+avl_rcu_reclaim (avl_rcu * rcu)
+{
+  avl_rcu_node * node = rcu->retired;
+
+  while (node) {
+    avl_rcu_node * next = node->retired_next;
+    if (node->free_key) {
+      node->free_key (node->key);
     }
-    if (m < AVL_GET_RANK(p)) {
-      p = p->left;
-    } else if (m > AVL_GET_RANK(p)) {
-      m = m - AVL_GET_RANK(p);
-      p = p->right;
-    } else {
-      *value_address = p->key;
-      return 0;
+    free (node);
+    node = next;
+  }
+  rcu->retired = NULL;
+  rcu->retired_count = 0;
+}
+
+/* only valid once all readers are gone */
+static void
+avl_rcu_free (avl_rcu * rcu)
+{
+  avl_rcu_node * node;
+
+  avl_rcu_reclaim (rcu);
+  avl_rcu_free_nodes (rcu->root);
+  while ((node = rcu->spare)) {
+    rcu->spare = node->retired_next;
+    free (node);
+  }
+  free (rcu);
+}
+
+/* make sure the next write finds <count> nodes to work with */
+static int
+avl_rcu_reserve (avl_rcu * rcu, unsigned long count)
+{
+  while (rcu->spare_count < count) {
+    avl_rcu_node * node = (avl_rcu_node *) malloc (sizeof (avl_rcu_node));
+    if (!node) {
+      return -1;
     }
+    node->retired_next = rcu->spare;
+    rcu->spare = node;
+    rcu->spare_count++;
   }
+  return 0;
 }
-           
-int
-avl_get_by_key (avl_tree * tree,
-         void * key,
-         void **value_address)
+
+static unsigned long
+avl_rcu_reserve_count (avl_rcu * rcu)
 {
-  avl_node * x = tree->root->right;
-  if (!x) {
-    return -1;
+  /* a copy per level, a new leaf and two copies per rebalancing */
+  return 3 * (AVL_RCU_HEIGHT (rcu->root) + 2);
+}
+
+static avl_rcu_node *
+avl_rcu_node_get (avl_rcu * rcu)
+{
+  avl_rcu_node * node = rcu->spare;
+
+  rcu->spare = node->retired_next;
+  rcu->spare_count--;
+  node->gen = rcu->gen;
+  node->retired_next = NULL;
+  node->free_key = NULL;
+  return node;
+}
+
+static void
+avl_rcu_retire (avl_rcu * rcu, avl_rcu_node * node, avl_free_key_fun_type free_key)
+{
+  node->free_key = free_key;
+  node->retired_next = rcu->retired;
+  rcu->retired = node;
+  rcu->retired_count++;
+}
+
+/* return a private version of <node> that may be changed in place */
+static avl_rcu_node *
+avl_rcu_writable (avl_rcu * rcu, avl_rcu_node * node)
+{
+  avl_rcu_node * copy;
+
+  if (node->gen == rcu->gen) {
+    return node;
   }
-  while (1) {
-    int compare_result = tree->compare_fun (tree->compare_arg, key, x->key);
-    if (compare_result < 0) {
-      if (x->left) {
-    x = x->left;
-      } else {
-    return -1;
-      }
-    } else if (compare_result > 0) {
-      if (x->right) {
-    x = x->right;
-      } else {
-    return -1;
-      }
-    } else {
-      *value_address = x->key;
-      return 0;
+  copy = avl_rcu_node_get (rcu);
+  copy->key = node->key;
+  copy->left = node->left;
+  copy->right = node->right;
+  copy->count = node->count;
+  copy->height = node->height;
+  avl_rcu_retire (rcu, node, NULL);
+  return copy;
+}
+
+static void
+avl_rcu_update (avl_rcu_node * node)
+{
+  int lh = AVL_RCU_HEIGHT (node->left);
+  int rh = AVL_RCU_HEIGHT (node->right);
+
+  node->height = 1 + (lh > rh ? lh : rh);
+  node->count = 1 + AVL_RCU_COUNT (node->left) + AVL_RCU_COUNT (node->right);
+}
+
+static avl_rcu_node *
+avl_rcu_rotate_right (avl_rcu * rcu, avl_rcu_node * node)
+{
+  avl_rcu_node * left = avl_rcu_writable (rcu, node->left);
+
+  node->left = left->right;
+  left->right = node;
+  avl_rcu_update (node);
+  avl_rcu_update (left);
+  return left;
+}
+
+static avl_rcu_node *
+avl_rcu_rotate_left (avl_rcu * rcu, avl_rcu_node * node)
+{
+  avl_rcu_node * right = avl_rcu_writable (rcu, node->right);
+
+  node->right = right->left;
+  right->left = node;
+  avl_rcu_update (node);
+  avl_rcu_update (right);
+  return right;
+}
+
+/* <node> is private, its subtrees differ in height by at most two */
+static avl_rcu_node *
+avl_rcu_balance (avl_rcu * rcu, avl_rcu_node * node)
+{
+  int balance = AVL_RCU_HEIGHT (node->right) - AVL_RCU_HEIGHT (node->left);
+
+  if (balance < -1) {
+    avl_rcu_node * left = node->left;
+    if (AVL_RCU_HEIGHT (left->right) > AVL_RCU_HEIGHT (left->left)) {
+      node->left = avl_rcu_rotate_left (rcu, avl_rcu_writable (rcu, left));
+    }
+    return avl_rcu_rotate_right (rcu, node);
+  } else if (balance > 1) {
+    avl_rcu_node * right = node->right;
+    if (AVL_RCU_HEIGHT (right->left) > AVL_RCU_HEIGHT (right->right)) {
+      node->right = avl_rcu_rotate_right (rcu, avl_rcu_writable (rcu, right));
     }
+    return avl_rcu_rotate_left (rcu, node);
   }
+  avl_rcu_update (node);
+  return node;
 }
 
-int avl_delete(avl_tree *tree, void *key, avl_free_key_fun_type free_key_fun)
+static avl_rcu_node *
+avl_rcu_insert_helper (avl_tree * tree, avl_rcu_node * node, void * key)
 {
-  avl_node *x, *y, *p, *q, *r, *top, *x_child;
-  int shortened_side, shorter;
-  
-  x = tree->root->right;
-  if (!x) {
-    return -1;
+  avl_rcu * rcu = tree->rcu;
+
+  if (!node) {
+    node = avl_rcu_node_get (rcu);
+    node->key = key;
+    node->left = NULL;
+    node->right = NULL;
+    node->count = 1;
+    node->height = 1;
+    return node;
   }
-  while (1) {
-    int compare_result = tree->compare_fun (tree->compare_arg, key, x->key);
+  node = avl_rcu_writable (rcu, node);
+  /* equal keys go to the left, just like in avl_insert() */
+  if (tree->compare_fun (tree->compare_arg, key, node->key) < 1) {
+    node->left = avl_rcu_insert_helper (tree, node->left, key);
+  } else {
+    node->right = avl_rcu_insert_helper (tree, node->right, key);
+  }
+  return avl_rcu_balance (rcu, node);
+}
+
+/* is the very key pointer <ptr> (which compares equal to <key>) in here? */
+static int
+avl_rcu_contains (avl_tree * tree, avl_rcu_node * node, void * key, void * ptr)
+{
+  while (node) {
+    int compare_result = tree->compare_fun (tree->compare_arg, key, node->key);
     if (compare_result < 0) {
-      /* move left
-       * We will be deleting from the left, adjust this node's
-       * rank accordingly
-       */
-      AVL_SET_RANK (x, (AVL_GET_RANK(x) - 1));
-      if (x->left) {
-    x = x->left;
-      } else {
-    /* Oops! now we have to undo the rank changes
-     * all the way up the tree
-     */
-    AVL_SET_RANK(x, (AVL_GET_RANK (x) + 1));
-    while (x != tree->root->right) {
-      if (x->parent->left == x) {
-        AVL_SET_RANK(x->parent, (AVL_GET_RANK (x->parent) + 1));
-      }
-      x = x->parent;
-    }
-    return -1;        /* key not in tree */
-      }
+      node = node->left;
     } else if (compare_result > 0) {
-      /* move right */
-      if (x->right) {
-    x = x->right;
-      } else {
-    AVL_SET_RANK(x, (AVL_GET_RANK (x) + 1));
-    while (x != tree->root->right) {
-      if (x->parent->left == x) {
-        AVL_SET_RANK(x->parent, (AVL_GET_RANK (x->parent) + 1));
-      }
-      x = x->parent;
-    }
-    return -1;        /* key not in tree */
-      }
+      node = node->right;
+    } else if (node->key == ptr) {
+      return 1;
     } else {
-      break;
+      if (avl_rcu_contains (tree, node->left, key, ptr)) {
+        return 1;
+      }
+      node = node->right;
     }
   }
+  return 0;
+}
 
-  if (x->left && x->right) {
-    void * temp_key;
+static avl_rcu_node *
+avl_rcu_delete_min (avl_rcu * rcu, avl_rcu_node * node, avl_rcu_node ** min)
+{
+  if (!node->left) {
+    *min = node;
+    return node->right;
+  }
+  node = avl_rcu_writable (rcu, node);
+  node->left = avl_rcu_delete_min (rcu, node->left, min);
+  return avl_rcu_balance (rcu, node);
+}
 
-    /* The complicated case.
-     * reduce this to the simple case where we are deleting
-     * a node with at most one child.
-     */
-    
-    /* find the immediate predecessor <y> */
-    y = x->left;
-    while (y->right) {
-      y = y->right;
+/*
+ * Remove the node holding exactly <ptr>, which must be in the subtree.
+ * Nodes only get copied on the way back up, so everything we look at
+ * on the way down is still published and can be retired as it is.
+ */
+static avl_rcu_node *
+avl_rcu_delete_helper (avl_tree * tree, avl_rcu_node * node, void * key, void * ptr, avl_free_key_fun_type free_key_fun)
+{
+  avl_rcu * rcu = tree->rcu;
+  int compare_result = tree->compare_fun (tree->compare_arg, key, node->key);
+
+  if (compare_result == 0 && node->key == ptr) {
+    avl_rcu_node * min;
+    avl_rcu_node * right;
+    avl_rcu_node * copy;
+
+    if (!node->left || !node->right) {
+      avl_rcu_retire (rcu, node, free_key_fun);
+      return node->left ? node->left : node->right;
     }
-    /* swap <x> with <y> */
-    temp_key = x->key;
-    x->key = y->key;
-    y->key = temp_key;
-    /* we know <x>'s left subtree lost a node because that's
-     * where we took it from
+    /* take over the smallest key of the right subtree, whose node
+     * is no longer needed
      */
-    AVL_SET_RANK (x, (AVL_GET_RANK (x) - 1));
-    x = y;
+    right = avl_rcu_delete_min (rcu, node->right, &min);
+    avl_rcu_retire (rcu, min, NULL);
+    copy = avl_rcu_node_get (rcu);
+    copy->key = min->key;
+    copy->left = node->left;
+    copy->right = right;
+    avl_rcu_retire (rcu, node, free_key_fun);
+    return avl_rcu_balance (rcu, copy);
   }
-  /* now <x> has at most one child
-   * scoot this child into the place of <x>
-   */
-  if (x->left) {
-    x_child = x->left;
-    x_child->parent = x->parent;
-  } else if (x->right) {
-    x_child = x->right;
-    x_child->parent = x->parent;
+
+  if (compare_result < 0 || (compare_result == 0 && avl_rcu_contains (tree, node->left, key, ptr))) {
+    avl_rcu_node * left = avl_rcu_delete_helper (tree, node->left, key, ptr, free_key_fun);
+    node = avl_rcu_writable (rcu, node);
+    node->left = left;
   } else {
-    x_child = NULL;
+    avl_rcu_node * right = avl_rcu_delete_helper (tree, node->right, key, ptr, free_key_fun);
+    node = avl_rcu_writable (rcu, node);
+    node->right = right;
   }
+  return avl_rcu_balance (rcu, node);
+}
 
-  /* now tell <x>'s parent that a grandchild became a child */
-  if (x == x->parent->left) {
-    x->parent->left = x_child;
-    shortened_side = -1;
-  } else {
-    x->parent->right = x_child;
-    shortened_side = +1;
+static void
+avl_rcu_retire_all (avl_rcu * rcu, avl_rcu_node * node)
+{
+  while (node) {
+    avl_rcu_node * right = node->right;
+    avl_rcu_retire_all (rcu, node->left);
+    avl_rcu_retire (rcu, node, NULL);
+    node = right;
   }
+}
 
-  /*
-   * the height of the subtree <x>
-   * has now been shortened.  climb back up
-   * the tree, rotating when necessary to adjust
-   * for the change.
-   */
-  shorter = 1;
-  p = x->parent;
-  
-  /* return the key and node to storage */
-  if (free_key_fun)
-      free_key_fun (x->key);
-#ifdef HAVE_AVL_NODE_LOCK
-  thread_rwlock_destroy (&x->rwlock);
+static avl_rcu_node *
+avl_rcu_copy (avl_rcu * rcu, avl_node * node)
+{
+  avl_rcu_node * copy;
+
+  if (!node) {
+    return NULL;
+  }
+  copy = avl_rcu_node_get (rcu);
+  copy->key = node->key;
+  copy->left = avl_rcu_copy (rcu, node->left);
+  copy->right = avl_rcu_copy (rcu, node->right);
+  avl_rcu_update (copy);
+  return copy;
+}
+
+#ifdef AVL_RCU_SUPPORTED
+static void
+avl_rcu_wait_readers (avl_rcu * rcu)
+{
+  int round;
+
+  for (round = 0; round < 2; round++) {
+    unsigned int epoch = rcu->epoch;
+    int i;
+
+    AVL_RCU_STORE (&rcu->epoch, epoch ^ 1);
+    for (i = 0; i < AVL_RCU_SLOTS; i++) {
+      while (AVL_RCU_LOAD (&rcu->slots[i].readers[epoch & 1]) != 0) {
+#ifndef NO_THREAD
+        thread_sleep (10);
+#endif
+      }
+    }
+  }
+}
 #endif
-  free (x);
 
-  while (shorter && p->parent) {
-    
-    /* case 1: height unchanged */
-    if (AVL_GET_BALANCE(p) == 0) {
-      if (shortened_side == -1) {
-    /* we removed a left child, the tree is now heavier
+static void
+avl_rcu_publish (avl_rcu * rcu, avl_rcu_node * root)
+{
+#ifdef AVL_RCU_SUPPORTED
+  AVL_RCU_STORE (&rcu->root, root);
+  rcu->gen++;
+  if (rcu->retired_count >= AVL_RCU_RETIRED_MAX) {
+    avl_rcu_wait_readers (rcu);
+    avl_rcu_reclaim (rcu);
+  }
+#endif
+}
+
+/*
+ * Replace the published copy by one mirroring the tree after a bulk
+ * change.  The writer must have reserved <tree->length> nodes.
+ */
+static void
+avl_rcu_rebuild (avl_tree * tree)
+{
+  avl_rcu * rcu = tree->rcu;
+
+  avl_rcu_retire_all (rcu, rcu->root);
+  avl_rcu_publish (rcu, avl_rcu_copy (rcu, tree->root->right));
+}
+
+void
+avl_rcu_synchronize (avl_tree * tree)
+{
+#ifdef AVL_RCU_SUPPORTED
+  if (tree->rcu) {
+    avl_rcu_wait_readers (tree->rcu);
+    avl_rcu_reclaim (tree->rcu);
+  }
+#endif
+}
+
+unsigned int
+avl_rcu_read_lock (avl_tree * tree)
+{
+#ifdef AVL_RCU_SUPPORTED
+  unsigned int slot;
+  unsigned int epoch;
+
+  if (!tree->rcu) {
+    return 0;
+  }
+  if (!avl_rcu_slot_hint) {
+    avl_rcu_slot_hint = AVL_RCU_INC (&avl_rcu_next_slot);
+  }
+  slot = avl_rcu_slot_hint % AVL_RCU_SLOTS;
+  epoch = AVL_RCU_LOAD (&tree->rcu->epoch) & 1;
+  AVL_RCU_INC (&tree->rcu->slots[slot].readers[epoch]);
+  return (slot << 1) | epoch;
+#else
+  return 0;
+#endif
+}
+
+void
+avl_rcu_read_unlock (avl_tree * tree, unsigned int token)
+{
+#ifdef AVL_RCU_SUPPORTED
+  if (tree->rcu) {
+    AVL_RCU_DEC (&tree->rcu->slots[token >> 1].readers[token & 1]);
+  }
+#endif
+}
+
+static avl_rcu_node *
+avl_rcu_get_root (avl_tree * tree)
+{
+#ifdef AVL_RCU_SUPPORTED
+  return tree->rcu ? AVL_RCU_LOAD (&tree->rcu->root) : NULL;
+#else
+  return NULL;
+#endif
+}
+
+int
+avl_rcu_get_by_key (avl_tree * tree,
+         void * key,
+         void ** value_address)
+{
+  avl_rcu_node * x = avl_rcu_get_root (tree);
+
+  AVL_STATS_COUNT (tree, lookups, 1);
+  while (x) {
+    int compare_result = tree->compare_fun (tree->compare_arg, key, x->key);
+    if (compare_result < 0) {
+      x = x->left;
+    } else if (compare_result > 0) {
+      x = x->right;
+    } else {
+      *value_address = x->key;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+int
+avl_rcu_get_by_index (avl_tree * tree,
+           unsigned long index,
+           void ** value_address)
+{
+  avl_rcu_node * x = avl_rcu_get_root (tree);
+
+  while (x) {
+    unsigned long left = AVL_RCU_COUNT (x->left);
+    if (index < left) {
+      x = x->left;
+    } else if (index > left) {
+      index = index - left - 1;
+      x = x->right;
+    } else {
+      *value_address = x->key;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+static int
+avl_rcu_iterate_inorder_helper (avl_rcu_node * node,
+            avl_iter_fun_type iter_fun,
+            void * iter_arg)
+{
+  int result;
+
+  while (node) {
+    result = avl_rcu_iterate_inorder_helper (node->left, iter_fun, iter_arg);
+    if (result != 0) {
+      return result;
+    }
+    result = iter_fun (node->key, iter_arg);
+    if (result != 0) {
+      return result;
+    }
+    node = node->right;
+  }
+  return 0;
+}
+
+int
+avl_rcu_iterate_inorder (avl_tree * tree,
+         avl_iter_fun_type iter_fun,
+         void * iter_arg)
+{
+  return avl_rcu_iterate_inorder_helper (avl_rcu_get_root (tree), iter_fun, iter_arg);
+}
+
+avl_tree *
+avl_tree_new (avl_key_compare_fun_type compare_fun,
+          void * compare_arg)
+{
+  return avl_tree_new_ex (compare_fun, compare_arg, AVL_TREE_FLAG_NONE);
+}
+
+avl_tree *
+avl_tree_new_ex (avl_key_compare_fun_type compare_fun,
+          void * compare_arg,
+          unsigned int flags)
+{
+  avl_tree * t = (avl_tree *) malloc (sizeof (avl_tree));
+
+  if (!t) {
+    return NULL;
+  } else {
+    avl_node * root = avl_node_new((void *)NULL, (avl_node *) NULL);
+    if (!root) {
+      free (t);
+      return NULL;
+    } else {
+      t->root = root;
+      t->height = 0;
+      t->length = 0;
+      t->version = 0;
+      t->compare_fun = compare_fun;
+      t->compare_arg = compare_arg;
+      t->flags = flags;
+      t->slab_pages = NULL;
+      t->slab_free = NULL;
+      t->slab_page_nodes = AVL_SLAB_PAGE_MIN;
+      t->rcu = NULL;
+      t->btree = NULL;
+      t->compact = NULL;
+      t->hash = NULL;
+      t->frozen = NULL;
+      if (((flags & AVL_TREE_FLAG_BTREE) && (flags & AVL_TREE_FLAG_RCU)) ||
+          ((flags & AVL_TREE_FLAG_INTRUSIVE) && (flags & (AVL_TREE_FLAG_BTREE | AVL_TREE_FLAG_RCU))) ||
+          ((flags & AVL_TREE_FLAG_COMPACT) &&
+           (flags & (AVL_TREE_FLAG_BTREE | AVL_TREE_FLAG_RCU | AVL_TREE_FLAG_INTRUSIVE))) ||
+          ((flags & AVL_TREE_FLAG_NODE_LOCK) &&
+           (flags & (AVL_TREE_FLAG_BTREE | AVL_TREE_FLAG_COMPACT | AVL_TREE_FLAG_RCU |
+                     AVL_TREE_FLAG_INTRUSIVE)))) {
+        free (root);
+        free (t);
+        return NULL;
+      }
+      if (flags & AVL_TREE_FLAG_BTREE) {
+        t->btree = avl_btree_new ();
+        if (!t->btree) {
+          free (root);
+          free (t);
+          return NULL;
+        }
+      }
+      if (flags & AVL_TREE_FLAG_COMPACT) {
+        t->compact = avl_compact_new ();
+        if (!t->compact) {
+          free (root);
+          free (t);
+          return NULL;
+        }
+      }
+#ifdef AVL_RCU_SUPPORTED
+      if (flags & AVL_TREE_FLAG_RCU) {
+        t->rcu = avl_rcu_new ();
+      }
+#endif
+      if ((flags & AVL_TREE_FLAG_RCU) && !t->rcu) {
+        free (root);
+        free (t);
+        return NULL;
+      }
+#ifdef HAVE_AVL_STATS
+      if (avl_stats_new (t) != 0) {
+        if (t->btree) {
+          avl_btree_free (t->btree, NULL);
+        }
+        if (t->compact) {
+          avl_compact_free (t->compact, NULL);
+        }
+        if (t->rcu) {
+          avl_rcu_free (t->rcu);
+        }
+        free (root);
+        free (t);
+        return NULL;
+      }
+#endif
+      thread_rwlock_create(&t->rwlock);
+#ifdef HAVE_AVL_NODE_LOCK
+      thread_mutex_create(&t->node_mutex);
+#endif
+      return t;
+    }
+  }
+}
+  
+/* give all slab pages back, no node may be left in them */
+static void
+avl_slab_release (avl_tree * tree)
+{
+  while (tree->slab_pages) {
+    avl_slab_page * page = tree->slab_pages;
+    tree->slab_pages = page->next;
+    free (page);
+  }
+  tree->slab_free = NULL;
+}
+
+/*
+ * Rotate left children up until the node has none, then it is the
+ * smallest one left and can go.  This frees in order without recursion
+ * or a stack, whatever the shape of the tree.
+ */
+static void
+avl_tree_free_helper (avl_tree * tree, avl_node * node, avl_free_key_fun_type free_key_fun)
+{
+  avl_node * next;
+  void * key;
+
+  while (node) {
+    if (node->left) {
+      next = node->left;
+      node->left = next->right;
+      next->right = node;
+    } else {
+      /* an intrusive node may go away together with its key */
+      next = node->right;
+      key = node->key;
+#ifdef HAVE_AVL_NODE_LOCK
+      thread_rwlock_destroy (&node->rwlock);
+#endif
+      if (!(tree->flags & (AVL_TREE_FLAG_SLAB | AVL_TREE_FLAG_INTRUSIVE))) {
+        free (node);
+      }
+      if (free_key_fun)
+          free_key_fun (key);
+    }
+    node = next;
+  }
+}
+  
+void
+avl_tree_free (avl_tree * tree, avl_free_key_fun_type free_key_fun)
+{
+  if (tree->frozen) {
+    /* the keys are in the arrays, no nodes are left */
+    avl_frozen_free (tree->frozen, free_key_fun);
+    free_key_fun = NULL;
+  }
+  if (tree->btree) {
+    avl_btree_free (tree->btree, free_key_fun);
+  } else if (tree->compact) {
+    avl_compact_free (tree->compact, free_key_fun);
+  } else if (tree->length) {
+#ifndef HAVE_AVL_NODE_LOCK
+    /* slab nodes go away with their pages and intrusive ones with
+     * their owners, so only walk the tree when there are keys to free
+     */
+    if (free_key_fun || !(tree->flags & (AVL_TREE_FLAG_SLAB | AVL_TREE_FLAG_INTRUSIVE)))
+#endif
+      avl_tree_free_helper (tree, tree->root->right, free_key_fun);
+  }
+  if (tree->rcu) {
+    avl_rcu_free (tree->rcu);
+  }
+  if (tree->hash) {
+    avl_hash_free (tree->hash);
+  }
+  avl_slab_release (tree);
+  if (tree->root) {
+#ifdef HAVE_AVL_NODE_LOCK
+    thread_rwlock_destroy(&tree->root->rwlock);
+#endif
+    free (tree->root);
+  }
+  thread_rwlock_destroy(&tree->rwlock);
+#ifdef HAVE_AVL_NODE_LOCK
+  thread_mutex_destroy(&tree->node_mutex);
+#endif
+#ifdef HAVE_AVL_STATS
+  avl_stats_free (tree->stats);
+#endif
+  free (tree);
+}
+
+/* link <key> into the tree, in the caller's <node> for intrusive trees */
+static avl_node *
+avl_insert_node_new (avl_tree * ob, avl_node * node, void * key, avl_node * parent)
+{
+  if (node) {
+    avl_node_init (node, key, parent);
+    return node;
+  }
+  return avl_tree_node_new (ob, key, parent);
+}
+
+int
+avl_tree_set_hash_index (avl_tree * tree,
+          avl_key_hash_fun_type hash_fun,
+          void * hash_arg)
+{
+  avl_hash * old = tree->hash;
+
+  if (!hash_fun) {
+    tree->hash = NULL;
+  } else {
+    tree->hash = (avl_hash *) calloc (1, sizeof (avl_hash));
+    if (!tree->hash) {
+      tree->hash = old;
+      return -1;
+    }
+    tree->hash->hash_fun = hash_fun;
+    tree->hash->hash_arg = hash_arg;
+    tree->hash->mask = AVL_HASH_MIN_SIZE - 1;
+    if (avl_hash_reserve (tree, tree->length) != 0) {
+      free (tree->hash);
+      tree->hash = old;
+      return -1;
+    }
+    avl_iterate_inorder (tree, avl_hash_fill, tree);
+  }
+  if (old) {
+    avl_hash_free (old);
+  }
+  return 0;
+}
+
+/*
+ * Fix balance factors from <s> down to the new leaf <q> and rotate at
+ * <s> if it tipped over.  <t> is the parent of <s>, the deepest node on
+ * the insertion path that was out of balance; nothing above <t> changes.
+ */
+static void
+avl_insert_rebalance (avl_tree * ob,
+           avl_node * t,
+           avl_node * s,
+           avl_node * q,
+           void * key)
+{
+  avl_node *p, *r;
+  int a;
+
+  /* adjust balance factors */
+  if (ob->compare_fun (ob->compare_arg, key, s->key) < 1) {
+    r = p = s->left;
+  } else {
+    r = p = s->right;
+  }
+  while (p != q) {
+    if (ob->compare_fun (ob->compare_arg, key, p->key) < 1) {
+  AVL_SET_BALANCE (p, -1);
+  p = p->left;
+    } else {
+  AVL_SET_BALANCE (p, +1);
+  p = p->right;
+    }
+  }
+  
+  /* balancing act */
+  
+  if (ob->compare_fun (ob->compare_arg, key, s->key) < 1) {
+    a = -1;
+  } else {
+    a = +1;
+  }
+  
+  if (AVL_GET_BALANCE (s) == 0) {
+    AVL_SET_BALANCE (s, a);
+    ob->height = ob->height + 1;
+    return;
+  } else if (AVL_GET_BALANCE (s) == -a) {
+    AVL_SET_BALANCE (s, 0);
+    return;
+  } else if (AVL_GET_BALANCE(s) == a) {
+    if (AVL_GET_BALANCE (r) == a) {
+  /* single rotation */
+  AVL_STATS_COUNT (ob, rotations, 1);
+  p = r;
+  if (a == -1) {
+    s->left = r->right;
+    if (r->right) {
+      r->right->parent = s;
+    }
+    r->right = s;
+    s->parent = r;
+    AVL_SET_RANK (s, (AVL_GET_RANK (s) - AVL_GET_RANK (r)));
+  } else {
+    s->right = r->left;
+    if (r->left) {
+      r->left->parent = s;
+    }
+    r->left = s;
+    s->parent = r;
+    AVL_SET_RANK (r, (AVL_GET_RANK (r) + AVL_GET_RANK (s)));
+  }
+  AVL_SET_BALANCE (s, 0);
+  AVL_SET_BALANCE (r, 0);
+    } else if (AVL_GET_BALANCE (r) == -a) {
+  /* double rotation */
+  AVL_STATS_COUNT (ob, rotations, 2);
+  if (a == -1) {
+    p = r->right;
+    r->right = p->left;
+    if (p->left) {
+      p->left->parent = r;
+    }
+    p->left = r;
+    r->parent = p;
+    s->left = p->right;
+    if (p->right) {
+      p->right->parent = s;
+    }
+    p->right = s;
+    s->parent = p;
+    AVL_SET_RANK (p, (AVL_GET_RANK (p) + AVL_GET_RANK (r)));
+    AVL_SET_RANK (s, (AVL_GET_RANK (s) - AVL_GET_RANK (p)));
+  } else {
+    p = r->left;
+    r->left = p->right;
+    if (p->right) {
+      p->right->parent = r;
+    }
+    p->right = r;
+    r->parent = p;
+    s->right = p->left;
+    if (p->left) {
+      p->left->parent = s;
+    }
+    p->left = s;
+    s->parent = p;
+    AVL_SET_RANK (r, (AVL_GET_RANK (r) - AVL_GET_RANK (p)));
+    AVL_SET_RANK (p, (AVL_GET_RANK (p) + AVL_GET_RANK (s)));
+  }
+  if (AVL_GET_BALANCE (p) == a) {
+    AVL_SET_BALANCE (s, -a);
+    AVL_SET_BALANCE (r, 0);
+  } else if (AVL_GET_BALANCE (p) == -a) {
+    AVL_SET_BALANCE (s, 0);
+    AVL_SET_BALANCE (r, a);
+  } else {
+    AVL_SET_BALANCE (s, 0);
+    AVL_SET_BALANCE (r, 0);
+  }
+  AVL_SET_BALANCE (p, 0);
+    }
+    /* finishing touch */
+    if (s == t->right) {
+  t->right = p;
+    } else {
+  t->left = p;
+    }
+    p->parent = t;
+  }
+}
+
+static int
+avl_insert_helper (avl_tree * ob,
+           void * key,
+           avl_node * new_node)
+{
+  if (!(ob->root->right)) {
+    avl_node * node = avl_insert_node_new (ob, new_node, key, ob->root);
+    if (!node) {
+      return -1;
+    } else {
+      ob->root->right = node;
+      ob->length = ob->length + 1;
+      AVL_STATS_DEPTH (ob, node);
+      return 0;
+    }
+  } else { /* not self.right == None */
+    avl_node *t, *p, *s, *q;
+
+    t = ob->root;
+    s = p = t->right;
+
+    while (1) {
+      if (ob->compare_fun (ob->compare_arg, key, p->key) < 1) {
+    /* move left */
+    AVL_SET_RANK (p, (AVL_GET_RANK (p) + 1));
+    q = p->left;
+    if (!q) {
+      /* insert */
+      avl_node * q_node = avl_insert_node_new (ob, new_node, key, p);
+      if (!q_node) {
+        return (-1);
+      } else {
+        q = q_node;
+        p->left = q;
+        break;
+      }
+    } else if (AVL_GET_BALANCE(q)) {
+      t = p;
+      s = q;
+    }
+    p = q;
+      } else {
+    /* move right */
+    q = p->right;
+    if (!q) {
+      /* insert */
+      avl_node * q_node = avl_insert_node_new (ob, new_node, key, p);
+      if (!q_node) {
+        return -1;
+      } else {
+        q = q_node;
+        p->right = q;
+        break;
+      }
+    } else if (AVL_GET_BALANCE(q)) {
+      t = p;
+      s = q;
+    }
+    p = q;
+      }
+    }
+    
+    ob->length = ob->length + 1;
+    AVL_STATS_DEPTH (ob, q);
+    avl_insert_rebalance (ob, t, s, q, key);
+  }
+  return 0;
+}
+
+int
+avl_insert (avl_tree * ob,
+           void * key)
+{
+  if (ob->frozen || (ob->flags & AVL_TREE_FLAG_INTRUSIVE)) {
+    return -1;
+  }
+  if (avl_hash_reserve (ob, 1) != 0) {
+    return -1;
+  }
+  if (ob->btree || ob->compact) {
+    if ((ob->compact ? avl_compact_insert (ob, key)
+                     : avl_btree_insert (ob, key)) != 0) {
+      return -1;
+    }
+    /* every change moves keys between index positions */
+    ob->version++;
+    ob->length++;
+    avl_hash_insert (ob, key);
+    AVL_STATS_COUNT (ob, inserts, 1);
+    return 0;
+  }
+  if (ob->rcu && avl_rcu_reserve (ob->rcu, avl_rcu_reserve_count (ob->rcu)) != 0) {
+    return -1;
+  }
+  if (avl_insert_helper (ob, key, NULL) != 0) {
+    return -1;
+  }
+  avl_hash_insert (ob, key);
+  if (ob->rcu) {
+    avl_rcu_publish (ob->rcu, avl_rcu_insert_helper (ob, ob->rcu->root, key));
+  }
+  AVL_STATS_COUNT (ob, inserts, 1);
+  return 0;
+}
+
+int
+avl_insert_node (avl_tree * tree,
+           avl_node * node,
+           void * key)
+{
+  if (!(tree->flags & AVL_TREE_FLAG_INTRUSIVE) || avl_hash_reserve (tree, 1) != 0) {
+    return -1;
+  }
+  if (avl_insert_helper (tree, key, node) != 0) {
+    return -1;
+  }
+  avl_hash_insert (tree, key);
+  AVL_STATS_COUNT (tree, inserts, 1);
+  return 0;
+}
+
+#ifdef HAVE_AVL_NODE_LOCK
+/*
+ * Lock coupling: avl_insert_locked() and avl_get_node_locked() run under
+ * the tree's read lock and take node locks top down, never a parent after
+ * its child.  An insert keeps the nodes from t, the parent of the deepest
+ * node out of balance, down to the new leaf write locked.  Any rotation
+ * happens inside that segment and the nodes above t only have their rank
+ * bumped before their lock is dropped, so the tree's write lock is never
+ * needed and work in disjoint subtrees only meets while passing the top.
+ */
+
+int
+avl_insert_locked (avl_tree * tree,
+           void * key)
+{
+  avl_node * path[AVL_PATH_MAX];
+  avl_node *t, *s, *p, *q, *node;
+  unsigned int depth, i;
+  int left = 0;
+
+  if (!(tree->flags & AVL_TREE_FLAG_NODE_LOCK) || tree->hash || tree->frozen) {
+    return -1;
+  }
+
+  thread_mutex_lock (&tree->node_mutex);
+  node = avl_tree_node_new (tree, key, NULL);
+  thread_mutex_unlock (&tree->node_mutex);
+  if (!node) {
+    return -1;
+  }
+
+  t = p = tree->root;
+  s = NULL;
+  avl_node_wlock (p);
+  path[0] = p;
+  depth = 1;
+  q = p->right;
+  while (q) {
+    avl_node_wlock (q);
+    if (!s) {
+      s = q;
+    } else if (AVL_GET_BALANCE (q)) {
+      /* nothing above p can change any more */
+      for (i = 0; i < depth - 1; i++) {
+        avl_node_unlock (path[i]);
+      }
+      path[0] = p;
+      depth = 1;
+      t = p;
+      s = q;
+    }
+    path[depth++] = p = q;
+    left = tree->compare_fun (tree->compare_arg, key, p->key) < 1;
+    if (left) {
+      AVL_SET_RANK (p, (AVL_GET_RANK (p) + 1));
+      q = p->left;
+    } else {
+      q = p->right;
+    }
+  }
+
+  node->parent = p;
+  if (left) {
+    p->left = node;
+  } else {
+    p->right = node;
+  }
+  thread_mutex_lock (&tree->node_mutex);
+  tree->length++;
+  thread_mutex_unlock (&tree->node_mutex);
+  if (s) {
+    avl_insert_rebalance (tree, t, s, node, key);
+  }
+  for (i = 0; i < depth; i++) {
+    avl_node_unlock (path[i]);
+  }
+  AVL_STATS_COUNT (tree, inserts, 1);
+  return 0;
+}
+
+avl_node *
+avl_get_node_locked (avl_tree * tree,
+         void * key,
+         int write)
+{
+  avl_node *p, *x;
+  int compare_result;
+
+  p = tree->root;
+  avl_node_rlock (p);
+  x = p->right;
+  while (x) {
+    avl_node_rlock (x);
+    compare_result = tree->compare_fun (tree->compare_arg, key, x->key);
+    if (compare_result == 0) {
+      if (write) {
+        /* x cannot move while its parent is read locked */
+        avl_node_unlock (x);
+        avl_node_wlock (x);
+      }
+      avl_node_unlock (p);
+      return x;
+    }
+    avl_node_unlock (p);
+    p = x;
+    x = compare_result < 0 ? x->left : x->right;
+  }
+  avl_node_unlock (p);
+  return NULL;
+}
+#endif
+
+static avl_node *
+avl_get_node_by_index (avl_tree * tree,
+           unsigned long index)
+{
+  avl_node * p = tree->root->right;
+  unsigned long m = index + 1;
+
+  while (1) {
+    if (!p) {
+      return NULL;
+    }
+    if (m < AVL_GET_RANK(p)) {
+      p = p->left;
+    } else if (m > AVL_GET_RANK(p)) {
+      m = m - AVL_GET_RANK(p);
+      p = p->right;
+    } else {
+      return p;
+    }
+  }
+}
+
+int
+avl_get_by_index (avl_tree * tree,
+           unsigned long index,
+           void ** value_address)
+{
+  avl_node * p;
+
+  if (tree->frozen) {
+    return avl_frozen_get_by_index (tree, index, value_address);
+  }
+  if (tree->btree) {
+    return avl_btree_get_by_index (tree, index, value_address);
+  }
+  if (tree->compact) {
+    return avl_compact_get_by_index (tree, index, value_address);
+  }
+  p = avl_get_node_by_index (tree, index);
+  if (!p) {
+    return -1;
+  }
+  *value_address = p->key;
+  return 0;
+}
+           
+int
+avl_get_by_key (avl_tree * tree,
+         void * key,
+         void **value_address)
+{
+  avl_node * x;
+
+  AVL_STATS_COUNT (tree, lookups, 1);
+  if (tree->hash) {
+    return avl_hash_get (tree, key, value_address);
+  }
+  if (tree->frozen) {
+    return avl_frozen_get_by_key (tree, key, value_address);
+  }
+  if (tree->btree) {
+    return avl_btree_get_by_key (tree, key, value_address);
+  }
+  if (tree->compact) {
+    return avl_compact_get_by_key (tree, key, value_address);
+  }
+#ifdef HAVE_AVL_NODE_LOCK
+  if (tree->flags & AVL_TREE_FLAG_NODE_LOCK) {
+    /* couple node locks so avl_insert_locked() may run alongside */
+    x = avl_get_node_locked (tree, key, 0);
+    if (!x) {
+      return -1;
+    }
+    *value_address = x->key;
+    avl_node_unlock (x);
+    return 0;
+  }
+#endif
+  x = tree->root->right;
+  if (!x) {
+    return -1;
+  }
+  while (1) {
+    int compare_result = tree->compare_fun (tree->compare_arg, key, x->key);
+    if (compare_result < 0) {
+      if (x->left) {
+    x = x->left;
+      } else {
+    return -1;
+      }
+    } else if (compare_result > 0) {
+      if (x->right) {
+    x = x->right;
+      } else {
+    return -1;
+      }
+    } else {
+      AVL_STATS_DEPTH (tree, x);
+      *value_address = x->key;
+      return 0;
+    }
+  }
+}
+
+avl_node *
+avl_get_node_by_key (avl_tree * tree,
+         void * key)
+{
+  avl_node * x = tree->root->right;
+
+  AVL_STATS_COUNT (tree, lookups, 1);
+  while (x) {
+    int compare_result = tree->compare_fun (tree->compare_arg, key, x->key);
+    if (compare_result < 0) {
+      x = x->left;
+    } else if (compare_result > 0) {
+      x = x->right;
+    } else {
+      AVL_STATS_DEPTH (tree, x);
+      return x;
+    }
+  }
+  return NULL;
+}
+
+static void avl_unlink_node(avl_tree *tree, avl_node *x);
+
+/* unlink the node of <key>, its key is handed back in <removed> */
+static int avl_delete_helper(avl_tree *tree, void *key, void **removed)
+{
+  avl_node *x, *y;
+  
+  x = tree->root->right;
+  if (!x) {
+    return -1;
+  }
+  while (1) {
+    int compare_result = tree->compare_fun (tree->compare_arg, key, x->key);
+    if (compare_result < 0) {
+      /* move left
+       * We will be deleting from the left, adjust this node's
+       * rank accordingly
+       */
+      AVL_SET_RANK (x, (AVL_GET_RANK(x) - 1));
+      if (x->left) {
+    x = x->left;
+      } else {
+    /* Oops! now we have to undo the rank changes
+     * all the way up the tree
+     */
+    AVL_SET_RANK(x, (AVL_GET_RANK (x) + 1));
+    while (x != tree->root->right) {
+      if (x->parent->left == x) {
+        AVL_SET_RANK(x->parent, (AVL_GET_RANK (x->parent) + 1));
+      }
+      x = x->parent;
+    }
+    return -1;        /* key not in tree */
+      }
+    } else if (compare_result > 0) {
+      /* move right */
+      if (x->right) {
+    x = x->right;
+      } else {
+    /* moving right did not change the rank of <x> */
+    while (x != tree->root->right) {
+      if (x->parent->left == x) {
+        AVL_SET_RANK(x->parent, (AVL_GET_RANK (x->parent) + 1));
+      }
+      x = x->parent;
+    }
+    return -1;        /* key not in tree */
+      }
+    } else {
+      break;
+    }
+  }
+
+  if (x->left && x->right) {
+    void * temp_key;
+
+    /* The complicated case.
+     * reduce this to the simple case where we are deleting
+     * a node with at most one child.
+     */
+    
+    /* find the immediate predecessor <y> */
+    y = x->left;
+    while (y->right) {
+      y = y->right;
+    }
+    /* swap <x> with <y> */
+    temp_key = x->key;
+    x->key = y->key;
+    y->key = temp_key;
+    /* we know <x>'s left subtree lost a node because that's
+     * where we took it from
+     */
+    AVL_SET_RANK (x, (AVL_GET_RANK (x) - 1));
+    x = y;
+  }
+
+  /* return the node to storage */
+  *removed = x->key;
+  avl_unlink_node (tree, x);
+  avl_tree_node_free (tree, x);
+  return 0;
+}
+
+/*
+ * Unlink <x>, which has at most one child and whose ancestors already
+ * had their ranks adjusted, and rebalance on the way back up.
+ */
+static void avl_unlink_node(avl_tree *tree, avl_node *x)
+{
+  avl_node *p, *q, *r, *top, *x_child;
+  int shortened_side, shorter;
+
+  avl_hash_remove (tree, x->key);
+
+  /* scoot the child of <x> into the place of <x> */
+  if (x->left) {
+    x_child = x->left;
+    x_child->parent = x->parent;
+  } else if (x->right) {
+    x_child = x->right;
+    x_child->parent = x->parent;
+  } else {
+    x_child = NULL;
+  }
+
+  /* now tell <x>'s parent that a grandchild became a child */
+  if (x == x->parent->left) {
+    x->parent->left = x_child;
+    shortened_side = -1;
+  } else {
+    x->parent->right = x_child;
+    shortened_side = +1;
+  }
+
+  /*
+   * the height of the subtree <x>
+   * has now been shortened.  climb back up
+   * the tree, rotating when necessary to adjust
+   * for the change.
+   */
+  shorter = 1;
+  p = x->parent;
+
+  while (shorter && p->parent) {
+    
+    /* case 1: height unchanged */
+    if (AVL_GET_BALANCE(p) == 0) {
+      if (shortened_side == -1) {
+    /* we removed a left child, the tree is now heavier
      * on the right
      */
-    AVL_SET_BALANCE (p, +1);
+    AVL_SET_BALANCE (p, +1);
+      } else {
+    /* we removed a right child, the tree is now heavier
+     * on the left
+     */
+    AVL_SET_BALANCE (p, -1);
+      }
+      shorter = 0;
+      
+    } else if (AVL_GET_BALANCE (p) == shortened_side) {
+      /* case 2: taller subtree shortened, height reduced */
+      AVL_SET_BALANCE (p, 0);
+    } else {
+      /* case 3: shorter subtree shortened */
+      top = p->parent;
+      /* set <q> to the taller of the two subtrees of <p> */
+      if (shortened_side == 1) {
+    q = p->left;
+      } else {
+    q = p->right;
+      }
+      AVL_STATS_COUNT (tree, rotations, (AVL_GET_BALANCE (q) == -AVL_GET_BALANCE (p)) ? 2 : 1);
+      if (AVL_GET_BALANCE (q) == 0) {
+    /* case 3a: height unchanged */
+    if (shortened_side == -1) {
+      /* single rotate left */
+      q->parent = p->parent;
+      p->right = q->left;
+      if (q->left) {
+        q->left->parent = p;
+      }
+      q->left = p;
+      p->parent = q;
+      AVL_SET_RANK (q, (AVL_GET_RANK (q) + AVL_GET_RANK (p)));
+    } else {
+      /* single rotate right */
+      q->parent = p->parent;
+      p->left = q->right;
+      if (q->right) {
+        q->right->parent = p;
+      }
+      q->right = p;
+      p->parent = q;
+      AVL_SET_RANK (p, (AVL_GET_RANK (p) - AVL_GET_RANK (q)));
+    }
+    shorter = 0;
+    AVL_SET_BALANCE (q, shortened_side);
+    AVL_SET_BALANCE (p, (- shortened_side));
+      } else if (AVL_GET_BALANCE (q) == AVL_GET_BALANCE (p)) {
+    /* case 3b: height reduced */
+    if (shortened_side == -1) {
+      /* single rotate left */
+      q->parent = p->parent;
+      p->right = q->left;
+      if (q->left) {
+        q->left->parent = p;
+      }
+      q->left = p;
+      p->parent = q;
+      AVL_SET_RANK (q, (AVL_GET_RANK (q) + AVL_GET_RANK (p)));
+    } else {
+      /* single rotate right */
+      q->parent = p->parent;
+      p->left = q->right;
+      if (q->right) {
+        q->right->parent = p;
+      }
+      q->right = p;
+      p->parent = q;
+      AVL_SET_RANK (p, (AVL_GET_RANK (p) - AVL_GET_RANK (q)));
+    }
+    shorter = 1;
+    AVL_SET_BALANCE (q, 0);
+    AVL_SET_BALANCE (p, 0);
+      } else {
+    /* case 3c: height reduced, balance factors opposite */
+    if (shortened_side == 1) {
+      /* double rotate right */
+      /* first, a left rotation around q */
+      r = q->right;
+      r->parent = p->parent;
+      q->right = r->left;
+      if (r->left) {
+        r->left->parent = q;
+      }
+      r->left = q;
+      q->parent = r;
+      /* now, a right rotation around p */
+      p->left = r->right;
+      if (r->right) {
+        r->right->parent = p;
+      }
+      r->right = p;
+      p->parent = r;
+      AVL_SET_RANK (r, (AVL_GET_RANK (r) + AVL_GET_RANK (q)));
+      AVL_SET_RANK (p, (AVL_GET_RANK (p) - AVL_GET_RANK (r)));
+    } else {
+      /* double rotate left */
+      /* first, a right rotation around q */
+      r = q->left;
+      r->parent = p->parent;
+      q->left = r->right;
+      if (r->right) {
+        r->right->parent = q;
+      }
+      r->right = q;
+      q->parent = r;
+      /* now a left rotation around p */
+      p->right = r->left;
+      if (r->left) {
+        r->left->parent = p;
+      }
+      r->left = p;
+      p->parent = r;
+      AVL_SET_RANK (q, (AVL_GET_RANK (q) - AVL_GET_RANK (r)));
+      AVL_SET_RANK (r, (AVL_GET_RANK (r) + AVL_GET_RANK (p)));        
+    }
+    if (AVL_GET_BALANCE (r) == shortened_side) {
+      AVL_SET_BALANCE (q, (- shortened_side));
+      AVL_SET_BALANCE (p, 0);
+    } else if (AVL_GET_BALANCE (r) == (- shortened_side)) {
+      AVL_SET_BALANCE (q, 0);
+      AVL_SET_BALANCE (p, shortened_side);
+    } else {
+      AVL_SET_BALANCE (q, 0);
+      AVL_SET_BALANCE (p, 0);
+    }
+    AVL_SET_BALANCE (r, 0);
+    q = r;
+      }
+      /* a rotation has caused <q> (or <r> in case 3c) to become
+       * the root.  let <p>'s former parent know this.
+       */
+      if (top->left == p) {
+    top->left = q;
+      } else {
+    top->right = q;
+      }
+      /* end case 3 */
+      p = q;
+    }
+    x = p;
+    p = x->parent;
+    /* shortened_side tells us which side we came up from */
+    if (x == p->left) {
+      shortened_side = -1;
+    } else {
+      shortened_side = +1;
+    }
+  } /* end while(shorter) */
+  /* when we're all done, we're one shorter */
+  tree->length = tree->length - 1;
+  tree->version++;
+}
+
+/*
+ * Swap the places of <x>, which has two children, and its in-order
+ * predecessor <y>.  Ranks and balance factors belong to the places.
+ */
+static void
+avl_swap_with_predecessor (avl_node * x, avl_node * y)
+{
+  avl_node * xp = x->parent;
+  avl_node * yl = y->left;
+  unsigned int rank_and_balance = x->rank_and_balance;
+
+  x->rank_and_balance = y->rank_and_balance;
+  y->rank_and_balance = rank_and_balance;
+  if (xp->left == x) {
+    xp->left = y;
+  } else {
+    xp->right = y;
+  }
+  y->right = x->right;
+  y->right->parent = y;
+  if (y == x->left) {
+    y->left = x;
+    x->parent = y;
+  } else {
+    y->left = x->left;
+    y->left->parent = y;
+    y->parent->right = x;
+    x->parent = y->parent;
+  }
+  y->parent = xp;
+  x->left = yl;
+  if (yl) {
+    yl->parent = x;
+  }
+  x->right = NULL;
+}
+
+int
+avl_delete_node (avl_tree * tree,
+         avl_node * node)
+{
+  avl_node * x;
+
+  if (!(tree->flags & AVL_TREE_FLAG_INTRUSIVE)) {
+    return -1;
+  }
+  if (node->left && node->right) {
+    /* keys cannot move between intrusive nodes, move the node itself
+     * to where the predecessor was
+     */
+    x = node->left;
+    while (x->right) {
+      x = x->right;
+    }
+    avl_swap_with_predecessor (node, x);
+  }
+  /* every ancestor having <node> on its left loses one rank */
+  for (x = node; x->parent != tree->root; x = x->parent) {
+    if (x == x->parent->left) {
+      AVL_SET_RANK (x->parent, (AVL_GET_RANK (x->parent) - 1));
+    }
+  }
+  avl_unlink_node (tree, node);
+  avl_tree_node_free (tree, node);
+  AVL_STATS_COUNT (tree, deletes, 1);
+  return 0;
+}
+
+int avl_delete(avl_tree *tree, void *key, avl_free_key_fun_type free_key_fun)
+{
+  void *removed;
+
+  if (tree->frozen) {
+    return -1;
+  }
+  if (tree->btree || tree->compact) {
+    if ((tree->compact ? avl_compact_delete (tree, key, &removed)
+                       : avl_btree_delete (tree, key, &removed)) != 0) {
+      return -1;
+    }
+    tree->version++;
+    tree->length--;
+    avl_hash_remove (tree, removed);
+    AVL_STATS_COUNT (tree, deletes, 1);
+    if (free_key_fun)
+      free_key_fun (removed);
+    return 0;
+  }
+  if (tree->flags & AVL_TREE_FLAG_INTRUSIVE) {
+    avl_node * node = avl_get_node_by_key (tree, key);
+    if (!node) {
+      return -1;
+    }
+    removed = node->key;
+    avl_delete_node (tree, node);
+    if (free_key_fun)
+      free_key_fun (removed);
+    return 0;
+  }
+  if (tree->rcu && avl_rcu_reserve (tree->rcu, avl_rcu_reserve_count (tree->rcu)) != 0) {
+    return -1;
+  }
+  if (avl_delete_helper (tree, key, &removed) != 0) {
+    return -1;
+  }
+  AVL_STATS_COUNT (tree, deletes, 1);
+  if (tree->rcu) {
+    /* readers may still look at the key, let the grace period free it */
+    avl_rcu_publish (tree->rcu, avl_rcu_delete_helper (tree, tree->rcu->root, key, removed, free_key_fun));
+  } else if (free_key_fun) {
+    free_key_fun (removed);
+  }
+  return 0;
+}
+
+static void
+avl_tree_free_nodes (avl_tree * tree, avl_node * node)
+{
+  if (node) {
+    avl_tree_free_nodes (tree, node->left);
+    avl_tree_free_nodes (tree, node->right);
+    avl_tree_node_free (tree, node);
+  }
+}
+
+/*
+ * Build a perfectly balanced subtree from keys[low..high-1].  The
+ * middle key becomes the root, so the left half is never smaller than
+ * the right one and the balance factor is either 0 or -1.
+ */
+static avl_node *
+avl_build_helper (avl_tree * tree,
+          void ** keys,
+          unsigned long low,
+          unsigned long high,
+          avl_node * parent,
+          unsigned int * height)
+{
+  unsigned long mid = low + (high - low) / 2;
+  unsigned int lh = 0, rh = 0;
+  avl_node * node;
+
+  node = avl_tree_node_new (tree, keys[mid], parent);
+  if (!node) {
+    return NULL;
+  }
+  if (low < mid) {
+    node->left = avl_build_helper (tree, keys, low, mid, node, &lh);
+    if (!node->left) {
+      avl_tree_node_free (tree, node);
+      return NULL;
+    }
+  }
+  if (mid + 1 < high) {
+    node->right = avl_build_helper (tree, keys, mid + 1, high, node, &rh);
+    if (!node->right) {
+      avl_tree_free_nodes (tree, node->left);
+      avl_tree_node_free (tree, node);
+      return NULL;
+    }
+  }
+  AVL_SET_RANK (node, (mid - low + 1));
+  AVL_SET_BALANCE (node, ((int)rh - (int)lh));
+  *height = 1 + AVL_MAX (lh, rh);
+  return node;
+}
+
+/*
+ * Fill an empty tree from <count> keys sorted in ascending order in
+ * linear time.  With <verify> set the order is checked with the
+ * tree's compare function first and -1 is returned if it is wrong.
+ */
+int
+avl_tree_build_sorted (avl_tree * tree,
+          void ** keys,
+          unsigned long count,
+          int verify)
+{
+  unsigned int height = 0;
+  avl_node * root;
+  unsigned long i;
+
+  if (tree->length || tree->frozen || (tree->flags & AVL_TREE_FLAG_INTRUSIVE)) {
+    return -1;
+  }
+  if (verify) {
+    for (i = 1; i < count; i++) {
+      if (tree->compare_fun (tree->compare_arg, keys[i - 1], keys[i]) > 0) {
+        return -1;
+      }
+    }
+  }
+  if (!count) {
+    return 0;
+  }
+  if (avl_hash_reserve (tree, count) != 0) {
+    return -1;
+  }
+  if (tree->btree || tree->compact) {
+    if ((tree->compact ? avl_compact_build_sorted (tree, keys, count)
+                       : avl_btree_build_sorted (tree, keys, count)) != 0) {
+      return -1;
+    }
+    tree->version++;
+    tree->length = count;
+  } else {
+    if (tree->rcu && avl_rcu_reserve (tree->rcu, count) != 0) {
+      return -1;
+    }
+
+    root = avl_build_helper (tree, keys, 0, count, tree->root, &height);
+    if (!root) {
+      return -1;
+    }
+    tree->root->right = root;
+    tree->length = count;
+    tree->height = height;
+    if (tree->rcu) {
+      avl_rcu_rebuild (tree);
+    }
+  }
+  for (i = 0; i < count; i++) {
+    avl_hash_insert (tree, keys[i]);
+  }
+  AVL_STATS_COUNT (tree, inserts, count);
+  return 0;
+}
+
+/* bounds and index lookups for the trees that keep no avl_nodes */
+static unsigned long
+avl_nodeless_get_bound (avl_tree * tree, void * key, int upper)
+{
+  if (tree->frozen) {
+    return avl_frozen_get_bound (tree, key, upper);
+  }
+  if (tree->compact) {
+    return avl_compact_get_bound (tree, key, upper);
+  }
+  return avl_btree_get_bound (tree, key, upper);
+}
+
+static int
+avl_nodeless_get_by_index (avl_tree * tree, unsigned long index, void ** value_address)
+{
+  if (tree->frozen) {
+    return avl_frozen_get_by_index (tree, index, value_address);
+  }
+  if (tree->compact) {
+    return avl_compact_get_by_index (tree, index, value_address);
+  }
+  return avl_btree_get_by_index (tree, index, value_address);
+}
+
+static int
+avl_freeze_collect (void * key, void * iter_arg)
+{
+  void *** next = (void ***) iter_arg;
+
+  *((*next)++) = key;
+  return 0;
+}
+
+int
+avl_tree_freeze (avl_tree * tree)
+{
+  avl_frozen * frozen;
+  avl_btree * btree = NULL;
+  avl_compact * compact = NULL;
+  void ** keys, ** next;
+
+  if (tree->frozen) {
+    return 0;
+  }
+  if (tree->rcu || (tree->flags & AVL_TREE_FLAG_INTRUSIVE)) {
+    return -1;
+  }
+  keys = (void **) malloc ((tree->length ? tree->length : 1) * sizeof (void *));
+  if (!keys) {
+    return -1;
+  }
+  next = keys;
+  avl_iterate_inorder (tree, avl_freeze_collect, &next);
+  /* an empty one to thaw into later */
+  if ((tree->btree && !(btree = avl_btree_new ())) ||
+      (tree->compact && !(compact = avl_compact_new ()))) {
+    free (keys);
+    return -1;
+  }
+  frozen = avl_frozen_new (keys, tree->length);
+  if (!frozen) {
+    if (btree) {
+      avl_btree_free (btree, NULL);
+    }
+    if (compact) {
+      avl_compact_free (compact, NULL);
+    }
+    free (keys);
+    return -1;
+  }
+
+  /* the keys stay, the nodes go */
+  if (tree->btree) {
+    avl_btree_free (tree->btree, NULL);
+    tree->btree = btree;
+  } else if (tree->compact) {
+    avl_compact_free (tree->compact, NULL);
+    tree->compact = compact;
+  } else {
+    avl_tree_free_helper (tree, tree->root->right, NULL);
+    tree->root->right = NULL;
+    avl_slab_release (tree);
+  }
+  tree->frozen = frozen;
+  tree->version++;
+  return 0;
+}
+
+int
+avl_tree_thaw (avl_tree * tree)
+{
+  avl_frozen * frozen = tree->frozen;
+  avl_hash * hash = tree->hash;
+  unsigned int length = tree->length;
+  int result;
+
+  if (!frozen) {
+    return 0;
+  }
+  tree->frozen = NULL;
+  tree->length = 0;
+  /* the hash index has the keys already */
+  tree->hash = NULL;
+  result = avl_tree_build_sorted (tree, avl_frozen_keys (frozen), length, 0);
+  tree->hash = hash;
+  if (result != 0) {
+    tree->frozen = frozen;
+    tree->length = length;
+    return -1;
+  }
+  avl_frozen_free (frozen, NULL);
+  tree->version++;
+  return 0;
+}
+
+/* the leftmost node below <node> */
+static avl_node *
+avl_node_first (avl_node * node)
+{
+  if (node) {
+    while (node->left) {
+      node = node->left;
+    }
+  }
+  return node;
+}
+
+/*
+ * The in-order successor of <node>, NULL after the last one.  Unlike
+ * avl_get_next() this recognises the end by the tree's root instead of
+ * a NULL key, so it works for trees holding a NULL key, too.
+ */
+static avl_node *
+avl_node_next (avl_tree * tree, avl_node * node)
+{
+  if (node->right) {
+    return avl_node_first (node->right);
+  }
+  while (node->parent != tree->root && node == node->parent->right) {
+    node = node->parent;
+  }
+  return (node->parent == tree->root) ? NULL : node->parent;
+}
+
+/*
+ * Batched updates.
+ *
+ * The batch is sorted with the tree's compare function first.  Small
+ * batches are then applied one key at a time, in order so the walks
+ * share their paths in the cache.  Larger ones are merged with the
+ * in-order sequence of the existing nodes, which are relinked into a
+ * perfectly balanced tree in one linear pass, like
+ * avl_tree_build_sorted() does.
+ */
+
+/* stable bottom-up merge sort of <keys>, <tmp> is scratch of <count> */
+static void
+avl_sort_keys (avl_tree * tree, void ** keys, void ** tmp, unsigned long count)
+{
+  unsigned long width, low, mid, high, i, j, k;
+  void ** from = keys;
+  void ** to = tmp;
+  void ** swap;
+
+  for (width = 1; width < count; width = width * 2) {
+    for (low = 0; low < count; low = high) {
+      mid = low + width < count ? low + width : count;
+      high = mid + width < count ? mid + width : count;
+      i = low;
+      j = mid;
+      for (k = low; k < high; k++) {
+        if (i < mid && (j >= high || tree->compare_fun (tree->compare_arg, from[i], from[j]) <= 0)) {
+          to[k] = from[i++];
+        } else {
+          to[k] = from[j++];
+        }
+      }
+    }
+    swap = from;
+    from = to;
+    to = swap;
+  }
+  if (from != keys) {
+    memcpy (keys, from, count * sizeof (void *));
+  }
+}
+
+/* whether <count> single updates beat relinking the whole tree */
+static int
+avl_batch_is_small (avl_tree * tree, unsigned long count)
+{
+  unsigned long size = tree->length + count;
+  unsigned long bits = 0;
+
+  while (size) {
+    bits++;
+    size = size >> 1;
+  }
+  return (count * bits) < tree->length;
+}
+
+/* the nodes of the tree, in order */
+static avl_node **
+avl_tree_collect_nodes (avl_tree * tree, unsigned long extra)
+{
+  avl_node ** nodes = (avl_node **) malloc ((tree->length + extra) * sizeof (avl_node *));
+  avl_node * node;
+  unsigned long i = 0;
+
+  if (!nodes) {
+    return NULL;
+  }
+  for (node = avl_node_first (tree->root->right); node; node = avl_node_next (tree, node)) {
+    nodes[i++] = node;
+  }
+  return nodes;
+}
+
+/* link nodes[low..high-1] into a perfectly balanced subtree */
+static avl_node *
+avl_relink_helper (avl_node ** nodes,
+          unsigned long low,
+          unsigned long high,
+          avl_node * parent,
+          unsigned int * height)
+{
+  unsigned long mid = low + (high - low) / 2;
+  unsigned int lh = 0, rh = 0;
+  avl_node * node = nodes[mid];
+
+  node->parent = parent;
+  node->left = NULL;
+  node->right = NULL;
+  if (low < mid) {
+    node->left = avl_relink_helper (nodes, low, mid, node, &lh);
+  }
+  if (mid + 1 < high) {
+    node->right = avl_relink_helper (nodes, mid + 1, high, node, &rh);
+  }
+  AVL_SET_RANK (node, (mid - low + 1));
+  AVL_SET_BALANCE (node, ((int)rh - (int)lh));
+  *height = 1 + AVL_MAX (lh, rh);
+  return node;
+}
+
+static void
+avl_tree_relink (avl_tree * tree, avl_node ** nodes, unsigned long count)
+{
+  unsigned int height = 0;
+
+  tree->root->right = count ? avl_relink_helper (nodes, 0, count, tree->root, &height) : NULL;
+  tree->length = count;
+  tree->height = height;
+  if (tree->rcu) {
+    avl_rcu_rebuild (tree);
+  }
+}
+
+int
+avl_insert_batch (avl_tree * tree,
+          void ** keys,
+          unsigned long count)
+{
+  void ** sorted;
+  avl_node ** nodes;
+  avl_node ** added;
+  unsigned long n, i, j, k;
+
+  if (tree->frozen || (tree->flags & AVL_TREE_FLAG_INTRUSIVE)) {
+    return -1;
+  }
+  if (!count) {
+    return 0;
+  }
+  sorted = (void **) malloc (2 * count * sizeof (void *));
+  if (!sorted) {
+    return -1;
+  }
+  memcpy (sorted, keys, count * sizeof (void *));
+  avl_sort_keys (tree, sorted, sorted + count, count);
+
+  if (tree->btree || tree->compact || avl_batch_is_small (tree, count)) {
+    for (i = 0; i < count; i++) {
+      if (avl_insert (tree, sorted[i]) != 0) {
+        free (sorted);
+        return -1;
+      }
+    }
+    free (sorted);
+    return 0;
+  }
+
+  /* get everything that can fail out of the way first */
+  n = tree->length;
+  nodes = avl_tree_collect_nodes (tree, 2 * count);
+  if (!nodes || avl_hash_reserve (tree, count) != 0 ||
+      (tree->rcu && avl_rcu_reserve (tree->rcu, n + count) != 0)) {
+    free (nodes);
+    free (sorted);
+    return -1;
+  }
+  added = nodes + n + count;
+  for (i = 0; i < count; i++) {
+    added[i] = avl_tree_node_new (tree, sorted[i], NULL);
+    if (!added[i]) {
+      while (i > 0) {
+        avl_tree_node_free (tree, added[--i]);
+      }
+      free (nodes);
+      free (sorted);
+      return -1;
+    }
+  }
+
+  /* merge from the back, new keys go before equal old ones like with
+   * avl_insert()
+   */
+  i = n;
+  j = count;
+  k = n + count;
+  while (j > 0) {
+    if (i > 0 && tree->compare_fun (tree->compare_arg, added[j - 1]->key, nodes[i - 1]->key) > 0) {
+      nodes[--k] = added[--j];
+    } else if (i > 0) {
+      nodes[--k] = nodes[--i];
+    } else {
+      nodes[--k] = added[--j];
+    }
+  }
+  avl_tree_relink (tree, nodes, n + count);
+  for (i = 0; i < count; i++) {
+    avl_hash_insert (tree, sorted[i]);
+  }
+  AVL_STATS_COUNT (tree, inserts, count);
+  free (nodes);
+  free (sorted);
+  return 0;
+}
+
+int
+avl_delete_batch (avl_tree * tree,
+          void ** keys,
+          unsigned long count,
+          avl_free_key_fun_type free_key_fun)
+{
+  void ** sorted;
+  avl_node ** nodes;
+  unsigned long n, i, j, kept, removed;
+  int result = 0;
+
+  if (tree->frozen) {
+    return -1;
+  }
+  if (!count) {
+    return 0;
+  }
+  sorted = (void **) malloc (2 * count * sizeof (void *));
+  if (!sorted) {
+    return -1;
+  }
+  memcpy (sorted, keys, count * sizeof (void *));
+  avl_sort_keys (tree, sorted, sorted + count, count);
+
+  if (tree->btree || tree->compact || avl_batch_is_small (tree, count)) {
+    for (i = 0; i < count; i++) {
+      if (avl_delete (tree, sorted[i], free_key_fun) != 0) {
+        result = -1;
+      }
+    }
+    free (sorted);
+    return result;
+  }
+
+  n = tree->length;
+  nodes = avl_tree_collect_nodes (tree, 0);
+  if (!nodes || (tree->rcu && avl_rcu_reserve (tree->rcu, n) != 0)) {
+    free (nodes);
+    free (sorted);
+    return -1;
+  }
+
+  /* keep the nodes not matched by a key, the matched ones are moved
+   * behind the kept ones
+   */
+  kept = 0;
+  removed = 0;
+  j = 0;
+  for (i = 0; i < n; i++) {
+    int compare_result = -1;
+    while (j < count &&
+           (compare_result = tree->compare_fun (tree->compare_arg, sorted[j], nodes[i]->key)) < 0) {
+      /* key not in tree */
+      result = -1;
+      j++;
+    }
+    if (j < count && compare_result == 0) {
+      sorted[removed++] = nodes[i];
+      j++;
+    } else {
+      nodes[kept++] = nodes[i];
+    }
+  }
+  if (j < count) {
+    result = -1;
+  }
+  avl_tree_relink (tree, nodes, kept);
+  if (removed) {
+    tree->version++;
+  }
+  AVL_STATS_COUNT (tree, deletes, removed);
+
+  if (removed && tree->rcu && free_key_fun) {
+    /* readers may still look at the keys */
+    avl_rcu_synchronize (tree);
+  }
+  for (i = 0; i < removed; i++) {
+    avl_node * node = (avl_node *) sorted[i];
+    void * key = node->key;
+    avl_hash_remove (tree, key);
+    avl_tree_node_free (tree, node);
+    if (free_key_fun)
+      free_key_fun (key);
+  }
+  free (nodes);
+  free (sorted);
+  return result;
+}
+
+/* walk along the parent pointers, no recursion */
+static int
+avl_iterate_inorder_helper (avl_tree * tree,
+            avl_iter_fun_type iter_fun,
+            void * iter_arg)
+{
+  avl_node * node;
+  int result;
+
+  for (node = avl_node_first (tree->root->right); node; node = avl_node_next (tree, node)) {
+    result = iter_fun (node->key, iter_arg);
+    if (result != 0) {
+      return result;
+    }
+  }
+  return 0;
+}
+
+int
+avl_iterate_inorder (avl_tree * tree,
+         avl_iter_fun_type iter_fun,
+         void * iter_arg)
+{
+  int result;
+
+  if (tree->frozen) {
+    return avl_frozen_iterate_inorder (tree, iter_fun, iter_arg);
+  }
+  if (tree->btree) {
+    return avl_btree_iterate_inorder (tree, iter_fun, iter_arg);
+  }
+  if (tree->compact) {
+    return avl_compact_iterate_inorder (tree, iter_fun, iter_arg);
+  }
+  if (tree->length) {
+    result = avl_iterate_inorder_helper (tree, iter_fun, iter_arg);
+    return (result);
+  } else {
+    return 0;
+  }
+}
+
+/*
+ * Iterators keep their place between calls, so a long walk can drop
+ * the tree's lock now and then.  The successor is found through the
+ * parent pointers, which takes amortized O(1) without a stack.  When
+ * the tree's version shows that nodes were deleted in the meantime the
+ * current node may be gone, so the iterator finds its place again by
+ * searching for the first key greater than the last one it returned.
+ */
+
+/* the first node holding a key greater than <key> */
+static avl_node *
+avl_node_upper_bound (avl_tree * tree, void * key)
+{
+  avl_node * x = tree->root->right;
+  avl_node * bound = NULL;
+
+  while (x) {
+    if (tree->compare_fun (tree->compare_arg, key, x->key) < 0) {
+      bound = x;
+      x = x->left;
+    } else {
+      x = x->right;
+    }
+  }
+  return bound;
+}
+
+void
+avl_iterator_init (avl_iterator * iterator,
+         avl_tree * tree)
+{
+  iterator->tree = tree;
+  iterator->node = NULL;
+  iterator->key = NULL;
+  iterator->version = tree->version;
+  iterator->index = 0;
+  iterator->started = 0;
+}
+
+int
+avl_iterator_next (avl_iterator * iterator,
+         void ** value_address)
+{
+  avl_tree * tree = iterator->tree;
+  avl_node * node;
+
+  if (tree->btree || tree->compact || tree->frozen) {
+    unsigned long index = 0;
+    if (iterator->started) {
+      /* keys stay where they are as long as the version holds, equal
+       * ones are not skipped then
+       */
+      if (iterator->version == tree->version) {
+        index = iterator->index + 1;
+      } else {
+        index = avl_nodeless_get_bound (tree, iterator->key, 1);
+      }
+    }
+    iterator->started = 1;
+    iterator->index = index;
+    iterator->version = tree->version;
+    if (avl_nodeless_get_by_index (tree, index, &iterator->key) != 0) {
+      return -1;
+    }
+    *value_address = iterator->key;
+    return 0;
+  }
+
+  if (!iterator->started) {
+    node = avl_node_first (tree->root->right);
+  } else if (!iterator->node) {
+    /* walked off the end already */
+    return -1;
+  } else if (iterator->version != tree->version) {
+    node = avl_node_upper_bound (tree, iterator->key);
+  } else {
+    node = avl_node_next (tree, iterator->node);
+  }
+  iterator->started = 1;
+  iterator->node = node;
+  iterator->version = tree->version;
+  if (!node) {
+    return -1;
+  }
+  iterator->key = node->key;
+  *value_address = node->key;
+  return 0;
+}
+
+/*
+ * Set <iterator> up to return the key at <index> next.  Unlike a key
+ * kept from before, the position stays meaningful whatever writers did
+ * to the tree in between.
+ */
+static void
+avl_iterator_seek (avl_iterator * iterator,
+         unsigned long index)
+{
+  avl_tree * tree = iterator->tree;
+
+  avl_iterator_init (iterator, tree);
+  if (!index) {
+    return;
+  }
+  iterator->started = 1;
+  if (tree->btree || tree->compact || tree->frozen) {
+    iterator->index = index - 1;
+  } else if ((iterator->node = avl_get_node_by_index (tree, index - 1)) != NULL) {
+    iterator->key = iterator->node->key;
+  }
+}
+
+int
+avl_iterate_inorder_yield (avl_tree * tree,
+         avl_iter_fun_type iter_fun,
+         void * iter_arg,
+         unsigned int batch)
+{
+  avl_iterator iterator;
+  unsigned long returned = 0;
+  unsigned int i;
+  void * key;
+  int result;
+
+  if (batch < 1) {
+    batch = 1;
+  }
+  avl_tree_rlock (tree);
+  avl_iterator_init (&iterator, tree);
+  while (1) {
+    for (i = 0; i < batch; i++) {
+      if (avl_iterator_next (&iterator, &key) != 0) {
+        avl_tree_unlock (tree);
+        return 0;
+      }
+      returned++;
+      result = iter_fun (key, iter_arg);
+      if (result != 0) {
+        avl_tree_unlock (tree);
+        return result;
+      }
+    }
+    /* let writers in; they may free the last key returned, so go on by
+     * position rather than searching for it
+     */
+    avl_tree_unlock (tree);
+    avl_tree_rlock (tree);
+    if (iterator.version != tree->version) {
+      avl_iterator_seek (&iterator, returned);
+    }
+  }
+}
+
+avl_node *avl_get_first(avl_tree *tree)
+{
+    avl_node *node;
+    
+    node = tree->root->right;
+    if (node == NULL || node->key == NULL) return NULL;
+
+    while (node->left)
+        node = node->left;
+
+    return node;
+}
+
+avl_node *avl_get_prev(avl_node *node)
+{
+    if (node->left) {
+        node = node->left;
+        while (node->right) {
+            node = node->right;
+        }
+
+        return node;
+    } else {
+        avl_node *child = node;
+        while (node->parent && node->parent->key) {
+            node = node->parent;
+            if (child == node->right) {
+                return node;
+            }
+            child = node;
+        }
+        
+        return NULL;
+    }
+}
+
+avl_node *avl_get_next(avl_node *node)
+{
+    if (node->right) {
+        node = node->right;
+        while (node->left) {
+            node = node->left;
+        }
+        
+        return node;
+    } else {
+        avl_node *child = node;
+        while (node->parent && node->parent->key) {
+            node = node->parent;
+            if (child == node->left) {
+                return node;
+            }
+            child = node;
+        }
+        
+        return NULL;
+    }
+}
+
+/*
+ * Fingers.
+ *
+ * A finger remembers the node of the last key it found or inserted.
+ * The next search climbs from there only as far as needed for the key
+ * to be inside the subtree it is in and descends again, so runs of
+ * close or ascending keys need O(1) compares on average instead of a
+ * walk from the root.  Inserts still update ranks and balance factors
+ * on the way up to the root, which needs no compares.
+ */
+
+static avl_node *
+avl_rotate_right (avl_node * x)
+{
+  avl_node * l = x->left;
+
+  x->left = l->right;
+  if (l->right) {
+    l->right->parent = x;
+  }
+  l->parent = x->parent;
+  if (x->parent->left == x) {
+    x->parent->left = l;
+  } else {
+    x->parent->right = l;
+  }
+  l->right = x;
+  x->parent = l;
+  AVL_SET_RANK (x, (AVL_GET_RANK (x) - AVL_GET_RANK (l)));
+  return l;
+}
+
+static avl_node *
+avl_rotate_left (avl_node * x)
+{
+  avl_node * r = x->right;
+
+  x->right = r->left;
+  if (r->left) {
+    r->left->parent = x;
+  }
+  r->parent = x->parent;
+  if (x->parent->left == x) {
+    x->parent->left = r;
+  } else {
+    x->parent->right = r;
+  }
+  r->left = x;
+  x->parent = r;
+  AVL_SET_RANK (r, (AVL_GET_RANK (r) + AVL_GET_RANK (x)));
+  return r;
+}
+
+/*
+ * The subtree of <node> just grew one level taller: fix the balance
+ * factors above it up to, not including, <top>, rotating where needed.
+ * Returns 1 if the subtree below <top> grew as well.  Rotations are
+ * counted for <tree> unless it is NULL.
+ */
+static int
+avl_grow_fixup (avl_tree * tree, avl_node * top, avl_node * node)
+{
+  avl_node * c, * p, * g;
+  int a;
+
+  /* climb while subtrees grow taller */
+  for (c = node; c->parent != top; c = p) {
+    p = c->parent;
+    a = (c == p->left) ? -1 : +1;
+    if (AVL_GET_BALANCE (p) == -a) {
+      AVL_SET_BALANCE (p, 0);
+      return 0;
+    } else if (AVL_GET_BALANCE (p) == 0) {
+      AVL_SET_BALANCE (p, a);
+      continue;
+    }
+    /* <p> leans two levels towards <c> now */
+    if (tree) {
+      AVL_STATS_COUNT (tree, rotations, (AVL_GET_BALANCE (c) == a) ? 1 : 2);
+    }
+    if (AVL_GET_BALANCE (c) == a) {
+      /* single rotation */
+      if (a == -1) {
+        avl_rotate_right (p);
       } else {
-    /* we removed a right child, the tree is now heavier
-     * on the left
-     */
-    AVL_SET_BALANCE (p, -1);
+        avl_rotate_left (p);
       }
-      shorter = 0;
-      
-    } else if (AVL_GET_BALANCE (p) == shortened_side) {
-      /* case 2: taller subtree shortened, height reduced */
       AVL_SET_BALANCE (p, 0);
+      AVL_SET_BALANCE (c, 0);
     } else {
-      /* case 3: shorter subtree shortened */
-      top = p->parent;
-      /* set <q> to the taller of the two subtrees of <p> */
-      if (shortened_side == 1) {
-    q = p->left;
+      /* double rotation */
+      if (a == -1) {
+        g = c->right;
+        avl_rotate_left (c);
+        avl_rotate_right (p);
       } else {
-    q = p->right;
-      }
-      if (AVL_GET_BALANCE (q) == 0) {
-    /* case 3a: height unchanged */
-    if (shortened_side == -1) {
-      /* single rotate left */
-      q->parent = p->parent;
-      p->right = q->left;
-      if (q->left) {
-        q->left->parent = p;
+        g = c->left;
+        avl_rotate_right (c);
+        avl_rotate_left (p);
       }
-      q->left = p;
-      p->parent = q;
-      AVL_SET_RANK (q, (AVL_GET_RANK (q) + AVL_GET_RANK (p)));
-    } else {
-      /* single rotate right */
-      q->parent = p->parent;
-      p->left = q->right;
-      if (q->right) {
-        q->right->parent = p;
+      if (AVL_GET_BALANCE (g) == a) {
+        AVL_SET_BALANCE (p, -a);
+        AVL_SET_BALANCE (c, 0);
+      } else if (AVL_GET_BALANCE (g) == -a) {
+        AVL_SET_BALANCE (p, 0);
+        AVL_SET_BALANCE (c, a);
+      } else {
+        AVL_SET_BALANCE (p, 0);
+        AVL_SET_BALANCE (c, 0);
       }
-      q->right = p;
-      p->parent = q;
-      AVL_SET_RANK (p, (AVL_GET_RANK (p) - AVL_GET_RANK (q)));
+      AVL_SET_BALANCE (g, 0);
     }
-    shorter = 0;
-    AVL_SET_BALANCE (q, shortened_side);
-    AVL_SET_BALANCE (p, (- shortened_side));
-      } else if (AVL_GET_BALANCE (q) == AVL_GET_BALANCE (p)) {
-    /* case 3b: height reduced */
-    if (shortened_side == -1) {
-      /* single rotate left */
-      q->parent = p->parent;
-      p->right = q->left;
-      if (q->left) {
-        q->left->parent = p;
-      }
-      q->left = p;
-      p->parent = q;
-      AVL_SET_RANK (q, (AVL_GET_RANK (q) + AVL_GET_RANK (p)));
-    } else {
-      /* single rotate right */
-      q->parent = p->parent;
-      p->left = q->right;
-      if (q->right) {
-        q->right->parent = p;
+    return 0;
+  }
+  return 1;
+}
+
+/* fix ranks and balance factors above the freshly linked leaf <node> */
+static void
+avl_insert_fixup (avl_tree * tree, avl_node * node)
+{
+  avl_node * c;
+
+  for (c = node; c->parent != tree->root; c = c->parent) {
+    if (c == c->parent->left) {
+      AVL_SET_RANK (c->parent, (AVL_GET_RANK (c->parent) + 1));
+    }
+  }
+  if (avl_grow_fixup (tree, tree->root, node)) {
+    tree->height = tree->height + 1;
+  }
+}
+
+/*
+ * Starting at the finger, find the node whose subtree the search for
+ * <key> has to descend into.  With <insert> set equal keys count as
+ * smaller, like in avl_insert(), otherwise a node holding <key> found
+ * on the way is returned and *<found> set.
+ */
+static avl_node *
+avl_finger_start (avl_finger * finger, void * key, int insert, int * found)
+{
+  avl_tree * tree = finger->tree;
+  avl_node * x = finger->node;
+  avl_node * b, * p;
+  int c, cp;
+
+  *found = 0;
+  if (!x || finger->version != tree->version) {
+    return tree->root->right;
+  }
+  c = tree->compare_fun (tree->compare_arg, key, x->key);
+  if (c == 0) {
+    if (!insert) {
+      *found = 1;
+      return x;
+    }
+    c = -1;
+  }
+  while (1) {
+    /* find the closest ancestor <p> bounding the subtree of <x> on the
+     * side of <key>, the ones in between need no compare
+     */
+    for (b = x, p = x->parent; p != tree->root; b = p, p = p->parent) {
+      if ((c < 0) == (b == p->right)) {
+        break;
       }
-      q->right = p;
-      p->parent = q;
-      AVL_SET_RANK (p, (AVL_GET_RANK (p) - AVL_GET_RANK (q)));
     }
-    shorter = 1;
-    AVL_SET_BALANCE (q, 0);
-    AVL_SET_BALANCE (p, 0);
-      } else {
-    /* case 3c: height reduced, balance factors opposite */
-    if (shortened_side == 1) {
-      /* double rotate right */
-      /* first, a left rotation around q */
-      r = q->right;
-      r->parent = p->parent;
-      q->right = r->left;
-      if (r->left) {
-        r->left->parent = q;
+    if (p == tree->root) {
+      return x;
+    }
+    cp = tree->compare_fun (tree->compare_arg, key, p->key);
+    if (cp == 0) {
+      if (!insert) {
+        *found = 1;
+        return p;
       }
-      r->left = q;
-      q->parent = r;
-      /* now, a right rotation around p */
-      p->left = r->right;
-      if (r->right) {
-        r->right->parent = p;
+      cp = -1;
+    }
+    if ((cp < 0) != (c < 0)) {
+      /* <key> lies between <x> and <p> */
+      return x;
+    }
+    x = p;
+  }
+}
+
+void
+avl_finger_init (avl_finger * finger,
+         avl_tree * tree)
+{
+  finger->tree = tree;
+  finger->node = NULL;
+  finger->version = tree->version;
+}
+
+int
+avl_finger_get_by_key (avl_finger * finger,
+         void * key,
+         void ** value_address)
+{
+  avl_tree * tree = finger->tree;
+  avl_node * x;
+  int found;
+
+  if (tree->btree || tree->compact || tree->frozen) {
+    return avl_get_by_key (tree, key, value_address);
+  }
+  AVL_STATS_COUNT (tree, lookups, 1);
+  x = avl_finger_start (finger, key, 0, &found);
+  while (x && !found) {
+    int compare_result = tree->compare_fun (tree->compare_arg, key, x->key);
+    if (compare_result == 0) {
+      break;
+    }
+    /* stay close to <key> even when it is not in the tree */
+    finger->node = x;
+    x = (compare_result < 0) ? x->left : x->right;
+  }
+  finger->version = tree->version;
+  if (!x) {
+    return -1;
+  }
+  finger->node = x;
+  *value_address = x->key;
+  return 0;
+}
+
+int
+avl_finger_insert (avl_finger * finger,
+         void * key)
+{
+  avl_tree * tree = finger->tree;
+  avl_node * x, * next, * node;
+  int found, left;
+
+  if (tree->btree || tree->compact || tree->rcu || tree->frozen ||
+      (tree->flags & AVL_TREE_FLAG_INTRUSIVE)) {
+    return avl_insert (tree, key);
+  }
+  if (avl_hash_reserve (tree, 1) != 0) {
+    return -1;
+  }
+  x = avl_finger_start (finger, key, 1, &found);
+  if (!x) {
+    node = avl_tree_node_new (tree, key, tree->root);
+    if (!node) {
+      return -1;
+    }
+    tree->root->right = node;
+  } else {
+    while (1) {
+      left = (tree->compare_fun (tree->compare_arg, key, x->key) < 1);
+      next = left ? x->left : x->right;
+      if (!next) {
+        break;
       }
-      r->right = p;
-      p->parent = r;
-      AVL_SET_RANK (r, (AVL_GET_RANK (r) + AVL_GET_RANK (q)));
-      AVL_SET_RANK (p, (AVL_GET_RANK (p) - AVL_GET_RANK (r)));
+      x = next;
+    }
+    node = avl_tree_node_new (tree, key, x);
+    if (!node) {
+      return -1;
+    }
+    if (left) {
+      x->left = node;
     } else {
-      /* double rotate left */
-      /* first, a right rotation around q */
-      r = q->left;
-      r->parent = p->parent;
-      q->left = r->right;
-      if (r->right) {
-        r->right->parent = q;
-      }
-      r->right = q;
-      q->parent = r;
-      /* now a left rotation around p */
-      p->right = r->left;
-      if (r->left) {
-        r->left->parent = p;
-      }
-      r->left = p;
-      p->parent = r;
-      AVL_SET_RANK (q, (AVL_GET_RANK (q) - AVL_GET_RANK (r)));
-      AVL_SET_RANK (r, (AVL_GET_RANK (r) + AVL_GET_RANK (p)));        
+      x->right = node;
     }
-    if (AVL_GET_BALANCE (r) == shortened_side) {
-      AVL_SET_BALANCE (q, (- shortened_side));
-      AVL_SET_BALANCE (p, 0);
-    } else if (AVL_GET_BALANCE (r) == (- shortened_side)) {
-      AVL_SET_BALANCE (q, 0);
-      AVL_SET_BALANCE (p, shortened_side);
+    avl_insert_fixup (tree, node);
+  }
+  tree->length = tree->length + 1;
+  avl_hash_insert (tree, key);
+  AVL_STATS_COUNT (tree, inserts, 1);
+  AVL_STATS_DEPTH (tree, node);
+  finger->node = node;
+  finger->version = tree->version;
+  return 0;
+}
+
+/*
+ * Split and join work on detached subtrees that carry their height and
+ * size along, so ranks and balance factors come out right looking at
+ * nothing but the paths involved.  Joining two trees around a middle
+ * node walks down the spine of the taller one to where the heights
+ * match, hangs the node in there and rebalances upwards like an insert.
+ * A split joins the pieces left and right of its search path bottom up,
+ * which costs O(log n) in total as the heights of the pieces telescope.
+ */
+
+typedef struct {
+  avl_node *            root;
+  unsigned int          height;
+  unsigned long         size;
+} avl_subtree;
+
+static unsigned int
+avl_subtree_height (avl_node * node)
+{
+  unsigned int height = 0;
+
+  /* follow the taller side */
+  while (node) {
+    height++;
+    node = (AVL_GET_BALANCE (node) < 0) ? node->left : node->right;
+  }
+  return height;
+}
+
+static avl_subtree
+avl_subtree_of (avl_tree * tree)
+{
+  avl_subtree t;
+
+  t.root = tree->root->right;
+  t.height = avl_subtree_height (t.root);
+  t.size = tree->length;
+  if (t.root) {
+    t.root->parent = NULL;
+  }
+  return t;
+}
+
+static void
+avl_subtree_attach (avl_tree * tree, avl_subtree t)
+{
+  tree->root->right = t.root;
+  if (t.root) {
+    t.root->parent = tree->root;
+  }
+  tree->height = t.height;
+  tree->length = t.size;
+  /* nodes changed trees or went away */
+  tree->version++;
+}
+
+/* free a detached subtree the way avl_delete() frees its nodes */
+static void
+avl_subtree_free (avl_tree * tree, avl_node * node, avl_free_key_fun_type free_key_fun)
+{
+  avl_node * next;
+  void * key;
+
+  while (node) {
+    if (node->left) {
+      next = node->left;
+      node->left = next->right;
+      next->right = node;
     } else {
-      AVL_SET_BALANCE (q, 0);
-      AVL_SET_BALANCE (p, 0);
+      next = node->right;
+      key = node->key;
+      avl_hash_remove (tree, key);
+      avl_tree_node_free (tree, node);
+      if (free_key_fun)
+          free_key_fun (key);
     }
-    AVL_SET_BALANCE (r, 0);
-    q = r;
-      }
-      /* a rotation has caused <q> (or <r> in case 3c) to become
-       * the root.  let <p>'s former parent know this.
-       */
-      if (top->left == p) {
-    top->left = q;
-      } else {
-    top->right = q;
-      }
-      /* end case 3 */
-      p = q;
+    node = next;
+  }
+}
+
+/* join <l>, <m> and <r>; no key of <l> is after <m>, none of <r> before */
+static avl_subtree
+avl_join3 (avl_subtree l, avl_node * m, avl_subtree r)
+{
+  avl_node top, * p, * c;
+  avl_subtree t;
+  unsigned int hc;
+  unsigned long sc;
+
+  t.size = l.size + r.size + 1;
+  AVL_SET_RANK (m, (l.size + 1));
+  if (l.height <= r.height + 1 && r.height <= l.height + 1) {
+    m->left = l.root;
+    m->right = r.root;
+    m->parent = NULL;
+    if (l.root) {
+      l.root->parent = m;
     }
-    x = p;
-    p = x->parent;
-    /* shortened_side tells us which side we came up from */
-    if (x == p->left) {
-      shortened_side = -1;
-    } else {
-      shortened_side = +1;
+    if (r.root) {
+      r.root->parent = m;
     }
-  } /* end while(shorter) */
-  /* when we're all done, we're one shorter */
-  tree->length = tree->length - 1;
-  return (0);
+    AVL_SET_BALANCE (m, ((int) r.height - (int) l.height));
+    t.root = m;
+    t.height = AVL_MAX (l.height, r.height) + 1;
+    return t;
+  }
+
+  /* hang the taller one below a scratch root, the rotations want one */
+  top.parent = NULL;
+  top.left = NULL;
+  if (l.height > r.height) {
+    /* down the right spine of <l>, where ranks stay as they are */
+    top.right = l.root;
+    l.root->parent = &top;
+    c = l.root;
+    hc = l.height;
+    sc = l.size;
+    do {
+      hc -= (AVL_GET_BALANCE (c) < 0) ? 2 : 1;
+      sc -= AVL_GET_RANK (c);
+      p = c;
+      c = c->right;
+    } while (hc > r.height + 1);
+    p->right = m;
+    m->left = c;
+    m->right = r.root;
+    AVL_SET_RANK (m, (sc + 1));
+    AVL_SET_BALANCE (m, ((int) r.height - (int) hc));
+  } else {
+    /* down the left spine of <r>, which gains <l> and <m> on the left */
+    top.right = r.root;
+    r.root->parent = &top;
+    c = r.root;
+    hc = r.height;
+    do {
+      hc -= (AVL_GET_BALANCE (c) > 0) ? 2 : 1;
+      AVL_SET_RANK (c, (AVL_GET_RANK (c) + l.size + 1));
+      p = c;
+      c = c->left;
+    } while (hc > l.height + 1);
+    p->left = m;
+    m->left = l.root;
+    m->right = c;
+    AVL_SET_BALANCE (m, ((int) hc - (int) l.height));
+  }
+  m->parent = p;
+  if (m->left) {
+    m->left->parent = m;
+  }
+  if (m->right) {
+    m->right->parent = m;
+  }
+  /* the subtree at <m> is one taller than the one it replaced */
+  t.height = AVL_MAX (l.height, r.height) + avl_grow_fixup (NULL, &top, m);
+  t.root = top.right;
+  t.root->parent = NULL;
+  return t;
+}
+
+/* join <l> and <r>, no key of <l> being after any of <r> */
+static avl_subtree
+avl_join2 (avl_subtree l, avl_subtree r)
+{
+  avl_tree scratch;
+  avl_node top, * m;
+
+  if (!l.root) {
+    return r;
+  }
+  if (!r.root) {
+    return l;
+  }
+  /* take the greatest node out of <l> to join around, nothing above it
+   * changes rank; avl_unlink_node() wants a tree around the subtree
+   */
+  memset (&scratch, 0, sizeof (scratch));
+  memset (&top, 0, sizeof (top));
+  scratch.root = &top;
+  scratch.length = l.size;
+  top.right = l.root;
+  l.root->parent = &top;
+  for (m = l.root; m->right; m = m->right)
+    ;
+  avl_unlink_node (&scratch, m);
+  l.root = top.right;
+  if (l.root) {
+    l.root->parent = NULL;
+  }
+  l.height = avl_subtree_height (l.root);
+  l.size--;
+  return avl_join3 (l, m, r);
 }
 
-static int
-avl_iterate_inorder_helper (avl_node * node,
-            avl_iter_fun_type iter_fun,
-            void * iter_arg)
+/*
+ * Split <t> into the keys before <key> and the rest, with <upper> set
+ * the keys equal to <key> go with the first part.
+ */
+static void
+avl_split_helper (avl_tree * tree,
+          avl_subtree t,
+          void * key,
+          int upper,
+          avl_subtree * low,
+          avl_subtree * high)
 {
-  int result;
-  if (node->left) {
-    result = avl_iterate_inorder_helper (node->left, iter_fun, iter_arg);
-    if (result != 0) {
-      return result;
+  avl_node * path[AVL_PATH_MAX];
+  unsigned int heights[AVL_PATH_MAX];
+  unsigned long sizes[AVL_PATH_MAX];
+  unsigned char to_high[AVL_PATH_MAX];
+  unsigned int depth = 0;
+  avl_subtree side;
+  avl_node * x;
+  int c;
+
+  for (x = t.root; x; depth++) {
+    c = tree->compare_fun (tree->compare_arg, key, x->key);
+    path[depth] = x;
+    heights[depth] = t.height;
+    sizes[depth] = t.size;
+    to_high[depth] = upper ? (c < 0) : (c <= 0);
+    if (to_high[depth]) {
+      t.height -= (AVL_GET_BALANCE (x) > 0) ? 2 : 1;
+      t.size = AVL_GET_RANK (x) - 1;
+      x = x->left;
+    } else {
+      t.height -= (AVL_GET_BALANCE (x) < 0) ? 2 : 1;
+      t.size -= AVL_GET_RANK (x);
+      x = x->right;
     }
   }
-  result = (iter_fun (node->key, iter_arg));
-  if (result != 0) {
-    return result;
-  }
-  if (node->right) {
-    result = avl_iterate_inorder_helper (node->right, iter_fun, iter_arg);
-    if (result != 0) {
-      return result;
+
+  low->root = high->root = NULL;
+  low->height = high->height = 0;
+  low->size = high->size = 0;
+  while (depth-- > 0) {
+    x = path[depth];
+    if (to_high[depth]) {
+      /* <x> and its right subtree go after everything split off below */
+      side.root = x->right;
+      side.height = heights[depth] - ((AVL_GET_BALANCE (x) < 0) ? 2 : 1);
+      side.size = sizes[depth] - AVL_GET_RANK (x);
+      if (side.root) {
+        side.root->parent = NULL;
+      }
+      *high = avl_join3 (*high, x, side);
+    } else {
+      side.root = x->left;
+      side.height = heights[depth] - ((AVL_GET_BALANCE (x) > 0) ? 2 : 1);
+      side.size = AVL_GET_RANK (x) - 1;
+      if (side.root) {
+        side.root->parent = NULL;
+      }
+      *low = avl_join3 (side, x, *low);
     }
   }
-  return 0;
+}
+
+/* whether whole subtrees of <tree> may move to another tree */
+static int
+avl_tree_nodes_movable (avl_tree * tree)
+{
+  return !(tree->btree || tree->compact || tree->rcu || tree->hash || tree->frozen ||
+           (tree->flags & AVL_TREE_FLAG_SLAB));
 }
 
 int
-avl_iterate_inorder (avl_tree * tree,
-         avl_iter_fun_type iter_fun,
-         void * iter_arg)
+avl_split (avl_tree * tree,
+       void * key,
+       avl_tree * high)
 {
-  int result;
+  avl_subtree low_part, high_part;
 
-  if (tree->length) {
-    result = avl_iterate_inorder_helper (tree->root->right, iter_fun, iter_arg);
-    return (result);
-  } else {
-    return 0;
+  if (!avl_tree_nodes_movable (tree) || !avl_tree_nodes_movable (high) || high->length ||
+      (tree->flags & AVL_TREE_FLAG_INTRUSIVE) != (high->flags & AVL_TREE_FLAG_INTRUSIVE)) {
+    return -1;
   }
+  avl_split_helper (tree, avl_subtree_of (tree), key, 0, &low_part, &high_part);
+  avl_subtree_attach (tree, low_part);
+  avl_subtree_attach (high, high_part);
+  return 0;
 }
 
-avl_node *avl_get_first(avl_tree *tree)
+int
+avl_join (avl_tree * low,
+      avl_tree * high)
 {
-    avl_node *node;
-    
-    node = tree->root->right;
-    if (node == NULL || node->key == NULL) return NULL;
+  avl_subtree empty = { NULL, 0, 0 };
 
-    while (node->left)
-        node = node->left;
+  if (!avl_tree_nodes_movable (low) || !avl_tree_nodes_movable (high) || low == high ||
+      (low->flags & AVL_TREE_FLAG_INTRUSIVE) != (high->flags & AVL_TREE_FLAG_INTRUSIVE)) {
+    return -1;
+  }
+  if (low->length && high->length) {
+    avl_node * last = low->root->right;
+    avl_node * first = high->root->right;
 
-    return node;
+    while (last->right) {
+      last = last->right;
+    }
+    first = avl_node_first (first);
+    if (low->compare_fun (low->compare_arg, last->key, first->key) > 0) {
+      return -1;
+    }
+  }
+  avl_subtree_attach (low, avl_join2 (avl_subtree_of (low), avl_subtree_of (high)));
+  avl_subtree_attach (high, empty);
+  return 0;
 }
 
-avl_node *avl_get_prev(avl_node *node)
+int
+avl_delete_range (avl_tree * tree,
+          void * low_key,
+          void * high_key,
+          avl_free_key_fun_type free_key_fun)
 {
-    if (node->left) {
-        node = node->left;
-        while (node->right) {
-            node = node->right;
-        }
+  avl_subtree low_part, range, high_part;
 
-        return node;
-    } else {
-        avl_node *child = node;
-        while (node->parent && node->parent->key) {
-            node = node->parent;
-            if (child == node->right) {
-                return node;
-            }
-            child = node;
-        }
-        
-        return NULL;
+  if (tree->frozen) {
+    return -1;
+  }
+  if (tree->compare_fun (tree->compare_arg, low_key, high_key) > 0) {
+    void * temp = low_key;
+    low_key = high_key;
+    high_key = temp;
+  }
+
+  if (tree->btree || tree->compact) {
+    /* no structural shortcut here, delete from the top of the range */
+    unsigned long low = avl_nodeless_get_bound (tree, low_key, 0);
+    unsigned long high = avl_nodeless_get_bound (tree, high_key, 1);
+    void * key;
+
+    while (high-- > low) {
+      if (avl_nodeless_get_by_index (tree, high, &key) != 0 ||
+          avl_delete (tree, key, free_key_fun) != 0) {
+        return -1;
+      }
     }
-}
+    return 0;
+  }
+  if (tree->rcu && avl_rcu_reserve (tree->rcu, tree->length) != 0) {
+    return -1;
+  }
 
-avl_node *avl_get_next(avl_node *node)
-{
-    if (node->right) {
-        node = node->right;
-        while (node->left) {
-            node = node->left;
-        }
-        
-        return node;
-    } else {
-        avl_node *child = node;
-        while (node->parent && node->parent->key) {
-            node = node->parent;
-            if (child == node->left) {
-                return node;
-            }
-            child = node;
-        }
-        
-        return NULL;
+  avl_split_helper (tree, avl_subtree_of (tree), low_key, 0, &low_part, &range);
+  avl_split_helper (tree, range, high_key, 1, &range, &high_part);
+  avl_subtree_attach (tree, avl_join2 (low_part, high_part));
+
+  if (tree->rcu) {
+    avl_rcu_rebuild (tree);
+    if (range.root && free_key_fun) {
+      /* readers may still look at the keys */
+      avl_rcu_synchronize (tree);
     }
+  }
+  AVL_STATS_COUNT (tree, deletes, range.size);
+  avl_subtree_free (tree, range.root, free_key_fun);
+  return 0;
 }
 
 /* iterate a function over a range of indices, using get_predecessor */
@@ -736,6 +3591,15 @@ avl_iterate_index_range (avl_tree * tree,
   unsigned long num_left;
   avl_node * node;
 
+  if (tree->frozen) {
+    return avl_frozen_iterate_index_range (tree, iter_fun, low, high, iter_arg);
+  }
+  if (tree->btree) {
+    return avl_btree_iterate_index_range (tree, iter_fun, low, high, iter_arg);
+  }
+  if (tree->compact) {
+    return avl_compact_iterate_index_range (tree, iter_fun, low, high, iter_arg);
+  }
   if (high > tree->length) {
     return -1;
   }
@@ -808,6 +3672,145 @@ avl_get_index_by_key (avl_tree * tree,
   }
 }
 
+/*
+ * Parallel iteration: the index range of the tree is cut into one
+ * slice per worker, each worker finds the start of its slice by rank
+ * and walks it in order.  The caller's read lock covers all workers
+ * since they are joined before we return.
+ */
+
+/* slices smaller than this are not worth a thread */
+#define AVL_PARALLEL_MIN_SLICE (1024)
+
+typedef struct avl_parallel_slice_tag {
+  avl_tree *                    tree;
+  avl_iter_index_fun_type       iter_fun;
+  void *                        iter_arg;
+  unsigned long                 low;
+  unsigned long                 high;
+  int                           result;
+} avl_parallel_slice;
+
+/* index range iteration counts from the start of the range */
+static int
+avl_iterate_slice_offset (unsigned long index, void * key, void * iter_arg)
+{
+  avl_parallel_slice * slice = (avl_parallel_slice *) iter_arg;
+
+  return slice->iter_fun (slice->low + index, key, slice->iter_arg);
+}
+
+static int
+avl_iterate_slice (avl_parallel_slice * slice)
+{
+  avl_tree * tree = slice->tree;
+  avl_node * node;
+  unsigned long i;
+
+  if (tree->frozen) {
+    return avl_frozen_iterate_index_range (tree, avl_iterate_slice_offset, slice->low, slice->high, slice);
+  }
+  if (tree->btree) {
+    return avl_btree_iterate_index_range (tree, avl_iterate_slice_offset, slice->low, slice->high, slice);
+  }
+  if (tree->compact) {
+    return avl_compact_iterate_index_range (tree, avl_iterate_slice_offset, slice->low, slice->high, slice);
+  }
+  node = avl_get_node_by_index (tree, slice->low);
+  for (i = slice->low; i < slice->high; i++) {
+    if (slice->iter_fun (i, node->key, slice->iter_arg) != 0) {
+      return -1;
+    }
+    node = avl_node_next (tree, node);
+  }
+  return 0;
+}
+
+#ifndef NO_THREAD
+static void *
+avl_iterate_slice_thread (void * arg)
+{
+  avl_parallel_slice * slice = (avl_parallel_slice *) arg;
+
+  slice->result = avl_iterate_slice (slice);
+  return NULL;
+}
+#endif
+
+int
+avl_iterate_parallel (avl_tree * tree,
+         avl_iter_index_fun_type iter_fun,
+         unsigned int workers,
+         void * iter_arg)
+{
+  avl_parallel_slice * slices;
+  unsigned long length = tree->length;
+  unsigned int i;
+  int result = 0;
+#ifndef NO_THREAD
+  thread_type ** threads;
+#endif
+
+  if (!length) {
+    return 0;
+  }
+  if (workers > length / AVL_PARALLEL_MIN_SLICE) {
+    workers = length / AVL_PARALLEL_MIN_SLICE;
+  }
+#ifdef NO_THREAD
+  workers = 1;
+#endif
+  if (workers < 1) {
+    workers = 1;
+  }
+
+  slices = (avl_parallel_slice *) calloc (workers, sizeof (avl_parallel_slice));
+  if (!slices) {
+    return -1;
+  }
+  for (i = 0; i < workers; i++) {
+    slices[i].tree = tree;
+    slices[i].iter_fun = iter_fun;
+    slices[i].iter_arg = iter_arg;
+    slices[i].low = (length * i) / workers;
+    slices[i].high = (length * (i + 1)) / workers;
+  }
+
+#ifndef NO_THREAD
+  threads = (thread_type **) calloc (workers, sizeof (thread_type *));
+  if (threads) {
+    /* the calling thread takes the first slice itself */
+    for (i = 1; i < workers; i++) {
+      threads[i] = thread_create ("avl iterate", avl_iterate_slice_thread, &slices[i], THREAD_ATTACHED);
+    }
+    for (i = 0; i < workers; i++) {
+      if (!threads[i]) {
+        slices[i].result = avl_iterate_slice (&slices[i]);
+      }
+    }
+    for (i = 1; i < workers; i++) {
+      if (threads[i]) {
+        thread_join (threads[i]);
+      }
+    }
+    free (threads);
+  } else
+#endif
+  {
+    for (i = 0; i < workers; i++) {
+      slices[i].result = avl_iterate_slice (&slices[i]);
+    }
+  }
+
+  for (i = 0; i < workers; i++) {
+    if (slices[i].result != 0) {
+      result = -1;
+    }
+  }
+  free (slices);
+  return result;
+}
+
 /* return the (low index, high index) pair that spans the given key */
 
 int
@@ -819,6 +3822,19 @@ avl_get_span_by_key (avl_tree * tree,
   unsigned long m, i, j;
   avl_node * node;
 
+  if (tree->btree || tree->compact || tree->frozen) {
+    i = avl_nodeless_get_bound (tree, key, 0);
+    j = avl_nodeless_get_bound (tree, key, 1);
+    if (i == j) {
+      /* like below: the index of the closest preceding key */
+      *low = *high = i - 1;
+    } else {
+      *low = i;
+      *high = j;
+    }
+    return 0;
+  }
+
   node = avl_get_index_by_key (tree, key, &m);
 
   /* did we find an exact match?
@@ -872,6 +3888,18 @@ avl_get_span_by_two_keys (avl_tree * tree,
     high_key = temp;
   }
 
+  if (tree->btree || tree->compact || tree->frozen) {
+    /* same results as the walk below: <high> is the last index of
+     * <high_key> if it is present and the index following its closest
+     * predecessor otherwise
+     */
+    *low = avl_nodeless_get_bound (tree, low_key, 0);
+    j = avl_nodeless_get_bound (tree, high_key, 0);
+    i = avl_nodeless_get_bound (tree, high_key, 1);
+    *high = (i > j) ? i - 1 : j;
+    return 0;
+  }
+
   low_node = avl_get_index_by_key (tree, low_key, &i);
   high_node = avl_get_index_by_key (tree, high_key, &j);
 
@@ -903,6 +3931,99 @@ avl_get_span_by_two_keys (avl_tree * tree,
   return 0;
 }
 
+/* the bound by rank on node trees, see avl_nodeless_get_bound() */
+static unsigned long
+avl_node_get_bound (avl_tree * tree, void * key, int upper)
+{
+  avl_node * x = tree->root->right;
+  unsigned long index = 0;
+
+  while (x) {
+    int compare_result = tree->compare_fun (tree->compare_arg, key, x->key);
+    if (compare_result < 0 || (!upper && compare_result == 0)) {
+      x = x->left;
+    } else {
+      index += AVL_GET_RANK (x);
+      x = x->right;
+    }
+  }
+  return index;
+}
+
+static unsigned long
+avl_get_bound (avl_tree * tree, void * key, int upper)
+{
+  AVL_STATS_COUNT (tree, lookups, 1);
+  if (tree->btree || tree->compact || tree->frozen) {
+    return avl_nodeless_get_bound (tree, key, upper);
+  }
+  return avl_node_get_bound (tree, key, upper);
+}
+
+unsigned long
+avl_get_lower_bound (avl_tree * tree, void * key)
+{
+  return avl_get_bound (tree, key, 0);
+}
+
+unsigned long
+avl_get_upper_bound (avl_tree * tree, void * key)
+{
+  return avl_get_bound (tree, key, 1);
+}
+
+unsigned long
+avl_get_count_by_two_keys (avl_tree * tree,
+              void * key_a,
+              void * key_b)
+{
+  unsigned long low, high;
+
+  if (tree->compare_fun (tree->compare_arg, key_a, key_b) > 0) {
+    void * temp = key_a;
+    key_a = key_b;
+    key_b = temp;
+  }
+  low = avl_get_bound (tree, key_a, 0);
+  high = avl_get_bound (tree, key_b, 1);
+  return high > low ? high - low : 0;
+}
+
+int
+avl_iterate_around_key (avl_tree * tree,
+            void * key,
+            unsigned long before,
+            unsigned long after,
+            avl_iter_index_fun_type iter_fun,
+            void * iter_arg)
+{
+  unsigned long index = avl_get_bound (tree, key, 0);
+  unsigned long low = index > before ? index - before : 0;
+  unsigned long high = tree->length - index > after ? index + after : tree->length;
+  unsigned long i;
+  avl_node * node;
+  void * value;
+
+  if (tree->btree || tree->compact || tree->frozen) {
+    /* one descent per key, but no nodes to step along */
+    for (i = low; i < high; i++) {
+      if (avl_nodeless_get_by_index (tree, i, &value) != 0 ||
+          iter_fun (i, value, iter_arg) != 0) {
+        return -1;
+      }
+    }
+    return 0;
+  }
+  node = low < high ? avl_get_node_by_index (tree, low) : NULL;
+  for (i = low; node && i < high; i++) {
+    if (iter_fun (i, node->key, iter_arg) != 0) {
+      return -1;
+    }
+    node = avl_node_next (tree, node);
+  }
+  return 0;
+}
+
            
 int
 avl_get_item_by_key_most (avl_tree * tree,
@@ -912,6 +4033,15 @@ avl_get_item_by_key_most (avl_tree * tree,
   avl_node * x = tree->root->right;
   *value_address = NULL;
 
+  AVL_STATS_COUNT (tree, lookups, 1);
+  if (tree->btree || tree->compact || tree->frozen) {
+    unsigned long index = avl_nodeless_get_bound (tree, key, 1);
+    if (!index) {
+      return -1;
+    }
+    return avl_nodeless_get_by_index (tree, index - 1, value_address);
+  }
+
   if (!x) {
     return -1;
   }
@@ -956,6 +4086,11 @@ avl_get_item_by_key_least (avl_tree * tree,
   avl_node * x = tree->root->right;
   *value_address = NULL;
 
+  AVL_STATS_COUNT (tree, lookups, 1);
+  if (tree->btree || tree->compact || tree->frozen) {
+    return avl_nodeless_get_by_index (tree, avl_nodeless_get_bound (tree, key, 0), value_address);
+  }
+
   if (!x) {
     return -1;
   }
@@ -990,8 +4125,6 @@ avl_get_item_by_key_least (avl_tree * tree,
   }
 }
 
-#define AVL_MAX(X, Y)  ((X) > (Y) ? (X) : (Y))
-
 static long
 avl_verify_balance (avl_node * node)
 {
@@ -1050,6 +4183,15 @@ avl_verify_rank (avl_node * node)
 int
 avl_verify (avl_tree * tree)
 {
+  if (tree->frozen) {
+    return avl_frozen_verify (tree);
+  }
+  if (tree->btree) {
+    return avl_btree_verify (tree);
+  }
+  if (tree->compact) {
+    return avl_compact_verify (tree);
+  }
   if (tree->length) {
     avl_verify_balance (tree->root->right);
     avl_verify_parent  (tree->root->right, tree->root);
@@ -1154,7 +4296,13 @@ avl_print_tree (avl_tree * tree, avl_key_printer_fun_type key_printer)
   if (!key_printer) {
     key_printer = default_key_printer;
   }
-  if (tree->length) {
+  if (tree->frozen) {
+    avl_frozen_print (tree, key_printer);
+  } else if (tree->btree) {
+    avl_btree_print (tree, key_printer);
+  } else if (tree->compact) {
+    avl_compact_print (tree, key_printer);
+  } else if (tree->length) {
     print_node (key_printer, tree->root->right, &top);
   } else {
     fprintf (stdout, "<empty tree>\n");
@@ -1164,12 +4312,24 @@ avl_print_tree (avl_tree * tree, avl_key_printer_fun_type key_printer)
 
 void avl_tree_rlock(avl_tree *tree)
 {
+#ifdef HAVE_AVL_STATS
+    unsigned long long start = avl_stats_clock ();
+    thread_rwlock_rlock(&tree->rwlock);
+    AVL_STATS_COUNT (tree, lock_wait_nsec, avl_stats_clock () - start);
+#else
     thread_rwlock_rlock(&tree->rwlock);
+#endif
 }
 
 void avl_tree_wlock(avl_tree *tree)
 {
+#ifdef HAVE_AVL_STATS
+    unsigned long long start = avl_stats_clock ();
+    thread_rwlock_wlock(&tree->rwlock);
+    AVL_STATS_COUNT (tree, lock_wait_nsec, avl_stats_clock () - start);
+#else
     thread_rwlock_wlock(&tree->rwlock);
+#endif
 }
 
 void avl_tree_unlock(avl_tree *tree)
@@ -1177,6 +4337,49 @@ void avl_tree_unlock(avl_tree *tree)
     thread_rwlock_unlock(&tree->rwlock);
 }
 
+int avl_tree_get_stats(avl_tree *tree, avl_tree_stats *stats)
+{
+#ifdef HAVE_AVL_STATS
+    unsigned int i;
+#endif
+
+    memset (stats, 0, sizeof (*stats));
+#ifdef HAVE_AVL_STATS
+    for (i = 0; i < AVL_STATS_SHARDS; i++) {
+        avl_tree_stats * shard = &(tree->stats->shards[i].counts);
+        unsigned long depth = AVL_STATS_LOAD (&shard->max_depth);
+        stats->lookups += AVL_STATS_LOAD (&shard->lookups);
+        stats->inserts += AVL_STATS_LOAD (&shard->inserts);
+        stats->deletes += AVL_STATS_LOAD (&shard->deletes);
+        stats->compares += AVL_STATS_LOAD (&shard->compares);
+        stats->rotations += AVL_STATS_LOAD (&shard->rotations);
+        stats->max_depth = AVL_MAX (stats->max_depth, depth);
+        stats->lock_wait_nsec += AVL_STATS_LOAD (&shard->lock_wait_nsec);
+    }
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+void avl_tree_reset_stats(avl_tree *tree)
+{
+#ifdef HAVE_AVL_STATS
+    unsigned int i;
+
+    for (i = 0; i < AVL_STATS_SHARDS; i++) {
+        avl_tree_stats * shard = &(tree->stats->shards[i].counts);
+        AVL_STATS_STORE (&shard->lookups, 0);
+        AVL_STATS_STORE (&shard->inserts, 0);
+        AVL_STATS_STORE (&shard->deletes, 0);
+        AVL_STATS_STORE (&shard->compares, 0);
+        AVL_STATS_STORE (&shard->rotations, 0);
+        AVL_STATS_STORE (&shard->max_depth, 0);
+        AVL_STATS_STORE (&shard->lock_wait_nsec, 0);
+    }
+#endif
+}
+
 #ifdef HAVE_AVL_NODE_LOCK
 void avl_node_rlock(avl_node *node)
 {
@@ -87,6 +87,26 @@ LIB32=link.exe -lib
 
 SOURCE=.\avl.c
 # End Source File
+# Begin Source File
+
+SOURCE=.\avl_btree.c
+# End Source File
+# Begin Source File
+
+SOURCE=.\avl_compact.c
+# End Source File
+# Begin Source File
+
+SOURCE=.\avl_frozen.c
+# End Source File
+# Begin Source File
+
+SOURCE=.\avl_shard.c
+# End Source File
+# Begin Source File
+
+SOURCE=.\avl_snapshot.c
+# End Source File
 # End Group
 # Begin Group "Header Files"
 
@@ -95,6 +115,26 @@ SOURCE=.\avl.c
 
 SOURCE=.\avl.h
 # End Source File
+# Begin Source File
+
+SOURCE=.\avl_btree.h
+# End Source File
+# Begin Source File
+
+SOURCE=.\avl_compact.h
+# End Source File
+# Begin Source File
+
+SOURCE=.\avl_frozen.h
+# End Source File
+# Begin Source File
+
+SOURCE=.\avl_shard.h
+# End Source File
+# Begin Source File
+
+SOURCE=.\avl_snapshot.h
+# End Source File
 # End Group
 # End Target
 # End Project
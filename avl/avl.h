@@ -12,6 +12,8 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
+
 #define AVL_KEY_PRINTER_BUFLEN (256)
 
 #ifndef NO_THREAD
@@ -22,6 +24,10 @@ extern "C" {
 #define thread_rwlock_rlock(x) do{}while(0)
 #define thread_rwlock_wlock(x) do{}while(0)
 #define thread_rwlock_unlock(x) do{}while(0)
+#define thread_mutex_create(x) do{}while(0)
+#define thread_mutex_destroy(x) do{}while(0)
+#define thread_mutex_lock(x) do{}while(0)
+#define thread_mutex_unlock(x) do{}while(0)
 #endif
 
 typedef struct avl_node_tag {
@@ -52,6 +58,10 @@ typedef struct avl_node_tag {
   ((n)->rank_and_balance) = \
     (((n)->rank_and_balance & 3) | (r << 2))
 
+/* the structure an intrusive avl_node is embedded in as <member> */
+#define AVL_NODE_ENTRY(n,type,member) \
+  ((type *)((char *)(n) - offsetof (type, member)))
+
 struct _avl_tree;
 
 typedef int (*avl_key_compare_fun_type)    (void * compare_arg, void * a, void * b);
@@ -59,6 +69,45 @@ typedef int (*avl_iter_fun_type)    (void * key, void * iter_arg);
 typedef int (*avl_iter_index_fun_type)    (unsigned long index, void * key, void * iter_arg);
 typedef int (*avl_free_key_fun_type)    (void * key);
 typedef int (*avl_key_printer_fun_type)    (char *, void *);
+typedef unsigned long (*avl_key_hash_fun_type)    (void * hash_arg, void * key);
+
+/* flags for avl_tree_new_ex() */
+#define AVL_TREE_FLAG_NONE    0x0000U
+/* carve nodes from per-tree pages instead of one malloc() per node */
+#define AVL_TREE_FLAG_SLAB    0x0001U
+/* keep a published read-only copy for the lock-free avl_rcu_*() readers */
+#define AVL_TREE_FLAG_RCU     0x0002U
+/* store the keys in a cache friendly B+tree instead of avl_nodes, the
+ * avl_node based functions (avl_get_first() and friends) do not work
+ * on such trees
+ */
+#define AVL_TREE_FLAG_BTREE   0x0004U
+/* the caller embeds the avl_nodes in its own structures and links them
+ * with avl_insert_node(), the tree never allocates or frees a node
+ */
+#define AVL_TREE_FLAG_INTRUSIVE 0x0008U
+/* keep the nodes in one array linked by 32 bit indices, about half the
+ * memory of avl_nodes for trees of millions of keys; like btree trees
+ * the avl_node based functions do not work on them
+ */
+#define AVL_TREE_FLAG_COMPACT 0x0010U
+/* let avl_insert_locked() run next to lookups, which then couple node
+ * locks on the way down; not with btree, compact, rcu or intrusive
+ * trees, and without HAVE_AVL_NODE_LOCK the flag does nothing
+ */
+#define AVL_TREE_FLAG_NODE_LOCK 0x0020U
+
+/* nodes in the first and the largest slab page */
+#define AVL_SLAB_PAGE_MIN     (16)
+#define AVL_SLAB_PAGE_MAX     (1024)
+
+typedef struct avl_slab_page_tag avl_slab_page;
+typedef struct avl_rcu_tag avl_rcu;
+typedef struct avl_btree_tag avl_btree;
+typedef struct avl_compact_tag avl_compact;
+typedef struct avl_hash_tag avl_hash;
+typedef struct avl_frozen_tag avl_frozen;
+typedef struct avl_stats_tag avl_stats;
 
 /*
  * <compare_fun> and <compare_arg> let us associate a particular compare
@@ -67,14 +116,31 @@ typedef int (*avl_key_printer_fun_type)    (char *, void *);
 
 #ifdef _mangle
 # define avl_tree_new _mangle(avl_tree_new)
+# define avl_tree_new_ex _mangle(avl_tree_new_ex)
 # define avl_node_new _mangle(avl_node_new)
 # define avl_tree_free _mangle(avl_tree_free)
+# define avl_tree_set_hash_index _mangle(avl_tree_set_hash_index)
+# define avl_tree_freeze _mangle(avl_tree_freeze)
+# define avl_tree_thaw _mangle(avl_tree_thaw)
 # define avl_insert _mangle(avl_insert)
 # define avl_delete _mangle(avl_delete)
+# define avl_insert_node _mangle(avl_insert_node)
+# define avl_delete_node _mangle(avl_delete_node)
+# define avl_get_node_by_key _mangle(avl_get_node_by_key)
+# define avl_tree_build_sorted _mangle(avl_tree_build_sorted)
+# define avl_insert_batch _mangle(avl_insert_batch)
+# define avl_delete_batch _mangle(avl_delete_batch)
+# define avl_split _mangle(avl_split)
+# define avl_join _mangle(avl_join)
+# define avl_delete_range _mangle(avl_delete_range)
 # define avl_get_by_index _mangle(avl_get_by_index)
 # define avl_get_by_key _mangle(avl_get_by_key)
 # define avl_iterate_inorder _mangle(avl_iterate_inorder)
 # define avl_iterate_index_range _mangle(avl_iterate_index_range)
+# define avl_iterate_parallel _mangle(avl_iterate_parallel)
+# define avl_iterate_inorder_yield _mangle(avl_iterate_inorder_yield)
+# define avl_iterator_init _mangle(avl_iterator_init)
+# define avl_iterator_next _mangle(avl_iterator_next)
 # define avl_tree_rlock _mangle(avl_tree_rlock)
 # define avl_tree_wlock _mangle(avl_tree_wlock)
 # define avl_tree_wlock _mangle(avl_tree_wlock)
@@ -82,8 +148,16 @@ typedef int (*avl_key_printer_fun_type)    (char *, void *);
 # define avl_node_rlock _mangle(avl_node_rlock)
 # define avl_node_wlock _mangle(avl_node_wlock)
 # define avl_node_unlock _mangle(avl_node_unlock)
+# define avl_insert_locked _mangle(avl_insert_locked)
+# define avl_tree_get_stats _mangle(avl_tree_get_stats)
+# define avl_tree_reset_stats _mangle(avl_tree_reset_stats)
+# define avl_get_node_locked _mangle(avl_get_node_locked)
 # define avl_get_span_by_key _mangle(avl_get_span_by_key)
 # define avl_get_span_by_two_keys _mangle(avl_get_span_by_two_keys)
+# define avl_get_lower_bound _mangle(avl_get_lower_bound)
+# define avl_get_upper_bound _mangle(avl_get_upper_bound)
+# define avl_get_count_by_two_keys _mangle(avl_get_count_by_two_keys)
+# define avl_iterate_around_key _mangle(avl_iterate_around_key)
 # define avl_verify _mangle(avl_verify)
 # define avl_print_tree _mangle(avl_print_tree)
 # define avl_get_first _mangle(avl_get_first)
@@ -91,20 +165,55 @@ typedef int (*avl_key_printer_fun_type)    (char *, void *);
 # define avl_get_next _mangle(avl_get_next)
 # define avl_get_item_by_key_most _mangle(avl_get_item_by_key_most)
 # define avl_get_item_by_key_least _mangle(avl_get_item_by_key_least)
+# define avl_finger_init _mangle(avl_finger_init)
+# define avl_finger_get_by_key _mangle(avl_finger_get_by_key)
+# define avl_finger_insert _mangle(avl_finger_insert)
+# define avl_rcu_read_lock _mangle(avl_rcu_read_lock)
+# define avl_rcu_read_unlock _mangle(avl_rcu_read_unlock)
+# define avl_rcu_get_by_key _mangle(avl_rcu_get_by_key)
+# define avl_rcu_get_by_index _mangle(avl_rcu_get_by_index)
+# define avl_rcu_iterate_inorder _mangle(avl_rcu_iterate_inorder)
+# define avl_rcu_synchronize _mangle(avl_rcu_synchronize)
 #endif
 
 typedef struct _avl_tree {
   avl_node *            root;
   unsigned int          height;
   unsigned int          length;
+  /* bumped whenever nodes may have been freed or lost their keys */
+  unsigned long         version;
   avl_key_compare_fun_type    compare_fun;
   void *             compare_arg;
+  unsigned int          flags;
+  /* AVL_TREE_FLAG_SLAB: pages owned by this tree and their unused nodes */
+  avl_slab_page *       slab_pages;
+  avl_node *            slab_free;
+  unsigned int          slab_page_nodes;
+  /* AVL_TREE_FLAG_RCU: the published copy and its reader bookkeeping */
+  avl_rcu *             rcu;
+  /* AVL_TREE_FLAG_BTREE: the B+tree holding the keys */
+  avl_btree *           btree;
+  /* AVL_TREE_FLAG_COMPACT: the node array holding the keys */
+  avl_compact *         compact;
+  /* avl_tree_set_hash_index(): exact match index over the keys */
+  avl_hash *            hash;
+  /* avl_tree_freeze(): the keys as flat arrays, no nodes meanwhile */
+  avl_frozen *          frozen;
 #ifndef NO_THREAD
   rwlock_t rwlock;
 #endif
+#if !defined(NO_THREAD) && defined(HAVE_AVL_NODE_LOCK)
+  /* node allocation and <length> for avl_insert_locked() */
+  mutex_t node_mutex;
+#endif
+#ifdef HAVE_AVL_STATS
+  /* see avl_tree_get_stats() */
+  avl_stats *           stats;
+#endif
 } avl_tree;
 
 avl_tree * avl_tree_new (avl_key_compare_fun_type compare_fun, void * compare_arg);
+avl_tree * avl_tree_new_ex (avl_key_compare_fun_type compare_fun, void * compare_arg, unsigned int flags);
 avl_node * avl_node_new (void * key, avl_node * parent);
 
 void avl_tree_free (
@@ -112,6 +221,31 @@ void avl_tree_free (
   avl_free_key_fun_type    free_key_fun
   );
 
+/*
+ * Keep a hash table of the keys next to the tree, so that
+ * avl_get_by_key() finds exact matches in O(1).  <hash_fun> must return
+ * the same value for keys the compare function finds equal.  The table
+ * is filled from the current keys and kept up to date by all updates,
+ * ordered lookups still use the tree.  A NULL <hash_fun> drops it.
+ */
+int avl_tree_set_hash_index (
+  avl_tree *        tree,
+  avl_key_hash_fun_type    hash_fun,
+  void *        hash_arg
+  );
+
+/*
+ * Freezing turns a tree that is done changing into a sorted array plus
+ * a copy in Eytzinger order and releases its nodes.  Lookups by key or
+ * index, spans, bounds and walks keep working, on the arrays, and as
+ * nothing changes any more they need no lock.  Updates fail with -1
+ * until avl_tree_thaw() rebuilt the tree, which must not run while
+ * readers may be about.  Rcu and intrusive trees cannot be frozen;
+ * avl_node based accessors like avl_get_first() find nothing meanwhile.
+ */
+int avl_tree_freeze (avl_tree * tree);
+int avl_tree_thaw (avl_tree * tree);
+
 int avl_insert (
   avl_tree *        ob,
   void *        key
@@ -123,6 +257,93 @@ int avl_delete (
   avl_free_key_fun_type    free_key_fun
   );
 
+/*
+ * Intrusive trees (AVL_TREE_FLAG_INTRUSIVE).
+ *
+ * avl_insert_node() links the caller's <node> under <key>, which is
+ * usually the structure <node> is embedded in, so that the compare,
+ * iterate and free functions see the same pointers as for a normal
+ * tree.  avl_delete_node() unlinks exactly <node> without freeing it.
+ * avl_delete() looks the node up by key, unlinks it and then hands its
+ * key to <free_key_fun>, avl_tree_free() calls <free_key_fun> after it
+ * is done with each node; both may thus free the whole structure.
+ * avl_insert() and avl_tree_build_sorted() fail on these trees, the
+ * remaining functions work as usual.
+ */
+int avl_insert_node (
+  avl_tree *        tree,
+  avl_node *        node,
+  void *        key
+  );
+
+int avl_delete_node (
+  avl_tree *        tree,
+  avl_node *        node
+  );
+
+avl_node * avl_get_node_by_key (
+  avl_tree *        tree,
+  void *        key
+  );
+
+int avl_tree_build_sorted (
+  avl_tree *        tree,
+  void **        keys,
+  unsigned long        count,
+  int            verify
+  );
+
+/*
+ * Insert or delete <count> keys in one go, taking the tree's write lock
+ * once around the call is enough.  Large batches are merged into the
+ * tree and rebalanced once instead of key by key.  When running out
+ * of memory avl_insert_batch() returns -1 with some of the keys possibly
+ * inserted; like avl_insert() it fails on intrusive trees.
+ * avl_delete_batch() removes one entry per key and returns -1 if some
+ * keys were not found.
+ */
+int avl_insert_batch (
+  avl_tree *        tree,
+  void **        keys,
+  unsigned long        count
+  );
+
+int avl_delete_batch (
+  avl_tree *        tree,
+  void **        keys,
+  unsigned long        count,
+  avl_free_key_fun_type    free_key_fun
+  );
+
+/*
+ * Structural bulk operations in O(log n), keeping ranks intact.
+ * avl_split() moves the keys not less than <key> to the empty tree
+ * <high>; avl_join() moves all keys of <high>, none of which may be less
+ * than the greatest one of <low>, to <low>.  Both need plain or both
+ * intrusive trees; slab, rcu, btree, compact and hash indexed ones are
+ * refused as their nodes cannot change owners.
+ * avl_delete_range() removes every key from <low_key> to <high_key>,
+ * both included, in O(log n + k).  Rcu trees copy their published tree
+ * afresh after that and btree and compact ones delete key by key instead.
+ */
+int avl_split (
+  avl_tree *        tree,
+  void *        key,
+  avl_tree *        high
+  );
+
+int avl_join (
+  avl_tree *        low,
+  avl_tree *        high
+  );
+
+int avl_delete_range (
+  avl_tree *        tree,
+  void *        low_key,
+  void *        high_key,
+  avl_free_key_fun_type    free_key_fun
+  );
+
 int avl_get_by_index (
   avl_tree *        tree,
   unsigned long        index,
@@ -135,6 +356,48 @@ int avl_get_by_key (
   void **        value_address
   );
 
+/*
+ * AVL_DEFINE_GET_BY_KEY(name, compare) defines a static
+ *   int name (avl_tree * tree, void * key, void ** value_address)
+ * that works like avl_get_by_key() on trees whose keys <compare>
+ * orders, with <compare>(a, b) (a macro or inline function of two
+ * keys, agreeing with the tree's compare function) expanded inside
+ * the search loop instead of called through a pointer.  B+tree, compact,
+ * frozen and hash indexed trees are passed on to avl_get_by_key(), and
+ * so are AVL_TREE_FLAG_NODE_LOCK trees, which need its node locks.
+ */
+#define AVL_DEFINE_GET_BY_KEY(name, compare) \
+static int \
+name (avl_tree * tree, void * key, void ** value_address) \
+{ \
+  avl_node * x; \
+  \
+  if (tree->btree || tree->compact || tree->frozen || tree->hash || \
+      (tree->flags & AVL_TREE_FLAG_NODE_LOCK)) { \
+    return avl_get_by_key (tree, key, value_address); \
+  } \
+  x = tree->root->right; \
+  while (x) { \
+    int compare_result = compare (key, x->key); \
+    if (compare_result < 0) { \
+      x = x->left; \
+    } else if (compare_result > 0) { \
+      x = x->right; \
+    } else { \
+      *value_address = x->key; \
+      return 0; \
+    } \
+  } \
+  return -1; \
+}
+
+/* ready made compares for the keys themselves being C strings or
+ * integers stored in the pointer
+ */
+#define AVL_COMPARE_STRING(a,b) strcmp ((const char *)(a), (const char *)(b))
+#define AVL_COMPARE_INTPTR(a,b) \
+  (((long)(a) > (long)(b)) - ((long)(a) < (long)(b)))
+
 int avl_iterate_inorder (
   avl_tree *        tree,
   avl_iter_fun_type    iter_fun,
@@ -149,6 +412,61 @@ int avl_iterate_index_range (
   void *        iter_arg
   );
 
+/*
+ * Call <iter_fun> for every key like avl_iterate_inorder(), spread over
+ * up to <workers> threads (the caller being one of them) that each walk
+ * a slice of the index range, in order on node trees and from its end
+ * on the others, like avl_iterate_index_range().  <iter_fun> must be
+ * thread safe; the index it gets tells where the key is in the tree.
+ * A worker stops at the first non-zero return of <iter_fun>, the others
+ * finish their slices and -1 is returned.  Hold the tree's read lock
+ * around the call as usual; the workers come from the thread library,
+ * which must have been initialised.
+ */
+int avl_iterate_parallel (
+  avl_tree *        tree,
+  avl_iter_index_fun_type iter_fun,
+  unsigned int        workers,
+  void *        iter_arg
+  );
+
+/*
+ * Iterators walk the keys in order one call at a time and may be kept
+ * while the tree's lock is dropped: after concurrent deletes they go on
+ * with the first key greater than the last one they returned, which
+ * therefore has to stay valid meanwhile.  Keys equal to that one may be
+ * skipped then, keys inserted behind it are seen.  Hold the tree's read
+ * lock during each avl_iterator_next().
+ */
+typedef struct avl_iterator_tag {
+  avl_tree *            tree;
+  avl_node *            node;
+  void *                key;
+  unsigned long         version;
+  /* where <key> is in a frozen, btree or compact tree */
+  unsigned long         index;
+  int                   started;
+} avl_iterator;
+
+void avl_iterator_init (avl_iterator * iterator, avl_tree * tree);
+/* -1 once all keys were returned */
+int avl_iterator_next (avl_iterator * iterator, void ** value_address);
+
+/*
+ * Like avl_iterate_inorder(), but takes the tree's read lock itself and
+ * drops it for a moment after every <batch> keys so writers are not
+ * held up by a long walk.  After writers changed the tree it goes on at
+ * the same position rather than after the last key, which may be freed
+ * by then: keys deleted before that position make it skip as many,
+ * keys inserted before it are returned again.
+ */
+int avl_iterate_inorder_yield (
+  avl_tree *        tree,
+  avl_iter_fun_type    iter_fun,
+  void *        iter_arg,
+  unsigned int        batch
+  );
+
 int avl_get_span_by_key (
   avl_tree *        tree,
   void *        key,
@@ -164,6 +482,40 @@ int avl_get_span_by_two_keys (
   unsigned long *    high
   );
 
+/*
+ * Order statistics in O(log n) from the ranks, with no walk over equal
+ * keys: the number of keys less than (lower bound) or not greater than
+ * (upper bound) <key>, which is also the index of the first key not
+ * less than, or greater than, <key>.  The rank of a value among all
+ * keys is its lower bound; the key at a percentile <p> is the one at
+ * index p * length / 100 by avl_get_by_index().
+ */
+unsigned long avl_get_lower_bound (avl_tree * tree, void * key);
+unsigned long avl_get_upper_bound (avl_tree * tree, void * key);
+
+/* keys from <key_a> to <key_b>, both included, given in either order */
+unsigned long avl_get_count_by_two_keys (
+  avl_tree *        tree,
+  void *        key_a,
+  void *        key_b
+  );
+
+/*
+ * Call <iter_fun> in order with up to <before> keys less than <key> and
+ * up to <after> keys from the first one not less than <key> on, with
+ * their indexes, in O(log n + before + after) on node and frozen trees.
+ * -1 if <iter_fun> returned non-zero.  The greatest N keys, largest
+ * first, are avl_iterate_index_range (tree, f, length - N, length).
+ */
+int avl_iterate_around_key (
+  avl_tree *        tree,
+  void *        key,
+  unsigned long        before,
+  unsigned long        after,
+  avl_iter_index_fun_type iter_fun,
+  void *        iter_arg
+  );
+
 int avl_verify (avl_tree * tree);
 
 void avl_print_tree (
@@ -191,6 +543,68 @@ int avl_get_item_by_key_least (
   void **        value_address
   );
 
+/*
+ * Fingers start searches and inserts at the node last found or
+ * inserted through them instead of at the root, which makes runs of
+ * ascending or nearby keys cheap.  A finger stays usable across
+ * inserts; once anything was deleted from the tree it starts over at
+ * the root by itself.  It is used under the same locks as the tree.
+ */
+typedef struct avl_finger_tag {
+  avl_tree *            tree;
+  avl_node *            node;
+  unsigned long         version;
+} avl_finger;
+
+void avl_finger_init (avl_finger * finger, avl_tree * tree);
+
+int avl_finger_get_by_key (
+  avl_finger *        finger,
+  void *        key,
+  void **        value_address
+  );
+
+int avl_finger_insert (
+  avl_finger *        finger,
+  void *        key
+  );
+
+/*
+ * RCU read mode, for trees created with AVL_TREE_FLAG_RCU.
+ *
+ * Readers bracket their lookups with avl_rcu_read_lock() and
+ * avl_rcu_read_unlock() instead of taking the tree lock.  Keys found
+ * inside such a section stay valid until it ends, deleted keys are
+ * only handed to their free function once no reader can see them.
+ * Writers keep using avl_tree_wlock() around avl_insert() and
+ * avl_delete() and must never be inside a read section themselves.
+ * avl_rcu_synchronize() waits for all current readers and reclaims
+ * what they could still see; it is also run automatically by writers
+ * once enough garbage has piled up.
+ */
+unsigned int avl_rcu_read_lock(avl_tree *tree);
+void avl_rcu_read_unlock(avl_tree *tree, unsigned int token);
+
+int avl_rcu_get_by_key (
+  avl_tree *        tree,
+  void *        key,
+  void **        value_address
+  );
+
+int avl_rcu_get_by_index (
+  avl_tree *        tree,
+  unsigned long        index,
+  void **        value_address
+  );
+
+int avl_rcu_iterate_inorder (
+  avl_tree *        tree,
+  avl_iter_fun_type    iter_fun,
+  void *        iter_arg
+  );
+
+void avl_rcu_synchronize(avl_tree *tree);
+
 /* optional locking stuff */
 void avl_tree_rlock(avl_tree *tree);
 void avl_tree_wlock(avl_tree *tree);
@@ -199,6 +613,51 @@ void avl_node_rlock(avl_node *node);
 void avl_node_wlock(avl_node *node);
 void avl_node_unlock(avl_node *node);
 
+/*
+ * Counters of what a tree was asked to do, kept when the library is
+ * built with HAVE_AVL_STATS.  Lookups count calls, inserts and deletes
+ * count keys that went in or out.  Compares are counted by putting a
+ * wrapper into the tree's compare_fun and compare_arg, so the compares
+ * AVL_DEFINE_GET_BY_KEY() inlines are not.  Rotations are those of
+ * node based trees, <max_depth> is that of the deepest node an insert
+ * or successful lookup reached, the root being at 1, and lock waits
+ * are measured in avl_tree_rlock() and avl_tree_wlock().  Threads count
+ * into shards of their own, which avl_tree_get_stats() adds up; it
+ * needs no lock and returns -1 with everything zero when the library
+ * keeps no counters.
+ */
+typedef struct {
+  unsigned long         lookups;
+  unsigned long         inserts;
+  unsigned long         deletes;
+  unsigned long         compares;
+  unsigned long         rotations;
+  unsigned long         max_depth;
+  unsigned long long    lock_wait_nsec;
+} avl_tree_stats;
+
+int avl_tree_get_stats(avl_tree *tree, avl_tree_stats *stats);
+void avl_tree_reset_stats(avl_tree *tree);
+
+#ifdef HAVE_AVL_NODE_LOCK
+/*
+ * Fine grained locking, for trees created with AVL_TREE_FLAG_NODE_LOCK.
+ * With the tree read locked, any number of threads may call
+ * avl_insert_locked(), avl_get_node_locked() and avl_get_by_key() at the
+ * same time; they couple node locks on the way down and never need the
+ * tree's write lock, rotations included.  Deletes and everything else
+ * that walks or indexes the tree still want the write lock while these
+ * run.  avl_insert_locked() fails on trees without the flag and on hash
+ * indexed or frozen ones, use avl_insert() under the write lock there.
+ * Lookups on other trees take no node locks.
+ */
+int avl_insert_locked(avl_tree *tree, void *key);
+/* the node holding <key>, read or (<write> set) write locked; the key's
+ * value may be updated in place until avl_node_unlock(), not its order
+ */
+avl_node *avl_get_node_locked(avl_tree *tree, void *key, int write);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,970 @@
+/* avl_btree.c
+**
+** B+tree engine for avl trees created with AVL_TREE_FLAG_BTREE.
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Library General Public
+** License as published by the Free Software Foundation; either
+** version 2 of the License, or (at your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Library General Public License for more details.
+**
+** You should have received a copy of the GNU Library General Public
+** License along with this library; if not, write to the
+** Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+** Boston, MA  02110-1301, USA.
+**
+*/
+
+/*
+ * Keys live in leaves of four cache lines which are chained for in
+ * order scans.  Inner nodes keep, next to their children, the number
+ * of keys below every child so that the order statistic functions of
+ * avl.h work the same as with the rank field of avl_node.
+ *
+ * Separator <keys[i]> of an inner node compares greater or equal to
+ * every key below <children[i]> and less or equal to every key below
+ * <children[i + 1]>.  It is always the very pointer stored first in
+ * the leftmost leaf below <children[i + 1]>: keys are owned by the
+ * caller and may be freed once deleted, so when that first key goes
+ * its separator is moved on to the new first key of the leaf.
+ */
+
+#ifdef HAVE_CONFIG_H
+ #include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "avl.h"
+#include "avl_btree.h"
+
+#define AVL_BTREE_ALIGN         (64)
+/* a leaf and an inner node take 4 and 6 cache lines on 64 bit hosts */
+#define AVL_BTREE_LEAF_MAX      (29)
+#define AVL_BTREE_LEAF_MIN      (AVL_BTREE_LEAF_MAX / 2)
+#define AVL_BTREE_ORDER         (16)
+#define AVL_BTREE_INNER_MIN     (AVL_BTREE_ORDER / 2)
+#define AVL_BTREE_MAX_DEPTH     (32)
+
+typedef struct {
+  /* 0 for leaves */
+  unsigned int          level;
+  /* keys in a leaf, children in an inner node */
+  unsigned int          count;
+} avl_btree_head;
+
+typedef struct avl_btree_leaf_tag {
+  avl_btree_head                head;
+  struct avl_btree_leaf_tag *   prev;
+  struct avl_btree_leaf_tag *   next;
+  void *                        keys[AVL_BTREE_LEAF_MAX];
+} avl_btree_leaf;
+
+typedef struct {
+  avl_btree_head        head;
+  void *                keys[AVL_BTREE_ORDER - 1];
+  avl_btree_head *      children[AVL_BTREE_ORDER];
+  unsigned long         counts[AVL_BTREE_ORDER];
+} avl_btree_inner;
+
+struct avl_btree_tag {
+  avl_btree_head *      root;
+  avl_btree_leaf *      first;
+  avl_btree_leaf *      last;
+};
+
+/* the way down to a leaf */
+typedef struct {
+  unsigned int          depth;
+  avl_btree_inner *     nodes[AVL_BTREE_MAX_DEPTH];
+  unsigned int          pos[AVL_BTREE_MAX_DEPTH];
+  avl_btree_leaf *      leaf;
+  unsigned int          leaf_pos;
+} avl_btree_path;
+
+static void *
+avl_btree_alloc (size_t size)
+{
+  void * ptr;
+
+#ifdef _WIN32
+  ptr = _aligned_malloc (size, AVL_BTREE_ALIGN);
+#else
+  if (posix_memalign (&ptr, AVL_BTREE_ALIGN, size) != 0) {
+    ptr = NULL;
+  }
+#endif
+  return ptr;
+}
+
+static void
+avl_btree_dealloc (void * ptr)
+{
+#ifdef _WIN32
+  _aligned_free (ptr);
+#else
+  free (ptr);
+#endif
+}
+
+static avl_btree_leaf *
+avl_btree_leaf_new (void)
+{
+  avl_btree_leaf * leaf = (avl_btree_leaf *) avl_btree_alloc (sizeof (avl_btree_leaf));
+
+  if (leaf) {
+    leaf->head.level = 0;
+    leaf->head.count = 0;
+    leaf->prev = NULL;
+    leaf->next = NULL;
+  }
+  return leaf;
+}
+
+static avl_btree_inner *
+avl_btree_inner_new (unsigned int level)
+{
+  avl_btree_inner * inner = (avl_btree_inner *) avl_btree_alloc (sizeof (avl_btree_inner));
+
+  if (inner) {
+    inner->head.level = level;
+    inner->head.count = 0;
+  }
+  return inner;
+}
+
+static unsigned long
+avl_btree_inner_total (avl_btree_inner * inner)
+{
+  unsigned long total = 0;
+  unsigned int i;
+
+  for (i = 0; i < inner->head.count; i++) {
+    total += inner->counts[i];
+  }
+  return total;
+}
+
+avl_btree *
+avl_btree_new (void)
+{
+  return (avl_btree *) calloc (1, sizeof (avl_btree));
+}
+
+static void
+avl_btree_free_helper (avl_btree_head * node, avl_free_key_fun_type free_key_fun)
+{
+  unsigned int i;
+
+  if (node->level) {
+    avl_btree_inner * inner = (avl_btree_inner *) node;
+    for (i = 0; i < inner->head.count; i++) {
+      avl_btree_free_helper (inner->children[i], free_key_fun);
+    }
+  } else if (free_key_fun) {
+    avl_btree_leaf * leaf = (avl_btree_leaf *) node;
+    for (i = 0; i < leaf->head.count; i++) {
+      free_key_fun (leaf->keys[i]);
+    }
+  }
+  avl_btree_dealloc (node);
+}
+
+void
+avl_btree_free (avl_btree * btree, avl_free_key_fun_type free_key_fun)
+{
+  if (btree->root) {
+    avl_btree_free_helper (btree->root, free_key_fun);
+  }
+  free (btree);
+}
+
+/* number of entries of <keys> comparing less than (or with <upper>
+ * set: less or equal to) <key>
+ */
+static unsigned int
+avl_btree_search (avl_tree * tree, void ** keys, unsigned int count, void * key, int upper)
+{
+  unsigned int low = 0, high = count;
+
+  while (low < high) {
+    unsigned int mid = low + (high - low) / 2;
+    int compare_result = tree->compare_fun (tree->compare_arg, key, keys[mid]);
+    if (compare_result > 0 || (upper && compare_result == 0)) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+/* walk down to the lower (or upper) bound of <key>, counting the keys
+ * left of the path in <index>
+ */
+static void
+avl_btree_descend (avl_tree * tree, void * key, int upper, avl_btree_path * path, unsigned long * index)
+{
+  avl_btree_head * node = tree->btree->root;
+  unsigned long skipped = 0;
+
+  path->depth = 0;
+  while (node->level) {
+    avl_btree_inner * inner = (avl_btree_inner *) node;
+    unsigned int i, pos;
+
+    pos = avl_btree_search (tree, inner->keys, inner->head.count - 1, key, upper);
+    for (i = 0; i < pos; i++) {
+      skipped += inner->counts[i];
+    }
+    path->nodes[path->depth] = inner;
+    path->pos[path->depth] = pos;
+    path->depth++;
+    node = inner->children[pos];
+  }
+  path->leaf = (avl_btree_leaf *) node;
+  path->leaf_pos = avl_btree_search (tree, path->leaf->keys, path->leaf->head.count, key, upper);
+  if (index) {
+    *index = skipped + path->leaf_pos;
+  }
+}
+
+/* move a path that points past the end of its leaf to the next one */
+static int
+avl_btree_path_next_leaf (avl_btree_path * path)
+{
+  avl_btree_head * node;
+  int d = (int) path->depth - 1;
+
+  while (d >= 0 && path->pos[d] + 1 >= path->nodes[d]->head.count) {
+    d--;
+  }
+  if (d < 0) {
+    return -1;
+  }
+  path->pos[d]++;
+  node = path->nodes[d]->children[path->pos[d]];
+  for (d++; d < (int) path->depth; d++) {
+    path->nodes[d] = (avl_btree_inner *) node;
+    path->pos[d] = 0;
+    node = path->nodes[d]->children[0];
+  }
+  path->leaf = (avl_btree_leaf *) node;
+  path->leaf_pos = 0;
+  return 0;
+}
+
+/* find the leaf and position holding the key with the given index */
+static avl_btree_leaf *
+avl_btree_find_index (avl_tree * tree, unsigned long index, unsigned int * pos)
+{
+  avl_btree_head * node = tree->btree->root;
+
+  while (node->level) {
+    avl_btree_inner * inner = (avl_btree_inner *) node;
+    unsigned int i = 0;
+    while (index >= inner->counts[i]) {
+      index -= inner->counts[i];
+      i++;
+    }
+    node = inner->children[i];
+  }
+  *pos = (unsigned int) index;
+  return (avl_btree_leaf *) node;
+}
+
+/*
+ * Put <child> (holding <count> keys, all of them not less than <sep>)
+ * right after child <pos> of the path node at <depth>, splitting
+ * nodes up to the root as needed.  The counts along the path already
+ * include <count>.  <spare> holds enough preallocated inner nodes for
+ * all the splits and a new root.
+ */
+static void
+avl_btree_insert_child (avl_btree * btree, avl_btree_path * path, int depth,
+        void * sep, avl_btree_head * child, unsigned long count,
+        avl_btree_inner ** spare)
+{
+  while (1) {
+    avl_btree_inner * inner;
+    avl_btree_inner * right;
+    unsigned int pos, n, half, i;
+    void * keys[AVL_BTREE_ORDER];
+    avl_btree_head * children[AVL_BTREE_ORDER + 1];
+    unsigned long counts[AVL_BTREE_ORDER + 1];
+
+    if (depth < 0) {
+      /* grow a new root */
+      avl_btree_inner * root = *spare;
+      root->head.level = btree->root->level + 1;
+      root->head.count = 2;
+      root->keys[0] = sep;
+      root->children[0] = btree->root;
+      root->children[1] = child;
+      root->counts[1] = count;
+      if (btree->root->level) {
+        root->counts[0] = avl_btree_inner_total ((avl_btree_inner *) btree->root);
+      } else {
+        root->counts[0] = btree->root->count;
+      }
+      btree->root = (avl_btree_head *) root;
+      return;
+    }
+
+    inner = path->nodes[depth];
+    pos = path->pos[depth];
+    n = inner->head.count;
+    inner->counts[pos] -= count;
+
+    if (n < AVL_BTREE_ORDER) {
+      memmove (&inner->children[pos + 2], &inner->children[pos + 1], (n - pos - 1) * sizeof (inner->children[0]));
+      memmove (&inner->counts[pos + 2], &inner->counts[pos + 1], (n - pos - 1) * sizeof (inner->counts[0]));
+      memmove (&inner->keys[pos + 1], &inner->keys[pos], (n - pos - 1) * sizeof (inner->keys[0]));
+      inner->children[pos + 1] = child;
+      inner->counts[pos + 1] = count;
+      inner->keys[pos] = sep;
+      inner->head.count++;
+      return;
+    }
+
+    /* full, split it in two */
+    right = *spare++;
+    right->head.level = inner->head.level;
+    for (i = 0; i <= pos; i++) {
+      children[i] = inner->children[i];
+      counts[i] = inner->counts[i];
+    }
+    children[pos + 1] = child;
+    counts[pos + 1] = count;
+    for (i = pos + 1; i < n; i++) {
+      children[i + 1] = inner->children[i];
+      counts[i + 1] = inner->counts[i];
+    }
+    for (i = 0; i < pos; i++) {
+      keys[i] = inner->keys[i];
+    }
+    keys[pos] = sep;
+    for (i = pos; i < n - 1; i++) {
+      keys[i + 1] = inner->keys[i];
+    }
+
+    half = (n + 1) / 2;
+    inner->head.count = half;
+    for (i = 0; i < half; i++) {
+      inner->children[i] = children[i];
+      inner->counts[i] = counts[i];
+    }
+    for (i = 0; i + 1 < half; i++) {
+      inner->keys[i] = keys[i];
+    }
+    right->head.count = n + 1 - half;
+    for (i = 0; i < right->head.count; i++) {
+      right->children[i] = children[half + i];
+      right->counts[i] = counts[half + i];
+    }
+    for (i = 0; i + 1 < right->head.count; i++) {
+      right->keys[i] = keys[half + i];
+    }
+
+    /* the separator between the halves moves up */
+    sep = keys[half - 1];
+    child = (avl_btree_head *) right;
+    count = avl_btree_inner_total (right);
+    depth--;
+  }
+}
+
+int
+avl_btree_insert (avl_tree * tree, void * key)
+{
+  avl_btree * btree = tree->btree;
+  avl_btree_path path;
+  avl_btree_leaf * leaf;
+  avl_btree_leaf * right;
+  avl_btree_inner * spare[AVL_BTREE_MAX_DEPTH + 1];
+  unsigned int pos, n, half, d, needed;
+  void * keys[AVL_BTREE_LEAF_MAX + 1];
+
+  if (!btree->root) {
+    leaf = avl_btree_leaf_new ();
+    if (!leaf) {
+      return -1;
+    }
+    leaf->keys[0] = key;
+    leaf->head.count = 1;
+    btree->root = (avl_btree_head *) leaf;
+    btree->first = btree->last = leaf;
+    return 0;
+  }
+
+  avl_btree_descend (tree, key, 0, &path, NULL);
+  leaf = path.leaf;
+  pos = path.leaf_pos;
+  n = leaf->head.count;
+
+  for (d = 0; d < path.depth; d++) {
+    path.nodes[d]->counts[path.pos[d]]++;
+  }
+
+  if (n < AVL_BTREE_LEAF_MAX) {
+    memmove (&leaf->keys[pos + 1], &leaf->keys[pos], (n - pos) * sizeof (leaf->keys[0]));
+    leaf->keys[pos] = key;
+    leaf->head.count++;
+    return 0;
+  }
+
+  /* full, so it gets split; allocate everything the split may need
+   * up front: one node per full ancestor and maybe a new root
+   */
+  needed = 1;
+  for (d = path.depth; d > 0 && path.nodes[d - 1]->head.count == AVL_BTREE_ORDER; d--) {
+    needed++;
+  }
+  right = avl_btree_leaf_new ();
+  for (d = 0; right && d < needed; d++) {
+    spare[d] = avl_btree_inner_new (0);
+    if (!spare[d]) {
+      break;
+    }
+  }
+  if (!right || d < needed) {
+    while (d--) {
+      avl_btree_dealloc (spare[d]);
+    }
+    if (right) {
+      avl_btree_dealloc (right);
+    }
+    for (d = 0; d < path.depth; d++) {
+      path.nodes[d]->counts[path.pos[d]]--;
+    }
+    return -1;
+  }
+
+  memcpy (keys, leaf->keys, pos * sizeof (keys[0]));
+  keys[pos] = key;
+  memcpy (&keys[pos + 1], &leaf->keys[pos], (n - pos) * sizeof (keys[0]));
+
+  half = (n + 1) / 2;
+  memcpy (leaf->keys, keys, half * sizeof (keys[0]));
+  leaf->head.count = half;
+  memcpy (right->keys, &keys[half], (n + 1 - half) * sizeof (keys[0]));
+  right->head.count = n + 1 - half;
+
+  right->prev = leaf;
+  right->next = leaf->next;
+  if (leaf->next) {
+    leaf->next->prev = right;
+  } else {
+    btree->last = right;
+  }
+  leaf->next = right;
+
+  avl_btree_insert_child (btree, &path, (int) path.depth - 1, right->keys[0],
+          (avl_btree_head *) right, right->head.count, spare);
+
+  /* the new root may not have been needed after all */
+  for (d = 0; d < needed; d++) {
+    if (spare[d]->head.level == 0) {
+      avl_btree_dealloc (spare[d]);
+    }
+  }
+  return 0;
+}
+
+/* drop child <pos> (and the separator left of it) from <inner> */
+static void
+avl_btree_remove_child (avl_btree_inner * inner, unsigned int pos)
+{
+  unsigned int n = inner->head.count;
+
+  memmove (&inner->children[pos], &inner->children[pos + 1], (n - pos - 1) * sizeof (inner->children[0]));
+  memmove (&inner->counts[pos], &inner->counts[pos + 1], (n - pos - 1) * sizeof (inner->counts[0]));
+  memmove (&inner->keys[pos - 1], &inner->keys[pos], (n - pos - 1) * sizeof (inner->keys[0]));
+  inner->head.count--;
+}
+
+static void
+avl_btree_fix_leaf (avl_btree * btree, avl_btree_inner * parent, unsigned int pos)
+{
+  avl_btree_leaf * leaf = (avl_btree_leaf *) parent->children[pos];
+  avl_btree_leaf * left = pos > 0 ? (avl_btree_leaf *) parent->children[pos - 1] : NULL;
+  avl_btree_leaf * right = pos + 1 < parent->head.count ? (avl_btree_leaf *) parent->children[pos + 1] : NULL;
+  unsigned int n = leaf->head.count;
+
+  if (left && left->head.count > AVL_BTREE_LEAF_MIN) {
+    /* borrow the last key of the left sibling */
+    memmove (&leaf->keys[1], &leaf->keys[0], n * sizeof (leaf->keys[0]));
+    leaf->keys[0] = left->keys[--left->head.count];
+    leaf->head.count++;
+    parent->keys[pos - 1] = leaf->keys[0];
+    parent->counts[pos - 1]--;
+    parent->counts[pos]++;
+  } else if (right && right->head.count > AVL_BTREE_LEAF_MIN) {
+    /* borrow the first key of the right sibling */
+    leaf->keys[leaf->head.count++] = right->keys[0];
+    right->head.count--;
+    memmove (&right->keys[0], &right->keys[1], right->head.count * sizeof (right->keys[0]));
+    parent->keys[pos] = right->keys[0];
+    parent->counts[pos + 1]--;
+    parent->counts[pos]++;
+  } else {
+    /* merge <leaf> into its left neighbour, or its right one into it */
+    if (!left) {
+      left = leaf;
+      leaf = right;
+      pos++;
+    }
+    memcpy (&left->keys[left->head.count], leaf->keys, leaf->head.count * sizeof (leaf->keys[0]));
+    left->head.count += leaf->head.count;
+    parent->counts[pos - 1] += leaf->head.count;
+    left->next = leaf->next;
+    if (leaf->next) {
+      leaf->next->prev = left;
+    } else {
+      btree->last = left;
+    }
+    avl_btree_remove_child (parent, pos);
+    avl_btree_dealloc (leaf);
+  }
+}
+
+static void
+avl_btree_fix_inner (avl_btree_inner * parent, unsigned int pos)
+{
+  avl_btree_inner * node = (avl_btree_inner *) parent->children[pos];
+  avl_btree_inner * left = pos > 0 ? (avl_btree_inner *) parent->children[pos - 1] : NULL;
+  avl_btree_inner * right = pos + 1 < parent->head.count ? (avl_btree_inner *) parent->children[pos + 1] : NULL;
+  unsigned int n = node->head.count;
+
+  if (left && left->head.count > AVL_BTREE_INNER_MIN) {
+    /* move the last child of the left sibling over */
+    unsigned int ln = left->head.count;
+    memmove (&node->children[1], &node->children[0], n * sizeof (node->children[0]));
+    memmove (&node->counts[1], &node->counts[0], n * sizeof (node->counts[0]));
+    memmove (&node->keys[1], &node->keys[0], (n - 1) * sizeof (node->keys[0]));
+    node->children[0] = left->children[ln - 1];
+    node->counts[0] = left->counts[ln - 1];
+    node->keys[0] = parent->keys[pos - 1];
+    parent->keys[pos - 1] = left->keys[ln - 2];
+    parent->counts[pos - 1] -= node->counts[0];
+    parent->counts[pos] += node->counts[0];
+    left->head.count--;
+    node->head.count++;
+  } else if (right && right->head.count > AVL_BTREE_INNER_MIN) {
+    /* move the first child of the right sibling over */
+    unsigned int rn = right->head.count;
+    node->children[n] = right->children[0];
+    node->counts[n] = right->counts[0];
+    node->keys[n - 1] = parent->keys[pos];
+    parent->keys[pos] = right->keys[0];
+    parent->counts[pos + 1] -= node->counts[n];
+    parent->counts[pos] += node->counts[n];
+    memmove (&right->children[0], &right->children[1], (rn - 1) * sizeof (right->children[0]));
+    memmove (&right->counts[0], &right->counts[1], (rn - 1) * sizeof (right->counts[0]));
+    memmove (&right->keys[0], &right->keys[1], (rn - 2) * sizeof (right->keys[0]));
+    right->head.count--;
+    node->head.count++;
+  } else {
+    unsigned int ln, i;
+    if (!left) {
+      left = node;
+      node = right;
+      pos++;
+    }
+    /* pull the separator down between the two halves */
+    ln = left->head.count;
+    left->keys[ln - 1] = parent->keys[pos - 1];
+    for (i = 0; i < node->head.count; i++) {
+      left->children[ln + i] = node->children[i];
+      left->counts[ln + i] = node->counts[i];
+    }
+    for (i = 0; i + 1 < node->head.count; i++) {
+      left->keys[ln + i] = node->keys[i];
+    }
+    left->head.count += node->head.count;
+    parent->counts[pos - 1] += parent->counts[pos];
+    avl_btree_remove_child (parent, pos);
+    avl_btree_dealloc (node);
+  }
+}
+
+int
+avl_btree_delete (avl_tree * tree, void * key, void ** removed)
+{
+  avl_btree * btree = tree->btree;
+  avl_btree_path path;
+  avl_btree_leaf * leaf;
+  unsigned int pos;
+  int d;
+
+  if (!btree->root) {
+    return -1;
+  }
+  avl_btree_descend (tree, key, 0, &path, NULL);
+  if (path.leaf_pos >= path.leaf->head.count && avl_btree_path_next_leaf (&path) != 0) {
+    return -1;
+  }
+  leaf = path.leaf;
+  pos = path.leaf_pos;
+  if (tree->compare_fun (tree->compare_arg, key, leaf->keys[pos]) != 0) {
+    return -1;
+  }
+
+  *removed = leaf->keys[pos];
+  leaf->head.count--;
+  memmove (&leaf->keys[pos], &leaf->keys[pos + 1], (leaf->head.count - pos) * sizeof (leaf->keys[0]));
+  for (d = 0; d < (int) path.depth; d++) {
+    path.nodes[d]->counts[path.pos[d]]--;
+  }
+  if (pos == 0 && leaf->head.count) {
+    /* the separator naming the removed key sits where the path first
+     * turns right; leaves below the root never run empty here */
+    for (d = (int) path.depth - 1; d >= 0 && path.pos[d] == 0; d--);
+    if (d >= 0) {
+      path.nodes[d]->keys[path.pos[d] - 1] = leaf->keys[0];
+    }
+  }
+
+  /* rebalance bottom up */
+  for (d = (int) path.depth - 1; d >= 0; d--) {
+    avl_btree_head * child = path.nodes[d]->children[path.pos[d]];
+    if (child->level == 0) {
+      if (child->count >= AVL_BTREE_LEAF_MIN) {
+        break;
+      }
+      avl_btree_fix_leaf (btree, path.nodes[d], path.pos[d]);
+    } else {
+      if (child->count >= AVL_BTREE_INNER_MIN) {
+        break;
+      }
+      avl_btree_fix_inner (path.nodes[d], path.pos[d]);
+    }
+  }
+
+  /* shrink from the top */
+  if (btree->root->level && btree->root->count == 1) {
+    avl_btree_head * root = btree->root;
+    btree->root = ((avl_btree_inner *) root)->children[0];
+    avl_btree_dealloc (root);
+  } else if (!btree->root->level && !btree->root->count) {
+    avl_btree_dealloc (btree->root);
+    btree->root = NULL;
+    btree->first = btree->last = NULL;
+  }
+  return 0;
+}
+
+/*
+ * Bulk loading: spread the keys evenly over as few full leaves as
+ * possible, which keeps every one of them above the minimum fill, then
+ * do the same for each level of inner nodes.
+ */
+int
+avl_btree_build_sorted (avl_tree * tree, void ** keys, unsigned long count)
+{
+  avl_btree * btree = tree->btree;
+  avl_btree_head ** level;
+  unsigned long * counts;
+  unsigned long nodes, i, done;
+  avl_btree_leaf * prev = NULL;
+
+  if (btree->root) {
+    return -1;
+  }
+  if (!count) {
+    return 0;
+  }
+
+  nodes = (count + AVL_BTREE_LEAF_MAX - 1) / AVL_BTREE_LEAF_MAX;
+  level = (avl_btree_head **) malloc (nodes * sizeof (*level));
+  counts = (unsigned long *) malloc (nodes * sizeof (*counts));
+  if (!level || !counts) {
+    free (level);
+    free (counts);
+    return -1;
+  }
+
+  done = 0;
+  for (i = 0; i < nodes; i++) {
+    unsigned long n = (count - done) / (nodes - i);
+    avl_btree_leaf * leaf = avl_btree_leaf_new ();
+    if (!leaf) {
+      while (i--) {
+        avl_btree_dealloc (level[i]);
+      }
+      btree->first = NULL;
+      free (level);
+      free (counts);
+      return -1;
+    }
+    memcpy (leaf->keys, &keys[done], n * sizeof (keys[0]));
+    leaf->head.count = (unsigned int) n;
+    leaf->prev = prev;
+    if (prev) {
+      prev->next = leaf;
+    } else {
+      btree->first = leaf;
+    }
+    prev = leaf;
+    level[i] = (avl_btree_head *) leaf;
+    counts[i] = n;
+    done += n;
+  }
+  btree->last = prev;
+
+  while (nodes > 1) {
+    unsigned long parents = (nodes + AVL_BTREE_ORDER - 1) / AVL_BTREE_ORDER;
+    unsigned long j;
+
+    done = 0;
+    for (i = 0; i < parents; i++) {
+      unsigned long n = (nodes - done) / (parents - i);
+      avl_btree_inner * inner = avl_btree_inner_new (level[done]->level + 1);
+      if (!inner) {
+        /* leaves are still chained, everything above got freed */
+        btree->root = NULL;
+        for (j = 0; j < i; j++) {
+          avl_btree_dealloc (level[j]);
+        }
+        for (j = done; j < nodes; j++) {
+          avl_btree_free_helper (level[j], NULL);
+        }
+        free (level);
+        free (counts);
+        btree->first = btree->last = NULL;
+        return -1;
+      }
+      for (j = 0; j < n; j++) {
+        avl_btree_head * child = level[done + j];
+        inner->children[j] = child;
+        inner->counts[j] = counts[done + j];
+        if (j) {
+          /* the smallest key below <child> */
+          while (child->level) {
+            child = ((avl_btree_inner *) child)->children[0];
+          }
+          inner->keys[j - 1] = ((avl_btree_leaf *) child)->keys[0];
+        }
+      }
+      inner->head.count = (unsigned int) n;
+      level[i] = (avl_btree_head *) inner;
+      counts[i] = avl_btree_inner_total (inner);
+      done += n;
+    }
+    nodes = parents;
+  }
+
+  btree->root = level[0];
+  free (level);
+  free (counts);
+  return 0;
+}
+
+int
+avl_btree_get_by_index (avl_tree * tree, unsigned long index, void ** value_address)
+{
+  avl_btree_leaf * leaf;
+  unsigned int pos;
+
+  if (index >= tree->length) {
+    return -1;
+  }
+  leaf = avl_btree_find_index (tree, index, &pos);
+  *value_address = leaf->keys[pos];
+  return 0;
+}
+
+int
+avl_btree_get_by_key (avl_tree * tree, void * key, void ** value_address)
+{
+  avl_btree_path path;
+  avl_btree_leaf * leaf;
+  unsigned int pos;
+
+  if (!tree->btree->root) {
+    return -1;
+  }
+  avl_btree_descend (tree, key, 0, &path, NULL);
+  leaf = path.leaf;
+  pos = path.leaf_pos;
+  if (pos >= leaf->head.count) {
+    leaf = leaf->next;
+    pos = 0;
+  }
+  if (leaf && tree->compare_fun (tree->compare_arg, key, leaf->keys[pos]) == 0) {
+    *value_address = leaf->keys[pos];
+    return 0;
+  }
+  return -1;
+}
+
+unsigned long
+avl_btree_get_bound (avl_tree * tree, void * key, int upper)
+{
+  avl_btree_path path;
+  unsigned long index;
+
+  if (!tree->btree->root) {
+    return 0;
+  }
+  avl_btree_descend (tree, key, upper, &path, &index);
+  return index;
+}
+
+int
+avl_btree_iterate_inorder (avl_tree * tree, avl_iter_fun_type iter_fun, void * iter_arg)
+{
+  avl_btree_leaf * leaf;
+  unsigned int i;
+  int result;
+
+  for (leaf = tree->btree->first; leaf; leaf = leaf->next) {
+    for (i = 0; i < leaf->head.count; i++) {
+      result = iter_fun (leaf->keys[i], iter_arg);
+      if (result != 0) {
+        return result;
+      }
+    }
+  }
+  return 0;
+}
+
+/* same order of calls as avl_iterate_index_range(): backwards from <high - 1> */
+int
+avl_btree_iterate_index_range (avl_tree * tree, avl_iter_index_fun_type iter_fun,
+        unsigned long low, unsigned long high, void * iter_arg)
+{
+  unsigned long num_left;
+  avl_btree_leaf * leaf;
+  unsigned int pos;
+
+  if (high > tree->length) {
+    return -1;
+  }
+  if (high <= low) {
+    return 0;
+  }
+  num_left = high - low;
+  leaf = avl_btree_find_index (tree, high - 1, &pos);
+  while (num_left) {
+    num_left--;
+    if (iter_fun (num_left, leaf->keys[pos], iter_arg) != 0) {
+      return -1;
+    }
+    if (pos) {
+      pos--;
+    } else if ((leaf = leaf->prev)) {
+      pos = leaf->head.count - 1;
+    } else {
+      break;
+    }
+  }
+  return 0;
+}
+
+static unsigned long
+avl_btree_verify_helper (avl_tree * tree, avl_btree_head * node, unsigned int level, int is_root)
+{
+  unsigned long total = 0;
+  unsigned int i;
+
+  if (node->level != level) {
+    fprintf (stderr, "btree: node at wrong level %u, expected %u\n", node->level, level);
+    exit (1);
+  }
+  if (level) {
+    avl_btree_inner * inner = (avl_btree_inner *) node;
+    if (inner->head.count < (is_root ? 2 : AVL_BTREE_INNER_MIN)) {
+      fprintf (stderr, "btree: inner node underflow\n");
+      exit (1);
+    }
+    for (i = 0; i < inner->head.count; i++) {
+      unsigned long count = avl_btree_verify_helper (tree, inner->children[i], level - 1, 0);
+      if (count != inner->counts[i]) {
+        fprintf (stderr, "btree: invalid count %lu != %lu\n", inner->counts[i], count);
+        exit (1);
+      }
+      total += count;
+    }
+  } else {
+    avl_btree_leaf * leaf = (avl_btree_leaf *) node;
+    if (!is_root && leaf->head.count < AVL_BTREE_LEAF_MIN) {
+      fprintf (stderr, "btree: leaf underflow\n");
+      exit (1);
+    }
+    total = leaf->head.count;
+  }
+  return total;
+}
+
+int
+avl_btree_verify (avl_tree * tree)
+{
+  avl_btree * btree = tree->btree;
+  avl_btree_leaf * leaf;
+  void * prev = NULL;
+  unsigned long seen = 0;
+  unsigned int i;
+
+  if (!btree->root) {
+    return 0;
+  }
+  avl_btree_verify_helper (tree, btree->root, btree->root->level, 1);
+  for (leaf = btree->first; leaf; leaf = leaf->next) {
+    for (i = 0; i < leaf->head.count; i++) {
+      if (seen && tree->compare_fun (tree->compare_arg, prev, leaf->keys[i]) > 0) {
+        fprintf (stderr, "btree: keys out of order at index %lu\n", seen);
+        exit (1);
+      }
+      prev = leaf->keys[i];
+      seen++;
+    }
+  }
+  if (seen != tree->length) {
+    fprintf (stderr, "btree: %lu keys in leaves, expected %u\n", seen, tree->length);
+    exit (1);
+  }
+  return 0;
+}
+
+static void
+avl_btree_print_helper (avl_btree_head * node, avl_key_printer_fun_type key_printer, int indent)
+{
+  char buffer[AVL_KEY_PRINTER_BUFLEN];
+  unsigned int i;
+
+  if (node->level) {
+    avl_btree_inner * inner = (avl_btree_inner *) node;
+    for (i = 0; i < inner->head.count; i++) {
+      if (i) {
+        key_printer (buffer, inner->keys[i - 1]);
+        fprintf (stdout, "%*s+-[%s]\n", indent, "", buffer);
+      }
+      avl_btree_print_helper (inner->children[i], key_printer, indent + 2);
+    }
+  } else {
+    avl_btree_leaf * leaf = (avl_btree_leaf *) node;
+    fprintf (stdout, "%*s", indent, "");
+    for (i = 0; i < leaf->head.count; i++) {
+      key_printer (buffer, leaf->keys[i]);
+      fprintf (stdout, "%s%s", i ? " " : "", buffer);
+    }
+    fprintf (stdout, "\n");
+  }
+}
+
+void
+avl_btree_print (avl_tree * tree, avl_key_printer_fun_type key_printer)
+{
+  if (tree->btree->root) {
+    avl_btree_print_helper (tree->btree->root, key_printer, 0);
+  } else {
+    fprintf (stdout, "<empty tree>\n");
+  }
+}
@@ -0,0 +1,68 @@
+/* avl_btree.h
+**
+** B+tree engine for avl trees created with AVL_TREE_FLAG_BTREE,
+** internal to the avl library.
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Library General Public
+** License as published by the Free Software Foundation; either
+** version 2 of the License, or (at your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Library General Public License for more details.
+**
+** You should have received a copy of the GNU Library General Public
+** License along with this library; if not, write to the
+** Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+** Boston, MA  02110-1301, USA.
+**
+*/
+
+#ifndef __AVL_BTREE_H
+#define __AVL_BTREE_H
+
+#include "avl.h"
+
+#ifdef _mangle
+# define avl_btree_new _mangle(avl_btree_new)
+# define avl_btree_free _mangle(avl_btree_free)
+# define avl_btree_insert _mangle(avl_btree_insert)
+# define avl_btree_delete _mangle(avl_btree_delete)
+# define avl_btree_build_sorted _mangle(avl_btree_build_sorted)
+# define avl_btree_get_by_index _mangle(avl_btree_get_by_index)
+# define avl_btree_get_by_key _mangle(avl_btree_get_by_key)
+# define avl_btree_get_bound _mangle(avl_btree_get_bound)
+# define avl_btree_iterate_inorder _mangle(avl_btree_iterate_inorder)
+# define avl_btree_iterate_index_range _mangle(avl_btree_iterate_index_range)
+# define avl_btree_verify _mangle(avl_btree_verify)
+# define avl_btree_print _mangle(avl_btree_print)
+#endif
+
+/* All of these work on tree->btree and leave tree->length to the caller. */
+
+avl_btree *avl_btree_new(void);
+void avl_btree_free(avl_btree *btree, avl_free_key_fun_type free_key_fun);
+
+int avl_btree_insert(avl_tree *tree, void *key);
+/* the key removed from the tree is handed back in <removed> */
+int avl_btree_delete(avl_tree *tree, void *key, void **removed);
+/* the btree must be empty, keys must be sorted */
+int avl_btree_build_sorted(avl_tree *tree, void **keys, unsigned long count);
+
+int avl_btree_get_by_index(avl_tree *tree, unsigned long index, void **value_address);
+int avl_btree_get_by_key(avl_tree *tree, void *key, void **value_address);
+/* index of the first key not less than (<upper> unset) or greater
+ * than (<upper> set) <key>
+ */
+unsigned long avl_btree_get_bound(avl_tree *tree, void *key, int upper);
+
+int avl_btree_iterate_inorder(avl_tree *tree, avl_iter_fun_type iter_fun, void *iter_arg);
+int avl_btree_iterate_index_range(avl_tree *tree, avl_iter_index_fun_type iter_fun,
+        unsigned long low, unsigned long high, void *iter_arg);
+
+int avl_btree_verify(avl_tree *tree);
+void avl_btree_print(avl_tree *tree, avl_key_printer_fun_type key_printer);
+
+#endif /* __AVL_BTREE_H */
@@ -0,0 +1,631 @@
+/* avl_compact.c
+**
+** Pooled node engine for avl trees created with AVL_TREE_FLAG_COMPACT.
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Library General Public
+** License as published by the Free Software Foundation; either
+** version 2 of the License, or (at your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Library General Public License for more details.
+**
+** You should have received a copy of the GNU Library General Public
+** License along with this library; if not, write to the
+** Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+** Boston, MA  02110-1301, USA.
+**
+*/
+
+/*
+ * The same AVL tree as with avl_node, but all nodes sit in one array
+ * and point at each other by 32 bit slot number, with slot 0 standing
+ * for NULL.  There is no parent link: insertion and deletion remember
+ * the way down in an avl_compact_path and retrace along it.  That makes
+ * a node 24 bytes on 64 bit hosts instead of 40 plus malloc overhead,
+ * and keeps a tree of a few million keys in far fewer cache lines and
+ * pages.  Slots given up by deletions are chained through <left> and
+ * reused before the array grows.
+ *
+ * Like avl_node, <rank> is one more than the size of the left subtree
+ * and equal keys go to the left.
+ */
+
+#ifdef HAVE_CONFIG_H
+ #include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "avl.h"
+#include "avl_compact.h"
+
+/* an AVL tree of 2^32 nodes is less than 46 levels deep */
+#define AVL_COMPACT_MAX_DEPTH   (64)
+#define AVL_COMPACT_MIN_SLOTS   (64)
+#define AVL_COMPACT_MAX_SLOTS   (0xffffffffU)
+
+typedef struct {
+  void *                key;
+  /* slot numbers of the children, 0 for none */
+  unsigned int          left;
+  unsigned int          right;
+  unsigned int          rank;
+  /* height of the right minus the left subtree */
+  signed char           balance;
+} avl_compact_node;
+
+struct avl_compact_tag {
+  /* slot 0 is never handed out */
+  avl_compact_node *    nodes;
+  unsigned int          size;
+  /* slots handed out at least once, including slot 0 */
+  unsigned int          used;
+  unsigned int          free_list;
+  unsigned int          root;
+};
+
+/* the way down from the root: <dirs[i]> is -1 or 1 for the step from
+ * <nodes[i]> to its left or right child
+ */
+typedef struct {
+  unsigned int          depth;
+  unsigned int          nodes[AVL_COMPACT_MAX_DEPTH];
+  signed char           dirs[AVL_COMPACT_MAX_DEPTH];
+} avl_compact_path;
+
+avl_compact *
+avl_compact_new (void)
+{
+  return (avl_compact *) calloc (1, sizeof (avl_compact));
+}
+
+/* make room for <count> more slots beyond <used> */
+static int
+avl_compact_reserve (avl_compact * compact, unsigned long count)
+{
+  avl_compact_node * nodes;
+  unsigned long size;
+
+  if (compact->used + count <= compact->size) {
+    return 0;
+  }
+  size = compact->size < AVL_COMPACT_MIN_SLOTS ? AVL_COMPACT_MIN_SLOTS : compact->size;
+  while (size < compact->used + count) {
+    size += size / 2;
+  }
+  if (size > AVL_COMPACT_MAX_SLOTS) {
+    size = AVL_COMPACT_MAX_SLOTS;
+    if (compact->used + count > size) {
+      return -1;
+    }
+  }
+  nodes = (avl_compact_node *) realloc (compact->nodes, size * sizeof (avl_compact_node));
+  if (!nodes) {
+    return -1;
+  }
+  compact->nodes = nodes;
+  compact->size = (unsigned int) size;
+  return 0;
+}
+
+/* a free slot, 0 if none can be had; moves the array */
+static unsigned int
+avl_compact_alloc (avl_compact * compact)
+{
+  unsigned int slot = compact->free_list;
+
+  if (slot) {
+    compact->free_list = compact->nodes[slot].left;
+    return slot;
+  }
+  if (!compact->used) {
+    compact->used = 1;
+  }
+  if (avl_compact_reserve (compact, 1)) {
+    return 0;
+  }
+  return compact->used++;
+}
+
+static void
+avl_compact_dealloc (avl_compact * compact, unsigned int slot)
+{
+  compact->nodes[slot].key = NULL;
+  compact->nodes[slot].left = compact->free_list;
+  compact->free_list = slot;
+}
+
+void
+avl_compact_free (avl_compact * compact, avl_free_key_fun_type free_key_fun)
+{
+  avl_compact_node * nodes = compact->nodes;
+  unsigned int stack[AVL_COMPACT_MAX_DEPTH];
+  unsigned int depth = 0, x = compact->root;
+
+  if (free_key_fun) {
+    while (x || depth) {
+      while (x) {
+        stack[depth++] = x;
+        x = nodes[x].left;
+      }
+      x = stack[--depth];
+      free_key_fun (nodes[x].key);
+      x = nodes[x].right;
+    }
+  }
+  free (compact->nodes);
+  free (compact);
+}
+
+/* store <child> where the path step at <level> came from, the root
+ * for level -1
+ */
+static void
+avl_compact_set_child (avl_compact * compact, avl_compact_path * path, int level, unsigned int child)
+{
+  if (level < 0) {
+    compact->root = child;
+  } else if (path->dirs[level] < 0) {
+    compact->nodes[path->nodes[level]].left = child;
+  } else {
+    compact->nodes[path->nodes[level]].right = child;
+  }
+}
+
+static unsigned int
+avl_compact_rotate_right (avl_compact_node * nodes, unsigned int x)
+{
+  unsigned int l = nodes[x].left;
+
+  nodes[x].left = nodes[l].right;
+  nodes[l].right = x;
+  nodes[x].rank -= nodes[l].rank;
+  return l;
+}
+
+static unsigned int
+avl_compact_rotate_left (avl_compact_node * nodes, unsigned int x)
+{
+  unsigned int r = nodes[x].right;
+
+  nodes[x].right = nodes[r].left;
+  nodes[r].left = x;
+  nodes[r].rank += nodes[x].rank;
+  return r;
+}
+
+/* rebalance <x> whose <side> (-1 left, 1 right) is two levels taller,
+ * returns the new top of the subtree and sets <shorter> when it lost a
+ * level
+ */
+static unsigned int
+avl_compact_rebalance (avl_compact_node * nodes, unsigned int x, int side, int * shorter)
+{
+  unsigned int c = side < 0 ? nodes[x].left : nodes[x].right;
+  unsigned int g, top;
+
+  if (nodes[c].balance != -side) {
+    top = side < 0 ? avl_compact_rotate_right (nodes, x) : avl_compact_rotate_left (nodes, x);
+    if (nodes[c].balance == 0) {
+      /* only after deletions */
+      nodes[x].balance = (signed char) side;
+      nodes[c].balance = (signed char) -side;
+      *shorter = 0;
+    } else {
+      nodes[x].balance = 0;
+      nodes[c].balance = 0;
+      *shorter = 1;
+    }
+    return top;
+  }
+  g = side < 0 ? nodes[c].right : nodes[c].left;
+  if (side < 0) {
+    nodes[x].left = avl_compact_rotate_left (nodes, c);
+    top = avl_compact_rotate_right (nodes, x);
+  } else {
+    nodes[x].right = avl_compact_rotate_right (nodes, c);
+    top = avl_compact_rotate_left (nodes, x);
+  }
+  nodes[x].balance = (signed char) (nodes[g].balance == side ? -side : 0);
+  nodes[c].balance = (signed char) (nodes[g].balance == -side ? side : 0);
+  nodes[g].balance = 0;
+  *shorter = 1;
+  return top;
+}
+
+int
+avl_compact_insert (avl_tree * tree, void * key)
+{
+  avl_compact * compact = tree->compact;
+  avl_compact_node * nodes;
+  avl_compact_path path;
+  unsigned int x, slot;
+  int i, shorter;
+
+  /* before taking pointers into the array, it may move */
+  slot = avl_compact_alloc (compact);
+  if (!slot) {
+    return -1;
+  }
+  nodes = compact->nodes;
+  nodes[slot].key = key;
+  nodes[slot].left = 0;
+  nodes[slot].right = 0;
+  nodes[slot].rank = 1;
+  nodes[slot].balance = 0;
+
+  path.depth = 0;
+  for (x = compact->root; x; path.depth++) {
+    path.nodes[path.depth] = x;
+    if (tree->compare_fun (tree->compare_arg, key, nodes[x].key) < 1) {
+      nodes[x].rank++;
+      path.dirs[path.depth] = -1;
+      x = nodes[x].left;
+    } else {
+      path.dirs[path.depth] = 1;
+      x = nodes[x].right;
+    }
+  }
+  avl_compact_set_child (compact, &path, (int) path.depth - 1, slot);
+
+  /* walk back up while the subtree grew */
+  for (i = (int) path.depth - 1; i >= 0; i--) {
+    x = path.nodes[i];
+    if (nodes[x].balance == 0) {
+      nodes[x].balance = path.dirs[i];
+    } else if (nodes[x].balance != path.dirs[i]) {
+      nodes[x].balance = 0;
+      break;
+    } else {
+      avl_compact_set_child (compact, &path, i - 1,
+                             avl_compact_rebalance (nodes, x, path.dirs[i], &shorter));
+      break;
+    }
+  }
+  return 0;
+}
+
+int
+avl_compact_delete (avl_tree * tree, void * key, void ** removed)
+{
+  avl_compact * compact = tree->compact;
+  avl_compact_node * nodes = compact->nodes;
+  avl_compact_path path;
+  unsigned int x, y, i;
+  int level, compare_result, shorter;
+
+  path.depth = 0;
+  for (x = compact->root; x; path.depth++) {
+    compare_result = tree->compare_fun (tree->compare_arg, key, nodes[x].key);
+    if (compare_result == 0) {
+      break;
+    }
+    path.nodes[path.depth] = x;
+    if (compare_result < 0) {
+      path.dirs[path.depth] = -1;
+      x = nodes[x].left;
+    } else {
+      path.dirs[path.depth] = 1;
+      x = nodes[x].right;
+    }
+  }
+  if (!x) {
+    return -1;
+  }
+  *removed = nodes[x].key;
+
+  /* with two children, the in order predecessor gives up its slot and
+   * its key moves to <x>
+   */
+  if (nodes[x].left && nodes[x].right) {
+    path.nodes[path.depth] = x;
+    path.dirs[path.depth++] = -1;
+    for (y = nodes[x].left; nodes[y].right; y = nodes[y].right) {
+      path.nodes[path.depth] = y;
+      path.dirs[path.depth++] = 1;
+    }
+    nodes[x].key = nodes[y].key;
+    x = y;
+  }
+  for (i = 0; i < path.depth; i++) {
+    if (path.dirs[i] < 0) {
+      nodes[path.nodes[i]].rank--;
+    }
+  }
+  avl_compact_set_child (compact, &path, (int) path.depth - 1,
+                         nodes[x].left ? nodes[x].left : nodes[x].right);
+  avl_compact_dealloc (compact, x);
+
+  /* walk back up while the subtree shrank */
+  for (level = (int) path.depth - 1; level >= 0; level--) {
+    x = path.nodes[level];
+    if (nodes[x].balance == path.dirs[level]) {
+      nodes[x].balance = 0;
+    } else if (nodes[x].balance == 0) {
+      nodes[x].balance = (signed char) -path.dirs[level];
+      break;
+    } else {
+      avl_compact_set_child (compact, &path, level - 1,
+                             avl_compact_rebalance (nodes, x, -path.dirs[level], &shorter));
+      if (!shorter) {
+        break;
+      }
+    }
+  }
+  return 0;
+}
+
+/* slots are handed out top down so the first levels share cache lines */
+static unsigned int
+avl_compact_build_helper (avl_compact * compact, void ** keys,
+                          unsigned long low, unsigned long high, int * height)
+{
+  avl_compact_node * nodes = compact->nodes;
+  unsigned long mid = low + (high - low) / 2;
+  unsigned int x = compact->used++;
+  int left_height = 0, right_height = 0;
+
+  nodes[x].key = keys[mid];
+  nodes[x].rank = (unsigned int) (mid - low + 1);
+  nodes[x].left = low < mid ? avl_compact_build_helper (compact, keys, low, mid, &left_height) : 0;
+  nodes[x].right = mid + 1 < high ? avl_compact_build_helper (compact, keys, mid + 1, high, &right_height) : 0;
+  nodes[x].balance = (signed char) (right_height - left_height);
+  *height = 1 + (left_height > right_height ? left_height : right_height);
+  return x;
+}
+
+int
+avl_compact_build_sorted (avl_tree * tree, void ** keys, unsigned long count)
+{
+  avl_compact * compact = tree->compact;
+  int height;
+
+  if (!count) {
+    return 0;
+  }
+  if (!compact->used) {
+    compact->used = 1;
+  }
+  if (avl_compact_reserve (compact, count)) {
+    return -1;
+  }
+  compact->root = avl_compact_build_helper (compact, keys, 0, count, &height);
+  return 0;
+}
+
+int
+avl_compact_get_by_index (avl_tree * tree, unsigned long index, void ** value_address)
+{
+  avl_compact_node * nodes = tree->compact->nodes;
+  unsigned int x = tree->compact->root;
+  unsigned long m = index + 1;
+
+  while (x) {
+    if (m < nodes[x].rank) {
+      x = nodes[x].left;
+    } else if (m > nodes[x].rank) {
+      m -= nodes[x].rank;
+      x = nodes[x].right;
+    } else {
+      *value_address = nodes[x].key;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+int
+avl_compact_get_by_key (avl_tree * tree, void * key, void ** value_address)
+{
+  avl_compact_node * nodes = tree->compact->nodes;
+  unsigned int x = tree->compact->root;
+  int compare_result;
+
+  while (x) {
+    compare_result = tree->compare_fun (tree->compare_arg, key, nodes[x].key);
+    if (compare_result < 0) {
+      x = nodes[x].left;
+    } else if (compare_result > 0) {
+      x = nodes[x].right;
+    } else {
+      *value_address = nodes[x].key;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+unsigned long
+avl_compact_get_bound (avl_tree * tree, void * key, int upper)
+{
+  avl_compact_node * nodes = tree->compact->nodes;
+  unsigned int x = tree->compact->root;
+  unsigned long index = 0;
+  int compare_result;
+
+  while (x) {
+    compare_result = tree->compare_fun (tree->compare_arg, key, nodes[x].key);
+    if (compare_result < 0 || (!upper && compare_result == 0)) {
+      x = nodes[x].left;
+    } else {
+      index += nodes[x].rank;
+      x = nodes[x].right;
+    }
+  }
+  return index;
+}
+
+int
+avl_compact_iterate_inorder (avl_tree * tree, avl_iter_fun_type iter_fun, void * iter_arg)
+{
+  avl_compact_node * nodes = tree->compact->nodes;
+  unsigned int stack[AVL_COMPACT_MAX_DEPTH];
+  unsigned int depth = 0, x = tree->compact->root;
+  int result;
+
+  while (x || depth) {
+    while (x) {
+      stack[depth++] = x;
+      x = nodes[x].left;
+    }
+    x = stack[--depth];
+    result = iter_fun (nodes[x].key, iter_arg);
+    if (result) {
+      return result;
+    }
+    x = nodes[x].right;
+  }
+  return 0;
+}
+
+/* from <high> - 1 down to <low>, like avl_iterate_index_range() */
+int
+avl_compact_iterate_index_range (avl_tree * tree, avl_iter_index_fun_type iter_fun,
+                                 unsigned long low, unsigned long high, void * iter_arg)
+{
+  avl_compact_node * nodes = tree->compact->nodes;
+  unsigned int stack[AVL_COMPACT_MAX_DEPTH];
+  unsigned int depth = 0, x = tree->compact->root;
+  unsigned long num_left, m = high;
+
+  if (high > tree->length) {
+    return -1;
+  }
+  if (high <= low) {
+    return 0;
+  }
+  /* the way to the key at <high> - 1, keeping the nodes left of it */
+  while (x) {
+    if (m < nodes[x].rank) {
+      x = nodes[x].left;
+    } else {
+      stack[depth++] = x;
+      if (m == nodes[x].rank) {
+        break;
+      }
+      m -= nodes[x].rank;
+      x = nodes[x].right;
+    }
+  }
+  num_left = high - low;
+  while (num_left) {
+    x = stack[--depth];
+    num_left--;
+    if (iter_fun (num_left, nodes[x].key, iter_arg)) {
+      return -1;
+    }
+    for (x = nodes[x].left; x; x = nodes[x].right) {
+      stack[depth++] = x;
+    }
+  }
+  return 0;
+}
+
+static unsigned long
+avl_compact_verify_helper (avl_tree * tree, unsigned int x, int * height, unsigned int depth)
+{
+  avl_compact_node * nodes = tree->compact->nodes;
+  unsigned long left_size, right_size;
+  int left_height = 0, right_height = 0;
+
+  if (x >= tree->compact->used || depth >= AVL_COMPACT_MAX_DEPTH) {
+    fprintf (stderr, "compact: bad slot %u at depth %u\n", x, depth);
+    exit (1);
+  }
+  left_size = nodes[x].left ? avl_compact_verify_helper (tree, nodes[x].left, &left_height, depth + 1) : 0;
+  right_size = nodes[x].right ? avl_compact_verify_helper (tree, nodes[x].right, &right_height, depth + 1) : 0;
+  if (nodes[x].rank != left_size + 1) {
+    fprintf (stderr, "compact: invalid rank at slot %u: %u != %lu\n", x, nodes[x].rank, left_size + 1);
+    exit (1);
+  }
+  if (nodes[x].balance != right_height - left_height) {
+    fprintf (stderr, "compact: invalid balance at slot %u: %d != %d\n",
+             x, nodes[x].balance, right_height - left_height);
+    exit (1);
+  }
+  *height = 1 + (left_height > right_height ? left_height : right_height);
+  return left_size + 1 + right_size;
+}
+
+int
+avl_compact_verify (avl_tree * tree)
+{
+  avl_compact * compact = tree->compact;
+  avl_compact_node * nodes = compact->nodes;
+  unsigned int stack[AVL_COMPACT_MAX_DEPTH];
+  unsigned int depth = 0, x, free_slots = 0;
+  unsigned long seen = 0;
+  void * prev = NULL;
+  int height;
+
+  if (!compact->root) {
+    if (tree->length) {
+      fprintf (stderr, "compact: empty, expected %u keys\n", tree->length);
+      exit (1);
+    }
+    return 0;
+  }
+  if (avl_compact_verify_helper (tree, compact->root, &height, 0) != tree->length) {
+    fprintf (stderr, "compact: wrong number of keys, expected %u\n", tree->length);
+    exit (1);
+  }
+  for (x = compact->root; x || depth; ) {
+    while (x) {
+      stack[depth++] = x;
+      x = nodes[x].left;
+    }
+    x = stack[--depth];
+    if (seen && tree->compare_fun (tree->compare_arg, prev, nodes[x].key) > 0) {
+      fprintf (stderr, "compact: keys out of order at index %lu\n", seen);
+      exit (1);
+    }
+    prev = nodes[x].key;
+    seen++;
+    x = nodes[x].right;
+  }
+  for (x = compact->free_list; x; x = nodes[x].left) {
+    if (++free_slots > compact->used) {
+      fprintf (stderr, "compact: free list loops\n");
+      exit (1);
+    }
+  }
+  if (seen + free_slots + 1 != compact->used) {
+    fprintf (stderr, "compact: %lu keys and %u free slots, %u slots used\n",
+             seen, free_slots, compact->used);
+    exit (1);
+  }
+  return 0;
+}
+
+/* right subtree on top, like print_node() in avl.c */
+static void
+avl_compact_print_helper (avl_compact_node * nodes, unsigned int x,
+                          avl_key_printer_fun_type key_printer, int indent)
+{
+  char buffer[AVL_KEY_PRINTER_BUFLEN];
+
+  if (nodes[x].right) {
+    avl_compact_print_helper (nodes, nodes[x].right, key_printer, indent + 2);
+  }
+  key_printer (buffer, nodes[x].key);
+  fprintf (stdout, "%*s+-[%c %s %03u]\n", indent, "",
+           "\\-/"[nodes[x].balance + 1], buffer, nodes[x].rank);
+  if (nodes[x].left) {
+    avl_compact_print_helper (nodes, nodes[x].left, key_printer, indent + 2);
+  }
+}
+
+void
+avl_compact_print (avl_tree * tree, avl_key_printer_fun_type key_printer)
+{
+  if (tree->compact->root) {
+    avl_compact_print_helper (tree->compact->nodes, tree->compact->root, key_printer, 0);
+  } else {
+    fprintf (stdout, "<empty tree>\n");
+  }
+}
@@ -0,0 +1,70 @@
+/* avl_compact.h
+**
+** avl trees of pooled nodes linked by 32 bit indices, internal to the
+** avl library.
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Library General Public
+** License as published by the Free Software Foundation; either
+** version 2 of the License, or (at your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Library General Public License for more details.
+**
+** You should have received a copy of the GNU Library General Public
+** License along with this library; if not, write to the
+** Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+** Boston, MA  02110-1301, USA.
+**
+*/
+
+#ifndef __AVL_COMPACT_H
+#define __AVL_COMPACT_H
+
+#include "avl.h"
+
+#ifdef _mangle
+# define avl_compact_new _mangle(avl_compact_new)
+# define avl_compact_free _mangle(avl_compact_free)
+# define avl_compact_insert _mangle(avl_compact_insert)
+# define avl_compact_delete _mangle(avl_compact_delete)
+# define avl_compact_build_sorted _mangle(avl_compact_build_sorted)
+# define avl_compact_get_by_index _mangle(avl_compact_get_by_index)
+# define avl_compact_get_by_key _mangle(avl_compact_get_by_key)
+# define avl_compact_get_bound _mangle(avl_compact_get_bound)
+# define avl_compact_iterate_inorder _mangle(avl_compact_iterate_inorder)
+# define avl_compact_iterate_index_range _mangle(avl_compact_iterate_index_range)
+# define avl_compact_verify _mangle(avl_compact_verify)
+# define avl_compact_print _mangle(avl_compact_print)
+#endif
+
+/* All of these work on tree->compact and leave tree->length to the
+ * caller, like their avl_btree_*() counterparts.
+ */
+
+avl_compact *avl_compact_new(void);
+void avl_compact_free(avl_compact *compact, avl_free_key_fun_type free_key_fun);
+
+int avl_compact_insert(avl_tree *tree, void *key);
+/* the key removed from the tree is handed back in <removed> */
+int avl_compact_delete(avl_tree *tree, void *key, void **removed);
+/* the pool must be empty, keys must be sorted */
+int avl_compact_build_sorted(avl_tree *tree, void **keys, unsigned long count);
+
+int avl_compact_get_by_index(avl_tree *tree, unsigned long index, void **value_address);
+int avl_compact_get_by_key(avl_tree *tree, void *key, void **value_address);
+/* index of the first key not less than (<upper> unset) or greater
+ * than (<upper> set) <key>
+ */
+unsigned long avl_compact_get_bound(avl_tree *tree, void *key, int upper);
+
+int avl_compact_iterate_inorder(avl_tree *tree, avl_iter_fun_type iter_fun, void *iter_arg);
+int avl_compact_iterate_index_range(avl_tree *tree, avl_iter_index_fun_type iter_fun,
+        unsigned long low, unsigned long high, void *iter_arg);
+
+int avl_compact_verify(avl_tree *tree);
+void avl_compact_print(avl_tree *tree, avl_key_printer_fun_type key_printer);
+
+#endif /* __AVL_COMPACT_H */
@@ -0,0 +1,254 @@
+/* avl_frozen.c
+**
+** flat read-only arrays for trees frozen with avl_tree_freeze().
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Library General Public
+** License as published by the Free Software Foundation; either
+** version 2 of the License, or (at your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Library General Public License for more details.
+**
+** You should have received a copy of the GNU Library General Public
+** License along with this library; if not, write to the
+** Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+** Boston, MA  02110-1301, USA.
+**
+*/
+
+/*
+ * A frozen tree keeps its keys twice: sorted, for everything that
+ * deals in indices, and in Eytzinger order, i.e. as an implicit binary
+ * tree laid out breadth first with the children of slot k in slots
+ * 2k and 2k+1, for lookups by key.  The first levels of the latter
+ * share a few cache lines and the search descends without any branch
+ * but the loop, so it stays cheap even though every step calls the
+ * compare function.  Nothing here ever changes after the arrays were
+ * built, which is why readers need no lock.
+ */
+
+#ifdef HAVE_CONFIG_H
+ #include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "avl.h"
+#include "avl_frozen.h"
+
+struct avl_frozen_tag {
+  unsigned long         count;
+  void **               keys;
+  /* slots 1 to <count>, slot 0 is unused */
+  void **               eytzinger;
+};
+
+/* fill the subtree at <slot> in order from <keys> */
+static unsigned long
+avl_frozen_fill (avl_frozen * frozen, unsigned long slot, unsigned long next)
+{
+  if (slot <= frozen->count) {
+    next = avl_frozen_fill (frozen, 2 * slot, next);
+    frozen->eytzinger[slot] = frozen->keys[next++];
+    next = avl_frozen_fill (frozen, 2 * slot + 1, next);
+  }
+  return next;
+}
+
+avl_frozen *
+avl_frozen_new (void ** keys, unsigned long count)
+{
+  avl_frozen * frozen = (avl_frozen *) malloc (sizeof (avl_frozen));
+
+  if (!frozen) {
+    return NULL;
+  }
+  frozen->eytzinger = (void **) malloc ((count + 1) * sizeof (void *));
+  if (!frozen->eytzinger) {
+    free (frozen);
+    return NULL;
+  }
+  frozen->count = count;
+  frozen->keys = keys;
+  frozen->eytzinger[0] = NULL;
+  avl_frozen_fill (frozen, 1, 0);
+  return frozen;
+}
+
+void
+avl_frozen_free (avl_frozen * frozen, avl_free_key_fun_type free_key_fun)
+{
+  unsigned long i;
+
+  if (free_key_fun) {
+    for (i = 0; i < frozen->count; i++) {
+      free_key_fun (frozen->keys[i]);
+    }
+  }
+  free (frozen->eytzinger);
+  free (frozen->keys);
+  free (frozen);
+}
+
+void **
+avl_frozen_keys (avl_frozen * frozen)
+{
+  return frozen->keys;
+}
+
+int
+avl_frozen_get_by_index (avl_tree * tree, unsigned long index, void ** value_address)
+{
+  if (index >= tree->frozen->count) {
+    return -1;
+  }
+  *value_address = tree->frozen->keys[index];
+  return 0;
+}
+
+int
+avl_frozen_get_by_key (avl_tree * tree, void * key, void ** value_address)
+{
+  avl_frozen * frozen = tree->frozen;
+  void ** eytzinger = frozen->eytzinger;
+  unsigned long n = frozen->count;
+  unsigned long k = 1;
+
+  /* go right past keys less than <key>, ending below a leaf */
+  while (k <= n) {
+#ifdef __GNUC__
+    /* the slots four levels down share two cache lines */
+    if (16 * k <= n) {
+      __builtin_prefetch (eytzinger + 16 * k);
+    }
+#endif
+    k = 2 * k + (tree->compare_fun (tree->compare_arg, key, eytzinger[k]) > 0);
+  }
+  /* undo the right turns taken since the last left one, which was at
+   * the first key not less than <key>
+   */
+#ifdef __GNUC__
+  k >>= __builtin_ffsl ((long) ~k);
+#else
+  while (k & 1) {
+    k >>= 1;
+  }
+  k >>= 1;
+#endif
+  if (!k || tree->compare_fun (tree->compare_arg, key, eytzinger[k]) != 0) {
+    return -1;
+  }
+  *value_address = eytzinger[k];
+  return 0;
+}
+
+unsigned long
+avl_frozen_get_bound (avl_tree * tree, void * key, int upper)
+{
+  void ** keys = tree->frozen->keys;
+  unsigned long base = 0;
+  unsigned long n = tree->frozen->count;
+  unsigned long half;
+  int compare_result;
+
+  if (!n) {
+    return 0;
+  }
+  /* the bound stays within [base, base + n], the compiler turns the
+   * selects into conditional moves
+   */
+  while (n > 1) {
+    half = n / 2;
+    compare_result = tree->compare_fun (tree->compare_arg, key, keys[base + half]);
+    base = (compare_result > 0 || (upper && compare_result == 0)) ? base + half : base;
+    n -= half;
+  }
+  compare_result = tree->compare_fun (tree->compare_arg, key, keys[base]);
+  return base + (compare_result > 0 || (upper && compare_result == 0));
+}
+
+int
+avl_frozen_iterate_inorder (avl_tree * tree, avl_iter_fun_type iter_fun, void * iter_arg)
+{
+  avl_frozen * frozen = tree->frozen;
+  unsigned long i;
+  int result;
+
+  for (i = 0; i < frozen->count; i++) {
+    result = iter_fun (frozen->keys[i], iter_arg);
+    if (result != 0) {
+      return result;
+    }
+  }
+  return 0;
+}
+
+/* same order and indices as avl_iterate_index_range() on nodes */
+int
+avl_frozen_iterate_index_range (avl_tree * tree, avl_iter_index_fun_type iter_fun,
+        unsigned long low, unsigned long high, void * iter_arg)
+{
+  unsigned long num_left;
+
+  if (high > tree->frozen->count) {
+    return -1;
+  }
+  if (high <= low) {
+    return 0;
+  }
+  num_left = high - low;
+  while (num_left) {
+    num_left--;
+    if (iter_fun (num_left, tree->frozen->keys[low + num_left], iter_arg) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int
+avl_frozen_verify (avl_tree * tree)
+{
+  avl_frozen * frozen = tree->frozen;
+  unsigned long i;
+
+  if (frozen->count != tree->length) {
+    fprintf (stderr, "frozen: %lu keys, expected %u\n", frozen->count, tree->length);
+    exit (1);
+  }
+  for (i = 1; i < frozen->count; i++) {
+    if (tree->compare_fun (tree->compare_arg, frozen->keys[i - 1], frozen->keys[i]) > 0) {
+      fprintf (stderr, "frozen: keys out of order at index %lu\n", i);
+      exit (1);
+    }
+  }
+  for (i = 1; i <= frozen->count; i++) {
+    void * key;
+    if (avl_frozen_get_by_key (tree, frozen->eytzinger[i], &key) != 0) {
+      fprintf (stderr, "frozen: key in slot %lu not found\n", i);
+      exit (1);
+    }
+  }
+  return 0;
+}
+
+void
+avl_frozen_print (avl_tree * tree, avl_key_printer_fun_type key_printer)
+{
+  char buffer[AVL_KEY_PRINTER_BUFLEN];
+  unsigned long i;
+
+  if (!tree->frozen->count) {
+    fprintf (stdout, "<empty tree>\n");
+    return;
+  }
+  for (i = 0; i < tree->frozen->count; i++) {
+    key_printer (buffer, tree->frozen->keys[i]);
+    fprintf (stdout, "%s%s", i ? " " : "", buffer);
+  }
+  fprintf (stdout, "\n");
+}
@@ -0,0 +1,63 @@
+/* avl_frozen.h
+**
+** flat read-only arrays for trees frozen with avl_tree_freeze(),
+** internal to the avl library.
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Library General Public
+** License as published by the Free Software Foundation; either
+** version 2 of the License, or (at your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Library General Public License for more details.
+**
+** You should have received a copy of the GNU Library General Public
+** License along with this library; if not, write to the
+** Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+** Boston, MA  02110-1301, USA.
+**
+*/
+
+#ifndef __AVL_FROZEN_H
+#define __AVL_FROZEN_H
+
+#include "avl.h"
+
+#ifdef _mangle
+# define avl_frozen_new _mangle(avl_frozen_new)
+# define avl_frozen_free _mangle(avl_frozen_free)
+# define avl_frozen_keys _mangle(avl_frozen_keys)
+# define avl_frozen_get_by_index _mangle(avl_frozen_get_by_index)
+# define avl_frozen_get_by_key _mangle(avl_frozen_get_by_key)
+# define avl_frozen_get_bound _mangle(avl_frozen_get_bound)
+# define avl_frozen_iterate_inorder _mangle(avl_frozen_iterate_inorder)
+# define avl_frozen_iterate_index_range _mangle(avl_frozen_iterate_index_range)
+# define avl_frozen_verify _mangle(avl_frozen_verify)
+# define avl_frozen_print _mangle(avl_frozen_print)
+#endif
+
+/* All but avl_frozen_new() and avl_frozen_free() work on tree->frozen. */
+
+/* takes over <keys>, sorted and allocated with malloc() */
+avl_frozen *avl_frozen_new(void **keys, unsigned long count);
+void avl_frozen_free(avl_frozen *frozen, avl_free_key_fun_type free_key_fun);
+/* the sorted keys */
+void **avl_frozen_keys(avl_frozen *frozen);
+
+int avl_frozen_get_by_index(avl_tree *tree, unsigned long index, void **value_address);
+int avl_frozen_get_by_key(avl_tree *tree, void *key, void **value_address);
+/* index of the first key not less than (<upper> unset) or greater
+ * than (<upper> set) <key>
+ */
+unsigned long avl_frozen_get_bound(avl_tree *tree, void *key, int upper);
+
+int avl_frozen_iterate_inorder(avl_tree *tree, avl_iter_fun_type iter_fun, void *iter_arg);
+int avl_frozen_iterate_index_range(avl_tree *tree, avl_iter_index_fun_type iter_fun,
+        unsigned long low, unsigned long high, void *iter_arg);
+
+int avl_frozen_verify(avl_tree *tree);
+void avl_frozen_print(avl_tree *tree, avl_key_printer_fun_type key_printer);
+
+#endif /* __AVL_FROZEN_H */
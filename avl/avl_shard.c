@@ -0,0 +1,266 @@
+/* avl_shard.c
+**
+** maps spread over several avl trees, each with its own lock
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Library General Public
+** License as published by the Free Software Foundation; either
+** version 2 of the License, or (at your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Library General Public License for more details.
+**
+** You should have received a copy of the GNU Library General Public
+** License along with this library; if not, write to the
+** Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+** Boston, MA  02110-1301, USA.
+**
+*/
+
+#ifdef HAVE_CONFIG_H
+ #include <config.h>
+#endif
+
+#include <stdlib.h>
+
+#include "avl.h"
+#include "avl_shard.h"
+
+#define AVL_SHARD_MAX           (1024)
+
+/* every shard is a tree of its own, locked with the tree's own lock */
+struct avl_shard_map_tag {
+  avl_tree **           shards;
+  unsigned int          mask;
+  avl_key_compare_fun_type      compare_fun;
+  void *                compare_arg;
+  avl_key_hash_fun_type hash_fun;
+  void *                hash_arg;
+};
+
+/* the current key of every shard during a merged walk */
+typedef struct {
+  void *                key;
+  unsigned int          shard;
+} avl_shard_cursor;
+
+static avl_tree *
+avl_shard_of (avl_shard_map * map, void * key)
+{
+  unsigned long h = map->hash_fun (map->hash_arg, key);
+
+  /* spread weak hashes before taking the low bits */
+  h ^= h >> 15;
+  h *= 2654435761UL;
+  h ^= h >> 13;
+  return map->shards[h & map->mask];
+}
+
+avl_shard_map *
+avl_shard_map_new (avl_key_compare_fun_type compare_fun,
+           void * compare_arg,
+           avl_key_hash_fun_type hash_fun,
+           void * hash_arg,
+           unsigned int shards,
+           unsigned int flags)
+{
+  avl_shard_map * map;
+  unsigned int count = 1;
+  unsigned int i;
+
+  if (!hash_fun || (flags & AVL_TREE_FLAG_INTRUSIVE)) {
+    return NULL;
+  }
+  while (count < shards && count < AVL_SHARD_MAX) {
+    count *= 2;
+  }
+
+  map = (avl_shard_map *) calloc (1, sizeof (avl_shard_map));
+  if (!map) {
+    return NULL;
+  }
+  map->shards = (avl_tree **) calloc (count, sizeof (avl_tree *));
+  if (!map->shards) {
+    free (map);
+    return NULL;
+  }
+  map->mask = count - 1;
+  map->compare_fun = compare_fun;
+  map->compare_arg = compare_arg;
+  map->hash_fun = hash_fun;
+  map->hash_arg = hash_arg;
+
+  for (i = 0; i < count; i++) {
+    map->shards[i] = avl_tree_new_ex (compare_fun, compare_arg, flags);
+    if (!map->shards[i]) {
+      while (i-- > 0) {
+        avl_tree_free (map->shards[i], NULL);
+      }
+      free (map->shards);
+      free (map);
+      return NULL;
+    }
+  }
+  return map;
+}
+
+void
+avl_shard_map_free (avl_shard_map * map, avl_free_key_fun_type free_key_fun)
+{
+  unsigned int i;
+
+  for (i = 0; i <= map->mask; i++) {
+    avl_tree_free (map->shards[i], free_key_fun);
+  }
+  free (map->shards);
+  free (map);
+}
+
+int
+avl_shard_map_insert (avl_shard_map * map, void * key)
+{
+  avl_tree * shard = avl_shard_of (map, key);
+  int result;
+
+  avl_tree_wlock (shard);
+  result = avl_insert (shard, key);
+  avl_tree_unlock (shard);
+  return result;
+}
+
+int
+avl_shard_map_delete (avl_shard_map * map, void * key, avl_free_key_fun_type free_key_fun)
+{
+  avl_tree * shard = avl_shard_of (map, key);
+  int result;
+
+  avl_tree_wlock (shard);
+  result = avl_delete (shard, key, free_key_fun);
+  avl_tree_unlock (shard);
+  return result;
+}
+
+int
+avl_shard_map_get_by_key (avl_shard_map * map, void * key, void ** value_address)
+{
+  avl_tree * shard = avl_shard_of (map, key);
+  int result;
+
+  avl_tree_rlock (shard);
+  result = avl_get_by_key (shard, key, value_address);
+  avl_tree_unlock (shard);
+  return result;
+}
+
+unsigned long
+avl_shard_map_length (avl_shard_map * map)
+{
+  unsigned long length = 0;
+  unsigned int i;
+
+  for (i = 0; i <= map->mask; i++) {
+    avl_tree_rlock (map->shards[i]);
+    length += map->shards[i]->length;
+    avl_tree_unlock (map->shards[i]);
+  }
+  return length;
+}
+
+int
+avl_shard_map_iterate (avl_shard_map * map, avl_iter_fun_type iter_fun, void * iter_arg)
+{
+  unsigned int i;
+  int result = 0;
+
+  for (i = 0; i <= map->mask && result == 0; i++) {
+    avl_tree_rlock (map->shards[i]);
+    result = avl_iterate_inorder (map->shards[i], iter_fun, iter_arg);
+    avl_tree_unlock (map->shards[i]);
+  }
+  return result;
+}
+
+/* order of the merge heap, ties go to the lower shard so walks repeat */
+static int
+avl_shard_cursor_less (avl_shard_map * map, avl_shard_cursor * a, avl_shard_cursor * b)
+{
+  int result = map->compare_fun (map->compare_arg, a->key, b->key);
+
+  return result < 0 || (result == 0 && a->shard < b->shard);
+}
+
+static void
+avl_shard_heap_down (avl_shard_map * map, avl_shard_cursor * heap, unsigned int count, unsigned int i)
+{
+  avl_shard_cursor top = heap[i];
+  unsigned int child;
+
+  while ((child = 2 * i + 1) < count) {
+    if (child + 1 < count && avl_shard_cursor_less (map, &heap[child + 1], &heap[child])) {
+      child++;
+    }
+    if (!avl_shard_cursor_less (map, &heap[child], &top)) {
+      break;
+    }
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = top;
+}
+
+/*
+ * k-way merge: a min heap holds the smallest key not yet returned of
+ * every shard, its shard's iterator refills the top after each key.
+ * Shards are locked in index order, which is the order everybody else
+ * who holds more than one uses as well.
+ */
+int
+avl_shard_map_iterate_inorder (avl_shard_map * map, avl_iter_fun_type iter_fun, void * iter_arg)
+{
+  unsigned int count = map->mask + 1;
+  avl_iterator * iterators;
+  avl_shard_cursor * heap;
+  unsigned int i, used = 0;
+  int result = 0;
+
+  iterators = (avl_iterator *) malloc (count * sizeof (avl_iterator));
+  heap = (avl_shard_cursor *) malloc (count * sizeof (avl_shard_cursor));
+  if (!iterators || !heap) {
+    free (iterators);
+    free (heap);
+    return -1;
+  }
+
+  for (i = 0; i < count; i++) {
+    avl_tree_rlock (map->shards[i]);
+    avl_iterator_init (&iterators[i], map->shards[i]);
+    if (avl_iterator_next (&iterators[i], &heap[used].key) == 0) {
+      heap[used++].shard = i;
+    }
+  }
+  for (i = used / 2; i > 0; i--) {
+    avl_shard_heap_down (map, heap, used, i - 1);
+  }
+
+  while (used) {
+    result = iter_fun (heap[0].key, iter_arg);
+    if (result != 0) {
+      break;
+    }
+    if (avl_iterator_next (&iterators[heap[0].shard], &heap[0].key) != 0) {
+      heap[0] = heap[--used];
+    }
+    if (used) {
+      avl_shard_heap_down (map, heap, used, 0);
+    }
+  }
+
+  for (i = 0; i < count; i++) {
+    avl_tree_unlock (map->shards[i]);
+  }
+  free (iterators);
+  free (heap);
+  return result;
+}
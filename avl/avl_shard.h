@@ -0,0 +1,75 @@
+/* avl_shard.h
+**
+** maps spread over several avl trees, each with its own lock
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Library General Public
+** License as published by the Free Software Foundation; either
+** version 2 of the License, or (at your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Library General Public License for more details.
+**
+** You should have received a copy of the GNU Library General Public
+** License along with this library; if not, write to the
+** Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+** Boston, MA  02110-1301, USA.
+**
+*/
+
+#ifndef __AVL_SHARD_H
+#define __AVL_SHARD_H
+
+#include "avl.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A shard map hashes every key to one of a fixed number of avl trees.
+ * Each shard is locked with its tree's own lock, so threads working on
+ * different keys rarely meet.  Unlike with avl_tree the
+ * functions below do the locking themselves.  Keys comparing equal must
+ * hash the same.  There is no global order but avl_shard_map_iterate_inorder()
+ * merges the shards on demand.
+ */
+typedef struct avl_shard_map_tag avl_shard_map;
+
+#ifdef _mangle
+# define avl_shard_map_new _mangle(avl_shard_map_new)
+# define avl_shard_map_free _mangle(avl_shard_map_free)
+# define avl_shard_map_insert _mangle(avl_shard_map_insert)
+# define avl_shard_map_delete _mangle(avl_shard_map_delete)
+# define avl_shard_map_get_by_key _mangle(avl_shard_map_get_by_key)
+# define avl_shard_map_length _mangle(avl_shard_map_length)
+# define avl_shard_map_iterate _mangle(avl_shard_map_iterate)
+# define avl_shard_map_iterate_inorder _mangle(avl_shard_map_iterate_inorder)
+#endif
+
+/* <shards> is rounded up to a power of two, at most 1024; <flags> go
+ * to avl_tree_new_ex() for every shard, AVL_TREE_FLAG_INTRUSIVE is not
+ * supported
+ */
+avl_shard_map *avl_shard_map_new(avl_key_compare_fun_type compare_fun, void *compare_arg,
+        avl_key_hash_fun_type hash_fun, void *hash_arg,
+        unsigned int shards, unsigned int flags);
+void avl_shard_map_free(avl_shard_map *map, avl_free_key_fun_type free_key_fun);
+
+int avl_shard_map_insert(avl_shard_map *map, void *key);
+int avl_shard_map_delete(avl_shard_map *map, void *key, avl_free_key_fun_type free_key_fun);
+int avl_shard_map_get_by_key(avl_shard_map *map, void *key, void **value_address);
+unsigned long avl_shard_map_length(avl_shard_map *map);
+
+/* every key, one shard after the other, holding one shard's lock at a time */
+int avl_shard_map_iterate(avl_shard_map *map, avl_iter_fun_type iter_fun, void *iter_arg);
+/* every key in order; all shards are read locked during the walk */
+int avl_shard_map_iterate_inorder(avl_shard_map *map, avl_iter_fun_type iter_fun, void *iter_arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __AVL_SHARD_H */
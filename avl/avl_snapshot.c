@@ -0,0 +1,598 @@
+/* avl_snapshot.c
+**
+** avl trees written to files that are mapped and searched in place
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Library General Public
+** License as published by the Free Software Foundation; either
+** version 2 of the License, or (at your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Library General Public License for more details.
+**
+** You should have received a copy of the GNU Library General Public
+** License along with this library; if not, write to the
+** Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+** Boston, MA  02110-1301, USA.
+**
+*/
+
+/*
+ * File layout, all offsets counted from the start of the file:
+ *
+ *   header
+ *   <count> record offsets in key order
+ *   <count> + 1 record offsets in Eytzinger order, slot 0 unused
+ *   records in Eytzinger order, each a record header and the codec's
+ *   bytes, padded to 8
+ *
+ * The Eytzinger table is the one avl_tree_freeze() builds, stored, so
+ * lookups descend it like they do in a frozen tree.  The records follow
+ * the same order, which keeps the ones the first levels of every search
+ * compare against close together.  Every record knows its index in key
+ * order, which turns the slot a search ends in into the bound without
+ * another table.
+ */
+
+#ifdef HAVE_CONFIG_H
+ #include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <process.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "avl.h"
+#include "avl_snapshot.h"
+
+#define AVL_SNAPSHOT_MAGIC      "AVLSNAP"
+#define AVL_SNAPSHOT_BYTE_ORDER (0x01020304U)
+#define AVL_SNAPSHOT_FORMAT     (1U)
+#define AVL_SNAPSHOT_ALIGN(n)   (((n) + 7) & ~(uint64_t) 7)
+
+typedef struct {
+  char                  magic[8];
+  uint32_t              byte_order;
+  uint32_t              format;
+  uint64_t              count;
+  uint64_t              sorted;
+  uint64_t              eytzinger;
+  uint64_t              size;
+} avl_snapshot_header;
+
+typedef struct {
+  uint64_t              index;
+  uint64_t              size;
+} avl_snapshot_record;
+
+struct avl_snapshot_tag {
+  const char *          base;
+  uint64_t              size;
+  unsigned long         count;
+  const uint64_t *      sorted;
+  const uint64_t *      eytzinger;
+  avl_key_compare_fun_type      compare_fun;
+  void *                compare_arg;
+};
+
+/* the tree's keys in order, and where their records go */
+typedef struct {
+  void **               keys;
+  uint64_t *            offsets;
+  unsigned long *       sizes;
+  /* index in key order of the record in every Eytzinger slot */
+  unsigned long *       slots;
+  unsigned long         count;
+} avl_snapshot_layout;
+
+static int
+avl_snapshot_collect (void * key, void * iter_arg)
+{
+  avl_snapshot_layout * layout = (avl_snapshot_layout *) iter_arg;
+
+  layout->keys[layout->count++] = key;
+  return 0;
+}
+
+static unsigned long
+avl_snapshot_fill (avl_snapshot_layout * layout, unsigned long slot, unsigned long next)
+{
+  if (slot <= layout->count) {
+    next = avl_snapshot_fill (layout, 2 * slot, next);
+    layout->slots[slot] = next++;
+    next = avl_snapshot_fill (layout, 2 * slot + 1, next);
+  }
+  return next;
+}
+
+static int
+avl_snapshot_write_records (FILE * file, avl_snapshot_layout * layout,
+        avl_key_encode_fun_type encode_fun, void * codec_arg)
+{
+  static const char pad[8] = { 0 };
+  unsigned long buffer_size = 0;
+  char * buffer = NULL;
+  unsigned long i;
+
+  for (i = 1; i <= layout->count; i++) {
+    avl_snapshot_record record;
+    unsigned long index = layout->slots[i];
+    unsigned long size = layout->sizes[index];
+
+    /* with room for the padding, which is cut off again below */
+    size = (unsigned long) (AVL_SNAPSHOT_ALIGN (sizeof (record) + size) - sizeof (record));
+    if (size > buffer_size) {
+      char * bigger = (char *) realloc (buffer, size);
+      if (!bigger) {
+        free (buffer);
+        return -1;
+      }
+      buffer = bigger;
+      buffer_size = size;
+    }
+    record.index = index;
+    record.size = encode_fun (codec_arg, layout->keys[index], buffer, size);
+    if (record.size != layout->sizes[index]
+        || fwrite (&record, sizeof (record), 1, file) != 1
+        || fwrite (buffer, 1, (size_t) record.size, file) != record.size
+        || fwrite (pad, 1, (size_t) (size - record.size), file) != size - record.size) {
+      free (buffer);
+      return -1;
+    }
+  }
+  free (buffer);
+  return 0;
+}
+
+/*
+ * The snapshot is written under a name of its own next to <filename>
+ * and renamed over it once complete.  That name carries the process id
+ * and a counter which goes up until O_EXCL creates a file nobody else
+ * is writing; <temporary> is left empty when none could be created.
+ */
+static FILE *
+avl_snapshot_create_temporary (const char * filename, char * temporary)
+{
+  unsigned int attempt;
+  FILE * file;
+  int fd = -1;
+
+  for (attempt = 0; attempt < 100 && fd < 0; attempt++) {
+#ifdef _WIN32
+    sprintf (temporary, "%s.%lu.%u.tmp", filename, (unsigned long) _getpid (), attempt);
+    fd = _open (temporary, _O_WRONLY | _O_CREAT | _O_EXCL | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    sprintf (temporary, "%s.%lu.%u.tmp", filename, (unsigned long) getpid (), attempt);
+    fd = open (temporary, O_WRONLY | O_CREAT | O_EXCL, 0666);
+#endif
+    if (fd < 0 && errno != EEXIST) {
+      break;
+    }
+  }
+  if (fd < 0) {
+    temporary[0] = '\0';
+    return NULL;
+  }
+#ifdef _WIN32
+  file = _fdopen (fd, "wb");
+  if (!file) {
+    _close (fd);
+  }
+#else
+  file = fdopen (fd, "wb");
+  if (!file) {
+    close (fd);
+  }
+#endif
+  if (!file) {
+    remove (temporary);
+    temporary[0] = '\0';
+  }
+  return file;
+}
+
+/* push the file's data to the disk before it is renamed into place */
+static int
+avl_snapshot_sync (FILE * file)
+{
+  if (fflush (file) != 0) {
+    return -1;
+  }
+#ifdef _WIN32
+  return _commit (_fileno (file));
+#else
+  return fsync (fileno (file));
+#endif
+}
+
+int
+avl_snapshot_write (avl_tree * tree,
+        const char * filename,
+        avl_key_encode_fun_type encode_fun,
+        void * codec_arg)
+{
+  avl_snapshot_header header;
+  avl_snapshot_layout layout;
+  uint64_t * eytzinger = NULL;
+  unsigned long count = tree->length;
+  uint64_t offset;
+  unsigned long i;
+  char * temporary;
+  FILE * file = NULL;
+  int result = -1;
+
+  memset (&layout, 0, sizeof (layout));
+  /* room for ".<pid>.<attempt>.tmp" */
+  temporary = (char *) malloc (strlen (filename) + 32);
+  if (temporary) {
+    temporary[0] = '\0';
+  }
+  layout.keys = (void **) malloc ((count ? count : 1) * sizeof (void *));
+  layout.offsets = (uint64_t *) malloc ((count ? count : 1) * sizeof (uint64_t));
+  layout.sizes = (unsigned long *) malloc ((count ? count : 1) * sizeof (unsigned long));
+  layout.slots = (unsigned long *) malloc ((count + 1) * sizeof (unsigned long));
+  eytzinger = (uint64_t *) malloc ((count + 1) * sizeof (uint64_t));
+  if (!temporary || !layout.keys || !layout.offsets || !layout.sizes || !layout.slots || !eytzinger) {
+    goto out;
+  }
+  avl_iterate_inorder (tree, avl_snapshot_collect, &layout);
+  if (layout.count != count) {
+    goto out;
+  }
+
+  memset (&header, 0, sizeof (header));
+  memcpy (header.magic, AVL_SNAPSHOT_MAGIC, sizeof (AVL_SNAPSHOT_MAGIC));
+  header.byte_order = AVL_SNAPSHOT_BYTE_ORDER;
+  header.format = AVL_SNAPSHOT_FORMAT;
+  header.count = count;
+  header.sorted = sizeof (header);
+  header.eytzinger = header.sorted + count * sizeof (uint64_t);
+  for (i = 0; i < count; i++) {
+    layout.sizes[i] = encode_fun (codec_arg, layout.keys[i], NULL, 0);
+  }
+  avl_snapshot_fill (&layout, 1, 0);
+  offset = header.eytzinger + (count + 1) * sizeof (uint64_t);
+  eytzinger[0] = 0;
+  for (i = 1; i <= count; i++) {
+    unsigned long index = layout.slots[i];
+    eytzinger[i] = layout.offsets[index] = offset;
+    offset += AVL_SNAPSHOT_ALIGN (sizeof (avl_snapshot_record) + layout.sizes[index]);
+  }
+  header.size = offset;
+
+  file = avl_snapshot_create_temporary (filename, temporary);
+  if (!file
+      || fwrite (&header, sizeof (header), 1, file) != 1
+      || fwrite (layout.offsets, sizeof (uint64_t), count, file) != count
+      || fwrite (eytzinger, sizeof (uint64_t), count + 1, file) != count + 1
+      || avl_snapshot_write_records (file, &layout, encode_fun, codec_arg) != 0
+      || avl_snapshot_sync (file) != 0) {
+    goto out;
+  }
+  result = fclose (file) == 0 ? 0 : -1;
+  file = NULL;
+#ifdef _WIN32
+  /* rename() does not replace files here */
+  if (result == 0) {
+    remove (filename);
+  }
+#endif
+  if (result == 0 && rename (temporary, filename) != 0) {
+    result = -1;
+  }
+
+out:
+  if (file) {
+    fclose (file);
+  }
+  if (result != 0 && temporary && temporary[0]) {
+    remove (temporary);
+  }
+  free (temporary);
+  free (layout.keys);
+  free (layout.offsets);
+  free (layout.sizes);
+  free (layout.slots);
+  free (eytzinger);
+  return result;
+}
+
+/* map the whole file read only, NULL on failure */
+static const char *
+avl_snapshot_map (const char * filename, uint64_t * size)
+{
+  const char * base;
+#ifdef _WIN32
+  HANDLE file, mapping;
+  LARGE_INTEGER file_size;
+
+  file = CreateFileA (filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file == INVALID_HANDLE_VALUE) {
+    return NULL;
+  }
+  if (!GetFileSizeEx (file, &file_size) || file_size.QuadPart < (LONGLONG) sizeof (avl_snapshot_header)) {
+    CloseHandle (file);
+    return NULL;
+  }
+  mapping = CreateFileMappingA (file, NULL, PAGE_READONLY, 0, 0, NULL);
+  CloseHandle (file);
+  if (!mapping) {
+    return NULL;
+  }
+  /* the view keeps the mapping alive */
+  base = (const char *) MapViewOfFile (mapping, FILE_MAP_READ, 0, 0, 0);
+  CloseHandle (mapping);
+  *size = (uint64_t) file_size.QuadPart;
+#else
+  struct stat st;
+  void * address;
+  int fd;
+
+  fd = open (filename, O_RDONLY);
+  if (fd == -1) {
+    return NULL;
+  }
+  if (fstat (fd, &st) != 0 || st.st_size < (off_t) sizeof (avl_snapshot_header)
+      || (uint64_t) st.st_size != (uint64_t) (size_t) st.st_size) {
+    close (fd);
+    return NULL;
+  }
+  address = mmap (NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (address == MAP_FAILED) {
+    return NULL;
+  }
+  base = (const char *) address;
+  *size = (uint64_t) st.st_size;
+#endif
+  return base;
+}
+
+static void
+avl_snapshot_unmap (const char * base, uint64_t size)
+{
+#ifdef _WIN32
+  UnmapViewOfFile (base);
+#else
+  munmap ((void *) base, (size_t) size);
+#endif
+}
+
+avl_snapshot *
+avl_snapshot_open (const char * filename,
+        avl_key_compare_fun_type compare_fun,
+        void * compare_arg)
+{
+  const avl_snapshot_header * header;
+  avl_snapshot * snapshot;
+  const char * base;
+  uint64_t size;
+
+  base = avl_snapshot_map (filename, &size);
+  if (!base) {
+    return NULL;
+  }
+  header = (const avl_snapshot_header *) base;
+  if (memcmp (header->magic, AVL_SNAPSHOT_MAGIC, sizeof (AVL_SNAPSHOT_MAGIC)) != 0
+      || header->byte_order != AVL_SNAPSHOT_BYTE_ORDER
+      || header->format != AVL_SNAPSHOT_FORMAT
+      || header->size != size
+      || header->count > size / sizeof (uint64_t)
+      || header->count != (unsigned long) header->count
+      || header->sorted != sizeof (avl_snapshot_header)
+      || header->eytzinger != header->sorted + header->count * sizeof (uint64_t)
+      || header->eytzinger + (header->count + 1) * sizeof (uint64_t) > size) {
+    avl_snapshot_unmap (base, size);
+    return NULL;
+  }
+
+  snapshot = (avl_snapshot *) malloc (sizeof (avl_snapshot));
+  if (!snapshot) {
+    avl_snapshot_unmap (base, size);
+    return NULL;
+  }
+  snapshot->base = base;
+  snapshot->size = size;
+  snapshot->count = (unsigned long) header->count;
+  snapshot->sorted = (const uint64_t *) (base + header->sorted);
+  snapshot->eytzinger = (const uint64_t *) (base + header->eytzinger);
+  snapshot->compare_fun = compare_fun;
+  snapshot->compare_arg = compare_arg;
+  return snapshot;
+}
+
+void
+avl_snapshot_close (avl_snapshot * snapshot)
+{
+  avl_snapshot_unmap (snapshot->base, snapshot->size);
+  free (snapshot);
+}
+
+unsigned long
+avl_snapshot_length (avl_snapshot * snapshot)
+{
+  return snapshot->count;
+}
+
+unsigned long
+avl_snapshot_record_size (const void * record)
+{
+  return (unsigned long) (((const avl_snapshot_record *) record) - 1)->size;
+}
+
+static const avl_snapshot_record *
+avl_snapshot_record_at (avl_snapshot * snapshot, uint64_t offset)
+{
+  return (const avl_snapshot_record *) (snapshot->base + offset);
+}
+
+/*
+ * Index of the first record not less than (<upper> unset) or greater
+ * than (<upper> set) <key>.  Same descent as avl_frozen_get_by_key().
+ */
+static unsigned long
+avl_snapshot_get_bound (avl_snapshot * snapshot, void * key, int upper)
+{
+  const uint64_t * eytzinger = snapshot->eytzinger;
+  unsigned long n = snapshot->count;
+  unsigned long k = 1;
+
+  while (k <= n) {
+    const avl_snapshot_record * record = avl_snapshot_record_at (snapshot, eytzinger[k]);
+    int compare_result;
+#ifdef __GNUC__
+    /* the offsets four levels down, and the records two levels down,
+     * whose offsets were fetched two levels ago
+     */
+    if (16 * k <= n) {
+      __builtin_prefetch (eytzinger + 16 * k);
+    }
+    if (4 * k + 3 <= n) {
+      __builtin_prefetch (snapshot->base + eytzinger[4 * k]);
+      __builtin_prefetch (snapshot->base + eytzinger[4 * k + 1]);
+      __builtin_prefetch (snapshot->base + eytzinger[4 * k + 2]);
+      __builtin_prefetch (snapshot->base + eytzinger[4 * k + 3]);
+    }
+#endif
+    compare_result = snapshot->compare_fun (snapshot->compare_arg, key, (void *) (record + 1));
+    k = 2 * k + (compare_result > 0 || (upper && compare_result == 0));
+  }
+#ifdef __GNUC__
+  k >>= __builtin_ffsl ((long) ~k);
+#else
+  while (k & 1) {
+    k >>= 1;
+  }
+  k >>= 1;
+#endif
+  if (!k) {
+    return n;
+  }
+  return (unsigned long) avl_snapshot_record_at (snapshot, eytzinger[k])->index;
+}
+
+int
+avl_snapshot_get_by_index (avl_snapshot * snapshot, unsigned long index, void ** value_address)
+{
+  if (index >= snapshot->count) {
+    return -1;
+  }
+  *value_address = (void *) (avl_snapshot_record_at (snapshot, snapshot->sorted[index]) + 1);
+  return 0;
+}
+
+int
+avl_snapshot_get_by_key (avl_snapshot * snapshot, void * key, void ** value_address)
+{
+  void * record;
+
+  if (avl_snapshot_get_by_index (snapshot, avl_snapshot_get_bound (snapshot, key, 0), &record) != 0
+      || snapshot->compare_fun (snapshot->compare_arg, key, record) != 0) {
+    return -1;
+  }
+  *value_address = record;
+  return 0;
+}
+
+int
+avl_snapshot_get_item_by_key_most (avl_snapshot * snapshot, void * key, void ** value_address)
+{
+  unsigned long index = avl_snapshot_get_bound (snapshot, key, 1);
+
+  *value_address = NULL;
+  if (!index) {
+    return -1;
+  }
+  return avl_snapshot_get_by_index (snapshot, index - 1, value_address);
+}
+
+int
+avl_snapshot_get_item_by_key_least (avl_snapshot * snapshot, void * key, void ** value_address)
+{
+  *value_address = NULL;
+  return avl_snapshot_get_by_index (snapshot, avl_snapshot_get_bound (snapshot, key, 0), value_address);
+}
+
+int
+avl_snapshot_get_span_by_key (avl_snapshot * snapshot,
+        void * key,
+        unsigned long * low,
+        unsigned long * high)
+{
+  unsigned long i = avl_snapshot_get_bound (snapshot, key, 0);
+  unsigned long j = avl_snapshot_get_bound (snapshot, key, 1);
+
+  if (i == j) {
+    /* the index of the closest preceding key, like avl_get_span_by_key() */
+    *low = *high = i - 1;
+  } else {
+    *low = i;
+    *high = j;
+  }
+  return 0;
+}
+
+int
+avl_snapshot_get_span_by_two_keys (avl_snapshot * snapshot,
+        void * key_a,
+        void * key_b,
+        unsigned long * low,
+        unsigned long * high)
+{
+  unsigned long low_a = avl_snapshot_get_bound (snapshot, key_a, 0);
+  unsigned long high_a = avl_snapshot_get_bound (snapshot, key_a, 1);
+  unsigned long low_b = avl_snapshot_get_bound (snapshot, key_b, 0);
+  unsigned long high_b = avl_snapshot_get_bound (snapshot, key_b, 1);
+
+  /* search keys cannot be compared with each other, their bounds can */
+  if (low_a > low_b || (low_a == low_b && high_a > high_b)) {
+    *low = low_b;
+    *high = (high_a > low_a) ? high_a - 1 : low_a;
+  } else {
+    *low = low_a;
+    *high = (high_b > low_b) ? high_b - 1 : low_b;
+  }
+  return 0;
+}
+
+int
+avl_snapshot_verify (avl_snapshot * snapshot)
+{
+  /* records start behind the Eytzinger table and do not overlap */
+  uint64_t start = (uint64_t) ((const char *) (snapshot->eytzinger + snapshot->count + 1) - snapshot->base);
+  unsigned long i;
+
+  for (i = 1; i <= snapshot->count; i++) {
+    uint64_t offset = snapshot->eytzinger[i];
+    const avl_snapshot_record * record;
+
+    if (offset < start || offset % 8 != 0 || offset > snapshot->size - sizeof (avl_snapshot_record)) {
+      return -1;
+    }
+    record = avl_snapshot_record_at (snapshot, offset);
+    if (record->size > snapshot->size - offset - sizeof (avl_snapshot_record)
+        || record->index >= snapshot->count || snapshot->sorted[record->index] != offset) {
+      return -1;
+    }
+    start = offset + sizeof (avl_snapshot_record) + record->size;
+  }
+  return 0;
+}
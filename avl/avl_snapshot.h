@@ -0,0 +1,99 @@
+/* avl_snapshot.h
+**
+** avl trees written to files that are mapped and searched in place
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Library General Public
+** License as published by the Free Software Foundation; either
+** version 2 of the License, or (at your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Library General Public License for more details.
+**
+** You should have received a copy of the GNU Library General Public
+** License along with this library; if not, write to the
+** Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+** Boston, MA  02110-1301, USA.
+**
+*/
+
+#ifndef __AVL_SNAPSHOT_H
+#define __AVL_SNAPSHOT_H
+
+#include "avl.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A snapshot is the content of an avl_tree written to a file by a
+ * caller supplied codec, in a form that needs no pointers: opening one
+ * maps the file and reads its header, nothing else, and all searches run
+ * on the mapping.  The "keys" handed out are the records as the codec
+ * wrote them, 8 byte aligned and read only, and stay valid until
+ * avl_snapshot_close().  The compare function given to avl_snapshot_open()
+ * is called as compare_fun (compare_arg, key, record) with <key> being
+ * what the caller searches for; it has to order records like the tree's
+ * own compare function ordered their keys.  Snapshots never change, so
+ * any number of threads may search one without locking.  The format uses
+ * the byte order of the machine that wrote it and is refused elsewhere.
+ */
+typedef struct avl_snapshot_tag avl_snapshot;
+
+/* Encode <key> into <buffer> if <size> is large enough and return the
+ * number of bytes the record takes in any case.  Called twice per key
+ * with the same result expected, the first time with a NULL <buffer>.
+ */
+typedef unsigned long (*avl_key_encode_fun_type) (void * codec_arg, void * key, void * buffer, unsigned long size);
+
+#ifdef _mangle
+# define avl_snapshot_write _mangle(avl_snapshot_write)
+# define avl_snapshot_open _mangle(avl_snapshot_open)
+# define avl_snapshot_close _mangle(avl_snapshot_close)
+# define avl_snapshot_length _mangle(avl_snapshot_length)
+# define avl_snapshot_record_size _mangle(avl_snapshot_record_size)
+# define avl_snapshot_get_by_index _mangle(avl_snapshot_get_by_index)
+# define avl_snapshot_get_by_key _mangle(avl_snapshot_get_by_key)
+# define avl_snapshot_get_item_by_key_most _mangle(avl_snapshot_get_item_by_key_most)
+# define avl_snapshot_get_item_by_key_least _mangle(avl_snapshot_get_item_by_key_least)
+# define avl_snapshot_get_span_by_key _mangle(avl_snapshot_get_span_by_key)
+# define avl_snapshot_get_span_by_two_keys _mangle(avl_snapshot_get_span_by_two_keys)
+# define avl_snapshot_verify _mangle(avl_snapshot_verify)
+#endif
+
+/* writes to a new file next to <filename>, syncs it and renames it over
+ * <filename> when complete; hold the tree's read lock around the call
+ */
+int avl_snapshot_write(avl_tree *tree, const char *filename,
+        avl_key_encode_fun_type encode_fun, void *codec_arg);
+
+/* only the header is checked, see avl_snapshot_verify() */
+avl_snapshot *avl_snapshot_open(const char *filename,
+        avl_key_compare_fun_type compare_fun, void *compare_arg);
+void avl_snapshot_close(avl_snapshot *snapshot);
+
+unsigned long avl_snapshot_length(avl_snapshot *snapshot);
+/* the size the codec returned for <record> */
+unsigned long avl_snapshot_record_size(const void *record);
+
+/* same results as the avl_tree functions of the same names */
+int avl_snapshot_get_by_index(avl_snapshot *snapshot, unsigned long index, void **value_address);
+int avl_snapshot_get_by_key(avl_snapshot *snapshot, void *key, void **value_address);
+int avl_snapshot_get_item_by_key_most(avl_snapshot *snapshot, void *key, void **value_address);
+int avl_snapshot_get_item_by_key_least(avl_snapshot *snapshot, void *key, void **value_address);
+int avl_snapshot_get_span_by_key(avl_snapshot *snapshot, void *key,
+        unsigned long *low, unsigned long *high);
+int avl_snapshot_get_span_by_two_keys(avl_snapshot *snapshot, void *key_a, void *key_b,
+        unsigned long *low, unsigned long *high);
+
+/* walks every record and checks it lies within the file, -1 if not */
+int avl_snapshot_verify(avl_snapshot *snapshot);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __AVL_SNAPSHOT_H */
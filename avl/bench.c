@@ -0,0 +1,473 @@
+/* bench.c
+**
+** microbenchmarks for the avl library
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Library General Public
+** License as published by the Free Software Foundation; either
+** version 2 of the License, or (at your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Library General Public License for more details.
+**
+** You should have received a copy of the GNU Library General Public
+** License along with this library; if not, write to the
+** Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+** Boston, MA  02110-1301, USA.
+**
+*/
+
+/*
+ * Usage: avlbench [-n size,size,...] [-f flags] [-t threads] [-r read%]
+ *
+ * For every tree size, runs each operation over the whole tree and
+ * prints the mean cost per operation next to percentiles.  Reading the
+ * clock around every single call would cost as much as a lookup, so the
+ * percentiles are taken over batches of AVL_BENCH_BATCH operations: a
+ * p99 of 200ns means 1% of the batches averaged 200ns or more per call.
+ * <flags> are passed to avl_tree_new_ex(), e.g. 1 for slab or 4 for
+ * btree trees.  The threaded mix has every thread look keys up under
+ * the read lock and, <read%> of the time not, insert or delete a key of
+ * its own under the write lock; its ns/op is the wall clock time divided
+ * by the calls of all threads, the percentiles are per thread.
+ */
+
+#ifdef HAVE_CONFIG_H
+ #include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+# include <windows.h>
+#else
+# include <time.h>
+#endif
+
+#include "avl.h"
+
+#define AVL_BENCH_BATCH         (32)
+#define AVL_BENCH_MAX_THREADS   (64)
+/* calls per lookup benchmark, whatever the size of the tree */
+#define AVL_BENCH_LOOKUPS       (1000000UL)
+
+typedef struct {
+  double *              samples;
+  unsigned long         count;
+  unsigned long         size;
+  unsigned long long    start;
+  unsigned long long    total;
+  unsigned long         ops;
+} avl_bench_timer;
+
+typedef struct {
+  avl_tree *            tree;
+  unsigned long         keys;
+  unsigned long         ops;
+  unsigned int          id;
+  unsigned int          threads;
+  unsigned int          read_percent;
+  avl_bench_timer       timer;
+} avl_bench_worker;
+
+static unsigned long long
+avl_bench_clock (void)
+{
+#ifdef _WIN32
+  static LARGE_INTEGER frequency;
+  LARGE_INTEGER now;
+
+  if (!frequency.QuadPart) {
+    QueryPerformanceFrequency (&frequency);
+  }
+  QueryPerformanceCounter (&now);
+  return (unsigned long long) ((double) now.QuadPart * 1e9 / (double) frequency.QuadPart);
+#else
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (unsigned long long) now.tv_sec * 1000000000ULL + (unsigned long long) now.tv_nsec;
+#endif
+}
+
+/* xorshift64*, one state per thread */
+static unsigned long long
+avl_bench_random (unsigned long long * state)
+{
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 2685821657736338717ULL;
+}
+
+/* keys are the numbers 1..n cast to pointers, never NULL */
+static int
+avl_bench_compare (void * compare_arg, void * a, void * b)
+{
+  unsigned long x = (unsigned long) a, y = (unsigned long) b;
+
+  return (x > y) - (x < y);
+}
+
+static int
+avl_bench_visit (void * key, void * iter_arg)
+{
+  *(unsigned long *) iter_arg += (unsigned long) key;
+  return 0;
+}
+
+static int
+avl_bench_timer_init (avl_bench_timer * timer, unsigned long ops)
+{
+  timer->size = ops / AVL_BENCH_BATCH + 2;
+  timer->samples = (double *) malloc (timer->size * sizeof (double));
+  timer->count = 0;
+  timer->total = 0;
+  timer->ops = 0;
+  return timer->samples ? 0 : -1;
+}
+
+static void
+avl_bench_timer_start (avl_bench_timer * timer)
+{
+  timer->start = avl_bench_clock ();
+}
+
+/* close a batch of <ops> calls begun with avl_bench_timer_start() */
+static void
+avl_bench_timer_stop (avl_bench_timer * timer, unsigned long ops)
+{
+  unsigned long long elapsed = avl_bench_clock () - timer->start;
+
+  if (ops && timer->count < timer->size) {
+    timer->samples[timer->count++] = (double) elapsed / (double) ops;
+  }
+  timer->total += elapsed;
+  timer->ops += ops;
+}
+
+static int
+avl_bench_compare_samples (const void * a, const void * b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+
+  return (x > y) - (x < y);
+}
+
+static double
+avl_bench_percentile (avl_bench_timer * timer, double p)
+{
+  unsigned long i = (unsigned long) (p * (double) (timer->count - 1) + 0.5);
+
+  return timer->samples[i];
+}
+
+/* <elapsed> is the wall clock time for all threads, 0 to use the timer's */
+static void
+avl_bench_report (const char * name, unsigned long keys, avl_bench_timer * timer,
+                  unsigned long long elapsed)
+{
+  if (!timer->ops || !timer->count) {
+    return;
+  }
+  qsort (timer->samples, timer->count, sizeof (double), avl_bench_compare_samples);
+  fprintf (stdout, "%-14s %9lu %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+           name, keys,
+           (double) (elapsed ? elapsed : timer->total) / (double) timer->ops,
+           avl_bench_percentile (timer, 0.5),
+           avl_bench_percentile (timer, 0.9),
+           avl_bench_percentile (timer, 0.99),
+           timer->samples[timer->count - 1]);
+}
+
+/* the keys 1..n in random order */
+static unsigned long *
+avl_bench_shuffled (unsigned long n, unsigned long long * state)
+{
+  unsigned long * keys = (unsigned long *) malloc (n * sizeof (unsigned long));
+  unsigned long i;
+
+  if (!keys) {
+    return NULL;
+  }
+  for (i = 0; i < n; i++) {
+    keys[i] = i + 1;
+  }
+  for (i = n; i > 1; i--) {
+    unsigned long j = (unsigned long) (avl_bench_random (state) % i);
+    unsigned long temp = keys[i - 1];
+    keys[i - 1] = keys[j];
+    keys[j] = temp;
+  }
+  return keys;
+}
+
+static avl_tree *
+avl_bench_fill (unsigned long * keys, unsigned long n, unsigned int flags,
+                const char * name, avl_bench_timer * timer)
+{
+  avl_tree * tree = avl_tree_new_ex (avl_bench_compare, NULL, flags);
+  unsigned long i, j;
+
+  if (!tree) {
+    return NULL;
+  }
+  avl_bench_timer_init (timer, n);
+  for (i = 0; i < n; i += AVL_BENCH_BATCH) {
+    unsigned long end = i + AVL_BENCH_BATCH < n ? i + AVL_BENCH_BATCH : n;
+    avl_bench_timer_start (timer);
+    for (j = i; j < end; j++) {
+      avl_insert (tree, (void *) keys[j]);
+    }
+    avl_bench_timer_stop (timer, end - i);
+  }
+  avl_bench_report (name, n, timer, 0);
+  free (timer->samples);
+  return tree;
+}
+
+static void
+avl_bench_single (unsigned long n, unsigned int flags)
+{
+  unsigned long long state = 0x9e3779b97f4a7c15ULL ^ n;
+  unsigned long * keys, * sequential;
+  avl_bench_timer timer;
+  avl_tree * tree;
+  unsigned long i, j, low, high, sum = 0;
+  void * value;
+
+  keys = avl_bench_shuffled (n, &state);
+  sequential = (unsigned long *) malloc (n * sizeof (unsigned long));
+  if (!keys || !sequential) {
+    fprintf (stderr, "out of memory for %lu keys\n", n);
+    exit (1);
+  }
+  for (i = 0; i < n; i++) {
+    sequential[i] = i + 1;
+  }
+
+  tree = avl_bench_fill (sequential, n, flags, "insert_seq", &timer);
+  if (!tree) {
+    fprintf (stderr, "cannot create a tree with flags %u\n", flags);
+    exit (1);
+  }
+  avl_tree_free (tree, NULL);
+  tree = avl_bench_fill (keys, n, flags, "insert_rand", &timer);
+
+  avl_bench_timer_init (&timer, AVL_BENCH_LOOKUPS);
+  for (i = 0; i < AVL_BENCH_LOOKUPS; i += AVL_BENCH_BATCH) {
+    avl_bench_timer_start (&timer);
+    for (j = 0; j < AVL_BENCH_BATCH; j++) {
+      sum += avl_get_by_key (tree, (void *) (avl_bench_random (&state) % n + 1), &value);
+    }
+    avl_bench_timer_stop (&timer, AVL_BENCH_BATCH);
+  }
+  avl_bench_report ("get_by_key", n, &timer, 0);
+
+  timer.count = timer.total = timer.ops = 0;
+  for (i = 0; i < AVL_BENCH_LOOKUPS; i += AVL_BENCH_BATCH) {
+    avl_bench_timer_start (&timer);
+    for (j = 0; j < AVL_BENCH_BATCH; j++) {
+      sum += avl_get_by_index (tree, (unsigned long) (avl_bench_random (&state) % n), &value);
+    }
+    avl_bench_timer_stop (&timer, AVL_BENCH_BATCH);
+  }
+  avl_bench_report ("get_by_index", n, &timer, 0);
+
+  timer.count = timer.total = timer.ops = 0;
+  for (i = 0; i < AVL_BENCH_LOOKUPS; i += AVL_BENCH_BATCH) {
+    avl_bench_timer_start (&timer);
+    for (j = 0; j < AVL_BENCH_BATCH; j++) {
+      unsigned long a = (unsigned long) (avl_bench_random (&state) % n + 1);
+      avl_get_span_by_two_keys (tree, (void *) a, (void *) (a + 100), &low, &high);
+      sum += high - low;
+    }
+    avl_bench_timer_stop (&timer, AVL_BENCH_BATCH);
+  }
+  avl_bench_report ("span", n, &timer, 0);
+  free (timer.samples);
+
+  /* one sample per walk, counted per key */
+  avl_bench_timer_init (&timer, AVL_BENCH_BATCH * 16);
+  for (i = 0; i < 16 && i * n < 16 * AVL_BENCH_LOOKUPS; i++) {
+    avl_bench_timer_start (&timer);
+    avl_iterate_inorder (tree, avl_bench_visit, &sum);
+    avl_bench_timer_stop (&timer, n);
+  }
+  avl_bench_report ("iterate", n, &timer, 0);
+  free (timer.samples);
+
+  /* delete in an order unrelated to the inserts */
+  for (i = n; i > 1; i--) {
+    unsigned long k = (unsigned long) (avl_bench_random (&state) % i);
+    unsigned long temp = keys[i - 1];
+    keys[i - 1] = keys[k];
+    keys[k] = temp;
+  }
+  avl_bench_timer_init (&timer, n);
+  for (i = 0; i < n; i += AVL_BENCH_BATCH) {
+    unsigned long end = i + AVL_BENCH_BATCH < n ? i + AVL_BENCH_BATCH : n;
+    avl_bench_timer_start (&timer);
+    for (j = i; j < end; j++) {
+      avl_delete (tree, (void *) keys[j], NULL);
+    }
+    avl_bench_timer_stop (&timer, end - i);
+  }
+  avl_bench_report ("delete_rand", n, &timer, 0);
+  free (timer.samples);
+  avl_tree_free (tree, NULL);
+
+  free (keys);
+  free (sequential);
+  /* keep the compiler from dropping the lookups */
+  if (sum == 1) {
+    fprintf (stdout, "\n");
+  }
+}
+
+#ifndef NO_THREAD
+/* even keys are shared, a worker inserts and deletes odd ones of its own */
+static void *
+avl_bench_worker_run (void * arg)
+{
+  avl_bench_worker * worker = (avl_bench_worker *) arg;
+  unsigned long long state = 0x2545f4914f6cdd1dULL * (worker->id + 1);
+  unsigned long own = 0, i, j;
+  void * value;
+
+  for (i = 0; i < worker->ops; i += AVL_BENCH_BATCH) {
+    avl_bench_timer_start (&worker->timer);
+    for (j = 0; j < AVL_BENCH_BATCH; j++) {
+      if (avl_bench_random (&state) % 100 < worker->read_percent) {
+        avl_tree_rlock (worker->tree);
+        avl_get_by_key (worker->tree, (void *) (2 * (avl_bench_random (&state) % worker->keys) + 2), &value);
+        avl_tree_unlock (worker->tree);
+      } else {
+        /* alternate between adding a key and taking it out again */
+        unsigned long key = 2 * ((own / 2) * worker->threads + worker->id) + 1;
+        avl_tree_wlock (worker->tree);
+        if (own % 2 == 0) {
+          avl_insert (worker->tree, (void *) key);
+        } else {
+          avl_delete (worker->tree, (void *) key, NULL);
+        }
+        avl_tree_unlock (worker->tree);
+        own++;
+      }
+    }
+    avl_bench_timer_stop (&worker->timer, AVL_BENCH_BATCH);
+  }
+  return NULL;
+}
+
+static void
+avl_bench_threads (unsigned long n, unsigned int flags, unsigned int threads, unsigned int read_percent)
+{
+  avl_bench_worker workers[AVL_BENCH_MAX_THREADS];
+  thread_type * handles[AVL_BENCH_MAX_THREADS];
+  avl_bench_timer all;
+  unsigned long long start, elapsed;
+  avl_tree * tree = avl_tree_new_ex (avl_bench_compare, NULL, flags);
+  unsigned long ops = AVL_BENCH_LOOKUPS / threads, i;
+  unsigned int t;
+  char name[32];
+
+  if (!tree) {
+    return;
+  }
+  for (i = 0; i < n; i++) {
+    avl_insert (tree, (void *) (2 * i + 2));
+  }
+  for (t = 0; t < threads; t++) {
+    workers[t].tree = tree;
+    workers[t].keys = n;
+    workers[t].ops = ops;
+    workers[t].id = t;
+    workers[t].threads = threads;
+    workers[t].read_percent = read_percent;
+    avl_bench_timer_init (&workers[t].timer, ops);
+  }
+  start = avl_bench_clock ();
+  for (t = 0; t < threads; t++) {
+    handles[t] = thread_create ("avl bench", avl_bench_worker_run, &workers[t], THREAD_ATTACHED);
+  }
+  for (t = 0; t < threads; t++) {
+    if (handles[t]) {
+      thread_join (handles[t]);
+    }
+  }
+  elapsed = avl_bench_clock () - start;
+
+  /* merge the batches of all threads, wall time over all calls */
+  avl_bench_timer_init (&all, ops * threads);
+  for (t = 0; t < threads; t++) {
+    memcpy (all.samples + all.count, workers[t].timer.samples, workers[t].timer.count * sizeof (double));
+    all.count += workers[t].timer.count;
+    all.ops += workers[t].timer.ops;
+    free (workers[t].timer.samples);
+  }
+  snprintf (name, sizeof (name), "mix%u_%ut", read_percent, threads);
+  avl_bench_report (name, n, &all, elapsed);
+  free (all.samples);
+  avl_tree_free (tree, NULL);
+}
+#endif
+
+int
+main (int argc, char ** argv)
+{
+  const char * sizes = "1000,10000,100000,1000000";
+  unsigned int flags = 0, threads = 4, read_percent = 90;
+  const char * p;
+  int i;
+
+  for (i = 1; i + 1 < argc; i += 2) {
+    if (!strcmp (argv[i], "-n")) {
+      sizes = argv[i + 1];
+    } else if (!strcmp (argv[i], "-f")) {
+      flags = (unsigned int) strtoul (argv[i + 1], NULL, 0);
+    } else if (!strcmp (argv[i], "-t")) {
+      threads = (unsigned int) atoi (argv[i + 1]);
+    } else if (!strcmp (argv[i], "-r")) {
+      read_percent = (unsigned int) atoi (argv[i + 1]);
+    } else {
+      break;
+    }
+  }
+  if (i < argc || threads < 1 || threads > AVL_BENCH_MAX_THREADS || read_percent > 100) {
+    fprintf (stderr, "usage: %s [-n size,size,...] [-f flags] [-t threads] [-r read%%]\n", argv[0]);
+    return 1;
+  }
+#ifndef NO_THREAD
+  thread_initialize ();
+#endif
+
+  fprintf (stdout, "%-14s %9s %9s %9s %9s %9s %9s\n",
+           "benchmark", "keys", "ns/op", "p50", "p90", "p99", "max");
+  for (p = sizes; *p; ) {
+    unsigned long n = strtoul (p, (char **) &p, 10);
+    if (n) {
+      avl_bench_single (n, flags);
+#ifndef NO_THREAD
+      avl_bench_threads (n, flags, 1, read_percent);
+      if (threads > 1) {
+        avl_bench_threads (n, flags, threads, read_percent);
+      }
+#endif
+    }
+    while (*p == ',' || *p == ' ') {
+      p++;
+    }
+    if (*p && (*p < '0' || *p > '9')) {
+      break;
+    }
+  }
+
+#ifndef NO_THREAD
+  thread_shutdown ();
+#endif
+  return 0;
+}
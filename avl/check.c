@@ -0,0 +1,1718 @@
+/* check.c
+**
+** behaviour checks for the avl library, run by "make check"
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Library General Public
+** License as published by the Free Software Foundation; either
+** version 2 of the License, or (at your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Library General Public License for more details.
+**
+** You should have received a copy of the GNU Library General Public
+** License along with this library; if not, write to the
+** Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+** Boston, MA  02110-1301, USA.
+**
+*/
+
+/*
+ * Every check builds its trees from fixed key sequences and compares
+ * what the API returns against a plain sorted array, so a run never
+ * depends on timing or on rand().  Keys are longs stored in the key
+ * pointers.  A failed check prints its line and the program exits with
+ * 1 once all checks ran.
+ */
+
+#ifdef HAVE_CONFIG_H
+ #include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "avl.h"
+#include "avl_shard.h"
+#include "avl_snapshot.h"
+
+#define AVL_CHECK(expr) avl_check ((expr) != 0, #expr, __LINE__)
+
+#define AVL_KEY(n)              ((void *) (long) (n))
+
+static unsigned long avl_check_failed = 0;
+/* keys handed to avl_check_free_key() so far */
+static unsigned long avl_check_freed = 0;
+
+static void
+avl_check (int ok, const char * expr, int line)
+{
+  if (!ok) {
+    fprintf (stderr, "check.c:%d: %s failed\n", line, expr);
+    avl_check_failed++;
+  }
+}
+
+static int
+avl_check_compare (void * compare_arg, void * a, void * b)
+{
+  return AVL_COMPARE_INTPTR (a, b);
+}
+
+static int
+avl_check_free_key (void * key)
+{
+  avl_check_freed++;
+  return 1;
+}
+
+typedef struct {
+  long *                keys;
+  unsigned long         count;
+  unsigned long         size;
+} avl_check_list;
+
+static int
+avl_check_collect (void * key, void * iter_arg)
+{
+  avl_check_list * list = (avl_check_list *) iter_arg;
+
+  if (list->count < list->size) {
+    list->keys[list->count] = (long) key;
+  }
+  list->count++;
+  return 0;
+}
+
+/* whether the keys a walk handed to avl_check_collect() are <expect> */
+static int
+avl_check_same (avl_check_list * list, const long * expect, unsigned long count)
+{
+  return list->count == count &&
+    memcmp (list->keys, expect, count * sizeof (long)) == 0;
+}
+
+/* the in order walk of <tree> against the sorted <expect> */
+static int
+avl_check_inorder (avl_tree * tree, const long * expect, unsigned long count)
+{
+  long keys[1024];
+  avl_check_list list;
+
+  list.keys = keys;
+  list.count = 0;
+  list.size = sizeof (keys) / sizeof (keys[0]);
+  if (avl_iterate_inorder (tree, avl_check_collect, &list) != 0) {
+    return 0;
+  }
+  return tree->length == count && avl_check_same (&list, expect, count);
+}
+
+/*
+ * RCU readers see every published key, and a key deleted while a
+ * reader is inside its section is only freed once the section ended
+ * and a grace period passed.
+ */
+static void
+avl_check_rcu (void)
+{
+  avl_tree * tree = avl_tree_new_ex (avl_check_compare, NULL, AVL_TREE_FLAG_RCU);
+  long expect[100];
+  long keys[100];
+  avl_check_list list;
+  unsigned int token;
+  void * value;
+  long i;
+
+  if (!tree) {
+    /* no RCU with this compiler */
+    return;
+  }
+  for (i = 0; i < 100; i++) {
+    /* 0, 37, 74, 11, ... visits every residue of 100 once */
+    avl_tree_wlock (tree);
+    AVL_CHECK (avl_insert (tree, AVL_KEY ((i * 37) % 100)) == 0);
+    avl_tree_unlock (tree);
+    expect[i] = i;
+  }
+
+  token = avl_rcu_read_lock (tree);
+  AVL_CHECK (avl_rcu_get_by_key (tree, AVL_KEY (42), &value) == 0 && value == AVL_KEY (42));
+  AVL_CHECK (avl_rcu_get_by_key (tree, AVL_KEY (100), &value) != 0);
+  AVL_CHECK (avl_rcu_get_by_index (tree, 17, &value) == 0 && value == AVL_KEY (17));
+  AVL_CHECK (avl_rcu_get_by_index (tree, 100, &value) != 0);
+  list.keys = keys;
+  list.count = 0;
+  list.size = 100;
+  AVL_CHECK (avl_rcu_iterate_inorder (tree, avl_check_collect, &list) == 0);
+  AVL_CHECK (avl_check_same (&list, expect, 100));
+  avl_rcu_read_unlock (tree, token);
+
+  /* a reader inside its section keeps the deleted key alive */
+  avl_check_freed = 0;
+  token = avl_rcu_read_lock (tree);
+  avl_tree_wlock (tree);
+  AVL_CHECK (avl_delete (tree, AVL_KEY (50), avl_check_free_key) == 0);
+  avl_tree_unlock (tree);
+  AVL_CHECK (avl_rcu_get_by_key (tree, AVL_KEY (50), &value) != 0);
+  AVL_CHECK (avl_check_freed == 0);
+  avl_rcu_read_unlock (tree, token);
+  avl_rcu_synchronize (tree);
+  AVL_CHECK (avl_check_freed == 1);
+
+  memmove (&expect[50], &expect[51], 49 * sizeof (long));
+  AVL_CHECK (avl_check_inorder (tree, expect, 99));
+  AVL_CHECK (avl_verify (tree) == 0);
+  avl_tree_free (tree, NULL);
+}
+
+/* keys behind pointers, freed when deleted, for engines keeping copies */
+static int
+avl_check_compare_heap (void * compare_arg, void * a, void * b)
+{
+  return AVL_COMPARE_INTPTR (*(long *) a, *(long *) b);
+}
+
+static int
+avl_check_free_heap (void * key)
+{
+  free (key);
+  return 1;
+}
+
+/*
+ * B+tree trees, grown far enough for inner nodes to split and merge,
+ * then bulk loaded.  Separators point at keys of the caller, so the
+ * last part deletes heap keys, the first of every leaf among them, and
+ * looks the others up again; a separator left on a freed key shows up
+ * under a memory checker.
+ */
+static void
+avl_check_btree (void)
+{
+  avl_tree * tree = avl_tree_new_ex (avl_check_compare, NULL, AVL_TREE_FLAG_BTREE);
+  static long expect[1000];
+  static void * keys[1000];
+  unsigned long count;
+  void * value;
+  long i;
+
+  AVL_CHECK (tree != NULL);
+  for (i = 0; i < 1000; i++) {
+    AVL_CHECK (avl_insert (tree, AVL_KEY ((i * 389) % 1000)) == 0);
+    expect[i] = i;
+  }
+  AVL_CHECK (avl_check_inorder (tree, expect, 1000));
+  AVL_CHECK (avl_verify (tree) == 0);
+
+  /* every third key goes, leaves borrow and merge on the way */
+  avl_check_freed = 0;
+  for (i = 0; i < 1000; i += 3) {
+    AVL_CHECK (avl_delete (tree, AVL_KEY (i), avl_check_free_key) == 0);
+  }
+  AVL_CHECK (avl_check_freed == 334);
+  AVL_CHECK (avl_delete (tree, AVL_KEY (3), NULL) != 0);
+  for (i = 0, count = 0; i < 1000; i++) {
+    if (i % 3) {
+      expect[count++] = i;
+    }
+  }
+  AVL_CHECK (avl_check_inorder (tree, expect, count));
+  AVL_CHECK (avl_verify (tree) == 0);
+  AVL_CHECK (avl_get_by_key (tree, AVL_KEY (500), &value) == 0 && value == AVL_KEY (500));
+  AVL_CHECK (avl_get_by_key (tree, AVL_KEY (501), &value) != 0);
+  AVL_CHECK (avl_get_by_index (tree, 400, &value) == 0 && value == AVL_KEY (expect[400]));
+  AVL_CHECK (avl_get_by_index (tree, count, &value) != 0);
+
+  /* equal keys are all kept */
+  AVL_CHECK (avl_insert (tree, AVL_KEY (500)) == 0);
+  AVL_CHECK (tree->length == count + 1);
+  AVL_CHECK (avl_delete (tree, AVL_KEY (500), NULL) == 0);
+  AVL_CHECK (avl_delete (tree, AVL_KEY (500), NULL) == 0);
+  AVL_CHECK (avl_get_by_key (tree, AVL_KEY (500), &value) != 0);
+  avl_tree_free (tree, NULL);
+
+  tree = avl_tree_new_ex (avl_check_compare, NULL, AVL_TREE_FLAG_BTREE);
+  for (i = 0; i < 1000; i++) {
+    keys[i] = AVL_KEY (2 * i);
+    expect[i] = 2 * i;
+  }
+  AVL_CHECK (avl_tree_build_sorted (tree, keys, 1000, 1) == 0);
+  AVL_CHECK (avl_check_inorder (tree, expect, 1000));
+  AVL_CHECK (avl_verify (tree) == 0);
+  AVL_CHECK (avl_tree_build_sorted (tree, keys, 1000, 1) != 0);
+  AVL_CHECK (avl_insert (tree, AVL_KEY (1)) == 0);
+  AVL_CHECK (avl_get_by_index (tree, 1, &value) == 0 && value == AVL_KEY (1));
+  avl_tree_free (tree, NULL);
+
+  tree = avl_tree_new_ex (avl_check_compare_heap, NULL, AVL_TREE_FLAG_BTREE);
+  for (i = 0; i < 1000; i++) {
+    long * key = (long *) malloc (sizeof (long));
+    *key = i;
+    AVL_CHECK (avl_insert (tree, key) == 0);
+  }
+  for (i = 0; i < 1000; i += 2) {
+    AVL_CHECK (avl_delete (tree, &i, avl_check_free_heap) == 0);
+  }
+  for (i = 0; i < 1000; i++) {
+    int found = avl_get_by_key (tree, &i, &value) == 0;
+    AVL_CHECK (found == (i % 2));
+  }
+  AVL_CHECK (avl_verify (tree) == 0);
+  avl_tree_free (tree, avl_check_free_heap);
+}
+
+/*
+ * Parent links, balance factors and ranks of a node based tree, which
+ * avl_verify() does not report on; returns the height of <node> or -1.
+ */
+static long
+avl_check_nodes (avl_node * node, avl_node * parent, unsigned long * count)
+{
+  unsigned long left = 0, right = 0;
+  long lh, rh;
+
+  if (!node) {
+    *count = 0;
+    return 0;
+  }
+  lh = avl_check_nodes (node->left, node, &left);
+  rh = avl_check_nodes (node->right, node, &right);
+  *count = left + right + 1;
+  if (lh < 0 || rh < 0 || node->parent != parent ||
+      AVL_GET_BALANCE (node) != rh - lh || AVL_GET_RANK (node) != left + 1) {
+    return -1;
+  }
+  return (lh > rh ? lh : rh) + 1;
+}
+
+static int
+avl_check_shape (avl_tree * tree)
+{
+  unsigned long count;
+
+  return avl_check_nodes (tree->root->right, tree->root, &count) >= 0 &&
+    count == tree->length;
+}
+
+/*
+ * A slab tree reuses the nodes deletes give back and still looks
+ * like any other tree; freeing it hands every key over once.  3000
+ * keys fill pages of every size.
+ */
+static void
+avl_check_slab (void)
+{
+  avl_tree * tree = avl_tree_new_ex (avl_check_compare, NULL, AVL_TREE_FLAG_SLAB);
+  void * value;
+  long i;
+
+  for (i = 0; i < 3000; i++) {
+    AVL_CHECK (avl_insert (tree, AVL_KEY ((i * 7) % 3000)) == 0);
+  }
+  AVL_CHECK (avl_check_shape (tree));
+  for (i = 1; i < 3000; i += 2) {
+    AVL_CHECK (avl_delete (tree, AVL_KEY (i), NULL) == 0);
+  }
+  AVL_CHECK (tree->length == 1500);
+  AVL_CHECK (avl_check_shape (tree));
+  for (i = 2999; i > 0; i -= 2) {
+    AVL_CHECK (avl_insert (tree, AVL_KEY (i)) == 0);
+  }
+  /* and one past what was there before */
+  AVL_CHECK (avl_insert (tree, AVL_KEY (3000)) == 0);
+  AVL_CHECK (avl_check_shape (tree));
+  for (i = 0; i <= 3000; i++) {
+    if (avl_get_by_index (tree, i, &value) != 0 || value != AVL_KEY (i)) {
+      break;
+    }
+  }
+  AVL_CHECK (i == 3001);
+
+  avl_check_freed = 0;
+  avl_tree_free (tree, avl_check_free_key);
+  AVL_CHECK (avl_check_freed == 3001);
+}
+
+/*
+ * A tree built from sorted keys, equal ones among them, is balanced
+ * and ranked like one filled key by key and takes updates after.
+ * Unsorted keys are refused before any node is made.
+ */
+static void
+avl_check_build_sorted (void)
+{
+  static const unsigned long counts[] = { 0, 1, 2, 3, 7, 1000 };
+  static void * keys[1000];
+  unsigned long count, height;
+  unsigned int c, slab;
+  avl_tree * tree;
+  void * value;
+  long i;
+
+  /* 0, 1, 1, 2, 3, 3, ... */
+  for (i = 0; i < 1000; i++) {
+    keys[i] = AVL_KEY (i * 2 / 3);
+  }
+  for (slab = 0; slab < 2; slab++) {
+    for (c = 0; c < sizeof (counts) / sizeof (counts[0]); c++) {
+      count = counts[c];
+      tree = avl_tree_new_ex (avl_check_compare, NULL, slab ? AVL_TREE_FLAG_SLAB : 0);
+      AVL_CHECK (avl_tree_build_sorted (tree, keys, count, 1) == 0);
+      AVL_CHECK (avl_check_shape (tree));
+      AVL_CHECK (avl_check_nodes (tree->root->right, tree->root, &height) == (long) tree->height);
+      for (i = 0; i < (long) count; i++) {
+        if (avl_get_by_index (tree, i, &value) != 0 || value != keys[i]) {
+          break;
+        }
+      }
+      AVL_CHECK (i == (long) count);
+      AVL_CHECK (avl_get_by_index (tree, count, &value) != 0);
+      /* only empty trees can be built */
+      AVL_CHECK ((avl_tree_build_sorted (tree, keys, 1, 1) == 0) == (count == 0));
+
+      AVL_CHECK (avl_insert (tree, AVL_KEY (-1)) == 0);
+      AVL_CHECK (avl_insert (tree, AVL_KEY (1000)) == 0);
+      if (count) {
+        AVL_CHECK (avl_delete (tree, keys[count / 2], NULL) == 0);
+      }
+      AVL_CHECK (avl_check_shape (tree));
+      avl_check_freed = 0;
+      avl_tree_free (tree, avl_check_free_key);
+      AVL_CHECK (avl_check_freed == (count ? count + 1 : 3));
+    }
+  }
+
+  /* out of order at the very end, so everything before is checked */
+  tree = avl_tree_new (avl_check_compare, NULL);
+  keys[999] = AVL_KEY (0);
+  AVL_CHECK (avl_tree_build_sorted (tree, keys, 1000, 1) != 0);
+  AVL_CHECK (tree->length == 0 && tree->root->right == NULL);
+  keys[999] = AVL_KEY (666);
+  AVL_CHECK (avl_tree_build_sorted (tree, keys, 1000, 1) == 0);
+  AVL_CHECK (avl_check_shape (tree));
+  avl_tree_free (tree, NULL);
+}
+
+typedef struct {
+  long                  value;
+  avl_node              node;
+} avl_check_item;
+
+static int
+avl_check_compare_item (void * compare_arg, void * a, void * b)
+{
+  return AVL_COMPARE_INTPTR (((avl_check_item *) a)->value, ((avl_check_item *) b)->value);
+}
+
+/*
+ * Intrusive trees.  Unlinking a node with two children swaps it with
+ * its predecessor, so afterwards every node left must still be the one
+ * embedded in its key and the tree must be balanced and ranked.
+ */
+static void
+avl_check_intrusive (void)
+{
+  avl_tree * tree = avl_tree_new_ex (avl_check_compare_item, NULL, AVL_TREE_FLAG_INTRUSIVE);
+  static avl_check_item items[200];
+  avl_check_item probe;
+  avl_node * node;
+  void * value;
+  long i, n;
+
+  AVL_CHECK (tree != NULL);
+  for (i = 0; i < 200; i++) {
+    n = (i * 73) % 200;
+    items[n].value = n;
+    AVL_CHECK (avl_insert_node (tree, &items[n].node, &items[n]) == 0);
+  }
+  AVL_CHECK (avl_insert (tree, &items[0]) != 0);
+  AVL_CHECK (avl_check_shape (tree));
+
+  /* the root has two children, as have most of the nodes near it */
+  for (i = 0; i < 50; i++) {
+    node = tree->root->right;
+    AVL_CHECK (avl_delete_node (tree, node) == 0);
+    AVL_CHECK (node->key != NULL);
+    AVL_CHECK (avl_check_shape (tree));
+  }
+  avl_check_freed = 0;
+  probe.value = ((avl_check_item *) avl_get_first (tree)->key)->value;
+  AVL_CHECK (avl_delete (tree, &probe, avl_check_free_key) == 0);
+  AVL_CHECK (avl_check_freed == 1 && tree->length == 149);
+  AVL_CHECK (avl_get_node_by_key (tree, &probe) == NULL);
+  AVL_CHECK (avl_check_shape (tree));
+
+  n = 0;
+  for (node = avl_get_first (tree); node; node = avl_get_next (node)) {
+    avl_check_item * item = AVL_NODE_ENTRY (node, avl_check_item, node);
+    AVL_CHECK (node->key == item);
+    AVL_CHECK (n == 0 || item->value > ((avl_check_item *) value)->value);
+    AVL_CHECK (avl_get_node_by_key (tree, item) == node);
+    value = item;
+    n++;
+  }
+  AVL_CHECK (n == (long) tree->length);
+  AVL_CHECK (avl_get_by_index (tree, 0, &value) == 0 && value == avl_get_first (tree)->key);
+  avl_tree_free (tree, NULL);
+}
+
+/*
+ * Batches large enough to be merged into the tree, and a small one
+ * that is inserted key by key, in no particular order and with a key
+ * that is already there.
+ */
+static void
+avl_check_batch (void)
+{
+  avl_tree * tree = avl_tree_new (avl_check_compare, NULL);
+  static long expect[400];
+  static void * keys[200];
+  unsigned long count;
+  long i;
+
+  for (i = 0; i < 100; i++) {
+    AVL_CHECK (avl_insert (tree, AVL_KEY (2 * i)) == 0);
+  }
+  for (i = 0; i < 100; i++) {
+    keys[i] = AVL_KEY ((i * 37) % 100 * 2 + 1);
+  }
+  AVL_CHECK (avl_insert_batch (tree, keys, 100) == 0);
+  for (i = 0; i < 200; i++) {
+    expect[i] = i;
+  }
+  AVL_CHECK (avl_check_inorder (tree, expect, 200));
+  AVL_CHECK (avl_check_shape (tree));
+
+  keys[0] = AVL_KEY (300);
+  keys[1] = AVL_KEY (50);
+  keys[2] = AVL_KEY (-1);
+  AVL_CHECK (avl_insert_batch (tree, keys, 3) == 0);
+  count = 0;
+  expect[count++] = -1;
+  for (i = 0; i < 200; i++) {
+    expect[count++] = i;
+    if (i == 50) {
+      expect[count++] = i;
+    }
+  }
+  expect[count++] = 300;
+  AVL_CHECK (avl_check_inorder (tree, expect, count));
+  AVL_CHECK (avl_check_shape (tree));
+
+  /* every key from 0 to 149 once, one of the two 50s stays */
+  for (i = 0; i < 150; i++) {
+    keys[i] = AVL_KEY (149 - i);
+  }
+  avl_check_freed = 0;
+  AVL_CHECK (avl_delete_batch (tree, keys, 150, avl_check_free_key) == 0);
+  AVL_CHECK (avl_check_freed == 150);
+  count = 0;
+  expect[count++] = -1;
+  expect[count++] = 50;
+  for (i = 150; i < 200; i++) {
+    expect[count++] = i;
+  }
+  expect[count++] = 300;
+  AVL_CHECK (avl_check_inorder (tree, expect, count));
+  AVL_CHECK (avl_check_shape (tree));
+
+  /* a key that is not there fails the batch, the others still go */
+  keys[0] = AVL_KEY (150);
+  keys[1] = AVL_KEY (151);
+  keys[2] = AVL_KEY (1000);
+  AVL_CHECK (avl_delete_batch (tree, keys, 3, NULL) != 0);
+  memmove (&expect[2], &expect[4], (count - 4) * sizeof (long));
+  AVL_CHECK (avl_check_inorder (tree, expect, count - 2));
+  AVL_CHECK (avl_check_shape (tree));
+  avl_tree_free (tree, NULL);
+}
+
+/* the in order walk of <tree> against <counts>[k] copies of each k */
+static int
+avl_check_counts (avl_tree * tree, const unsigned char * counts, long size)
+{
+  static long expect[4096];
+  unsigned long count = 0;
+  long k, n;
+
+  for (k = 0; k < size; k++) {
+    for (n = 0; n < counts[k] && count < 4096; n++) {
+      expect[count++] = k;
+    }
+  }
+  return count <= 1024 && avl_check_inorder (tree, expect, count);
+}
+
+/* finger lookups of keys -5..<to> in three orders against the tree */
+static int
+avl_check_finger_lookups (avl_finger * finger, long to)
+{
+  long span = to + 6;
+  void * value, * expect;
+  long i, key;
+  int pass;
+
+  for (pass = 0; pass < 3; pass++) {
+    for (i = 0; i < span; i++) {
+      if (pass == 0) {
+        key = i - 5;
+      } else if (pass == 1) {
+        key = to - i;
+      } else {
+        key = (i * 389) % span - 5;
+      }
+      if ((avl_finger_get_by_key (finger, AVL_KEY (key), &value) == 0) !=
+          (avl_get_by_key (finger->tree, AVL_KEY (key), &expect) == 0)) {
+        return 0;
+      }
+      if (avl_get_by_key (finger->tree, AVL_KEY (key), &expect) == 0 && value != expect) {
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+/*
+ * Ascending, descending and scattered runs of inserts through one
+ * finger, lookups through it in all directions, and the same finger
+ * after a delete and after a split took its node away.
+ */
+static void
+avl_check_finger (void)
+{
+  avl_tree * tree = avl_tree_new (avl_check_compare, NULL);
+  avl_tree * high = avl_tree_new (avl_check_compare, NULL);
+  static unsigned char counts[1000];
+  unsigned long seed = 1;
+  avl_finger finger;
+  void * value;
+  long i, key;
+
+  memset (counts, 0, sizeof (counts));
+  avl_finger_init (&finger, tree);
+  AVL_CHECK (avl_finger_get_by_key (&finger, AVL_KEY (1), &value) != 0);
+  for (i = 0; i < 300; i++) {
+    AVL_CHECK (avl_finger_insert (&finger, AVL_KEY (i)) == 0);
+    counts[i]++;
+  }
+  AVL_CHECK (avl_check_shape (tree));
+  for (i = 599; i >= 300; i--) {
+    AVL_CHECK (avl_finger_insert (&finger, AVL_KEY (i)) == 0);
+    counts[i]++;
+  }
+  AVL_CHECK (avl_check_shape (tree));
+  /* scattered over 600..899, some of them more than once */
+  for (i = 0; i < 300; i++) {
+    seed = seed * 1103515245UL + 12345UL;
+    key = 600 + (long) ((seed >> 16) % 300);
+    AVL_CHECK (avl_finger_insert (&finger, AVL_KEY (key)) == 0);
+    counts[key]++;
+  }
+  AVL_CHECK (avl_check_shape (tree));
+  AVL_CHECK (avl_check_counts (tree, counts, 1000));
+  AVL_CHECK (avl_check_finger_lookups (&finger, 905));
+
+  /* the node the finger is on goes, and others with it */
+  AVL_CHECK (avl_finger_get_by_key (&finger, AVL_KEY (350), &value) == 0);
+  for (i = 0; i < 600; i += 7) {
+    AVL_CHECK (avl_delete (tree, AVL_KEY (i), NULL) == 0);
+    counts[i]--;
+  }
+  AVL_CHECK (avl_check_finger_lookups (&finger, 905));
+  for (i = 0; i < 600; i += 14) {
+    AVL_CHECK (avl_finger_insert (&finger, AVL_KEY (i)) == 0);
+    counts[i]++;
+  }
+  AVL_CHECK (avl_check_shape (tree));
+  AVL_CHECK (avl_check_counts (tree, counts, 1000));
+
+  /* the node the finger is on moves to <high> */
+  AVL_CHECK (avl_finger_get_by_key (&finger, AVL_KEY (599), &value) == 0);
+  AVL_CHECK (avl_split (tree, AVL_KEY (500), high) == 0);
+  AVL_CHECK (avl_check_finger_lookups (&finger, 905));
+  AVL_CHECK (avl_finger_get_by_key (&finger, AVL_KEY (599), &value) != 0);
+  AVL_CHECK (avl_finger_insert (&finger, AVL_KEY (801)) == 0);
+  counts[801]++;
+  AVL_CHECK (avl_get_by_key (high, AVL_KEY (801), &value) != 0);
+  AVL_CHECK (avl_check_shape (tree) && avl_check_shape (high));
+  AVL_CHECK (avl_join (tree, high) != 0);
+  AVL_CHECK (avl_delete (tree, AVL_KEY (801), NULL) == 0);
+  AVL_CHECK (avl_join (tree, high) == 0);
+  counts[801]--;
+  AVL_CHECK (avl_check_counts (tree, counts, 1000));
+  AVL_CHECK (avl_check_finger_lookups (&finger, 905));
+
+  avl_tree_free (tree, NULL);
+  avl_tree_free (high, NULL);
+}
+
+#define AVL_CHECK_PARALLEL_KEYS (5000)
+
+typedef struct {
+  unsigned char         seen[AVL_CHECK_PARALLEL_KEYS];
+  void *                keys[AVL_CHECK_PARALLEL_KEYS];
+  /* an index past the end came in */
+  int                   wrong;
+  /* non-zero makes the callback fail at that index, plus one */
+  unsigned long         stop;
+} avl_check_parallel;
+
+/* each index belongs to one worker, so no two threads write a slot */
+static int
+avl_check_parallel_visit (unsigned long index, void * key, void * iter_arg)
+{
+  avl_check_parallel * visits = (avl_check_parallel *) iter_arg;
+
+  if (index >= AVL_CHECK_PARALLEL_KEYS) {
+    visits->wrong = 1;
+    return 1;
+  }
+  visits->seen[index]++;
+  visits->keys[index] = key;
+  return visits->stop == index + 1;
+}
+
+/*
+ * Parallel walks with one worker, two, several and more than there
+ * are keys see every index once with the key avl_get_by_index() has
+ * there, on node and btree trees with equal keys; a callback failing
+ * fails the walk.
+ */
+static void
+avl_check_iterate_parallel (void)
+{
+  static const unsigned int flags[2] = { AVL_TREE_FLAG_NONE, AVL_TREE_FLAG_BTREE };
+  static const unsigned int workers[4] = { 1, 2, 4, AVL_CHECK_PARALLEL_KEYS + 1 };
+  static avl_check_parallel visits;
+  unsigned long i, seen;
+  unsigned int f, w;
+  void * value;
+
+  for (f = 0; f < 2; f++) {
+    avl_tree * tree = avl_tree_new_ex (avl_check_compare, NULL, flags[f]);
+
+    AVL_CHECK (avl_iterate_parallel (tree, avl_check_parallel_visit, 4, &visits) == 0);
+    /* 0..3999 and every fourth of them twice */
+    for (i = 0; i < AVL_CHECK_PARALLEL_KEYS; i++) {
+      AVL_CHECK (avl_insert (tree, AVL_KEY (i < 4000 ? (i * 389) % 4000 : (i - 4000) * 4)) == 0);
+    }
+
+    for (w = 0; w < 4; w++) {
+      int same = 1;
+
+      memset (&visits, 0, sizeof (visits));
+      avl_tree_rlock (tree);
+      AVL_CHECK (avl_iterate_parallel (tree, avl_check_parallel_visit, workers[w], &visits) == 0);
+      avl_tree_unlock (tree);
+      AVL_CHECK (!visits.wrong);
+      for (i = 0; i < AVL_CHECK_PARALLEL_KEYS && same; i++) {
+        same = visits.seen[i] == 1 && avl_get_by_index (tree, i, &value) == 0 && value == visits.keys[i];
+      }
+      AVL_CHECK (same);
+    }
+
+    /*
+     * one worker stops at its failing index, the walk fails; node trees
+     * walk their slice up, the others down like avl_iterate_index_range()
+     */
+    memset (&visits, 0, sizeof (visits));
+    visits.stop = 2500 + 1;
+    AVL_CHECK (avl_iterate_parallel (tree, avl_check_parallel_visit, 1, &visits) == -1);
+    for (i = 0, seen = 0; i < AVL_CHECK_PARALLEL_KEYS; i++) {
+      seen += visits.seen[i];
+    }
+    AVL_CHECK (seen == (tree->btree ? 2500 : 2501) && visits.seen[2500] == 1);
+    memset (&visits, 0, sizeof (visits));
+    visits.stop = 4999 + 1;
+    AVL_CHECK (avl_iterate_parallel (tree, avl_check_parallel_visit, 4, &visits) == -1);
+    avl_tree_free (tree, NULL);
+  }
+}
+
+static unsigned long
+avl_check_hash (void * hash_arg, void * key)
+{
+  return (unsigned long) (long) key * 2654435761UL;
+}
+
+/* avl_get_by_key() of <tree> and <plain> agree on keys <from>..<to> */
+static int
+avl_check_lookups (avl_tree * tree, avl_tree * plain, long from, long to)
+{
+  void * value, * expect;
+  long i;
+
+  for (i = from; i <= to; i++) {
+    int found = avl_get_by_key (tree, AVL_KEY (i), &value) == 0;
+
+    if (found != (avl_get_by_key (plain, AVL_KEY (i), &expect) == 0) ||
+        (found && value != expect)) {
+      return 0;
+    }
+  }
+  return tree->length == plain->length;
+}
+
+/*
+ * A hash indexed tree with equal keys answers like the same tree
+ * without the index after every kind of update, and cannot be split
+ * or joined.
+ */
+static void
+avl_check_hash_index (void)
+{
+  avl_tree * tree = avl_tree_new (avl_check_compare, NULL);
+  avl_tree * plain = avl_tree_new (avl_check_compare, NULL);
+  avl_tree * other = avl_tree_new (avl_check_compare, NULL);
+  static void * keys[200];
+  long i;
+
+  /* 0..99, the multiples of 3 twice; the index is filled from them */
+  for (i = 0; i < 100; i++) {
+    AVL_CHECK (avl_insert (tree, AVL_KEY ((i * 37) % 100)) == 0);
+    AVL_CHECK (avl_insert (plain, AVL_KEY ((i * 37) % 100)) == 0);
+    if (i % 3 == 0) {
+      AVL_CHECK (avl_insert (tree, AVL_KEY (i)) == 0);
+      AVL_CHECK (avl_insert (plain, AVL_KEY (i)) == 0);
+    }
+  }
+  AVL_CHECK (avl_tree_set_hash_index (tree, avl_check_hash, NULL) == 0);
+  AVL_CHECK (avl_check_lookups (tree, plain, -5, 305));
+
+  for (i = 100; i < 150; i++) {
+    AVL_CHECK (avl_insert (tree, AVL_KEY (i)) == 0);
+    AVL_CHECK (avl_insert (plain, AVL_KEY (i)) == 0);
+  }
+  AVL_CHECK (avl_check_lookups (tree, plain, -5, 305));
+
+  /* one copy of a key that is there twice, then the other one */
+  for (i = 0; i < 60; i += 3) {
+    AVL_CHECK (avl_delete (tree, AVL_KEY (i), NULL) == 0);
+    AVL_CHECK (avl_delete (plain, AVL_KEY (i), NULL) == 0);
+  }
+  AVL_CHECK (avl_check_lookups (tree, plain, -5, 305));
+  for (i = 0; i < 30; i += 3) {
+    AVL_CHECK (avl_delete (tree, AVL_KEY (i), NULL) == 0);
+    AVL_CHECK (avl_delete (plain, AVL_KEY (i), NULL) == 0);
+  }
+  AVL_CHECK (avl_check_lookups (tree, plain, -5, 305));
+
+  /* a batch merged into the tree and one inserted key by key */
+  for (i = 0; i < 150; i++) {
+    keys[i] = AVL_KEY ((i * 7) % 150 + 150);
+  }
+  AVL_CHECK (avl_insert_batch (tree, keys, 150) == 0);
+  AVL_CHECK (avl_insert_batch (plain, keys, 150) == 0);
+  AVL_CHECK (avl_insert_batch (tree, keys, 3) == 0);
+  AVL_CHECK (avl_insert_batch (plain, keys, 3) == 0);
+  AVL_CHECK (avl_check_lookups (tree, plain, -5, 305));
+  AVL_CHECK (avl_check_shape (tree));
+
+  for (i = 0; i < 100; i++) {
+    keys[i] = AVL_KEY (200 + i);
+  }
+  AVL_CHECK (avl_delete_batch (tree, keys, 100, NULL) == 0);
+  AVL_CHECK (avl_delete_batch (plain, keys, 100, NULL) == 0);
+  AVL_CHECK (avl_check_lookups (tree, plain, -5, 305));
+
+  AVL_CHECK (avl_tree_freeze (tree) == 0);
+  AVL_CHECK (avl_check_lookups (tree, plain, -5, 305));
+  AVL_CHECK (avl_tree_thaw (tree) == 0);
+  AVL_CHECK (avl_check_lookups (tree, plain, -5, 305));
+  AVL_CHECK (avl_delete (tree, AVL_KEY (150), NULL) == 0);
+  AVL_CHECK (avl_delete (plain, AVL_KEY (150), NULL) == 0);
+  AVL_CHECK (avl_insert (tree, AVL_KEY (1000)) == 0);
+  AVL_CHECK (avl_insert (plain, AVL_KEY (1000)) == 0);
+  AVL_CHECK (avl_check_lookups (tree, plain, -5, 1005));
+  AVL_CHECK (avl_check_shape (tree));
+
+  /* nodes cannot move to or from an indexed tree */
+  AVL_CHECK (avl_split (tree, AVL_KEY (100), other) == -1);
+  AVL_CHECK (avl_join (tree, other) == -1);
+  AVL_CHECK (avl_join (other, tree) == -1);
+  AVL_CHECK (avl_check_lookups (tree, plain, -5, 1005));
+
+  /* dropped, the tree answers alone */
+  AVL_CHECK (avl_tree_set_hash_index (tree, NULL, NULL) == 0);
+  AVL_CHECK (avl_check_lookups (tree, plain, -5, 1005));
+  AVL_CHECK (avl_split (tree, AVL_KEY (100), other) == 0);
+
+  avl_tree_free (tree, NULL);
+  avl_tree_free (plain, NULL);
+  avl_tree_free (other, NULL);
+}
+
+AVL_DEFINE_GET_BY_KEY (avl_check_get_inline, AVL_COMPARE_INTPTR)
+
+/*
+ * The inlined lookup answers like avl_get_by_key() for keys that are
+ * there once, twice and not at all, on node trees and on those it
+ * passes on.
+ */
+static void
+avl_check_get_by_key_inline (void)
+{
+  /* the last one gets a hash index */
+  static const unsigned int flags[] = { 0, AVL_TREE_FLAG_SLAB, AVL_TREE_FLAG_BTREE, 0 };
+  void * value, * expect;
+  unsigned int f;
+  long i;
+
+  for (f = 0; f < sizeof (flags) / sizeof (flags[0]); f++) {
+    avl_tree * tree = avl_tree_new_ex (avl_check_compare, NULL, flags[f]);
+
+    /* the even keys 0..398, multiples of 6 twice */
+    for (i = 0; i < 200; i++) {
+      long key = (i * 37) % 200 * 2;
+
+      AVL_CHECK (avl_insert (tree, AVL_KEY (key)) == 0);
+      if (key % 6 == 0) {
+        AVL_CHECK (avl_insert (tree, AVL_KEY (key)) == 0);
+      }
+    }
+    if (f == sizeof (flags) / sizeof (flags[0]) - 1) {
+      AVL_CHECK (avl_tree_set_hash_index (tree, avl_check_hash, NULL) == 0);
+    }
+    for (i = -3; i < 403; i++) {
+      int found = avl_check_get_inline (tree, AVL_KEY (i), &value) == 0;
+
+      AVL_CHECK (found == (avl_get_by_key (tree, AVL_KEY (i), &expect) == 0));
+      AVL_CHECK (found == (i >= 0 && i < 400 && i % 2 == 0));
+      AVL_CHECK (!found || value == expect);
+    }
+    avl_tree_free (tree, NULL);
+  }
+}
+
+/* the keys an iterator returns, at most <size> of them */
+static unsigned long
+avl_check_iterator (avl_iterator * iterator, long * keys, unsigned long size)
+{
+  unsigned long count = 0;
+  void * value;
+
+  while (count < size && avl_iterator_next (iterator, &value) == 0) {
+    keys[count++] = (long) value;
+  }
+  return count;
+}
+
+/* collects until the list is full, then stops the walk */
+static int
+avl_check_collect_some (void * key, void * iter_arg)
+{
+  avl_check_list * list = (avl_check_list *) iter_arg;
+
+  avl_check_collect (key, iter_arg);
+  return list->count == list->size ? 7 : 0;
+}
+
+/*
+ * Iterators and the yielding walk on node, slab and btree trees with
+ * equal keys side by side, against a sorted array; then an iterator
+ * that goes on after keys on both sides of it were deleted.
+ */
+static void
+avl_check_iterators (void)
+{
+  static const unsigned int flags[3] = {
+    AVL_TREE_FLAG_NONE, AVL_TREE_FLAG_SLAB, AVL_TREE_FLAG_BTREE
+  };
+  static long expect[150];
+  static long rest[100];
+  static long keys[200];
+  unsigned long count, n;
+  avl_iterator iterator;
+  avl_check_list list;
+  unsigned int f;
+  long i;
+
+  /* 0..99 with every even key twice */
+  for (i = 0, count = 0; i < 100; i++) {
+    expect[count++] = i;
+    if (i % 2 == 0) {
+      expect[count++] = i;
+    }
+  }
+  /*
+   * expect[59] is 39, what is left behind it once a copy of each of
+   * 70..79 went and 200 came in
+   */
+  for (i = 60, n = 0; i < 150; i++) {
+    if (expect[i] < 70 || expect[i] > 79 || (expect[i] % 2 == 0 && expect[i] == expect[i - 1])) {
+      rest[n++] = expect[i];
+    }
+  }
+  rest[n++] = 200;
+
+  for (f = 0; f < 3; f++) {
+    avl_tree * tree = avl_tree_new_ex (avl_check_compare, NULL, flags[f]);
+
+    for (i = 0; i < 100; i++) {
+      AVL_CHECK (avl_insert (tree, AVL_KEY ((i * 37) % 100)) == 0);
+    }
+    for (i = 0; i < 100; i += 2) {
+      AVL_CHECK (avl_insert (tree, AVL_KEY (98 - i)) == 0);
+    }
+
+    avl_iterator_init (&iterator, tree);
+    AVL_CHECK (avl_check_iterator (&iterator, keys, 200) == 150);
+    AVL_CHECK (memcmp (keys, expect, 150 * sizeof (long)) == 0);
+    AVL_CHECK (avl_check_iterator (&iterator, keys, 200) == 0);
+
+    list.keys = keys;
+    list.count = 0;
+    list.size = 200;
+    AVL_CHECK (avl_iterate_inorder_yield (tree, avl_check_collect, &list, 1) == 0);
+    AVL_CHECK (avl_check_same (&list, expect, 150));
+    list.count = 0;
+    AVL_CHECK (avl_iterate_inorder_yield (tree, avl_check_collect, &list, 7) == 0);
+    AVL_CHECK (avl_check_same (&list, expect, 150));
+    list.count = 0;
+    list.size = 40;
+    AVL_CHECK (avl_iterate_inorder_yield (tree, avl_check_collect_some, &list, 7) == 7);
+    AVL_CHECK (avl_check_same (&list, expect, 40));
+
+    avl_iterator_init (&iterator, tree);
+    AVL_CHECK (avl_check_iterator (&iterator, keys, 60) == 60);
+    AVL_CHECK (memcmp (keys, expect, 60 * sizeof (long)) == 0);
+    for (i = 0; i < 20; i++) {
+      AVL_CHECK (avl_delete (tree, AVL_KEY (i), NULL) == 0);
+    }
+    for (i = 70; i < 80; i++) {
+      AVL_CHECK (avl_delete (tree, AVL_KEY (i), NULL) == 0);
+    }
+    AVL_CHECK (avl_insert (tree, AVL_KEY (200)) == 0);
+    AVL_CHECK (avl_check_iterator (&iterator, keys, 200) == n);
+    AVL_CHECK (memcmp (keys, rest, n * sizeof (long)) == 0);
+    avl_tree_free (tree, NULL);
+  }
+}
+
+#if !defined(NO_THREAD) && defined(HAVE_AVL_NODE_LOCK)
+#define AVL_CHECK_THREADS       (4)
+#define AVL_CHECK_PER_THREAD    (2000)
+
+typedef struct {
+  avl_tree *            tree;
+  long                  first;
+  unsigned long         failed;
+} avl_check_worker;
+
+/* keys <first>, <first> + AVL_CHECK_THREADS, ... so that threads meet */
+static void *
+avl_check_insert_locked (void * arg)
+{
+  avl_check_worker * worker = (avl_check_worker *) arg;
+  void * value;
+  long i;
+
+  for (i = 0; i < AVL_CHECK_PER_THREAD; i++) {
+    long key = worker->first + i * AVL_CHECK_THREADS;
+    avl_tree_rlock (worker->tree);
+    if (avl_insert_locked (worker->tree, AVL_KEY (key)) != 0 ||
+        avl_get_by_key (worker->tree, AVL_KEY (key), &value) != 0 || value != AVL_KEY (key) ||
+        avl_check_get_inline (worker->tree, AVL_KEY (key), &value) != 0 || value != AVL_KEY (key)) {
+      worker->failed++;
+    }
+    avl_tree_unlock (worker->tree);
+  }
+  return NULL;
+}
+
+/*
+ * Lock coupling is for AVL_TREE_FLAG_NODE_LOCK trees only.  Threads
+ * insert interleaved keys under the read lock and look them up again,
+ * the result is the same tree however they were scheduled.
+ */
+static void
+avl_check_node_lock (void)
+{
+  avl_tree * tree = avl_tree_new (avl_check_compare, NULL);
+  avl_check_worker workers[AVL_CHECK_THREADS];
+  thread_type * threads[AVL_CHECK_THREADS];
+  avl_node * node;
+  void * value;
+  long i;
+
+  AVL_CHECK (avl_insert_locked (tree, AVL_KEY (1)) != 0);
+  avl_tree_free (tree, NULL);
+  AVL_CHECK (avl_tree_new_ex (avl_check_compare, NULL,
+                              AVL_TREE_FLAG_NODE_LOCK | AVL_TREE_FLAG_BTREE) == NULL);
+
+  tree = avl_tree_new_ex (avl_check_compare, NULL, AVL_TREE_FLAG_NODE_LOCK);
+  for (i = 0; i < AVL_CHECK_THREADS; i++) {
+    workers[i].tree = tree;
+    workers[i].first = i;
+    workers[i].failed = 0;
+    threads[i] = thread_create ("avlcheck", avl_check_insert_locked, &workers[i], THREAD_ATTACHED);
+    AVL_CHECK (threads[i] != NULL);
+  }
+  for (i = 0; i < AVL_CHECK_THREADS; i++) {
+    if (threads[i]) {
+      thread_join (threads[i]);
+    }
+    AVL_CHECK (workers[i].failed == 0);
+  }
+  AVL_CHECK (tree->length == AVL_CHECK_THREADS * AVL_CHECK_PER_THREAD);
+  AVL_CHECK (avl_check_shape (tree));
+  for (i = 0; i < AVL_CHECK_THREADS * AVL_CHECK_PER_THREAD; i++) {
+    if (avl_get_by_index (tree, i, &value) != 0 || value != AVL_KEY (i)) {
+      break;
+    }
+  }
+  AVL_CHECK (i == AVL_CHECK_THREADS * AVL_CHECK_PER_THREAD);
+
+  /* nodes come back locked, missing keys come back as NULL */
+  avl_tree_rlock (tree);
+  node = avl_get_node_locked (tree, AVL_KEY (10), 1);
+  AVL_CHECK (node != NULL && node->key == AVL_KEY (10));
+  if (node) {
+    avl_node_unlock (node);
+  }
+  AVL_CHECK (avl_get_node_locked (tree, AVL_KEY (-1), 0) == NULL);
+  avl_tree_unlock (tree);
+  avl_tree_free (tree, NULL);
+}
+#endif
+
+/*
+ * Split a tree at a key in it and at one between two keys, join the
+ * halves back, and delete ranges from node and btree trees.
+ */
+static void
+avl_check_split_join (void)
+{
+  avl_tree * tree = avl_tree_new (avl_check_compare, NULL);
+  avl_tree * high = avl_tree_new (avl_check_compare, NULL);
+  avl_tree * btree = avl_tree_new_ex (avl_check_compare, NULL, AVL_TREE_FLAG_BTREE);
+  static long expect[200];
+  unsigned long count;
+  long i;
+
+  for (i = 0; i < 100; i++) {
+    AVL_CHECK (avl_insert (tree, AVL_KEY ((i * 37) % 100 * 2)) == 0);
+    AVL_CHECK (avl_insert (btree, AVL_KEY (i)) == 0);
+    expect[i] = 2 * i;
+  }
+
+  AVL_CHECK (avl_split (tree, AVL_KEY (120), high) == 0);
+  AVL_CHECK (avl_check_inorder (tree, expect, 60));
+  AVL_CHECK (avl_check_inorder (high, &expect[60], 40));
+  AVL_CHECK (avl_check_shape (tree) && avl_check_shape (high));
+  /* <high> has to be empty */
+  AVL_CHECK (avl_split (tree, AVL_KEY (0), high) != 0);
+  AVL_CHECK (avl_join (tree, high) == 0);
+  AVL_CHECK (high->length == 0);
+  AVL_CHECK (avl_check_inorder (tree, expect, 100));
+  AVL_CHECK (avl_check_shape (tree));
+
+  AVL_CHECK (avl_split (tree, AVL_KEY (31), high) == 0);
+  AVL_CHECK (avl_check_inorder (tree, expect, 16));
+  AVL_CHECK (avl_check_inorder (high, &expect[16], 84));
+  AVL_CHECK (avl_check_shape (tree) && avl_check_shape (high));
+  /* keys of <high> less than the greatest one of <low> are refused */
+  AVL_CHECK (avl_join (high, tree) != 0);
+  AVL_CHECK (avl_join (tree, high) == 0);
+  AVL_CHECK (avl_check_inorder (tree, expect, 100));
+  AVL_CHECK (avl_check_shape (tree));
+  AVL_CHECK (avl_split (btree, AVL_KEY (50), high) != 0);
+
+  /* the even keys from 50 to 69 */
+  avl_check_freed = 0;
+  AVL_CHECK (avl_delete_range (tree, AVL_KEY (49), AVL_KEY (69), avl_check_free_key) == 0);
+  AVL_CHECK (avl_check_freed == 10);
+  memmove (&expect[25], &expect[35], 65 * sizeof (long));
+  AVL_CHECK (avl_check_inorder (tree, expect, 90));
+  AVL_CHECK (avl_check_shape (tree));
+  avl_check_freed = 0;
+  AVL_CHECK (avl_delete_range (btree, AVL_KEY (10), AVL_KEY (89), avl_check_free_key) == 0);
+  AVL_CHECK (avl_check_freed == 80);
+  for (i = 0, count = 0; i < 100; i++) {
+    if (i < 10 || i > 89) {
+      expect[count++] = i;
+    }
+  }
+  AVL_CHECK (avl_check_inorder (btree, expect, count));
+  AVL_CHECK (avl_verify (btree) == 0);
+
+  avl_tree_free (tree, NULL);
+  avl_tree_free (high, NULL);
+  avl_tree_free (btree, NULL);
+}
+
+/*
+ * Frozen node and btree trees answer from their arrays, every key and
+ * every gap between two keys is looked up, and updates fail until the
+ * tree is thawed again.
+ */
+static void
+avl_check_freeze (void)
+{
+  static const unsigned int flags[2] = { AVL_TREE_FLAG_NONE, AVL_TREE_FLAG_BTREE };
+  static long expect[301];
+  avl_iterator iterator;
+  avl_tree * tree;
+  unsigned int f;
+  void * value;
+  long i;
+
+  tree = avl_tree_new_ex (avl_check_compare, NULL, AVL_TREE_FLAG_RCU);
+  if (tree) {
+    AVL_CHECK (avl_tree_freeze (tree) != 0);
+    avl_tree_free (tree, NULL);
+  }
+
+  for (f = 0; f < 2; f++) {
+    tree = avl_tree_new_ex (avl_check_compare, NULL, flags[f]);
+    for (i = 0; i < 300; i++) {
+      AVL_CHECK (avl_insert (tree, AVL_KEY ((i * 37) % 300 * 2)) == 0);
+      expect[i] = 2 * i;
+    }
+    AVL_CHECK (avl_tree_freeze (tree) == 0);
+    AVL_CHECK (avl_tree_freeze (tree) == 0);
+    AVL_CHECK (avl_verify (tree) == 0);
+    AVL_CHECK (tree->length == 300);
+    AVL_CHECK (avl_check_inorder (tree, expect, 300));
+    for (i = -1; i < 600; i++) {
+      int found = avl_get_by_key (tree, AVL_KEY (i), &value) == 0;
+      AVL_CHECK (found == (i >= 0 && i % 2 == 0));
+      AVL_CHECK (!found || value == AVL_KEY (i));
+    }
+    for (i = 0; i < 300; i++) {
+      AVL_CHECK (avl_get_by_index (tree, i, &value) == 0 && value == AVL_KEY (2 * i));
+    }
+    AVL_CHECK (avl_get_by_index (tree, 300, &value) != 0);
+    avl_iterator_init (&iterator, tree);
+    for (i = 0; avl_iterator_next (&iterator, &value) == 0; i++) {
+      AVL_CHECK (value == AVL_KEY (2 * i));
+    }
+    AVL_CHECK (i == 300);
+
+    AVL_CHECK (avl_insert (tree, AVL_KEY (1)) != 0);
+    AVL_CHECK (avl_delete (tree, AVL_KEY (2), NULL) != 0);
+    AVL_CHECK (avl_check_inorder (tree, expect, 300));
+
+    AVL_CHECK (avl_tree_thaw (tree) == 0);
+    AVL_CHECK (avl_insert (tree, AVL_KEY (599)) == 0);
+    AVL_CHECK (avl_delete (tree, AVL_KEY (0), NULL) == 0);
+    expect[300] = 599;
+    AVL_CHECK (avl_check_inorder (tree, &expect[1], 300));
+    AVL_CHECK (avl_verify (tree) == 0);
+    AVL_CHECK (tree->btree || avl_check_shape (tree));
+    avl_tree_free (tree, NULL);
+  }
+}
+
+/* a long followed by as many bytes as the key modulo 5 */
+static unsigned long
+avl_check_encode (void * codec_arg, void * key, void * buffer, unsigned long size)
+{
+  unsigned long need = sizeof (long) + (unsigned long) ((long) key % 5);
+
+  if (buffer && size >= need) {
+    memcpy (buffer, &key, sizeof (long));
+    memset ((char *) buffer + sizeof (long), 'x', need - sizeof (long));
+  }
+  return need;
+}
+
+static int
+avl_check_compare_record (void * compare_arg, void * key, void * record)
+{
+  return AVL_COMPARE_INTPTR (key, *(const long *) record);
+}
+
+/*
+ * A snapshot written from a tree with equal keys in it has to give
+ * the answers the tree gives, and a rewrite replaces it as a whole.
+ * No key is 0, which avl_get_item_by_key_most() could not tell from
+ * nothing found.
+ */
+static void
+avl_check_snapshot (void)
+{
+  static const char * filename = "avlcheck.snapshot";
+  avl_tree * tree = avl_tree_new (avl_check_compare, NULL);
+  avl_snapshot * snapshot;
+  unsigned long low, high, slow, shigh;
+  void * value, * record;
+  long i;
+
+  for (i = 0; i < 500; i++) {
+    AVL_CHECK (avl_insert (tree, AVL_KEY ((i * 37) % 500 / 2 * 3 + 1)) == 0);
+  }
+  AVL_CHECK (avl_snapshot_write (tree, filename, avl_check_encode, NULL) == 0);
+  snapshot = avl_snapshot_open (filename, avl_check_compare_record, NULL);
+  AVL_CHECK (snapshot != NULL);
+  if (!snapshot) {
+    avl_tree_free (tree, NULL);
+    return;
+  }
+  AVL_CHECK (avl_snapshot_verify (snapshot) == 0);
+  AVL_CHECK (avl_snapshot_length (snapshot) == 500);
+
+  for (i = 0; i < 500; i++) {
+    AVL_CHECK (avl_get_by_index (tree, i, &value) == 0);
+    AVL_CHECK (avl_snapshot_get_by_index (snapshot, i, &record) == 0);
+    AVL_CHECK (*(long *) record == (long) value);
+    AVL_CHECK (avl_snapshot_record_size (record) == sizeof (long) + (long) value % 5);
+  }
+  AVL_CHECK (avl_snapshot_get_by_index (snapshot, 500, &record) != 0);
+  for (i = -2; i < 760; i++) {
+    int found = avl_get_by_key (tree, AVL_KEY (i), &value) == 0;
+    AVL_CHECK ((avl_snapshot_get_by_key (snapshot, AVL_KEY (i), &record) == 0) == found);
+    AVL_CHECK (!found || *(long *) record == i);
+    found = avl_get_item_by_key_most (tree, AVL_KEY (i), &value) == 0;
+    AVL_CHECK ((avl_snapshot_get_item_by_key_most (snapshot, AVL_KEY (i), &record) == 0) == found);
+    AVL_CHECK (!found || *(long *) record == (long) value);
+    found = avl_get_item_by_key_least (tree, AVL_KEY (i), &value) == 0;
+    AVL_CHECK ((avl_snapshot_get_item_by_key_least (snapshot, AVL_KEY (i), &record) == 0) == found);
+    AVL_CHECK (!found || *(long *) record == (long) value);
+    found = avl_get_span_by_key (tree, AVL_KEY (i), &low, &high) == 0;
+    AVL_CHECK ((avl_snapshot_get_span_by_key (snapshot, AVL_KEY (i), &slow, &shigh) == 0) == found);
+    AVL_CHECK (!found || (low == slow && high == shigh));
+    found = avl_get_span_by_two_keys (tree, AVL_KEY (i), AVL_KEY (i + 40), &low, &high) == 0;
+    AVL_CHECK ((avl_snapshot_get_span_by_two_keys (snapshot, AVL_KEY (i), AVL_KEY (i + 40), &slow, &shigh) == 0) == found);
+    AVL_CHECK (!found || (low == slow && high == shigh));
+  }
+
+  /* closed first, windows cannot replace a mapped file */
+  avl_snapshot_close (snapshot);
+  AVL_CHECK (avl_delete (tree, AVL_KEY (1), NULL) == 0);
+  AVL_CHECK (avl_snapshot_write (tree, filename, avl_check_encode, NULL) == 0);
+  snapshot = avl_snapshot_open (filename, avl_check_compare_record, NULL);
+  AVL_CHECK (snapshot != NULL && avl_snapshot_length (snapshot) == 499);
+  if (snapshot) {
+    avl_snapshot_close (snapshot);
+  }
+  remove (filename);
+  avl_tree_free (tree, NULL);
+}
+
+/* whether a walk of <list> is sorted and holds every key <counts> times */
+static int
+avl_check_walk_counts (avl_check_list * list, const unsigned char * counts, long size)
+{
+  unsigned char seen[1000];
+  unsigned long i;
+  long total = 0;
+
+  memset (seen, 0, sizeof (seen));
+  for (i = 0; i < list->count; i++) {
+    if (list->keys[i] < 0 || list->keys[i] >= size ||
+        (i > 0 && list->keys[i - 1] > list->keys[i])) {
+      return 0;
+    }
+    seen[list->keys[i]]++;
+  }
+  for (i = 0; i < (unsigned long) size; i++) {
+    total += counts[i];
+  }
+  return list->count == (unsigned long) total && memcmp (seen, counts, size) == 0;
+}
+
+/* keys equal in groups of 16, which avl_check_hash() spreads over shards */
+static int
+avl_check_compare_coarse (void * compare_arg, void * a, void * b)
+{
+  return AVL_COMPARE_INTPTR (AVL_KEY ((long) a / 16), AVL_KEY ((long) b / 16));
+}
+
+/*
+ * A shard map of any size finds what it was given, and its merged
+ * walk is the sorted walk of one tree holding all of its keys.
+ */
+static void
+avl_check_shard (void)
+{
+  static const unsigned int shards[] = { 1, 3, 8, 64 };
+  unsigned char counts[1000];
+  long keys[1000];
+  avl_check_list list;
+  avl_shard_map * map;
+  void * value;
+  unsigned int s;
+  long i;
+
+  list.keys = keys;
+  list.size = sizeof (keys) / sizeof (keys[0]);
+
+  for (s = 0; s < sizeof (shards) / sizeof (shards[0]); s++) {
+    map = avl_shard_map_new (avl_check_compare, NULL, avl_check_hash, NULL, shards[s], 0);
+    AVL_CHECK (map != NULL);
+    if (!map) {
+      continue;
+    }
+    /* 0..599, every multiple of 5 twice */
+    memset (counts, 0, sizeof (counts));
+    for (i = 0; i < 600; i++) {
+      long key = (i * 37) % 600;
+
+      AVL_CHECK (avl_shard_map_insert (map, AVL_KEY (key)) == 0);
+      counts[key]++;
+      if (key % 5 == 0) {
+        AVL_CHECK (avl_shard_map_insert (map, AVL_KEY (key)) == 0);
+        counts[key]++;
+      }
+    }
+    AVL_CHECK (avl_shard_map_length (map) == 720);
+    for (i = -5; i < 605; i++) {
+      int found = avl_shard_map_get_by_key (map, AVL_KEY (i), &value) == 0;
+
+      AVL_CHECK (found == (i >= 0 && i < 600));
+      AVL_CHECK (!found || (long) value == i);
+    }
+    list.count = 0;
+    AVL_CHECK (avl_shard_map_iterate_inorder (map, avl_check_collect, &list) == 0);
+    AVL_CHECK (avl_check_walk_counts (&list, counts, 600));
+    list.count = 0;
+    AVL_CHECK (avl_shard_map_iterate (map, avl_check_collect, &list) == 0);
+    AVL_CHECK (list.count == 720);
+
+    /* one copy of every fourth key, so some duplicates keep one */
+    for (i = 0; i < 600; i += 4) {
+      AVL_CHECK (avl_shard_map_delete (map, AVL_KEY (i), NULL) == 0);
+      counts[i]--;
+    }
+    AVL_CHECK (avl_shard_map_delete (map, AVL_KEY (600), NULL) != 0);
+    AVL_CHECK (avl_shard_map_length (map) == 720 - 150);
+    for (i = -5; i < 605; i++) {
+      int found = avl_shard_map_get_by_key (map, AVL_KEY (i), &value) == 0;
+
+      AVL_CHECK (found == (i >= 0 && i < 600 && counts[i] > 0));
+      AVL_CHECK (!found || (long) value == i);
+    }
+    list.count = 0;
+    AVL_CHECK (avl_shard_map_iterate_inorder (map, avl_check_collect, &list) == 0);
+    AVL_CHECK (avl_check_walk_counts (&list, counts, 600));
+
+    avl_check_freed = 0;
+    avl_shard_map_free (map, avl_check_free_key);
+    AVL_CHECK (avl_check_freed == 720 - 150);
+  }
+
+  /* the merge keeps equal keys from different shards together, in
+   * shard order, although lookups would need them in one shard */
+  map = avl_shard_map_new (avl_check_compare_coarse, NULL, avl_check_hash, NULL, 8, 0);
+  AVL_CHECK (map != NULL);
+  if (map) {
+    for (i = 0; i < 320; i++) {
+      AVL_CHECK (avl_shard_map_insert (map, AVL_KEY ((i * 37) % 320)) == 0);
+    }
+    list.count = 0;
+    AVL_CHECK (avl_shard_map_iterate_inorder (map, avl_check_collect, &list) == 0);
+    AVL_CHECK (list.count == 320);
+    memset (counts, 0, sizeof (counts));
+    for (i = 0; i < (long) list.count && i < 320; i++) {
+      AVL_CHECK (i == 0 || keys[i - 1] / 16 <= keys[i] / 16);
+      if (keys[i] >= 0 && keys[i] < 320) {
+        counts[keys[i]]++;
+      }
+    }
+    for (i = 0; i < 320; i++) {
+      AVL_CHECK (counts[i] == 1);
+    }
+    avl_shard_map_free (map, NULL);
+  }
+}
+
+#ifdef HAVE_AVL_STATS
+#define AVL_CHECK_STATS_THREADS (24)
+#define AVL_CHECK_STATS_LOOKUPS (10000)
+
+/* calls of avl_check_compare_counted() */
+static unsigned long avl_check_compares = 0;
+
+static int
+avl_check_compare_counted (void * compare_arg, void * a, void * b)
+{
+  avl_check_compares++;
+  return AVL_COMPARE_INTPTR (a, b);
+}
+
+#ifndef NO_THREAD
+/* lookups of every key of a tree of 0..99 under the read lock */
+static void *
+avl_check_stats_lookups (void * arg)
+{
+  avl_tree * tree = (avl_tree *) arg;
+  void * value;
+  long i;
+
+  for (i = 0; i < AVL_CHECK_STATS_LOOKUPS; i++) {
+    avl_tree_rlock (tree);
+    avl_get_by_key (tree, AVL_KEY (i % 100), &value);
+    avl_tree_unlock (tree);
+  }
+  return NULL;
+}
+#endif
+
+/*
+ * The counters are exact: inserts and deletes of keys that went in or
+ * out, every lookup, every compare, the depth of the deepest key found,
+ * and lookups of more threads than there are shards.
+ */
+static void
+avl_check_stats (void)
+{
+  avl_tree * tree = avl_tree_new (avl_check_compare_counted, NULL);
+  avl_tree_stats stats;
+  unsigned long count;
+  void * value;
+  long i, height;
+#ifndef NO_THREAD
+  thread_type * threads[AVL_CHECK_STATS_THREADS];
+#endif
+
+  avl_check_compares = 0;
+  for (i = 0; i < 100; i++) {
+    AVL_CHECK (avl_insert (tree, AVL_KEY ((i * 37) % 100)) == 0);
+  }
+  for (i = 0; i < 100; i++) {
+    AVL_CHECK ((avl_get_by_key (tree, AVL_KEY (2 * i), &value) == 0) == (i < 50));
+  }
+  for (i = 0; i < 30; i++) {
+    AVL_CHECK (avl_delete (tree, AVL_KEY (3 * i), NULL) == 0);
+  }
+  AVL_CHECK (avl_delete (tree, AVL_KEY (3), NULL) != 0);
+  AVL_CHECK (avl_tree_get_stats (tree, &stats) == 0);
+  AVL_CHECK (stats.inserts == 100);
+  AVL_CHECK (stats.lookups == 100);
+  AVL_CHECK (stats.deletes == 30);
+  AVL_CHECK (stats.compares == avl_check_compares);
+  AVL_CHECK (stats.rotations > 0);
+
+  avl_tree_reset_stats (tree);
+  AVL_CHECK (avl_tree_get_stats (tree, &stats) == 0);
+  AVL_CHECK (stats.inserts == 0 && stats.lookups == 0 && stats.deletes == 0 &&
+             stats.compares == 0 && stats.rotations == 0 && stats.max_depth == 0);
+
+  /* finding every key reaches the deepest one */
+  height = avl_check_nodes (tree->root->right, tree->root, &count);
+  for (i = 0; i < 100; i++) {
+    avl_get_by_key (tree, AVL_KEY (i), &value);
+  }
+  AVL_CHECK (avl_tree_get_stats (tree, &stats) == 0);
+  AVL_CHECK (stats.lookups == 100 && stats.max_depth == (unsigned long) height);
+  avl_tree_free (tree, NULL);
+
+#ifndef NO_THREAD
+  tree = avl_tree_new (avl_check_compare, NULL);
+  for (i = 0; i < 100; i++) {
+    AVL_CHECK (avl_insert (tree, AVL_KEY (i)) == 0);
+  }
+  avl_tree_reset_stats (tree);
+  for (i = 0; i < AVL_CHECK_STATS_THREADS; i++) {
+    threads[i] = thread_create ("avlcheck", avl_check_stats_lookups, tree, THREAD_ATTACHED);
+    AVL_CHECK (threads[i] != NULL);
+  }
+  for (i = 0, count = 0; i < AVL_CHECK_STATS_THREADS; i++) {
+    if (threads[i]) {
+      thread_join (threads[i]);
+      count += AVL_CHECK_STATS_LOOKUPS;
+    }
+  }
+  AVL_CHECK (avl_tree_get_stats (tree, &stats) == 0);
+  AVL_CHECK (stats.lookups == count);
+  avl_tree_free (tree, NULL);
+#endif
+}
+#endif
+
+/*
+ * Compact trees through growth of the slot array, deletes whose slots
+ * are reused by the inserts after them, equal keys and bulk loading;
+ * avl_verify() checks balance and ranks of these.
+ */
+static void
+avl_check_compact (void)
+{
+  avl_tree * tree = avl_tree_new_ex (avl_check_compare, NULL, AVL_TREE_FLAG_COMPACT);
+  static long expect[1000];
+  static void * keys[1000];
+  unsigned long count;
+  void * value;
+  long i;
+
+  AVL_CHECK (tree != NULL);
+  AVL_CHECK (avl_tree_new_ex (avl_check_compare, NULL,
+                              AVL_TREE_FLAG_COMPACT | AVL_TREE_FLAG_BTREE) == NULL);
+  for (i = 0; i < 1000; i++) {
+    AVL_CHECK (avl_insert (tree, AVL_KEY ((i * 389) % 1000)) == 0);
+    expect[i] = i;
+  }
+  AVL_CHECK (avl_check_inorder (tree, expect, 1000));
+  AVL_CHECK (avl_verify (tree) == 0);
+
+  avl_check_freed = 0;
+  for (i = 0; i < 1000; i += 3) {
+    AVL_CHECK (avl_delete (tree, AVL_KEY (i), avl_check_free_key) == 0);
+  }
+  AVL_CHECK (avl_check_freed == 334);
+  AVL_CHECK (avl_delete (tree, AVL_KEY (3), NULL) != 0);
+  for (i = 0, count = 0; i < 1000; i++) {
+    if (i % 3) {
+      expect[count++] = i;
+    }
+  }
+  AVL_CHECK (avl_check_inorder (tree, expect, count));
+  AVL_CHECK (avl_verify (tree) == 0);
+  AVL_CHECK (avl_get_by_key (tree, AVL_KEY (500), &value) == 0 && value == AVL_KEY (500));
+  AVL_CHECK (avl_get_by_key (tree, AVL_KEY (501), &value) != 0);
+  AVL_CHECK (avl_get_by_index (tree, 400, &value) == 0 && value == AVL_KEY (expect[400]));
+
+  /* into the freed slots, one of them twice */
+  for (i = 0; i < 1000; i += 3) {
+    AVL_CHECK (avl_insert (tree, AVL_KEY (i)) == 0);
+  }
+  AVL_CHECK (avl_insert (tree, AVL_KEY (999)) == 0);
+  for (i = 0; i < 1000; i++) {
+    expect[i] = i;
+  }
+  AVL_CHECK (tree->length == 1001);
+  AVL_CHECK (avl_get_by_index (tree, 1000, &value) == 0 && value == AVL_KEY (999));
+  AVL_CHECK (avl_delete (tree, AVL_KEY (999), NULL) == 0);
+  AVL_CHECK (avl_check_inorder (tree, expect, 1000));
+  AVL_CHECK (avl_verify (tree) == 0);
+  avl_tree_free (tree, NULL);
+
+  tree = avl_tree_new_ex (avl_check_compare, NULL, AVL_TREE_FLAG_COMPACT);
+  for (i = 0; i < 1000; i++) {
+    keys[i] = AVL_KEY (2 * i);
+    expect[i] = 2 * i;
+  }
+  AVL_CHECK (avl_tree_build_sorted (tree, keys, 1000, 1) == 0);
+  AVL_CHECK (avl_check_inorder (tree, expect, 1000));
+  AVL_CHECK (avl_verify (tree) == 0);
+  AVL_CHECK (avl_insert (tree, AVL_KEY (1)) == 0);
+  AVL_CHECK (avl_get_by_index (tree, 1, &value) == 0 && value == AVL_KEY (1));
+  AVL_CHECK (avl_verify (tree) == 0);
+  avl_check_freed = 0;
+  avl_tree_free (tree, avl_check_free_key);
+  AVL_CHECK (avl_check_freed == 1001);
+}
+
+typedef struct {
+  unsigned long         first;
+  unsigned long         count;
+  const long *          expect;
+  int                   wrong;
+} avl_check_around;
+
+/* every call has to be the next index of the sorted reference */
+static int
+avl_check_around_key (unsigned long index, void * key, void * iter_arg)
+{
+  avl_check_around * around = (avl_check_around *) iter_arg;
+
+  if (index != around->first + around->count || (long) key != around->expect[index]) {
+    around->wrong = 1;
+  }
+  around->count++;
+  return 0;
+}
+
+/*
+ * Bounds, counts and the walk around a key for every key and every gap
+ * of node, btree, compact and frozen trees with runs of equal keys,
+ * against counting in a sorted array.
+ */
+static void
+avl_check_order_statistics (void)
+{
+  static const unsigned int flags[4] = {
+    AVL_TREE_FLAG_NONE, AVL_TREE_FLAG_BTREE, AVL_TREE_FLAG_COMPACT, AVL_TREE_FLAG_NONE
+  };
+  static long expect[400];
+  avl_check_around around;
+  unsigned long lower, upper, j;
+  unsigned int f;
+  long i;
+
+  /* 0, 3, 6, ... each as often as its index modulo 4, plus one */
+  for (i = 0, j = 0; j < 400; i++) {
+    long n;
+    for (n = 0; n <= i % 4 && j < 400; n++) {
+      expect[j++] = 3 * i;
+    }
+  }
+
+  for (f = 0; f < 4; f++) {
+    avl_tree * tree = avl_tree_new_ex (avl_check_compare, NULL, flags[f]);
+
+    for (j = 0; j < 400; j++) {
+      AVL_CHECK (avl_insert (tree, AVL_KEY (expect[(j * 37) % 400])) == 0);
+    }
+    if (f == 3) {
+      AVL_CHECK (avl_tree_freeze (tree) == 0);
+    }
+    AVL_CHECK (avl_check_inorder (tree, expect, 400));
+
+    for (i = -1; i <= expect[399] + 1; i++) {
+      for (lower = 0; lower < 400 && expect[lower] < i; lower++);
+      for (upper = lower; upper < 400 && expect[upper] == i; upper++);
+      AVL_CHECK (avl_get_lower_bound (tree, AVL_KEY (i)) == lower);
+      AVL_CHECK (avl_get_upper_bound (tree, AVL_KEY (i)) == upper);
+      AVL_CHECK (avl_get_count_by_two_keys (tree, AVL_KEY (i), AVL_KEY (i)) == upper - lower);
+      for (j = lower; j < 400 && expect[j] <= i + 20; j++);
+      AVL_CHECK (avl_get_count_by_two_keys (tree, AVL_KEY (i + 20), AVL_KEY (i)) == j - lower);
+
+      around.first = lower > 5 ? lower - 5 : 0;
+      around.count = 0;
+      around.expect = expect;
+      around.wrong = 0;
+      AVL_CHECK (avl_iterate_around_key (tree, AVL_KEY (i), 5, 7, avl_check_around_key, &around) == 0);
+      AVL_CHECK (!around.wrong);
+      AVL_CHECK (around.count == (lower - around.first) + (lower + 7 <= 400 ? 7 : 400 - lower));
+    }
+    avl_tree_free (tree, NULL);
+  }
+}
+
+int
+main (int argc, char ** argv)
+{
+#ifndef NO_THREAD
+  thread_initialize ();
+#endif
+
+  avl_check_rcu ();
+  avl_check_btree ();
+  avl_check_slab ();
+  avl_check_build_sorted ();
+  avl_check_intrusive ();
+  avl_check_batch ();
+  avl_check_finger ();
+  avl_check_iterate_parallel ();
+  avl_check_hash_index ();
+  avl_check_get_by_key_inline ();
+  avl_check_iterators ();
+#if !defined(NO_THREAD) && defined(HAVE_AVL_NODE_LOCK)
+  avl_check_node_lock ();
+#endif
+  avl_check_split_join ();
+  avl_check_freeze ();
+  avl_check_snapshot ();
+  avl_check_shard ();
+#ifdef HAVE_AVL_STATS
+  avl_check_stats ();
+#endif
+  avl_check_compact ();
+  avl_check_order_statistics ();
+
+#ifndef NO_THREAD
+  thread_shutdown ();
+#endif
+  if (avl_check_failed) {
+    fprintf (stderr, "%lu checks failed\n", avl_check_failed);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,806 @@
+/* check.c
+**
+** behaviour checks for the http parser, run by "make check"
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Library General Public
+** License as published by the Free Software Foundation; either
+** version 2 of the License, or (at your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Library General Public License for more details.
+**
+** You should have received a copy of the GNU Library General Public
+** License along with this library; if not, write to the
+** Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+** Boston, MA  02110-1301, USA.
+**
+*/
+
+/*
+ * The parser is included rather than linked so the checks can drive
+ * its static steps, like a parse with a smaller arena than any request
+ * gets.  Requests are fixed strings and the vars a parse leaves are
+ * compared as a text dump, one "<ns> <name>=[<value>]..." line per
+ * var.  A failed check prints its line and the program exits with 1
+ * once all checks ran.
+ */
+
+#include "httpp.c"
+
+#define HTTPP_CHECK(expr) _check((expr) != 0, #expr, __LINE__)
+
+#define CHECK_DUMP_SIZE 16384
+
+static unsigned long check_failed = 0;
+
+static void _check(int ok, const char *expr, int line)
+{
+    if (!ok) {
+        fprintf(stderr, "check.c:%d: %s failed\n", line, expr);
+        check_failed++;
+    }
+}
+
+/* all vars of <parser>, namespace by namespace and sorted by name */
+static void _check_dump(http_parser_t *parser, char *out, size_t size)
+{
+    static const httpp_ns_t ns[4] = {HTTPP_NS_VAR, HTTPP_NS_HEADER, HTTPP_NS_QUERY_STRING, HTTPP_NS_POST_BODY};
+    static const char tag[4] = {'V', 'H', 'Q', 'P'};
+    size_t pos = 0;
+    size_t i, j, k;
+
+    out[0] = '\0';
+    for (i = 0; i < 4; i++) {
+        char **keys = httpp_get_any_key(parser, ns[i]);
+
+        if (!keys)
+            continue;
+
+        for (j = 0; keys[j]; j++) {
+            const http_var_t *var = httpp_get_any_var(parser, ns[i], keys[j]);
+
+            if (!var)
+                continue;
+            pos += snprintf(out + pos, size - pos, "%c %s=", tag[i], var->name);
+            for (k = 0; k < var->values && pos < size; k++)
+                pos += snprintf(out + pos, size - pos, "[%s]", var->value[k]);
+            if (pos < size)
+                pos += snprintf(out + pos, size - pos, "\n");
+            if (pos >= size)
+                pos = size - 1;
+        }
+        httpp_free_any_key(keys);
+    }
+}
+
+/* strcmp() that takes NULL for a var that is not there */
+static int _check_same(const char *value, const char *expect)
+{
+    return value && strcmp(value, expect) == 0;
+}
+
+static int _check_dump_is(http_parser_t *parser, const char *expect, int line)
+{
+    static char dump[CHECK_DUMP_SIZE];
+
+    _check_dump(parser, dump, sizeof(dump));
+    if (strcmp(dump, expect) == 0)
+        return 1;
+
+    fprintf(stderr, "check.c:%d: vars are\n%s", line, dump);
+    return 0;
+}
+
+#define CHECK_DUMP_IS(parser, expect) HTTPP_CHECK(_check_dump_is((parser), (expect), __LINE__))
+
+static http_parser_t *_check_parser(unsigned int flags)
+{
+    http_parser_t *parser = httpp_create_parser_ex(flags);
+
+    if (parser)
+        httpp_initialize(parser, NULL);
+
+    return parser;
+}
+
+/* httpp_parse() a copy of <request>, overwritten before it is freed */
+static int _check_parse(http_parser_t *parser, const char *request)
+{
+    size_t len = strlen(request);
+    char *copy = malloc(len);
+    int ret;
+
+    memcpy(copy, request, len);
+    ret = httpp_parse(parser, copy, len);
+    memset(copy, 'X', len);
+    free(copy);
+
+    return ret;
+}
+
+static const char _check_request[] =
+    "GET /a%20b/c?x=1&y=%41B&x=2&z= HTTP/1.1\r\n"
+    "Host: example.org\r\n"
+    "X-Thing: a:b\r\n"
+    "User-Agent: t/1\r\n"
+    "host: other\r\n"
+    "\r\n";
+
+static const char _check_request_vars[] =
+    "V __protocol=[HTTP]\n"
+    "V __queryargs=[?x=1&y=%41B&x=2&z=]\n"
+    "V __rawuri=[/a%20b/c?x=1&y=%41B&x=2&z=]\n"
+    "V __req_type=[GET]\n"
+    "V __uri=[/a%20b/c]\n"
+    "V __version=[1.1]\n"
+    "H host=[other]\n"
+    "H user-agent=[t/1]\n"
+    "H x-thing=[a:b]\n"
+    "Q x=[1][2]\n"
+    "Q y=[AB]\n";
+
+static void check_zero_copy(void)
+{
+    static char copied[CHECK_DUMP_SIZE];
+    static char borrowed[CHECK_DUMP_SIZE];
+    char request[4096];
+    http_parser_t *parser;
+    const http_var_t *var;
+    http_lines_t table;
+    size_t len;
+    char *data;
+    int lines;
+    int i;
+
+    /* the vars do not depend on the mode nor on the caller's buffer */
+    parser = _check_parser(HTTPP_PARSER_FLAG_NONE);
+    HTTPP_CHECK(_check_parse(parser, _check_request));
+    CHECK_DUMP_IS(parser, _check_request_vars);
+    HTTPP_CHECK(parser->buffer == NULL);
+    HTTPP_CHECK(parser->arena_used == 0);
+    httpp_release(parser);
+
+    parser = _check_parser(HTTPP_PARSER_FLAG_ZERO_COPY);
+    HTTPP_CHECK(_check_parse(parser, _check_request));
+    CHECK_DUMP_IS(parser, _check_request_vars);
+    HTTPP_CHECK(parser->buffer != NULL);
+    /* the replaced host keeps its entry, x's values left the arena */
+    HTTPP_CHECK(parser->arena_used == 12);
+    HTTPP_CHECK(parser->arena_used <= parser->arena_size);
+    var = parser->known[httpp_header_host];
+    HTTPP_CHECK(var && (var->flags & HTTPP_VAR_FLAG_BORROWED));
+    var = parser->known[httpp_header_user_agent];
+    HTTPP_CHECK(var && (var->flags & HTTPP_VAR_FLAG_BORROWED));
+    var = httpp_get_any_var(parser, HTTPP_NS_QUERY_STRING, "x");
+    HTTPP_CHECK(var && var->value != &((http_arena_var_t *)var)->value);
+
+    /* vars set over borrowed ones and deleted ones */
+    httpp_setvar(parser, "host", "after");
+    httpp_setvar(parser, "x-new", "n");
+    httpp_deletevar(parser, HTTPP_VAR_URI);
+    httpp_deletevar(parser, "user-agent");
+    HTTPP_CHECK(_check_same(httpp_getvar(parser, "host"), "after"));
+    HTTPP_CHECK(_check_same(httpp_getvar_id(parser, httpp_header_host), "after"));
+    HTTPP_CHECK(httpp_getvar(parser, HTTPP_VAR_URI) == NULL);
+    HTTPP_CHECK(httpp_getvar_id(parser, httpp_header_user_agent) == NULL);
+    HTTPP_CHECK(_check_same(httpp_getvar(parser, "x-thing"), "a:b"));
+    httpp_release(parser);
+
+    /* vars the caller set before: headers are replaced, query
+     * parameters get the request's values appended, copied
+     */
+    for (i = 0; i < 2; i++) {
+        parser = _check_parser(i ? HTTPP_PARSER_FLAG_ZERO_COPY : HTTPP_PARSER_FLAG_NONE);
+        httpp_set_query_param(parser, "x", "0");
+        httpp_setvar(parser, "host", "pre");
+        HTTPP_CHECK(_check_parse(parser, "GET /p?x=1&x=2&w=3 HTTP/1.0\r\nHost: h\r\n\r\n"));
+        CHECK_DUMP_IS(parser,
+            "V __protocol=[HTTP]\n"
+            "V __queryargs=[?x=1&x=2&w=3]\n"
+            "V __rawuri=[/p?x=1&x=2&w=3]\n"
+            "V __req_type=[GET]\n"
+            "V __uri=[/p]\n"
+            "V __version=[1.0]\n"
+            "H host=[h]\n"
+            "Q w=[3]\n"
+            "Q x=[0][1][2]\n");
+        if (i) {
+            var = httpp_get_any_var(parser, HTTPP_NS_QUERY_STRING, "x");
+            HTTPP_CHECK(var && !(var->flags & HTTPP_VAR_FLAG_BORROWED));
+            var = httpp_get_any_var(parser, HTTPP_NS_QUERY_STRING, "w");
+            HTTPP_CHECK(var && (var->flags & HTTPP_VAR_FLAG_BORROWED));
+            var = parser->known[httpp_header_host];
+            HTTPP_CHECK(var && (var->flags & HTTPP_VAR_FLAG_BORROWED));
+        }
+        httpp_release(parser);
+    }
+
+    /* every '&' gets its room in the arena */
+    len = snprintf(request, sizeof(request), "GET /many?");
+    for (i = 0; i < 200; i++)
+        len += snprintf(request + len, sizeof(request) - len, "%sk%03d=%d", i ? "&" : "", i, i);
+    len += snprintf(request + len, sizeof(request) - len, " HTTP/1.1\r\nHost: h\r\n\r\n");
+    HTTPP_CHECK(len < sizeof(request));
+
+    parser = _check_parser(HTTPP_PARSER_FLAG_NONE);
+    HTTPP_CHECK(_check_parse(parser, request));
+    _check_dump(parser, copied, sizeof(copied));
+    httpp_release(parser);
+
+    parser = _check_parser(HTTPP_PARSER_FLAG_ZERO_COPY);
+    HTTPP_CHECK(_check_parse(parser, request));
+    _check_dump(parser, borrowed, sizeof(borrowed));
+    HTTPP_CHECK(strcmp(copied, borrowed) == 0);
+    HTTPP_CHECK(parser->arena_used == PARSE_FIXED_VARS + 1 + 200);
+    HTTPP_CHECK(parser->arena_used <= parser->arena_size);
+    HTTPP_CHECK(_check_same(httpp_get_query_param(parser, "k199"), "199"));
+    httpp_release(parser);
+
+    /* a full arena: httpp_parse() with room for three vars only, the
+     * rest is copied and freed with the parser
+     */
+    parser = _check_parser(HTTPP_PARSER_FLAG_ZERO_COPY);
+    len = strlen(_check_request);
+    data = _httpp_borrow_data(parser, _check_request, len);
+    HTTPP_CHECK(data != NULL);
+    if (data) {
+        parser->arena_size = 3;
+        lines = split_headers(data, len, &table);
+        HTTPP_CHECK(parse_request_line(parser, table.line[0], data + len + 1));
+        parse_headers(parser, &table, lines);
+        CHECK_DUMP_IS(parser, _check_request_vars);
+        HTTPP_CHECK(parser->arena_used == 3);
+        var = parser->known[httpp_header_host];
+        HTTPP_CHECK(var && !(var->flags & HTTPP_VAR_FLAG_BORROWED));
+        HTTPP_CHECK(_check_same(httpp_getvar_id(parser, httpp_header_host), "other"));
+    }
+    httpp_release(parser);
+}
+
+static const char _check_feed_request[] =
+    "POST /upload?id=7 HTTP/1.1\r\n"
+    "Host: example.org\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 4\r\n"
+    "X-Long: a value long enough to reach over a line buffer of 16 bytes\r\n"
+    "\r\n";
+
+/* what httpp_parse() makes of <request>, for httpp_feed() to match */
+static void _check_parsed(const char *request, char *out, size_t size)
+{
+    http_parser_t *parser = _check_parser(HTTPP_PARSER_FLAG_NONE);
+
+    HTTPP_CHECK(_check_parse(parser, request));
+    _check_dump(parser, out, size);
+    httpp_release(parser);
+}
+
+static void check_feed(void)
+{
+    static char parsed[CHECK_DUMP_SIZE];
+    static char fed[CHECK_DUMP_SIZE];
+    char request[4096];
+    http_parser_t *parser;
+    size_t head = strlen(_check_feed_request);
+    size_t len, consumed, total, i;
+    int ret;
+
+    /* the request and its body, then nothing more is taken */
+    len = snprintf(request, sizeof(request), "%sBODY", _check_feed_request);
+    _check_parsed(_check_feed_request, parsed, sizeof(parsed));
+
+    parser = _check_parser(HTTPP_PARSER_FLAG_NONE);
+    HTTPP_CHECK(httpp_feed(parser, request, len, &consumed) == HTTPP_FEED_DONE);
+    HTTPP_CHECK(consumed == head);
+    HTTPP_CHECK(strcmp(request + consumed, "BODY") == 0);
+    HTTPP_CHECK(parser->req_type == httpp_req_post);
+    _check_dump(parser, fed, sizeof(fed));
+    HTTPP_CHECK(strcmp(parsed, fed) == 0);
+    HTTPP_CHECK(httpp_feed(parser, "more", 4, &consumed) == HTTPP_FEED_DONE);
+    HTTPP_CHECK(consumed == 0);
+    HTTPP_CHECK(httpp_feed(parser, NULL, 0, NULL) == HTTPP_FEED_DONE);
+    httpp_release(parser);
+
+    /* a byte at a time */
+    parser = _check_parser(HTTPP_PARSER_FLAG_NONE);
+    for (i = 0; i < head - 1; i++) {
+        ret = httpp_feed(parser, request + i, 1, &consumed);
+        HTTPP_CHECK(ret == HTTPP_FEED_NEED_MORE);
+        HTTPP_CHECK(consumed == 1);
+        if (ret != HTTPP_FEED_NEED_MORE)
+            break;
+    }
+    HTTPP_CHECK(httpp_feed(parser, request + head - 1, 1, &consumed) == HTTPP_FEED_DONE);
+    HTTPP_CHECK(consumed == 1);
+    HTTPP_CHECK(httpp_feed(parser, request + head, 1, &consumed) == HTTPP_FEED_DONE);
+    HTTPP_CHECK(consumed == 0);
+    _check_dump(parser, fed, sizeof(fed));
+    HTTPP_CHECK(strcmp(parsed, fed) == 0);
+    httpp_release(parser);
+
+    /* in two pieces, cut at every offset */
+    for (i = 0; i <= len; i++) {
+        parser = _check_parser(HTTPP_PARSER_FLAG_NONE);
+        ret = httpp_feed(parser, request, i, &consumed);
+        HTTPP_CHECK(ret == (i < head ? HTTPP_FEED_NEED_MORE : HTTPP_FEED_DONE));
+        HTTPP_CHECK(consumed == (i < head ? i : head));
+        total = consumed;
+        if (i < head) {
+            HTTPP_CHECK(httpp_feed(parser, request + i, len - i, &consumed) == HTTPP_FEED_DONE);
+            total += consumed;
+        }
+        HTTPP_CHECK(total == head);
+        _check_dump(parser, fed, sizeof(fed));
+        HTTPP_CHECK(strcmp(parsed, fed) == 0);
+        httpp_release(parser);
+    }
+
+    /* "\n" line ends and more header lines than httpp_parse() takes */
+    len = snprintf(request, sizeof(request), "GET /n HTTP/1.0\n");
+    for (i = 0; i < MAX_HEADERS + 8; i++)
+        len += snprintf(request + len, sizeof(request) - len, "X-H%02u: %u\n", (unsigned int)i, (unsigned int)i);
+    len += snprintf(request + len, sizeof(request) - len, "\n");
+    _check_parsed(request, parsed, sizeof(parsed));
+    HTTPP_CHECK(strstr(parsed, "H x-h30=[30]\n") != NULL);
+    HTTPP_CHECK(strstr(parsed, "x-h31") == NULL);
+    for (i = 1; i <= 7; i += 6) {
+        size_t at;
+
+        parser = _check_parser(HTTPP_PARSER_FLAG_NONE);
+        ret = HTTPP_FEED_NEED_MORE;
+        for (at = 0; at < len && ret == HTTPP_FEED_NEED_MORE; at += consumed)
+            ret = httpp_feed(parser, request + at, at + i < len ? i : len - at, &consumed);
+        HTTPP_CHECK(ret == HTTPP_FEED_DONE);
+        HTTPP_CHECK(at == len);
+        _check_dump(parser, fed, sizeof(fed));
+        HTTPP_CHECK(strcmp(parsed, fed) == 0);
+        httpp_release(parser);
+    }
+
+    /* requests it does not take, and keeps not taking */
+    parser = _check_parser(HTTPP_PARSER_FLAG_NONE);
+    HTTPP_CHECK(httpp_feed(parser, "BREW /pot HTTP/1.1\r\n\r\n", 22, &consumed) == HTTPP_FEED_ERROR);
+    HTTPP_CHECK(httpp_feed(parser, "GET / HTTP/1.1\r\n\r\n", 18, &consumed) == HTTPP_FEED_ERROR);
+    HTTPP_CHECK(consumed == 0);
+    httpp_release(parser);
+
+    /* an unknown method is refused at its end, before the line is in */
+    parser = _check_parser(HTTPP_PARSER_FLAG_NONE);
+    HTTPP_CHECK(httpp_feed(parser, "GETS", 4, &consumed) == HTTPP_FEED_NEED_MORE);
+    HTTPP_CHECK(httpp_feed(parser, " ", 1, &consumed) == HTTPP_FEED_ERROR);
+    httpp_release(parser);
+
+    parser = _check_parser(HTTPP_PARSER_FLAG_NONE);
+    HTTPP_CHECK(httpp_feed(parser, "GET\r\n", 5, &consumed) == HTTPP_FEED_ERROR);
+    httpp_release(parser);
+
+    parser = _check_parser(HTTPP_PARSER_FLAG_NONE);
+    HTTPP_CHECK(httpp_feed(parser, NULL, 1, &consumed) == HTTPP_FEED_ERROR);
+    HTTPP_CHECK(consumed == 0);
+    httpp_release(parser);
+
+    /* headers that never end */
+    parser = _check_parser(HTTPP_PARSER_FLAG_NONE);
+    HTTPP_CHECK(httpp_feed(parser, "GET / HTTP/1.1\r\n", 16, &consumed) == HTTPP_FEED_NEED_MORE);
+    memset(request, 'a', sizeof(request));
+    ret = HTTPP_FEED_NEED_MORE;
+    for (i = 0; i < FEED_MAX_SIZE / sizeof(request) + 1 && ret == HTTPP_FEED_NEED_MORE; i++)
+        ret = httpp_feed(parser, request, sizeof(request), &consumed);
+    HTTPP_CHECK(ret == HTTPP_FEED_ERROR);
+    httpp_release(parser);
+}
+
+#define CHECK_SPLIT_SCALAR  0
+#define CHECK_SPLIT_SSE2    1
+#define CHECK_SPLIT_AVX2    2
+#define CHECK_SPLIT_HEADERS 3
+
+/* split_headers() with the given loops only, 0 if this build or CPU
+ * has not got them
+ */
+static int _check_split(int mode, char *data, unsigned long len, http_lines_t *table, int *lines)
+{
+    http_split_t split;
+    unsigned long i = 0;
+
+    memset(table, 0, sizeof(*table));
+    if (mode == CHECK_SPLIT_HEADERS) {
+        *lines = split_headers(data, len, table);
+        return 1;
+    }
+
+    split.table = table;
+    split.lines = 0;
+    split.ended = 0;
+    split.done = 0;
+    table->line[0] = data;
+    table->colon[0] = NULL;
+
+    switch (mode) {
+        case CHECK_SPLIT_SCALAR:
+        break;
+        case CHECK_SPLIT_SSE2:
+#ifdef HTTPP_SPLIT_SSE2
+            i = _split_sse2(&split, data, 0, len);
+        break;
+#else
+            return 0;
+#endif
+        case CHECK_SPLIT_AVX2:
+#ifdef HTTPP_SPLIT_AVX2
+            if (!__builtin_cpu_supports("avx2"))
+                return 0;
+            i = _split_avx2(&split, data, len);
+            if (!split.done)
+                i = _split_sse2(&split, data, i, len);
+        break;
+#else
+            return 0;
+#endif
+    }
+
+    for (; i < len && !split.done; i++) {
+        switch (data[i]) {
+            case '\0':
+            case '\r':
+            case '\n':
+            case ':':
+                _split_at(&split, data, i, len);
+            break;
+        }
+    }
+
+    if (!split.ended)
+        table->len[split.lines] = &data[len] - table->line[split.lines];
+
+    *lines = split.lines;
+    return 1;
+}
+
+static long _check_offset(const char *data, const char *p)
+{
+    return p ? (long)(p - data) : -1;
+}
+
+/* every way to split <request> and its prefixes gives the same lines */
+static void _check_split_same(const char *request, unsigned long size)
+{
+    char *scalar = malloc(size + 1);
+    char *data = malloc(size + 1);
+    http_lines_t want, table;
+    unsigned long len;
+    int want_lines, lines;
+    int mode, i;
+
+    for (len = 0; len <= size; len++) {
+        memcpy(scalar, request, len);
+        scalar[len] = '\0';
+        _check_split(CHECK_SPLIT_SCALAR, scalar, len, &want, &want_lines);
+        HTTPP_CHECK(want_lines <= MAX_HEADERS);
+
+        for (mode = CHECK_SPLIT_SSE2; mode <= CHECK_SPLIT_HEADERS; mode++) {
+            int same;
+
+            memcpy(data, request, len);
+            data[len] = '\0';
+            if (!_check_split(mode, data, len, &table, &lines))
+                continue;
+
+            same = lines == want_lines && memcmp(data, scalar, len) == 0;
+            for (i = 0; i < MAX_HEADERS && same; i++) {
+                same = _check_offset(data, table.line[i]) == _check_offset(scalar, want.line[i]) &&
+                       _check_offset(data, table.colon[i]) == _check_offset(scalar, want.colon[i]) &&
+                       table.len[i] == want.len[i];
+            }
+            if (!same)
+                fprintf(stderr, "check.c: split %d of %lu bytes differs\n", mode, len);
+            HTTPP_CHECK(same);
+        }
+    }
+
+    free(scalar);
+    free(data);
+}
+
+static void check_split(void)
+{
+    char request[4096];
+    size_t len;
+    int shift, i;
+
+    /* the request line moves every ':', '\r' and '\n' after it across
+     * the 16 and 32 byte blocks, headers of all lengths up to over
+     * MAX_HEADERS lines, values with ':' in them
+     */
+    for (shift = 0; shift < 33; shift++) {
+        len = snprintf(request, sizeof(request), "GET /%.*s HTTP/1.1%s", shift,
+                       "abcdefghijklmnopqrstuvwxyzabcdefghij", shift & 1 ? "\n" : "\r\n");
+        for (i = 0; i < MAX_HEADERS + 4; i++) {
+            len += snprintf(request + len, sizeof(request) - len, "X-%.*s:%s%.*s%s", i % 17 + 1,
+                            "hhhhhhhhhhhhhhhhhh", i % 3 ? " " : "", (i * 7) % 37,
+                            "v:v::vvvvvvvvvvvvvv:vvvvvvvvvvvvvvvvvvvvvvv", (i + shift) % 4 ? "\r\n" : "\n");
+        }
+        len += snprintf(request + len, sizeof(request) - len, "\r\nbody:\r\n");
+        HTTPP_CHECK(len < sizeof(request));
+        _check_split_same(request, len);
+    }
+
+    /* the empty line at every offset, lines without ':', a '\0' */
+    for (shift = 0; shift < 40; shift++) {
+        len = snprintf(request, sizeof(request), "GET / HTTP/1.0\r\nA:%.*s\r\nnocolon\r\n\n", shift,
+                       "0123456789012345678901234567890123456789");
+        _check_split_same(request, len);
+    }
+    memcpy(request, "GET / HTTP/1.0\r\nA: x\0y:z\r\nB: 2\r\n\r\n", 35);
+    _check_split_same(request, 35);
+
+    /* and the parse itself */
+    len = snprintf(request, sizeof(request), "GET /s HTTP/1.1\r\nHost:: h:1\r\nX-Long-Name-Over-Sixteen: v\nA:\r\nB:  b\r\n\r\n");
+    {
+        http_parser_t *parser = _check_parser(HTTPP_PARSER_FLAG_ZERO_COPY);
+
+        HTTPP_CHECK(_check_parse(parser, request));
+        CHECK_DUMP_IS(parser,
+            "V __protocol=[HTTP]\n"
+            "V __req_type=[GET]\n"
+            "V __uri=[/s]\n"
+            "V __version=[1.1]\n"
+            "H b=[b]\n"
+            "H host=[h:1]\n"
+            "H x-long-name-over-sixteen=[v]\n");
+        httpp_release(parser);
+    }
+}
+
+static void check_header_ids(void)
+{
+    static const char *unknown[] = {
+        "", "a", "ho", "hos", "hostx", "date", "server", "cache-control",
+        "content-range", "icy-metaint", "ice-foo", "x-forwarded-host",
+        "accept-", "accept-encodin", "user_agent", "host ", NULL
+    };
+    char request[4096];
+    char name[64];
+    char value[64];
+    http_parser_t *parser;
+    http_varlist_t defaults;
+    char *default_value;
+    size_t len, j;
+    int id, from, mode;
+
+    /* names round trip, in any case, and nothing else is known */
+    for (id = 0; id < httpp_header_unknown; id++) {
+        const char *known = _httpp_header_names[id];
+
+        HTTPP_CHECK(httpp_str_to_header(known) == (httpp_header_e)id);
+        len = strlen(known);
+        for (j = 0; j <= len; j++)
+            name[j] = (j % 2) ? toupper((unsigned char)known[j]) : known[j];
+        HTTPP_CHECK(httpp_str_to_header(name) == (httpp_header_e)id);
+        for (j = 0; j <= len; j++)
+            name[j] = toupper((unsigned char)known[j]);
+        HTTPP_CHECK(httpp_str_to_header(name) == (httpp_header_e)id);
+        name[len - 1] = '\0';
+        HTTPP_CHECK(httpp_str_to_header(name) == httpp_header_unknown);
+        snprintf(name, sizeof(name), "%sa", known);
+        HTTPP_CHECK(httpp_str_to_header(name) == httpp_header_unknown);
+        snprintf(name, sizeof(name), "x%s", known);
+        HTTPP_CHECK(httpp_str_to_header(name) == httpp_header_unknown);
+    }
+    for (j = 0; unknown[j]; j++)
+        HTTPP_CHECK(httpp_str_to_header(unknown[j]) == httpp_header_unknown);
+
+    /* every known header of a request, copied and borrowed, in two
+     * requests as there are more than a request takes
+     */
+    for (mode = 0; mode < 2; mode++) {
+        for (from = 0; from < httpp_header_unknown; from += httpp_header_unknown / 2) {
+            parser = _check_parser(mode ? HTTPP_PARSER_FLAG_ZERO_COPY : HTTPP_PARSER_FLAG_NONE);
+            len = snprintf(request, sizeof(request), "GET / HTTP/1.1\r\n");
+            for (id = from; id < from + httpp_header_unknown / 2; id++) {
+                const char *known = _httpp_header_names[id];
+
+                for (j = 0; known[j]; j++)
+                    name[j] = (j == 0 || known[j - 1] == '-') ? toupper((unsigned char)known[j]) : known[j];
+                name[j] = '\0';
+                len += snprintf(request + len, sizeof(request) - len, "%s: v%d\r\n", name, id);
+            }
+            len += snprintf(request + len, sizeof(request) - len, "\r\n");
+            HTTPP_CHECK(len < sizeof(request));
+            HTTPP_CHECK(_check_parse(parser, request));
+
+            for (id = 0; id < httpp_header_unknown; id++) {
+                const char *known = _httpp_header_names[id];
+
+                if (id < from || id >= from + httpp_header_unknown / 2) {
+                    HTTPP_CHECK(httpp_getvar_id(parser, id) == NULL);
+                    HTTPP_CHECK(httpp_getvar(parser, known) == NULL);
+                    continue;
+                }
+                snprintf(value, sizeof(value), "v%d", id);
+                HTTPP_CHECK(_check_same(httpp_getvar_id(parser, id), value));
+                HTTPP_CHECK(httpp_getvar_id(parser, id) == httpp_getvar(parser, known));
+                HTTPP_CHECK(parser->known[id] && parser->known[id] == httpp_get_any_var(parser, HTTPP_NS_HEADER, known));
+            }
+
+            /* set and deleted by name, by the name as in parser->vars */
+            httpp_setvar(parser, _httpp_header_names[from], "set");
+            HTTPP_CHECK(_check_same(httpp_getvar_id(parser, from), "set"));
+            httpp_deletevar(parser, _httpp_header_names[from + 1]);
+            HTTPP_CHECK(httpp_getvar_id(parser, from + 1) == NULL);
+            HTTPP_CHECK(httpp_getvar(parser, _httpp_header_names[from + 1]) == NULL);
+            httpp_setvar(parser, "HOST", "upper");
+            HTTPP_CHECK(httpp_getvar_id(parser, httpp_header_host) == httpp_getvar(parser, "host"));
+            HTTPP_CHECK(_check_same(httpp_getvar(parser, "HOST"), "upper"));
+
+            HTTPP_CHECK(httpp_getvar_id(parser, httpp_header_unknown) == NULL);
+            HTTPP_CHECK(httpp_getvar_id(parser, (httpp_header_e)-1) == NULL);
+            httpp_release(parser);
+        }
+    }
+
+    /* defaults and httpp_feed() keep the ids too */
+    default_value = "default";
+    memset(&defaults, 0, sizeof(defaults));
+    defaults.var.name = "user-agent";
+    defaults.var.values = 1;
+    defaults.var.value = &default_value;
+    parser = httpp_create_parser();
+    httpp_initialize(parser, &defaults);
+    HTTPP_CHECK(_check_same(httpp_getvar_id(parser, httpp_header_user_agent), "default"));
+    HTTPP_CHECK(httpp_getvar_id(parser, httpp_header_host) == NULL);
+    HTTPP_CHECK(httpp_feed(parser, "GET / HTTP/1.0\r\nhOST: fed\r\n\r\n", 29, NULL) == HTTPP_FEED_DONE);
+    HTTPP_CHECK(_check_same(httpp_getvar_id(parser, httpp_header_host), "fed"));
+    HTTPP_CHECK(_check_same(httpp_getvar_id(parser, httpp_header_user_agent), "default"));
+    httpp_release(parser);
+
+    HTTPP_CHECK(httpp_getvar_id(NULL, httpp_header_host) == NULL);
+}
+
+static const struct {
+    const char *name;
+    httpp_request_type_e type;
+} _check_methods[] = {
+    {"GET", httpp_req_get},
+    {"POST", httpp_req_post},
+    {"PUT", httpp_req_put},
+    {"HEAD", httpp_req_head},
+    {"OPTIONS", httpp_req_options},
+    {"DELETE", httpp_req_delete},
+    {"TRACE", httpp_req_trace},
+    {"CONNECT", httpp_req_connect},
+    {"SOURCE", httpp_req_source},
+    {"PLAY", httpp_req_play},
+    {"STATS", httpp_req_stats},
+    {NULL, httpp_req_unknown}
+};
+
+/* httpp_str_to_method() the slow way */
+static httpp_request_type_e _check_method(const char *method)
+{
+    size_t i;
+
+    for (i = 0; _check_methods[i].name; i++) {
+        if (strcasecmp(method, _check_methods[i].name) == 0)
+            return _check_methods[i].type;
+    }
+
+    return httpp_req_unknown;
+}
+
+static void check_methods(void)
+{
+    static const char *unknown[] = {
+        "", "G", "GE", "GETS", "GET ", " GET", "POS", "POSTS", "OPTION",
+        "OPTIONSS", "OPTIONSOPTIONS", "CONNECTION", "SOURCES", "BREW",
+        "PATCH", "G\xc5T", NULL
+    };
+    const char alphabet[] = "AEGTSaegts@`-";
+    char request[256];
+    char name[16];
+    http_parser_t *parser;
+    size_t i, j, len;
+    unsigned int c;
+    int mode;
+
+    for (i = 0; _check_methods[i].name; i++) {
+        const char *method = _check_methods[i].name;
+
+        len = strlen(method);
+        HTTPP_CHECK(httpp_str_to_method(method) == _check_methods[i].type);
+        for (j = 0; j <= len; j++)
+            name[j] = tolower((unsigned char)method[j]);
+        HTTPP_CHECK(httpp_str_to_method(name) == _check_methods[i].type);
+        name[len - 1] = '\0';
+        HTTPP_CHECK(httpp_str_to_method(name) == httpp_req_unknown);
+
+        /* any other byte anywhere, the nul ending it early */
+        for (j = 0; j < len; j++) {
+            for (c = 1; c < 256; c++) {
+                memcpy(name, method, len + 1);
+                name[j] = (char)c;
+                HTTPP_CHECK(httpp_str_to_method(name) == _check_method(name));
+            }
+        }
+        snprintf(name, sizeof(name), "%s%s", method, method);
+        HTTPP_CHECK(httpp_str_to_method(name) == httpp_req_unknown);
+        memcpy(name, method, len + 1);
+        memcpy(name + len + 1, "XX", 3);
+        HTTPP_CHECK(httpp_str_to_method(name) == _check_methods[i].type);
+    }
+    for (i = 0; unknown[i]; i++)
+        HTTPP_CHECK(httpp_str_to_method(unknown[i]) == httpp_req_unknown);
+
+    /* all short words of letters that hash alike and of the bytes
+     * that lowercase to them
+     */
+    for (i = 0; i < 13 * 13 * 13 * 13; i++) {
+        size_t n = i;
+
+        for (len = 0; len < 4; len++, n /= 13)
+            name[len] = alphabet[n % 13];
+        name[len] = '\0';
+        for (j = 1; j <= len; j++) {
+            char cut = name[j];
+
+            name[j] = '\0';
+            HTTPP_CHECK(httpp_str_to_method(name) == _check_method(name));
+            name[j] = cut;
+        }
+    }
+
+    /* the request line, in both modes */
+    for (mode = 0; mode < 2; mode++) {
+        for (i = 0; _check_methods[i].name; i++) {
+            parser = _check_parser(mode ? HTTPP_PARSER_FLAG_ZERO_COPY : HTTPP_PARSER_FLAG_NONE);
+            snprintf(request, sizeof(request), "%s /m HTTP/1.1\r\n\r\n", _check_methods[i].name);
+            HTTPP_CHECK(_check_parse(parser, request));
+            HTTPP_CHECK(parser->req_type == _check_methods[i].type);
+            HTTPP_CHECK(_check_same(httpp_getvar(parser, HTTPP_VAR_REQ_TYPE), _check_methods[i].name));
+            httpp_release(parser);
+        }
+
+        parser = _check_parser(mode ? HTTPP_PARSER_FLAG_ZERO_COPY : HTTPP_PARSER_FLAG_NONE);
+        HTTPP_CHECK(_check_parse(parser, "pLaY /m HTTP/1.1\r\n\r\n"));
+        HTTPP_CHECK(parser->req_type == httpp_req_play);
+        HTTPP_CHECK(_check_same(httpp_getvar(parser, HTTPP_VAR_REQ_TYPE), "PLAY"));
+        httpp_release(parser);
+
+        parser = _check_parser(mode ? HTTPP_PARSER_FLAG_ZERO_COPY : HTTPP_PARSER_FLAG_NONE);
+        HTTPP_CHECK(!_check_parse(parser, "GETX /m HTTP/1.1\r\n\r\n"));
+        HTTPP_CHECK(parser->req_type == httpp_req_unknown);
+        HTTPP_CHECK(httpp_getvar(parser, HTTPP_VAR_REQ_TYPE) == NULL);
+        httpp_release(parser);
+    }
+
+    /* nothing parsed yet */
+    parser = httpp_create_parser();
+    HTTPP_CHECK(parser->req_type == httpp_req_none);
+    httpp_release(parser);
+}
+
+int main(int argc, char **argv)
+{
+#ifndef NO_THREAD
+    thread_initialize();
+#endif
+
+    check_zero_copy();
+    check_feed();
+    check_split();
+    check_header_ids();
+    check_methods();
+
+#ifndef NO_THREAD
+    thread_shutdown();
+#endif
+
+    if (check_failed) {
+        fprintf(stderr, "%lu checks failed\n", check_failed);
+        return 1;
+    }
+    return 0;
+}
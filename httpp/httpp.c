@@ -34,6 +34,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdint.h>
 #ifdef HAVE_STRINGS_H
 #include <strings.h>
 #endif
@@ -41,7 +42,165 @@
 #include <avl/avl.h>
 #include "httpp.h"
 
+/* split_headers() looks for line ends and colons 16 bytes at a time
+ * with SSE2, or 32 with AVX2 where the CPU has it.  HTTPP_NO_SIMD
+ * keeps it scalar.
+ */
+#if !defined(HTTPP_NO_SIMD) && defined(__GNUC__) && defined(__SSE2__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define HTTPP_SPLIT_SSE2
+#include <emmintrin.h>
+#if defined(__clang__) || __GNUC__ >= 5
+#define HTTPP_SPLIT_AVX2
+#include <immintrin.h>
+#endif
+#endif
+
 #define MAX_HEADERS 32
+/* vars httpp_parse() sets besides headers and query parameters */
+#define PARSE_FIXED_VARS 6
+
+/* http_var_t flags: the var is an entry of the parser's arena and its
+ * name and values point into the parser's buffer
+ */
+#define HTTPP_VAR_FLAG_BORROWED 0x0001U
+
+/* longest header block httpp_feed() accepts, request line included */
+#define FEED_MAX_SIZE 32768
+#define FEED_LINE_MIN 256
+
+/* what httpp_feed() keeps between calls: the line received so far */
+struct http_parser_feed_tag {
+    int state;
+    int lines;
+    /* the method of the request line was looked at */
+    int method;
+    size_t size;
+    char *line;
+    size_t line_len;
+    size_t line_alloc;
+};
+
+/* split_headers() output: the lines, their strlen() and first ':' */
+typedef struct {
+    char *line[MAX_HEADERS];
+    size_t len[MAX_HEADERS];
+    char *colon[MAX_HEADERS];
+} http_lines_t;
+
+/* names of the httpp_header_e ids, as in parser->vars */
+static const char *_httpp_header_names[httpp_header_unknown] = {
+    "accept",
+    "accept-encoding",
+    "accept-language",
+    "authorization",
+    "connection",
+    "content-length",
+    "content-type",
+    "cookie",
+    "expect",
+    "host",
+    "ice-audio-info",
+    "ice-bitrate",
+    "ice-description",
+    "ice-genre",
+    "ice-name",
+    "ice-public",
+    "ice-url",
+    "icy-br",
+    "icy-description",
+    "icy-genre",
+    "icy-metadata",
+    "icy-name",
+    "icy-pub",
+    "icy-url",
+    "if-modified-since",
+    "origin",
+    "range",
+    "referer",
+    "transfer-encoding",
+    "upgrade",
+    "user-agent",
+    "x-forwarded-for"
+};
+
+/* Perfect hash of the names above, lowercased, to their ids:
+ * (len + 25 * name[2] + 4 * name[len - 1]) & 63.  Names are at least
+ * 3 long.
+ */
+#define HEADER_SLOTS 64
+static const unsigned char _httpp_header_slots[HEADER_SLOTS] = {
+    httpp_header_connection, httpp_header_accept,
+    httpp_header_unknown, httpp_header_unknown,
+    httpp_header_unknown, httpp_header_referer,
+    httpp_header_expect, httpp_header_unknown,
+    httpp_header_icy_url, httpp_header_unknown,
+    httpp_header_if_modified_since, httpp_header_unknown,
+    httpp_header_unknown, httpp_header_x_forwarded_for,
+    httpp_header_accept_language, httpp_header_host,
+    httpp_header_unknown, httpp_header_unknown,
+    httpp_header_unknown, httpp_header_unknown,
+    httpp_header_ice_url, httpp_header_unknown,
+    httpp_header_accept_encoding, httpp_header_range,
+    httpp_header_icy_description, httpp_header_authorization,
+    httpp_header_unknown, httpp_header_unknown,
+    httpp_header_unknown, httpp_header_unknown,
+    httpp_header_content_type, httpp_header_icy_br,
+    httpp_header_icy_pub, httpp_header_icy_metadata,
+    httpp_header_unknown, httpp_header_unknown,
+    httpp_header_ice_description, httpp_header_unknown,
+    httpp_header_transfer_encoding, httpp_header_ice_audio_info,
+    httpp_header_unknown, httpp_header_unknown,
+    httpp_header_upgrade, httpp_header_unknown,
+    httpp_header_content_length, httpp_header_icy_name,
+    httpp_header_icy_genre, httpp_header_unknown,
+    httpp_header_unknown, httpp_header_cookie,
+    httpp_header_unknown, httpp_header_ice_public,
+    httpp_header_unknown, httpp_header_unknown,
+    httpp_header_unknown, httpp_header_user_agent,
+    httpp_header_unknown, httpp_header_ice_name,
+    httpp_header_ice_genre, httpp_header_unknown,
+    httpp_header_ice_bitrate, httpp_header_unknown,
+    httpp_header_unknown, httpp_header_origin
+};
+
+/* Methods are looked up as one number: their bytes ORed with 0x20,
+ * which lowercases letters and turns nothing else into one, the first
+ * byte lowest.  (word * METHOD_HASH) >> 60 is a perfect hash of the
+ * known ones.
+ */
+#define METHOD_MAX_LEN 7
+#define METHOD_WORD(a,b,c,d,e,f,g) ((uint64_t)(a) | (uint64_t)(b) << 8 | (uint64_t)(c) << 16 | \
+    (uint64_t)(d) << 24 | (uint64_t)(e) << 32 | (uint64_t)(f) << 40 | (uint64_t)(g) << 48)
+#define METHOD_HASH 0xefac6de6c7c66f53ULL
+
+static const struct {
+    uint64_t word;
+    httpp_request_type_e type;
+} _httpp_methods[16] = {
+    {0, httpp_req_unknown},
+    {METHOD_WORD('t','r','a','c','e',0,0), httpp_req_trace},
+    {METHOD_WORD('h','e','a','d',0,0,0), httpp_req_head},
+    {0, httpp_req_unknown},
+    {METHOD_WORD('g','e','t',0,0,0,0), httpp_req_get},
+    {METHOD_WORD('p','l','a','y',0,0,0), httpp_req_play},
+    {0, httpp_req_unknown},
+    {METHOD_WORD('p','u','t',0,0,0,0), httpp_req_put},
+    {0, httpp_req_unknown},
+    {METHOD_WORD('p','o','s','t',0,0,0), httpp_req_post},
+    {0, httpp_req_unknown},
+    {METHOD_WORD('o','p','t','i','o','n','s'), httpp_req_options},
+    {METHOD_WORD('s','t','a','t','s',0,0), httpp_req_stats},
+    {METHOD_WORD('c','o','n','n','e','c','t'), httpp_req_connect},
+    {METHOD_WORD('d','e','l','e','t','e',0), httpp_req_delete},
+    {METHOD_WORD('s','o','u','r','c','e',0), httpp_req_source}
+};
+
+/* arena entry, single valued vars use <value> as their value array */
+typedef struct {
+    http_var_t var;
+    char *value;
+} http_arena_var_t;
 
 /* internal functions */
 
@@ -52,8 +211,12 @@ static char *_lowercase(char *str);
 static int _compare_vars(void *compare_arg, void *a, void *b);
 static int _free_vars(void *key);
 
+/* avl_get_by_key() with _compare_vars() inlined */
+#define _COMPARE_VARS(a,b) strcmp(((http_var_t *)(a))->name, ((http_var_t *)(b))->name)
+AVL_DEFINE_GET_BY_KEY(_get_var_by_key, _COMPARE_VARS)
+
 /* For avl tree manipulation */
-static void parse_query(avl_tree *tree, const char *query, size_t len);
+static void parse_query(http_parser_t *borrow, avl_tree *tree, const char *query, size_t len);
 static const char *_httpp_get_param(avl_tree *tree, const char *name);
 static void _httpp_set_param_nocopy(avl_tree *tree, char *name, char *value, int replace);
 static void _httpp_set_param(avl_tree *tree, const char *name, const char *value);
@@ -117,15 +280,21 @@ httpp_request_info_t httpp_request_info(httpp_request_type_e req)
 }
 
 http_parser_t *httpp_create_parser(void)
+{
+    return httpp_create_parser_ex(HTTPP_PARSER_FLAG_NONE);
+}
+
+http_parser_t *httpp_create_parser_ex(unsigned int flags)
 {
     http_parser_t *parser = calloc(1, sizeof(http_parser_t));
 
     parser->refc = 1;
+    parser->flags = flags;
     parser->req_type = httpp_req_none;
     parser->uri = NULL;
-    parser->vars = avl_tree_new(_compare_vars, NULL);
-    parser->queryvars = avl_tree_new(_compare_vars, NULL);
-    parser->postvars = avl_tree_new(_compare_vars, NULL);
+    parser->vars = avl_tree_new_ex(_compare_vars, NULL, AVL_TREE_FLAG_INTRUSIVE);
+    parser->queryvars = avl_tree_new_ex(_compare_vars, NULL, AVL_TREE_FLAG_INTRUSIVE);
+    parser->postvars = avl_tree_new_ex(_compare_vars, NULL, AVL_TREE_FLAG_INTRUSIVE);
 
     return parser;
 }
@@ -147,79 +316,370 @@ void httpp_initialize(http_parser_t *parser, http_varlist_t *defaults)
     }
 }
 
-static int split_headers(char *data, unsigned long len, char **line)
+/* the method in the <len> bytes at <method>, any case */
+static httpp_request_type_e _httpp_method(const char *method, size_t len)
 {
-    /* first we count how many lines there are 
-    ** and set up the line[] array     
-    */
-    int lines = 0;
+    uint64_t word = 0;
+    unsigned int slot;
+    size_t i;
+
+    if (len > METHOD_MAX_LEN)
+        return httpp_req_unknown;
+
+    for (i = 0; i < len; i++)
+        word |= (uint64_t)((unsigned char)method[i] | 0x20) << (8 * i);
+
+    slot = (word * METHOD_HASH) >> 60;
+
+    return _httpp_methods[slot].word == word ? _httpp_methods[slot].type : httpp_req_unknown;
+}
+
+static unsigned int _httpp_header_slot(const char *name, size_t len)
+{
+    return (len + 25 * ((unsigned char)name[2] | 0x20) + 4 * ((unsigned char)name[len - 1] | 0x20)) % HEADER_SLOTS;
+}
+
+/* id of the <len> byte header <name>, any case */
+static httpp_header_e _httpp_header_id(const char *name, size_t len)
+{
+    httpp_header_e id;
+
+    if (len < 3)
+        return httpp_header_unknown;
+
+    id = _httpp_header_slots[_httpp_header_slot(name, len)];
+    /* a match stops strncasecmp() before the end of a shorter name */
+    if (id == httpp_header_unknown || strncasecmp(name, _httpp_header_names[id], len) != 0 ||
+        _httpp_header_names[id][len] != '\0')
+        return httpp_header_unknown;
+
+    return id;
+}
+
+/* id of the var named <name> in parser->vars, which is case sensitive */
+static httpp_header_e _httpp_var_id(const char *name)
+{
+    size_t len = strlen(name);
+    httpp_header_e id;
+
+    if (len < 3)
+        return httpp_header_unknown;
+
+    id = _httpp_header_slots[_httpp_header_slot(name, len)];
+    /* parsed headers use the names above */
+    if (id == httpp_header_unknown || (name != _httpp_header_names[id] && strcmp(name, _httpp_header_names[id]) != 0))
+        return httpp_header_unknown;
+
+    return id;
+}
+
+/* keep parser->known in line with <var>, just put into parser->vars */
+static void _httpp_known_set(http_parser_t *parser, http_var_t *var)
+{
+    httpp_header_e id = _httpp_var_id(var->name);
+
+    if (id != httpp_header_unknown)
+        parser->known[id] = var;
+}
+
+/* whether <p> points into the parser's buffer */
+static int _httpp_is_borrowed(http_parser_t *parser, const void *p)
+{
+    const char *buffer = parser->buffer;
+
+    return buffer && (const char *)p >= buffer && (const char *)p < buffer + parser->buffer_size;
+}
+
+/* Copy the request into a new buffer owned by the parser: the arena
+ * first, then the request, then as much room again for strings derived
+ * from it.  NULL if the parser copies vars or parsed into a buffer
+ * before; the vars of that parse still point into it.
+ */
+static char *_httpp_borrow_data(http_parser_t *parser, const char *http_data, unsigned long len)
+{
+    size_t vars = MAX_HEADERS + PARSE_FIXED_VARS + 1;
     unsigned long i;
-    line[lines] = data;
-    for (i = 0; i < len && lines < MAX_HEADERS; i++) {
-        if (data[i] == '\r')
-            data[i] = '\0';
-        if (data[i] == '\n') {
-            lines++;
+    char *data;
+
+    if (!(parser->flags & HTTPP_PARSER_FLAG_ZERO_COPY) || parser->buffer)
+        return NULL;
+
+    /* every '&' in the request line may start a query parameter */
+    for (i = 0; i < len && http_data[i] != '\n'; i++) {
+        if (http_data[i] == '&')
+            vars++;
+    }
+
+    parser->buffer_size = vars * sizeof(http_arena_var_t) + 2 * (len + 1);
+    parser->buffer = malloc(parser->buffer_size);
+    if (!parser->buffer)
+        return NULL;
+    parser->arena = parser->buffer;
+    parser->arena_used = 0;
+    parser->arena_size = vars;
+
+    data = (char *)parser->buffer + vars * sizeof(http_arena_var_t);
+    memcpy(data, http_data, len);
+    data[len] = 0;
+
+    return data;
+}
+
+static void _httpp_release_data(http_parser_t *parser, char *data)
+{
+    if (!_httpp_is_borrowed(parser, data))
+        free(data);
+}
+
+/* like _httpp_set_param_nocopy() for strings in the parser's buffer */
+static void _httpp_set_borrowed(http_parser_t *parser, avl_tree *tree, char *name, char *value, int replace)
+{
+    http_var_t *found = _httpp_get_param_var(tree, name);
+    http_arena_var_t *entry;
+    char **n;
+
+    if (found && !replace && (found->flags & HTTPP_VAR_FLAG_BORROWED)) {
+        /* another value for a query parameter, the array leaves the arena */
+        if (found->value == &((http_arena_var_t *)found)->value) {
+            n = malloc(sizeof(*n) * 2);
+            if (n)
+                n[0] = found->value[0];
+        } else {
+            n = realloc(found->value, sizeof(*n) * (found->values + 1));
+        }
+        if (!n)
+            return;
+        found->value = n;
+        found->value[found->values++] = value;
+        return;
+    }
+
+    if ((found && !replace) || parser->arena_used == parser->arena_size) {
+        /* appending to a var of the caller's, or out of room */
+        _httpp_set_param_nocopy(tree, strdup(name), strdup(value), replace);
+        if (tree == parser->vars && (found = _httpp_get_param_var(tree, name)) != NULL)
+            _httpp_known_set(parser, found);
+        return;
+    }
+
+    entry = (http_arena_var_t *)parser->arena + parser->arena_used++;
+    memset(entry, 0, sizeof(*entry));
+    entry->var.name = name;
+    entry->var.values = 1;
+    entry->var.value = &entry->value;
+    entry->var.flags = HTTPP_VAR_FLAG_BORROWED;
+    entry->value = value;
+
+    if (found)
+        avl_delete(tree, (void *)found, _free_vars);
+    avl_insert_node(tree, &entry->var.node, (void *)&entry->var);
+    if (tree == parser->vars)
+        _httpp_known_set(parser, &entry->var);
+}
+
+/* httpp_setvar() for strings of the request at <data>, which are not
+ * copied if the parser owns it
+ */
+static void _httpp_setvar_parsed(http_parser_t *parser, const char *data, const char *name, const char *value)
+{
+    if (_httpp_is_borrowed(parser, data)) {
+        _httpp_set_borrowed(parser, parser->vars, (char *)name, (char *)value, 1);
+    } else {
+        httpp_setvar(parser, name, value);
+    }
+}
+
+/* split_headers() state while it walks the request */
+typedef struct {
+    http_lines_t *table;
+    int lines;
+    /* the current line has its '\0' already */
+    int ended;
+    int done;
+} http_split_t;
+
+/* Handle data[i], one of '\0', '\r', '\n' and ':'.  Sets <done> at the
+ * end of the headers.
+ */
+static inline void _split_at(http_split_t *split, char *data, unsigned long i, unsigned long len)
+{
+    http_lines_t *table = split->table;
+    int l = split->lines;
+
+    switch (data[i]) {
+        case ':':
+            if (!split->ended && table->colon[l] == NULL)
+                table->colon[l] = &data[i];
+            return;
+        case '\r':
             data[i] = '\0';
-            if (lines >= MAX_HEADERS)
-                return MAX_HEADERS;
-            if (i + 1 < len) {
-                if (data[i + 1] == '\n' || data[i + 1] == '\r')
-                    break;
-                line[lines] = &data[i + 1];
+            /* fall through */
+        case '\0':
+            if (!split->ended) {
+                table->len[l] = &data[i] - table->line[l];
+                split->ended = 1;
             }
+            return;
+    }
+
+    /* '\n' */
+    data[i] = '\0';
+    if (!split->ended)
+        table->len[l] = &data[i] - table->line[l];
+    split->ended = 1;
+    split->lines = ++l;
+    if (l >= MAX_HEADERS) {
+        split->done = 1;
+    } else if (i + 1 < len) {
+        if (data[i + 1] == '\n' || data[i + 1] == '\r') {
+            split->done = 1;
+        } else {
+            table->line[l] = &data[i + 1];
+            table->colon[l] = NULL;
+            split->ended = 0;
         }
     }
+}
 
-    i++;
-    while (i < len && data[i] == '\n') i++;
+#ifdef HTTPP_SPLIT_SSE2
+/* These look at 16 or 32 bytes at a time from <i> and stop short of
+ * the last block, the bits set are handled in order like the scalar
+ * loop does.
+ */
+static unsigned long _split_sse2(http_split_t *split, char *data, unsigned long i, unsigned long len)
+{
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    const __m128i colon = _mm_set1_epi8(':');
+    const __m128i nul = _mm_setzero_si128();
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        unsigned int mask = _mm_movemask_epi8(_mm_or_si128(
+                    _mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)),
+                    _mm_or_si128(_mm_cmpeq_epi8(v, colon), _mm_cmpeq_epi8(v, nul))));
+
+        for (; mask; mask &= mask - 1) {
+            _split_at(split, data, i + __builtin_ctz(mask), len);
+            if (split->done)
+                return i;
+        }
+    }
 
-    return lines;
+    return i;
 }
+#endif
 
-static void parse_headers(http_parser_t *parser, char **line, int lines)
+#ifdef HTTPP_SPLIT_AVX2
+__attribute__((target("avx2")))
+static unsigned long _split_avx2(http_split_t *split, char *data, unsigned long len)
 {
-    int i, l;
-    int whitespace, slen;
-    char *name = NULL;
-    char *value = NULL;
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    const __m256i colon = _mm256_set1_epi8(':');
+    const __m256i nul = _mm256_setzero_si256();
+    unsigned long i;
 
-    /* parse the name: value lines. */
-    for (l = 1; l < lines; l++) {
-        whitespace = 0;
-        name = line[l];
-        value = NULL;
-        slen = strlen(line[l]);
-        for (i = 0; i < slen; i++) {
-            if (line[l][i] == ':') {
-                whitespace = 1;
-                line[l][i] = '\0';
-            } else {
-                if (whitespace) {
-                    whitespace = 0;
-                    while (i < slen && line[l][i] == ' ')
-                        i++;
-
-                    if (i < slen)
-                        value = &line[l][i];
-                    
-                    break;
-                }
-            }
+    for (i = 0; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_or_si256(
+                    _mm256_or_si256(_mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, lf)),
+                    _mm256_or_si256(_mm256_cmpeq_epi8(v, colon), _mm256_cmpeq_epi8(v, nul))));
+
+        for (; mask; mask &= mask - 1) {
+            _split_at(split, data, i + __builtin_ctz(mask), len);
+            if (split->done)
+                return i;
         }
-        
-        if (name != NULL && value != NULL) {
-            httpp_setvar(parser, _lowercase(name), value);
-            name = NULL; 
-            value = NULL;
+    }
+
+    return i;
+}
+#endif
+
+/* Cut the request into lines in place and fill <table>, counting the
+ * lines up to the empty one ending the headers, at most MAX_HEADERS.
+ */
+static int split_headers(char *data, unsigned long len, http_lines_t *table)
+{
+    http_split_t split;
+    unsigned long i = 0;
+
+    split.table = table;
+    split.lines = 0;
+    split.ended = 0;
+    split.done = 0;
+    table->line[0] = data;
+    table->colon[0] = NULL;
+
+#if defined(HTTPP_SPLIT_AVX2)
+    if (__builtin_cpu_supports("avx2"))
+        i = _split_avx2(&split, data, len);
+    if (!split.done)
+        i = _split_sse2(&split, data, i, len);
+#elif defined(HTTPP_SPLIT_SSE2)
+    i = _split_sse2(&split, data, 0, len);
+#endif
+
+    for (; i < len && !split.done; i++) {
+        switch (data[i]) {
+            case '\0':
+            case '\r':
+            case '\n':
+            case ':':
+                _split_at(&split, data, i, len);
+            break;
         }
     }
+
+    /* the last line ran up to the end of the data */
+    if (!split.ended)
+        table->len[split.lines] = &data[len] - table->line[split.lines];
+
+    return split.lines;
+}
+
+/* one name: value line of <len> bytes, cut up in place at its first ':' */
+static void parse_header_line(http_parser_t *parser, char *line, size_t len, char *colon)
+{
+    char *name = line;
+    char *end = line + len;
+    char *value;
+
+    if (colon == NULL)
+        return;
+
+    value = colon;
+    while (value < end && *value == ':')
+        *value++ = '\0';
+    while (value < end && *value == ' ')
+        value++;
+
+    if (value < end) {
+        httpp_header_e id = _httpp_header_id(name, colon - name);
+
+        if (id != httpp_header_unknown)
+            name = (char *)_httpp_header_names[id];
+        else
+            _lowercase(name);
+        _httpp_setvar_parsed(parser, line, name, value);
+    }
+}
+
+static void parse_headers(http_parser_t *parser, http_lines_t *table, int lines)
+{
+    int l;
+
+    /* parse the name: value lines. */
+    for (l = 1; l < lines; l++)
+        parse_header_line(parser, table->line[l], table->len[l], table->colon[l]);
 }
 
 int httpp_parse_response(http_parser_t *parser, const char *http_data, unsigned long len, const char *uri)
 {
     char *data;
-    char *line[MAX_HEADERS];
+    http_lines_t table;
+    char **line = table.line;
     int lines, slen,i, whitespace=0, where=0,code;
     char *version=NULL, *resp_code=NULL, *message=NULL;
     
@@ -232,7 +692,7 @@ int httpp_parse_response(http_parser_t *parser, const char *http_data, unsigned
     memcpy(data, http_data, len);
     data[len] = 0;
 
-    lines = split_headers(data, len, line);
+    lines = split_headers(data, len, &table);
 
     /* In this case, the first line contains:
      * VERSION RESPONSE_CODE MESSAGE, such as HTTP/1.0 200 OK
@@ -269,7 +729,7 @@ int httpp_parse_response(http_parser_t *parser, const char *http_data, unsigned
     httpp_setvar(parser, HTTPP_VAR_URI, uri);
     httpp_setvar(parser, HTTPP_VAR_REQ_TYPE, "NONE");
 
-    parse_headers(parser, line, lines);
+    parse_headers(parser, &table, lines);
 
     free(data);
 
@@ -284,7 +744,7 @@ int httpp_parse_postdata(http_parser_t *parser, const char *body_data, size_t le
         return -1;
     }
 
-    parse_query(parser->postvars, body_data, len);
+    parse_query(NULL, parser->postvars, body_data, len);
 
     return 0;
 }
@@ -301,27 +761,20 @@ static int hex(char c)
         return -1;
 }
 
-static char *url_unescape(const char *src, size_t len)
+/* decode into <dst>, which may be <src> itself */
+static int url_unescape_to(char *dst, const char *src, size_t len)
 {
-    unsigned char *decoded;
     size_t i;
-    char *dst;
     int done = 0;
 
-    decoded = calloc(1, len + 1);
-
-    dst = (char *)decoded;
-
     for(i=0; i < len; i++) {
         switch(src[i]) {
         case '%':
             if(i+2 >= len) {
-                free(decoded);
-                return NULL;
+                return -1;
             }
             if(hex(src[i+1]) == -1 || hex(src[i+2]) == -1 ) {
-                free(decoded);
-                return NULL;
+                return -1;
             }
 
             *dst++ = hex(src[i+1]) * 16  + hex(src[i+2]);
@@ -334,8 +787,7 @@ static char *url_unescape(const char *src, size_t len)
             done = 1;
             break;
         case 0:
-            free(decoded);
-            return NULL;
+            return -1;
             break;
         default:
             *dst++ = src[i];
@@ -347,10 +799,23 @@ static char *url_unescape(const char *src, size_t len)
 
     *dst = 0; /* null terminator */
 
-    return (char *)decoded;
+    return 0;
 }
 
-static void parse_query_element(avl_tree *tree, const char *start, const char *mid, const char *end)
+static char *url_unescape(const char *src, size_t len)
+{
+    char *decoded = calloc(1, len + 1);
+
+    if (decoded && url_unescape_to(decoded, src, len) != 0) {
+        free(decoded);
+        return NULL;
+    }
+
+    return decoded;
+}
+
+/* with <borrow> set, the query is in its buffer and decoded in place */
+static void parse_query_element(http_parser_t *borrow, avl_tree *tree, const char *start, const char *mid, const char *end)
 {
     size_t keylen;
     char *key;
@@ -370,6 +835,16 @@ static void parse_query_element(avl_tree *tree, const char *start, const char *m
     if (!keylen || !valuelen)
         return;
 
+    if (borrow) {
+        key = (char *)start;
+        value = (char *)mid + 1;
+        if (url_unescape_to(value, value, valuelen) != 0)
+            return;
+        key[keylen] = 0;
+        _httpp_set_borrowed(borrow, tree, key, value, 0);
+        return;
+    }
+
     key = malloc(keylen + 1);
     memcpy(key, start, keylen);
     key[keylen] = 0;
@@ -379,7 +854,7 @@ static void parse_query_element(avl_tree *tree, const char *start, const char *m
     _httpp_set_param_nocopy(tree, key, value, 0);
 }
 
-static void parse_query(avl_tree *tree, const char *query, size_t len)
+static void parse_query(http_parser_t *borrow, avl_tree *tree, const char *query, size_t len)
 {
     const char *start = query;
     const char *mid = NULL;
@@ -391,7 +866,7 @@ static void parse_query(avl_tree *tree, const char *query, size_t len)
     for (i = 0; i < len; i++) {
         switch (query[i]) {
             case '&':
-                parse_query_element(tree, start, mid, &(query[i]));
+                parse_query_element(borrow, tree, start, mid, &(query[i]));
                 start = &(query[i + 1]);
                 mid = NULL;
             break;
@@ -401,30 +876,22 @@ static void parse_query(avl_tree *tree, const char *query, size_t len)
         }
     }
 
-    parse_query_element(tree, start, mid, &(query[i]));
+    parse_query_element(borrow, tree, start, mid, &(query[i]));
 }
 
-int httpp_parse(http_parser_t *parser, const char *http_data, unsigned long len)
+/* Parse the request line, cut up in place, into the parser.  <rawuri>
+ * is room for a copy of the uri when the line is in the parser's
+ * buffer, NULL to copy.  0 if it is not a request line.
+ */
+static int parse_request_line(http_parser_t *parser, char *line, char *rawuri)
 {
-    char *data, *tmp;
-    char *line[MAX_HEADERS]; /* limited to 32 lines, should be more than enough */
+    char *tmp;
     int i;
-    int lines;
     char *req_type = NULL;
     char *uri = NULL;
     char *version = NULL;
     int whitespace, where, slen;
-
-    if (http_data == NULL)
-        return 0;
-
-    /* make a local copy of the data, including 0 terminator */
-    data = (char *)malloc(len+1);
-    if (data == NULL) return 0;
-    memcpy(data, http_data, len);
-    data[len] = 0;
-
-    lines = split_headers(data, len, line);
+    size_t method_len;
 
     /* parse the first line special
     ** the format is:
@@ -434,12 +901,15 @@ int httpp_parse(http_parser_t *parser, const char *http_data, unsigned long len)
     */
     where = 0;
     whitespace = 0;
-    slen = strlen(line[0]);
-    req_type = line[0];
+    slen = strlen(line);
+    req_type = line;
+    method_len = slen;
     for (i = 0; i < slen; i++) {
-        if (line[0][i] == ' ') {
+        if (line[i] == ' ') {
+            if (where == 0 && !whitespace)
+                method_len = i;
             whitespace = 1;
-            line[0][i] = '\0';
+            line[i] = '\0';
         } else {
             /* we're just past the whitespace boundry */
             if (whitespace) {
@@ -447,14 +917,13 @@ int httpp_parse(http_parser_t *parser, const char *http_data, unsigned long len)
                 where++;
                 switch (where) {
                     case 1:
-                        uri = &line[0][i];
+                        uri = &line[i];
                     break;
                     case 2:
-                        version = &line[0][i];
+                        version = &line[i];
                     break;
                     case 3:
                         /* There is an extra element in the request line. This is not HTTP. */
-                        free(data);
                         return 0;
                     break;
                 }
@@ -462,98 +931,247 @@ int httpp_parse(http_parser_t *parser, const char *http_data, unsigned long len)
         }
     }
 
-    parser->req_type = httpp_str_to_method(req_type);
+    parser->req_type = _httpp_method(req_type, method_len);
 
     if (uri != NULL && strlen(uri) > 0) {
         char *query;
         if((query = strchr(uri, '?')) != NULL) {
-            httpp_setvar(parser, HTTPP_VAR_RAWURI, uri);
-            httpp_setvar(parser, HTTPP_VAR_QUERYARGS, query);
+            if (rawuri) {
+                /* the uri is cut up below, keep it whole after the request */
+                strcpy(rawuri, uri);
+                _httpp_setvar_parsed(parser, line, HTTPP_VAR_RAWURI, rawuri);
+                _httpp_setvar_parsed(parser, line, HTTPP_VAR_QUERYARGS, rawuri + (query - uri));
+            } else {
+                httpp_setvar(parser, HTTPP_VAR_RAWURI, uri);
+                httpp_setvar(parser, HTTPP_VAR_QUERYARGS, query);
+            }
             *query = 0;
             query++;
-            parse_query(parser->queryvars, query, strlen(query));
+            parse_query(rawuri ? parser : NULL, parser->queryvars, query, strlen(query));
         }
 
-        parser->uri = strdup(uri);
+        parser->uri = rawuri ? uri : strdup(uri);
     } else {
-        free(data);
         return 0;
     }
 
     if ((version != NULL) && ((tmp = strchr(version, '/')) != NULL)) {
         tmp[0] = '\0';
         if ((strlen(version) > 0) && (strlen(&tmp[1]) > 0)) {
-            httpp_setvar(parser, HTTPP_VAR_PROTOCOL, version);
-            httpp_setvar(parser, HTTPP_VAR_VERSION, &tmp[1]);
+            _httpp_setvar_parsed(parser, line, HTTPP_VAR_PROTOCOL, version);
+            _httpp_setvar_parsed(parser, line, HTTPP_VAR_VERSION, &tmp[1]);
         } else {
-            free(data);
             return 0;
         }
     } else {
-        free(data);
         return 0;
     }
 
     if (parser->req_type != httpp_req_none && parser->req_type != httpp_req_unknown) {
         switch (parser->req_type) {
         case httpp_req_get:
-            httpp_setvar(parser, HTTPP_VAR_REQ_TYPE, "GET");
+            _httpp_setvar_parsed(parser, line, HTTPP_VAR_REQ_TYPE, "GET");
             break;
         case httpp_req_post:
-            httpp_setvar(parser, HTTPP_VAR_REQ_TYPE, "POST");
+            _httpp_setvar_parsed(parser, line, HTTPP_VAR_REQ_TYPE, "POST");
             break;
         case httpp_req_put:
-            httpp_setvar(parser, HTTPP_VAR_REQ_TYPE, "PUT");
+            _httpp_setvar_parsed(parser, line, HTTPP_VAR_REQ_TYPE, "PUT");
             break;
         case httpp_req_head:
-            httpp_setvar(parser, HTTPP_VAR_REQ_TYPE, "HEAD");
+            _httpp_setvar_parsed(parser, line, HTTPP_VAR_REQ_TYPE, "HEAD");
             break;
         case httpp_req_options:
-            httpp_setvar(parser, HTTPP_VAR_REQ_TYPE, "OPTIONS");
+            _httpp_setvar_parsed(parser, line, HTTPP_VAR_REQ_TYPE, "OPTIONS");
             break;
         case httpp_req_delete:
-            httpp_setvar(parser, HTTPP_VAR_REQ_TYPE, "DELETE");
+            _httpp_setvar_parsed(parser, line, HTTPP_VAR_REQ_TYPE, "DELETE");
             break;
         case httpp_req_trace:
-            httpp_setvar(parser, HTTPP_VAR_REQ_TYPE, "TRACE");
+            _httpp_setvar_parsed(parser, line, HTTPP_VAR_REQ_TYPE, "TRACE");
             break;
         case httpp_req_connect:
-            httpp_setvar(parser, HTTPP_VAR_REQ_TYPE, "CONNECT");
+            _httpp_setvar_parsed(parser, line, HTTPP_VAR_REQ_TYPE, "CONNECT");
             break;
         case httpp_req_source:
-            httpp_setvar(parser, HTTPP_VAR_REQ_TYPE, "SOURCE");
+            _httpp_setvar_parsed(parser, line, HTTPP_VAR_REQ_TYPE, "SOURCE");
             break;
         case httpp_req_play:
-            httpp_setvar(parser, HTTPP_VAR_REQ_TYPE, "PLAY");
+            _httpp_setvar_parsed(parser, line, HTTPP_VAR_REQ_TYPE, "PLAY");
             break;
         case httpp_req_stats:
-            httpp_setvar(parser, HTTPP_VAR_REQ_TYPE, "STATS");
+            _httpp_setvar_parsed(parser, line, HTTPP_VAR_REQ_TYPE, "STATS");
             break;
         default:
             break;
         }
     } else {
-        free(data);
         return 0;
     }
 
     if (parser->uri != NULL) {
-        httpp_setvar(parser, HTTPP_VAR_URI, parser->uri);
+        _httpp_setvar_parsed(parser, line, HTTPP_VAR_URI, parser->uri);
     } else {
-        free(data);
         return 0;
     }
 
-    parse_headers(parser, line, lines);
+    return 1;
+}
 
-    free(data);
+int httpp_parse(http_parser_t *parser, const char *http_data, unsigned long len)
+{
+    char *data;
+    http_lines_t table;
+    int lines;
+    int borrowed;
+
+    if (http_data == NULL)
+        return 0;
+
+    data = _httpp_borrow_data(parser, http_data, len);
+    borrowed = data != NULL;
+    if (!borrowed) {
+        /* make a local copy of the data, including 0 terminator */
+        data = (char *)malloc(len+1);
+        if (data == NULL) return 0;
+        memcpy(data, http_data, len);
+        data[len] = 0;
+    }
+
+    lines = split_headers(data, len, &table);
+
+    if (!parse_request_line(parser, table.line[0], borrowed ? data + len + 1 : NULL)) {
+        _httpp_release_data(parser, data);
+        return 0;
+    }
+
+    parse_headers(parser, &table, lines);
+
+    _httpp_release_data(parser, data);
 
     return 1;
 }
 
+static int _httpp_feed_append(struct http_parser_feed_tag *feed, const char *data, size_t len)
+{
+    if (feed->line_len + len >= feed->line_alloc) {
+        size_t alloc = feed->line_alloc ? feed->line_alloc : FEED_LINE_MIN;
+        char *line;
+
+        while (feed->line_len + len >= alloc)
+            alloc *= 2;
+        line = realloc(feed->line, alloc);
+        if (line == NULL)
+            return -1;
+        feed->line = line;
+        feed->line_alloc = alloc;
+    }
+
+    memcpy(feed->line + feed->line_len, data, len);
+    feed->line_len += len;
+
+    return 0;
+}
+
+/* Refuse the request line once its method is in, from the line as it
+ * is so far, if it is none we know; parse_request_line() would too.
+ * <from> is where the bytes just added start.
+ */
+static int _httpp_feed_method(struct http_parser_feed_tag *feed, size_t from)
+{
+    const char *space = memchr(feed->line + from, ' ', feed->line_len - from);
+    size_t len = space ? (size_t)(space - feed->line) : feed->line_len;
+
+    if (space == NULL && len <= METHOD_MAX_LEN)
+        return HTTPP_FEED_NEED_MORE;
+
+    feed->method = 1;
+
+    return _httpp_method(feed->line, len) == httpp_req_unknown ? HTTPP_FEED_ERROR : HTTPP_FEED_NEED_MORE;
+}
+
+/* a whole line is in, handle it like httpp_parse() handles its lines */
+static int _httpp_feed_line(http_parser_t *parser, struct http_parser_feed_tag *feed)
+{
+    char *line = feed->line;
+    char *cr;
+    int ret = HTTPP_FEED_NEED_MORE;
+
+    line[feed->line_len] = '\0';
+    if ((cr = memchr(line, '\r', feed->line_len)) != NULL)
+        *cr = '\0';
+
+    if (feed->lines == 0) {
+        if (!parse_request_line(parser, line, NULL))
+            ret = HTTPP_FEED_ERROR;
+    } else if (line[0] == '\0') {
+        ret = HTTPP_FEED_DONE;
+    } else if (feed->lines < MAX_HEADERS) {
+        size_t len = strlen(line);
+        parse_header_line(parser, line, len, memchr(line, ':', len));
+    }
+
+    feed->lines++;
+    feed->line_len = 0;
+
+    return ret;
+}
+
+int httpp_feed(http_parser_t *parser, const char *data, size_t len, size_t *consumed)
+{
+    struct http_parser_feed_tag *feed;
+    size_t used = 0;
+
+    if (consumed)
+        *consumed = 0;
+
+    if (parser == NULL || (data == NULL && len))
+        return HTTPP_FEED_ERROR;
+
+    feed = parser->feed;
+    if (feed == NULL) {
+        feed = calloc(1, sizeof(*feed));
+        if (feed == NULL)
+            return HTTPP_FEED_ERROR;
+        feed->state = HTTPP_FEED_NEED_MORE;
+        parser->feed = feed;
+    }
+
+    /* each byte is looked at once, partial lines wait in feed->line */
+    while (feed->state == HTTPP_FEED_NEED_MORE && used < len) {
+        const char *eol = memchr(data + used, '\n', len - used);
+        size_t chunk = (eol ? (size_t)(eol - data) + 1 : len) - used;
+
+        if (feed->size + chunk > FEED_MAX_SIZE ||
+            _httpp_feed_append(feed, data + used, eol ? chunk - 1 : chunk) != 0) {
+            feed->state = HTTPP_FEED_ERROR;
+            break;
+        }
+        feed->size += chunk;
+        used += chunk;
+
+        if (feed->lines == 0 && !feed->method)
+            feed->state = _httpp_feed_method(feed, feed->line_len - (eol ? chunk - 1 : chunk));
+        if (eol && feed->state == HTTPP_FEED_NEED_MORE)
+            feed->state = _httpp_feed_line(parser, feed);
+    }
+
+    if (feed->state != HTTPP_FEED_NEED_MORE) {
+        free(feed->line);
+        feed->line = NULL;
+        feed->line_len = feed->line_alloc = 0;
+    }
+
+    if (consumed)
+        *consumed = used;
+
+    return feed->state;
+}
+
 void httpp_deletevar(http_parser_t *parser, const char *name)
 {
     http_var_t var;
+    httpp_header_e id;
 
     if (parser == NULL || name == NULL)
         return;
@@ -561,6 +1179,10 @@ void httpp_deletevar(http_parser_t *parser, const char *name)
 
     var.name = (char*)name;
 
+    id = _httpp_var_id(name);
+    if (id != httpp_header_unknown)
+        parser->known[id] = NULL;
+
     avl_delete(parser->vars, (void *)&var, _free_vars);
 }
 
@@ -585,11 +1207,26 @@ void httpp_setvar(http_parser_t *parser, const char *name, const char *value)
     var->value[0] = strdup(value);
 
     if (httpp_getvar(parser, name) == NULL) {
-        avl_insert(parser->vars, (void *)var);
+        avl_insert_node(parser->vars, &var->node, (void *)var);
     } else {
         avl_delete(parser->vars, (void *)var, _free_vars);
-        avl_insert(parser->vars, (void *)var);
+        avl_insert_node(parser->vars, &var->node, (void *)var);
     }
+    _httpp_known_set(parser, var);
+}
+
+const char *httpp_getvar_id(http_parser_t *parser, httpp_header_e id)
+{
+    http_var_t *var;
+
+    if (parser == NULL || id < 0 || id >= httpp_header_unknown)
+        return NULL;
+
+    var = parser->known[id];
+    if (var == NULL || !var->values)
+        return NULL;
+
+    return var->value[0];
 }
 
 const char *httpp_getvar(http_parser_t *parser, const char *name)
@@ -597,15 +1234,20 @@ const char *httpp_getvar(http_parser_t *parser, const char *name)
     http_var_t var;
     http_var_t *found;
     void *fp;
+    httpp_header_e id;
 
     if (parser == NULL || name == NULL)
         return NULL;
 
+    id = _httpp_var_id(name);
+    if (id != httpp_header_unknown)
+        return httpp_getvar_id(parser, id);
+
     fp = &found;
     memset(&var, 0, sizeof(var));
     var.name = (char*)name;
 
-    if (avl_get_by_key(parser->vars, &var, fp) == 0) {
+    if (_get_var_by_key(parser->vars, &var, fp) == 0) {
         if (!found->values)
             return NULL;
         return found->value[0];
@@ -614,6 +1256,34 @@ const char *httpp_getvar(http_parser_t *parser, const char *name)
     }
 }
 
+/* swap a borrowed var for a copy that may take values of its own */
+static http_var_t *_httpp_unborrow(avl_tree *tree, http_var_t *var)
+{
+    http_var_t *copy = calloc(1, sizeof(http_var_t));
+
+    if (copy == NULL)
+        return NULL;
+
+    copy->name = strdup(var->name);
+    copy->value = calloc(var->values, sizeof(*copy->value));
+    if (!copy->name || !copy->value) {
+        _free_vars(copy);
+        return NULL;
+    }
+    for (; copy->values < var->values; copy->values++) {
+        copy->value[copy->values] = strdup(var->value[copy->values]);
+        if (!copy->value[copy->values]) {
+            _free_vars(copy);
+            return NULL;
+        }
+    }
+
+    avl_delete(tree, (void *)var, _free_vars);
+    avl_insert_node(tree, &copy->node, (void *)copy);
+
+    return copy;
+}
+
 static void _httpp_set_param_nocopy(avl_tree *tree, char *name, char *value, int replace)
 {
     http_var_t *var, *found;
@@ -623,6 +1293,14 @@ static void _httpp_set_param_nocopy(avl_tree *tree, char *name, char *value, int
         return;
 
     found = _httpp_get_param_var(tree, name);
+    if (found && !replace && (found->flags & HTTPP_VAR_FLAG_BORROWED)) {
+        found = _httpp_unborrow(tree, found);
+        if (!found) {
+            free(name);
+            free(value);
+            return;
+        }
+    }
 
     if (replace || !found) {
         var = (http_var_t *)calloc(1, sizeof(http_var_t));
@@ -653,9 +1331,9 @@ static void _httpp_set_param_nocopy(avl_tree *tree, char *name, char *value, int
 
     if (replace && found) {
         avl_delete(tree, (void *)found, _free_vars);
-        avl_insert(tree, (void *)var);
+        avl_insert_node(tree, &var->node, (void *)var);
     } else if (!found) {
-        avl_insert(tree, (void *)var);
+        avl_insert_node(tree, &var->node, (void *)var);
     }
 }
 
@@ -677,7 +1355,7 @@ static http_var_t *_httpp_get_param_var(avl_tree *tree, const char *name)
     memset(&var, 0, sizeof(var));
     var.name = (char *)name;
 
-    if (avl_get_by_key(tree, (void *)&var, fp) == 0)
+    if (_get_var_by_key(tree, (void *)&var, fp) == 0)
         return found;
     else
         return NULL;
@@ -852,13 +1530,23 @@ const char *httpp_get_param(http_parser_t *parser, const char *name)
 static void httpp_clear(http_parser_t *parser)
 {
     parser->req_type = httpp_req_none;
-    if (parser->uri)
+    if (parser->uri && !_httpp_is_borrowed(parser, parser->uri))
         free(parser->uri);
     parser->uri = NULL;
     avl_tree_free(parser->vars, _free_vars);
     avl_tree_free(parser->queryvars, _free_vars);
     avl_tree_free(parser->postvars, _free_vars);
     parser->vars = NULL;
+    memset(parser->known, 0, sizeof(parser->known));
+    if (parser->feed) {
+        free(parser->feed->line);
+        free(parser->feed);
+        parser->feed = NULL;
+    }
+    /* after the vars, some live in it */
+    free(parser->buffer);
+    parser->buffer = NULL;
+    parser->arena = NULL;
 }
 
 int httpp_addref(http_parser_t *parser)
@@ -910,6 +1598,13 @@ static int _free_vars(void *key)
     http_var_t *var = (http_var_t *)key;
     size_t i;
 
+    if (var->flags & HTTPP_VAR_FLAG_BORROWED) {
+        /* only a value array grown out of the arena is ours */
+        if (var->value != &((http_arena_var_t *)var)->value)
+            free(var->value);
+        return 1;
+    }
+
     free(var->name);
 
     for (i = 0; i < var->values; i++) {
@@ -922,30 +1617,15 @@ static int _free_vars(void *key)
 }
 
 httpp_request_type_e httpp_str_to_method(const char * method) {
-    if (strcasecmp("GET", method) == 0) {
-        return httpp_req_get;
-    } else if (strcasecmp("POST", method) == 0) {
-        return httpp_req_post;
-    } else if (strcasecmp("PUT", method) == 0) {
-        return httpp_req_put;
-    } else if (strcasecmp("HEAD", method) == 0) {
-        return httpp_req_head;
-    } else if (strcasecmp("OPTIONS", method) == 0) {
-        return httpp_req_options;
-    } else if (strcasecmp("DELETE", method) == 0) {
-        return httpp_req_delete;
-    } else if (strcasecmp("TRACE", method) == 0) {
-        return httpp_req_trace;
-    } else if (strcasecmp("CONNECT", method) == 0) {
-        return httpp_req_connect;
-    } else if (strcasecmp("SOURCE", method) == 0) {
-        return httpp_req_source;
-    } else if (strcasecmp("PLAY", method) == 0) {
-        return httpp_req_play;
-    } else if (strcasecmp("STATS", method) == 0) {
-        return httpp_req_stats;
-    } else {
-        return httpp_req_unknown;
-    }
+    size_t len;
+
+    for (len = 0; len <= METHOD_MAX_LEN && method[len]; len++);
+
+    return _httpp_method(method, len);
+}
+
+httpp_header_e httpp_str_to_header(const char *name)
+{
+    return _httpp_header_id(name, strlen(name));
 }
 
@@ -68,6 +68,44 @@ typedef enum httpp_request_type_tag {
     httpp_req_unknown
 } httpp_request_type_e;
 
+/* Headers the parser gives ids to, see httpp_getvar_id() */
+typedef enum httpp_header_tag {
+    httpp_header_accept,
+    httpp_header_accept_encoding,
+    httpp_header_accept_language,
+    httpp_header_authorization,
+    httpp_header_connection,
+    httpp_header_content_length,
+    httpp_header_content_type,
+    httpp_header_cookie,
+    httpp_header_expect,
+    httpp_header_host,
+    httpp_header_ice_audio_info,
+    httpp_header_ice_bitrate,
+    httpp_header_ice_description,
+    httpp_header_ice_genre,
+    httpp_header_ice_name,
+    httpp_header_ice_public,
+    httpp_header_ice_url,
+    httpp_header_icy_br,
+    httpp_header_icy_description,
+    httpp_header_icy_genre,
+    httpp_header_icy_metadata,
+    httpp_header_icy_name,
+    httpp_header_icy_pub,
+    httpp_header_icy_url,
+    httpp_header_if_modified_since,
+    httpp_header_origin,
+    httpp_header_range,
+    httpp_header_referer,
+    httpp_header_transfer_encoding,
+    httpp_header_upgrade,
+    httpp_header_user_agent,
+    httpp_header_x_forwarded_for,
+    /* Used for all other headers. MUST BE LAST ONE IN LIST. */
+    httpp_header_unknown
+} httpp_header_e;
+
 typedef unsigned int httpp_request_info_t;
 #define HTTPP_REQUEST_IS_SAFE                       ((httpp_request_info_t)0x0001U)
 #define HTTPP_REQUEST_IS_IDEMPOTENT                 ((httpp_request_info_t)0x0002U)
@@ -81,6 +119,10 @@ struct http_var_tag {
     char *name;
     size_t values;
     char **value;
+    /* links the var into the parser's intrusive trees */
+    avl_node node;
+    /* internal, 0 for vars set up by callers */
+    unsigned int flags;
 };
 
 typedef struct http_varlist_tag {
@@ -88,6 +130,26 @@ typedef struct http_varlist_tag {
     struct http_varlist_tag *next;
 } http_varlist_t;
 
+/* httpp_parse() copies the request into one block owned by the parser
+ * and points the vars it sets into that instead of copying every name
+ * and value on its own: a fixed number of allocations per request,
+ * however many headers and query parameters it has.  Vars set by the
+ * caller are copied as before.
+ */
+#define HTTPP_PARSER_FLAG_NONE          0x0000U
+#define HTTPP_PARSER_FLAG_ZERO_COPY     0x0001U
+
+/* httpp_feed() takes a request as it comes in, in pieces of any size,
+ * and parses every line as soon as it is complete.  It returns
+ * HTTPP_FEED_NEED_MORE once all of <data> is used up, HTTPP_FEED_DONE
+ * at the empty line ending the headers, with <consumed> telling where
+ * the body starts in <data>, and HTTPP_FEED_ERROR for a request it
+ * does not take.  Later calls return the same.  Vars are always copied.
+ */
+#define HTTPP_FEED_ERROR                (-1)
+#define HTTPP_FEED_NEED_MORE            0
+#define HTTPP_FEED_DONE                 1
+
 typedef struct http_parser_tag {
     size_t refc;
     httpp_request_type_e req_type;
@@ -95,18 +157,34 @@ typedef struct http_parser_tag {
     avl_tree *vars;
     avl_tree *queryvars;
     avl_tree *postvars;
+    unsigned int flags;
+    /* HTTPP_PARSER_FLAG_ZERO_COPY: the request and the vars pointing
+     * into it, allocated together
+     */
+    void *buffer;
+    size_t buffer_size;
+    void *arena;
+    size_t arena_used;
+    size_t arena_size;
+    /* httpp_feed() state */
+    struct http_parser_feed_tag *feed;
+    /* the vars of the headers with an id, NULL if not set */
+    http_var_t *known[httpp_header_unknown];
 } http_parser_t;
 
 #ifdef _mangle
 # define httpp_request_info _mangle(httpp_request_info)
 # define httpp_create_parser _mangle(httpp_create_parser)
+# define httpp_create_parser_ex _mangle(httpp_create_parser_ex)
 # define httpp_initialize _mangle(httpp_initialize)
 # define httpp_parse _mangle(httpp_parse)
+# define httpp_feed _mangle(httpp_feed)
 # define httpp_parse_icy _mangle(httpp_parse_icy)
 # define httpp_parse_response _mangle(httpp_parse_response)
 # define httpp_parse_postdata _mangle(httpp_parse_postdata)
 # define httpp_setvar _mangle(httpp_setvar)
 # define httpp_getvar _mangle(httpp_getvar)
+# define httpp_getvar_id _mangle(httpp_getvar_id)
 # define httpp_set_query_param _mangle(httpp_set_query_param)
 # define httpp_get_query_param _mangle(httpp_get_query_param)
 # define httpp_set_post_param _mangle(httpp_set_post_param)
@@ -123,14 +201,18 @@ typedef struct http_parser_tag {
 httpp_request_info_t httpp_request_info(httpp_request_type_e req);
 
 http_parser_t *httpp_create_parser(void);
+http_parser_t *httpp_create_parser_ex(unsigned int flags);
 void httpp_initialize(http_parser_t *parser, http_varlist_t *defaults);
 int httpp_parse(http_parser_t *parser, const char *http_data, unsigned long len);
+int httpp_feed(http_parser_t *parser, const char *data, size_t len, size_t *consumed);
 int httpp_parse_icy(http_parser_t *parser, const char *http_data, unsigned long len);
 int httpp_parse_response(http_parser_t *parser, const char *http_data, unsigned long len, const char *uri);
 int httpp_parse_postdata(http_parser_t *parser, const char *body_data, size_t len);
 void httpp_setvar(http_parser_t *parser, const char *name, const char *value);
 void httpp_deletevar(http_parser_t *parser, const char *name);
 const char *httpp_getvar(http_parser_t *parser, const char *name);
+/* httpp_getvar() by id, an array lookup */
+const char *httpp_getvar_id(http_parser_t *parser, httpp_header_e id);
 void httpp_set_query_param(http_parser_t *parser, const char *name, const char *value);
 const char *httpp_get_query_param(http_parser_t *parser, const char *name);
 void httpp_set_post_param(http_parser_t *parser, const char *name, const char *value);
@@ -145,5 +227,6 @@ int httpp_release(http_parser_t *parser);
 
 /* util functions */
 httpp_request_type_e httpp_str_to_method(const char * method);
+httpp_header_e httpp_str_to_header(const char *name);
  
 #endif
@@ -8,17 +8,22 @@ int main(int argc, char **argv)
 {
     char buff[8192];
     int readed;
-    http_parser_t parser;
+    http_parser_t *parser;
     avl_node *node;
     http_var_t *var;
+    const char *version;
+    size_t i;
 
-    httpp_initialize(&parser, NULL);
+    parser = httpp_create_parser();
+    if (!parser)
+        return 1;
+    httpp_initialize(parser, NULL);
 
     readed = fread(buff, 1, 8192, stdin);
-    if (httpp_parse(&parser, buff, readed)) {
+    if (httpp_parse(parser, buff, readed)) {
         printf("Parse succeeded...\n\n");
         printf("Request was ");
-        switch (parser.req_type) {
+        switch (parser->req_type) {
         case httpp_req_none:
             printf(" none\n");
             break;
@@ -34,16 +39,22 @@ int main(int argc, char **argv)
         case httpp_req_head:
             printf(" head\n");
             break;
+        default:
+            printf(" %s\n", httpp_getvar(parser, HTTPP_VAR_REQ_TYPE));
+            break;
         }
-        printf("Version was 1.%d\n", parser.version);
-        
-        node = avl_get_first(parser.vars);
+        version = httpp_getvar(parser, HTTPP_VAR_VERSION);
+        printf("Version was %s\n", version ? version : "(none)");
+
+        node = avl_get_first(parser->vars);
         while (node) {
             var = (http_var_t *)node->key;
-            
-            if (var)
-                printf("Iterating variable(s): %s = %s\n", var->name, var->value);
-            
+
+            if (var) {
+                for (i = 0; i < var->values; i++)
+                    printf("Iterating variable(s): %s = %s\n", var->name, var->value[i]);
+            }
+
             node = avl_get_next(node);
         }
     } else {
@@ -51,9 +62,8 @@ int main(int argc, char **argv)
     }
 
     printf("Destroying parser...\n");
-    httpp_destroy(&parser);
+    httpp_destroy(parser);
 
     return 0;
 }
 
-
@@ -93,6 +93,8 @@ typedef struct thread_start_tag {
 static long _next_thread_id = 0;
 static int _initialized = 0;
 static avl_tree *_threadtree = NULL;
+/* thread ids ascend, so inserts start where the last one ended */
+static avl_finger _threadtree_finger;
 
 #ifdef DEBUG_MUTEXES
 static mutex_t _threadtree_mutex = { -1, NULL, MUTEX_STATE_UNINIT, NULL, -1,
@@ -174,6 +176,7 @@ void thread_initialize(void)
     /* initialize the thread tree and insert the main thread */
 
     _threadtree = avl_tree_new(_compare_threads, NULL);
+    avl_finger_init(&_threadtree_finger, _threadtree);
 
     thread = (thread_type *)malloc(sizeof(thread_type));
 
@@ -184,7 +187,7 @@ void thread_initialize(void)
     thread->create_time = time(NULL);
     thread->name = strdup("Main Thread");
 
-    avl_insert(_threadtree, (void *)thread);
+    avl_finger_insert(&_threadtree_finger, (void *)thread);
 
     _catch_signals();
 
@@ -654,7 +657,7 @@ static void *_start_routine(void *arg)
     /* insert thread into thread tree here */
     _mutex_lock(&_threadtree_mutex);
     thread->sys_thread = pthread_self();
-    avl_insert(_threadtree, (void *)thread);
+    avl_finger_insert(&_threadtree_finger, (void *)thread);
     _mutex_unlock(&_threadtree_mutex);
 
 #ifdef THREAD_DEBUG